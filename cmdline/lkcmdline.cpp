@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <memory>
+#include <vector>
 
 #include <lk/absyn.h>
 #include <lk/env.h>
@@ -13,6 +14,9 @@
 #include <lk/invoke.h>
 #include <lk/codegen.h>
 #include <lk/vm.h>
+#include <lk/regcodegen.h>
+#include <lk/regvm.h>
+#include <lk/aot.h>
 
 void fcall_out( lk::invoke_t &cxt )
 {
@@ -43,6 +47,13 @@ int main(int argc, char *argv[])
 {
 	bool parse_only = false;
 	bool use_vm = true;
+	bool use_regvm = false;
+	bool profile = false;
+	bool use_jit = false;
+	bool aot = false;
+	bool assembly = false;
+	unsigned int passes = lk::codegen::OPT_ALL;
+	std::vector<const char*> libraries;
 	
 	if ( argc <= 1 )
 	{
@@ -50,10 +61,25 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	
-	if ( argc > 2 )
+	for ( int i=2;i<argc;i++ )
 	{
-		if( strcmp( argv[2], "--parse" ) == 0 ) parse_only = true;
-		if( strcmp( argv[2], "--eval" ) == 0 ) use_vm = false;
+		if( strcmp( argv[i], "--parse" ) == 0 ) parse_only = true;
+		if( strcmp( argv[i], "--eval" ) == 0 ) use_vm = false;
+		if( strcmp( argv[i], "--regvm" ) == 0 ) use_regvm = true;
+		if( strcmp( argv[i], "--profile" ) == 0 ) profile = true;
+		if( strcmp( argv[i], "--jit" ) == 0 ) use_jit = true;
+		if( strcmp( argv[i], "--aot" ) == 0 ) aot = true;
+		// native modules written by --aot and built, or extensions, whose functions the script calls
+		if( strcmp( argv[i], "--load" ) == 0 && i+1 < argc ) libraries.push_back( argv[++i] );
+		// print the stack vm assembly, optionally without some of the optimization passes
+		if( strcmp( argv[i], "--asm" ) == 0 ) assembly = true;
+		if( strcmp( argv[i], "--no-fold" ) == 0 ) passes &= ~lk::codegen::OPT_FOLD;
+		if( strcmp( argv[i], "--no-thread" ) == 0 ) passes &= ~lk::codegen::OPT_THREAD;
+		if( strcmp( argv[i], "--no-dead" ) == 0 ) passes &= ~lk::codegen::OPT_DEAD;
+		if( strcmp( argv[i], "--no-compact" ) == 0 ) passes &= ~lk::codegen::OPT_COMPACT;
+		if( strcmp( argv[i], "--no-fuse" ) == 0 ) passes &= ~lk::codegen::OPT_FUSE;
+		if( strcmp( argv[i], "--no-inline" ) == 0 ) passes &= ~lk::codegen::OPT_INLINE;
+		if( strcmp( argv[i], "--no-forloop" ) == 0 ) passes &= ~lk::codegen::OPT_FORLOOP;
 	}
 	
 	lk::input_file p( argv[1] );
@@ -71,6 +97,46 @@ int main(int argc, char *argv[])
 		return -1;
 	
 	if ( parse_only ) return 0;
+
+	if ( assembly )
+	{
+		lk::codegen C;
+		C.set_passes( passes );
+		if ( !C.generate( tree.get() ) )
+		{
+			printf("codegen: %s\n", (const char*)C.error().c_str() );
+			return -1;
+		}
+
+		lk_string text, code;
+		C.textout( text, code );
+		fputs( text.c_str(), stdout );
+		return 0;
+	}
+
+	if ( aot )
+	{
+		// C++ source of a native module with the script's functions, next to the script
+		lk::aotgen G;
+		bool ok = G.generate( tree.get(), argv[1] );
+		for( size_t i=0;i<G.warnings().size();i++ )
+			printf("aot: %s\n", (const char*)G.warnings()[i].c_str() );
+
+		if ( !ok )
+		{
+			printf("aot: %s\n", (const char*)G.error().c_str() );
+			return -1;
+		}
+
+		lk_string file = lk_string( argv[1] ) + ".cpp";
+		if ( FILE *fp = fopen( file.c_str(), "w" ) )
+		{
+			fputs( G.source().c_str(), fp );
+			fclose( fp );
+			printf("native module source written to %s\n", file.c_str() );
+		}
+		return 0;
+	}
 	
 	lk::env_t env;
 	env.register_func( fcall_in );
@@ -81,9 +147,52 @@ int main(int argc, char *argv[])
 	env.register_funcs( lk::stdlib_string() );
 	env.register_funcs( lk::stdlib_math() );
 
+	for( size_t i=0;i<libraries.size();i++ )
+	{
+		try
+		{
+			if ( !env.load_library( libraries[i] ) )
+			{
+				printf("load: could not open %s\n", libraries[i] );
+				return -1;
+			}
+		}
+		catch( lk::error_t &e )
+		{
+			printf("load: %s: %s\n", libraries[i], (const char*)e.text.c_str() );
+			return -1;
+		}
+	}
+
+	if ( use_vm && use_regvm )
+	{
+		// programs that do not fit the register instruction set run on the stack vm, which
+		// is reported so that timings of --regvm are not taken for the register vm's
+		lk::regcodegen R;
+		if ( !R.generate( tree.get() ) )
+			fprintf( stderr, "regvm: %s, running on the stack vm\n", (const char*)R.error().c_str() );
+		else
+		{
+			lk::bytecode bc;
+			R.get( bc );
+
+			lk::regvm V;
+			V.load( &bc );
+			V.initialize( &env );
+			if ( !V.run() )
+			{
+				printf("vm: %s\n", (const char*)V.error().c_str());
+				return -1;
+			}
+
+			return 0;
+		}
+	}
+
 	if ( use_vm )
 	{
 		lk::codegen C;
+		C.set_passes( passes );
 		if ( C.generate( tree.get() ) )
 		{
 			lk::bytecode bc;
@@ -91,12 +200,36 @@ int main(int argc, char *argv[])
 			
 			lk::vm V;
 			V.load( &bc );
+			V.set_profiling( profile );
+			V.set_jit( use_jit );
 			V.initialize( &env );
-			if ( !V.run() )
-			{
+			bool ok = V.run();
+			if ( !ok )
 				printf("vm: %s\n", (const char*)V.error().c_str());
-				return -1;
+
+			if ( profile )
+			{
+				// report next to the script, and stacks for flame graph tools
+				lk::profile_t prof = V.get_profile();
+				lk_string file = lk_string( argv[1] ) + ".prof";
+				if ( FILE *fp = fopen( file.c_str(), "w" ) )
+				{
+					fputs( prof.report( bc ).c_str(), fp );
+					fclose( fp );
+					printf("profile written to %s\n", file.c_str() );
+				}
+
+				file = lk_string( argv[1] ) + ".folded";
+				if ( FILE *fp = fopen( file.c_str(), "w" ) )
+				{
+					fputs( prof.collapsed().c_str(), fp );
+					fclose( fp );
+					printf("call stacks written to %s\n", file.c_str() );
+				}
 			}
+
+			if ( !ok )
+				return -1;
 		}
 		else
 		{
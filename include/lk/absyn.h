@@ -338,6 +338,22 @@ namespace lk {
     };
 
     void pretty_print(lk_string &str, node_t *root, int level);
+
+/** Caches whether a function definition refers to its '__args' vector.
+* \class args_attr_t
+*/
+    class args_attr_t : public attr_t {
+    public:
+        args_attr_t(bool u) : used(u) {}
+
+        bool used;
+    };
+
+    /// returns true if the body of a 'define' expression refers to '__args', not counting nested definitions
+    bool uses_args(expr_t *define);
+
+    /// returns true if the last statement of a function body is a 'return'
+    bool ends_with_return(node_t *body);
 };
 
 #endif
@@ -0,0 +1,305 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __lk_aot_h
+#define __lk_aot_h
+
+#include <cmath>
+#include <limits>
+
+#include <lk/absyn.h>
+#include <lk/env.h>
+#include <lk/vm.h>
+#include <lk/invoke.h>
+#include <lk/vecops.h>
+
+// a native module must export 2 functions:
+// int lk_module_api_version()
+// lk::fcall_t *lk_module_functions()
+// and is loaded by env_t::load_library like an extension.  unlike extensions, modules
+// work directly on lk::vardata_t, so they must be built against the same lk headers
+// as the host and resolve the lk library from it
+
+// version 2 added packed arrays of numbers, version 3 strings held in place, version 4 tables
+// keyed by atoms
+#ifdef LK_NANBOX
+#define LK_MODULE_API_VERSION 0x104 // values are laid out differently
+#else
+#define LK_MODULE_API_VERSION 4
+#endif
+
+#define LK_BEGIN_MODULE() \
+    extern "C" LKAPIEXPORT int lk_module_api_version() \
+        { return LK_MODULE_API_VERSION; } \
+    extern "C" LKAPIEXPORT lk::fcall_t *lk_module_functions() { \
+    static lk::fcall_t _ll[] = {
+#define LK_END_MODULE() ,0 }; return _ll; }
+
+namespace lk {
+
+/**
+* \class aotgen
+*
+* Translates the functions defined at the top level of a script into C++ source for a native
+* module.  Each function is compiled from its stack bytecode, one block of C++ per instruction
+* with the vm stack held in local variables, so it behaves as the vm would run it: arguments
+* are passed by reference, variables are resolved by name through the calling environments,
+* and errors are reported with the statement and line they occur at.
+*
+* A function is left out, with a warning, if it defines nested functions, reads or writes
+* special variables or calls exit.  Compiled code cannot call functions defined by a script
+* run on the vm, and does not poll the host while it runs.  Other top level statements of
+* the script are not part of the module.
+*/
+    class aotgen {
+    public:
+        aotgen();
+
+        /// generates the bytecode of the tree and translates it
+        bool generate(lk::node_t *tree, const lk_string &name);
+
+        /// translates the top level functions of stack bytecode, naming the module in comments
+        bool generate(const bytecode &bc, const lk_string &name);
+
+        lk_string source() { return m_src; }
+
+        lk_string error() { return m_errStr; }
+
+        /// functions that were left out of the module, and why
+        std::vector<lk_string> &warnings() { return m_warnings; }
+
+        /// names of the functions compiled into the module
+        std::vector<lk_string> &functions() { return m_funcs; }
+
+    private:
+        lk_string m_src;
+        lk_string m_errStr;
+        std::vector<lk_string> m_warnings;
+        std::vector<lk_string> m_funcs;
+
+        const bytecode *m_bc;
+        lk_string m_name;
+
+        /// translates the function whose body is [start,end), returning false with a reason
+        /// in 'why' if it cannot be compiled
+        bool function(size_t start, size_t end, size_t index, const lk_string &name, lk_string &fsrc,
+                      lk_string &why);
+
+        /// statements building the constant v in the variable 'var', nested 'level' deep
+        void constant(lk_string &src, const lk_string &var, const vardata_t &v, int level);
+    };
+
+/**
+* Support for the code generated by lk::aotgen.  A frame holds the environment of a call to a
+* compiled function, with the same lookup rules and error messages as the frames of lk::vm.
+*/
+    namespace aot {
+
+        /// error raised by compiled code, with the message already prefixed by the statement
+        /// it occurred at, so that callers report it unchanged
+        class failure : public error_t {
+        public:
+            failure(const lk_string &s) : error_t(s) {}
+        };
+
+        /// function named by an identifier, as found for an environment while the function
+        /// version was unchanged
+        struct site {
+            unsigned int fver;
+            env_t *global;
+            fcallinfo_t *fci;
+        };
+
+        class frame {
+        public:
+            frame(invoke_t &cxt, const atom_t *ids, site *sites, vardata_t **slots);
+
+            invoke_t &cxt;
+            env_t env;
+            int stmt, line; ///< position of the instruction being run
+
+            /// binds the next argument by reference to the name 'id', as ARG
+            void arg(size_t id);
+
+            /// builds '__args', as ARGV
+            void argv();
+
+            /// RREF, LREF, LCREF and LGREF
+            void ref(vardata_t &top, Opcode op, size_t id);
+
+            /// RLOC and LLOC, with 'arg' packing the slot and identifier
+            void local(vardata_t &top, Opcode op, size_t arg) {
+                if (vardata_t *x = slots[arg >> 16]) top.assign(x);
+                else push_local(top, op, arg);
+            }
+
+            /// INCL and DECL
+            void increment(size_t arg, double d);
+
+            /// FORPREP and FORLOOP, which also advances the counter: true if the loop runs
+            bool loop(bool advance, size_t arg, vardata_t &limit);
+
+            /// CALL and TCALL: the callee is at base[nargs] and the result goes to base[-1]
+            void call(vardata_t *base, size_t nargs, bool thiscall);
+
+            void swi(size_t index, size_t noptions);
+
+            void typ(vardata_t &top, size_t id);
+
+            /// result of a return with an empty stack, which is the function itself
+            void ret_self(size_t id);
+
+            void mat(vardata_t &lhs, vardata_t &rhs);
+
+            void wat(vardata_t &lhs, vardata_t &rhs);
+
+            void sz(vardata_t &top);
+
+            void keys(vardata_t &top);
+
+            /// raises a failure at the current statement
+            void fail(const lk_string &msg);
+
+            /// reports an exception thrown by the runtime as the vm does
+            void exception(std::exception &e);
+
+        private:
+            const atom_t *ids;
+            site *sites;
+            vardata_t **slots;
+            size_t iarg;
+            env_t *root; ///< host environment, found on the first function lookup
+
+            fcallinfo_t *func(size_t id);
+
+            env_t *globals();
+
+            void push_local(vardata_t &top, Opcode op, size_t arg);
+        };
+
+        // instructions that do not depend on the frame, as implemented by lk::vm
+
+        inline void add(vardata_t &l, const vardata_t &rhs) {
+            vardata_t &lhs = l.deref();
+            if (lhs.type() == vardata_t::STRING || rhs.type() == vardata_t::STRING)
+                l.assign(lhs.as_string() + rhs.as_string());
+            else if (vecops::applies(lhs, rhs))
+                vecops::binary(vecops::ADD, lhs, rhs, l);
+            else
+                l.assign(lhs.num() + rhs.num());
+        }
+
+        inline void sub(vardata_t &l, const vardata_t &rhs) {
+            vardata_t &lhs = l.deref();
+            if (vecops::applies(lhs, rhs))
+                vecops::binary(vecops::SUB, lhs, rhs, l);
+            else
+                l.assign(lhs.num() - rhs.num());
+        }
+
+        inline void mul(vardata_t &l, const vardata_t &rhs) {
+            vardata_t &lhs = l.deref();
+            if (vecops::applies(lhs, rhs))
+                vecops::binary(vecops::MUL, lhs, rhs, l);
+            else
+                l.assign(lhs.num() * rhs.num());
+        }
+
+        inline void div(vardata_t &l, vardata_t &r) {
+            if (vecops::applies(l.deref(), r.deref())) {
+                vecops::binary(vecops::DIV, l.deref(), r.deref(), l);
+                return;
+            }
+
+            double den = r.deref().num();
+            if (den == 0.0)
+                l.assign(std::numeric_limits<double>::quiet_NaN());
+            else
+                l.assign(l.deref().num() / den);
+        }
+
+        inline void power(vardata_t &l, const vardata_t &rhs) {
+            vardata_t &lhs = l.deref();
+            if (vecops::applies(lhs, rhs))
+                vecops::binary(vecops::EXP, lhs, rhs, l);
+            else
+                l.assign(::pow(lhs.num(), rhs.num()));
+        }
+
+        inline void neg(vardata_t &x) {
+            if (x.deref().type() == vardata_t::VECTOR)
+                vecops::negate(x.deref(), x);
+            else
+                x.assign(0.0 - x.deref().num());
+        }
+
+        /// outcome of comparison 'op' (LT, LE, GT or GE) of two values that are not arrays
+        inline bool test(vecops::op_t op, vardata_t &lhs, vardata_t &rhs) {
+            switch (op) {
+                case vecops::LT: return lhs.lessthan(rhs);
+                case vecops::LE: return lhs.lessthan(rhs) || lhs.equals(rhs);
+                case vecops::GT: return !lhs.lessthan(rhs) && !lhs.equals(rhs);
+                default: return !lhs.lessthan(rhs);
+            }
+        }
+
+        /// comparison 'op', giving a mask for arrays
+        inline void compare(vecops::op_t op, vardata_t &l, vardata_t &rhs) {
+            vardata_t &lhs = l.deref();
+            if (vecops::applies(lhs, rhs))
+                vecops::binary(op, lhs, rhs, l);
+            else
+                l.assign(test(op, lhs, rhs) ? 1.0 : 0.0);
+        }
+
+        /// condition of a comparison and jump, which may not compare arrays
+        inline bool compare_jump(vecops::op_t op, vardata_t &lhs, vardata_t &rhs) {
+            if (vecops::applies(lhs, rhs))
+                throw error_t(vecops::mask_test_error());
+            return test(op, lhs, rhs);
+        }
+
+        void idx(vardata_t &arr, vardata_t &index, bool is_mutable);
+
+        void key(vardata_t &hash, vardata_t &key, bool is_mutable);
+
+        void wr(vardata_t &value, vardata_t &ref);
+
+        void addwr(vardata_t &value, vardata_t &ref);
+
+        void vec(vardata_t *items, size_t n);
+
+        void hash(vardata_t *items, size_t n);
+    }
+
+} // namespace lk
+
+#endif
@@ -0,0 +1,129 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __lk_atom_h
+#define __lk_atom_h
+
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+#include <lk/absyn.h>
+
+namespace lk {
+
+/**
+* \class atom_t
+*
+* Handle to the one copy of a string kept in a table shared by the whole process, together
+* with its hash.  Atoms of equal strings are the same atom, so atoms compare as pointers.
+* Identifiers and the keys of tables and environments are held as atoms: a name used by many
+* tables or frames is stored once, and a lookup with an atom neither hashes nor compares
+* characters.
+*
+* An atom stays in the table while any handle to it remains.  Handles may be made, copied
+* and dropped from any thread; only making an atom from a string and dropping the last handle
+* to one take the lock of the table.
+*/
+    class atom_t {
+    public:
+        /// an atom, shared by all its handles
+        struct rep {
+            rep(const lk_string &s, size_t h) : str(s), hash(h), refs(1) {}
+
+            const lk_string str;
+            const size_t hash; ///< lk_string_hash of str
+            std::atomic<unsigned int> refs;
+        };
+
+        /// an empty handle, to no atom
+        atom_t() : m_p(0) {}
+
+        /// the atom of s, adding it to the table if there is none yet
+        explicit atom_t(const lk_string &s);
+
+        explicit atom_t(const char *s);
+
+        atom_t(const atom_t &rhs) : m_p(rhs.m_p) {
+            if (m_p) m_p->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        atom_t(atom_t &&rhs) : m_p(rhs.m_p) { rhs.m_p = 0; }
+
+        ~atom_t() { if (m_p) release(); }
+
+        atom_t &operator=(const atom_t &rhs) {
+            atom_t tmp(rhs);
+            std::swap(m_p, tmp.m_p);
+            return *this;
+        }
+
+        atom_t &operator=(atom_t &&rhs) {
+            std::swap(m_p, rhs.m_p);
+            return *this;
+        }
+
+        bool empty() const { return m_p == 0; }
+
+        const lk_string &str() const { return m_p ? m_p->str : empty_string(); }
+
+        operator const lk_string &() const { return str(); }
+
+        size_t hash() const { return m_p ? m_p->hash : 0; }
+
+        bool operator==(const atom_t &rhs) const { return m_p == rhs.m_p; }
+
+        bool operator!=(const atom_t &rhs) const { return m_p != rhs.m_p; }
+
+    private:
+        rep *m_p;
+
+        void release();
+
+        static const lk_string &empty_string();
+    };
+
+/// Hash and Equal of lk::hashmap for atom keys, which can also be looked up by string
+    struct atom_hash {
+        size_t operator()(const atom_t &a) const { return a.hash(); }
+
+        size_t operator()(const lk_string &s) const { return lk_string_hash()(s); }
+    };
+
+    struct atom_equal {
+        bool operator()(const atom_t &a, const atom_t &b) const { return a == b; }
+
+        bool operator()(const atom_t &a, const lk_string &s) const { return a.str() == s; }
+    };
+
+} // namespace lk
+
+#endif
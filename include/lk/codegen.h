@@ -51,6 +51,23 @@ namespace lk {
     public:
         codegen();
 
+        /// optimization passes run over the instructions by generate(), in this order
+        enum {
+            OPT_FOLD = 0x01, ///< evaluate arithmetic, concatenation and branches on constants
+            OPT_THREAD = 0x02, ///< jump directly to the end of a chain of jumps
+            OPT_DEAD = 0x04, ///< remove unreachable code and jumps to the next instruction
+            OPT_COMPACT = 0x08, ///< drop labels no instruction refers to and number the rest in order
+            OPT_FUSE = 0x10, ///< fuse common instruction sequences into single instructions
+            OPT_INLINE = 0x20, ///< generate calls to small functions in place, see find_inlinable()
+            OPT_FORLOOP = 0x40, ///< generate counting loops with FORPREP and FORLOOP, see counting_loop()
+            OPT_ALL = 0xFF
+        };
+
+        /// selects the passes run by generate(), all of them by default
+        void set_passes(unsigned int passes) { m_passes = passes; }
+
+        unsigned int passes() const { return m_passes; }
+
         lk_string error() { return m_errStr; }
 
         /// traverses tree and identifes node types to create instructions, variables, data structures, labels, etc
@@ -62,6 +79,9 @@ namespace lk {
         /// writes the bytecode into assembly
         void textout(lk_string &assembly, lk_string &bytecode);
 
+        static bool initialize_const_vec(lk::list_t *v, vardata_t &vvec);        ///< creates vector vardata type
+        static bool initialize_const_hash(lk::list_t *v, vardata_t &vhash);        ///< creates hash vardata type
+
     private:
 
 /** Composes codegen's stack.
@@ -72,51 +92,74 @@ namespace lk {
 *
 */
         struct instr {
-            instr(srcpos_t sp, Opcode _op, int _arg, const char *lbl = 0)
-                    : pos(sp), op(_op), arg(_arg) {
-                label = 0;
-                if (lbl) label = new lk_string(lbl);
-            }
-
-            instr(const instr &cpy) {
-                copy(cpy);
-            }
-
-            ~instr() {
-                if (label) delete label;
-            }
-
-            void copy(const instr &cpy) {
-                pos = cpy.pos;
-                op = cpy.op;
-                arg = cpy.arg;
-                label = 0;
-                if (cpy.label)
-                    label = new lk_string(*cpy.label);
-            }
-
-            instr &operator=(const instr &rhs) {
-                copy(rhs);
-                return *this;
+            instr(srcpos_t sp, Opcode _op, int _arg, int lbl = -1)
+                    : pos(sp), op(_op), arg(_arg), label(lbl) {
             }
 
             lk::srcpos_t pos;
             Opcode op;
             int arg;
-            lk_string *label;
+            int label; ///< label whose address is patched into arg, or -1
         };
 
         /// functions as virtual stack
         std::vector<instr> m_asm;
-        /// maps from label # to position in stack, ie: the fifth label created label, "L5", is in m_asm position 1
-        typedef unordered_map<lk_string, int, lk_string_hash, lk_string_equal> LabelMap;
-        LabelMap m_labelAddr;
+        /// maps from label # to position in stack, ie: the fifth label created, "L5", is in m_asm position m_labelAddr[5]
+        std::vector<int> m_labelAddr;
         std::vector<vardata_t> m_constData;
         std::vector<lk_string> m_idList;
-        int m_labelCounter;
+        /// indices into m_idList and m_constData, so that placing a name or constant does not scan the pools
+        hashmap<lk_string, int, lk_string_hash, lk_string_equal> m_idIndex;
+        hashmap<size_t, int, std::hash<size_t>, std::equal_to<size_t> > m_constIndex; ///< latest constant for each vardata_t::hash_value()
+        std::vector<int> m_constNext; ///< earlier constant with the same hash, or -1
         /// stores labels associated with loops: continueAddr for advancing loops, break for end
-        std::vector<lk_string> m_breakAddr, m_continueAddr;
+        std::vector<int> m_breakAddr, m_continueAddr;
         lk_string m_errStr;
+        unsigned int m_passes;
+
+/** Lexical scope of a function body being generated.
+* \struct scope
+*
+* Records where the body starts in m_asm and the ranges taken by nested function
+* bodies, which have their own scopes and are skipped when assigning frame slots.
+* The counters of FORPREP and FORLOOP have their slots before the body is generated.
+*/
+        struct scope {
+            scope(size_t s) : start(s) {}
+
+            size_t start;
+            std::vector<std::pair<size_t, size_t> > nested;
+            std::vector<int> params; ///< identifiers of the arguments, in slot order
+            std::vector<int> counters; ///< identifiers of loop counters, in the slots after the arguments
+        };
+
+        std::vector<scope> m_scopes;
+        scope m_top; ///< loop counters of the top level code, which has no other slots
+
+/** A function whose calls are generated in place.
+* \struct inlinable
+*
+* A function defined by a top level statement whose name is not written anywhere else,
+* with a body of a single small 'return' expression that writes nothing.
+*/
+        struct inlinable {
+            inlinable() : define(0), defined(false) {}
+
+            lk::expr_t *define;
+            std::vector<lk_string> params;
+            bool defined; ///< set once the top level definition is generated
+        };
+
+        hashmap<lk_string, inlinable, lk_string_hash, lk_string_equal> m_inlinable;
+        /// function whose body is being generated in place, and the PICKs of its arguments
+        inlinable *m_inlining;
+        std::vector<std::pair<size_t, int> > m_picks;
+
+        /// finds the functions defined in root whose calls can be generated in place
+        void find_inlinable(lk::node_t *root);
+
+        /// generates a call in place, if it is to an inlinable function
+        bool inline_call(lk::expr_t *call);
 
         bool error(const char *fmt, ...);
 
@@ -130,17 +173,49 @@ namespace lk {
 
         int const_literal(const lk_string &lit);
 
-        lk_string new_label();
+        bool pfgen_key(lk::node_t *root);
+
+        int new_label();
 
-        void place_label(const lk_string &s);
+        void place_label(int L);
 
         int emit(srcpos_t pos, Opcode o, int arg = 0);                        ///< makes instructions & adds to m_asm
-        int emit(srcpos_t pos, Opcode o, const lk_string &L);
+        int emit_jump(srcpos_t pos, Opcode o, int L);                        ///< as emit(), with the address of label L
 
-        bool initialize_const_vec(lk::list_t *v, vardata_t &vvec);        ///< creates vector vardata type
-        bool initialize_const_hash(lk::list_t *v, vardata_t &vhash);        ///< creates hash vardata type
         bool pfgen_stmt(lk::node_t *root, unsigned int flags);
 
+        /// recognizes a loop that can be generated with FORPREP and FORLOOP
+        bool counting_loop(lk::iter_t *loop, int &var);
+
+        /// frame slot of a loop counter in the current scope, or -1 if there is none for it
+        int counter_slot(const lk_string &name);
+
+        /// rewrites references to function locals and arguments in m_asm[s.start, end) into slot accesses
+        void assign_slots(const scope &s, size_t end, lk::list_t *params);
+
+        /// runs the optimization passes selected by set_passes()
+        void optimize();
+
+        /// marks the addresses that placed labels refer to
+        std::vector<bool> jump_targets();
+
+        /// replaces m_asm with code, moving labels from each address i to remap[i]
+        void relocate(std::vector<instr> &code, const std::vector<int> &remap);
+
+        /// folds the instructions at the end of code if their operands are constants
+        bool fold_last(std::vector<instr> &code, const std::vector<bool> &target);
+
+        void fold_constants();
+
+        void thread_jumps();
+
+        void remove_dead_code();
+
+        void compact_labels();
+
+        /// fuses common instruction sequences into single instructions
+        void peephole();
+
         bool pfgen(lk::node_t *root, unsigned int flags);
     };
 }; // namespace lk
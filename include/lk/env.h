@@ -35,9 +35,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
 #include <exception>
+#include <limits>
+#include <stdint.h>
 
 #include <lk/absyn.h>
+#include <lk/atom.h>
+#include <lk/hashmap.h>
 #include <lk/invoke.h>
 
 /// create and associate a doc_t from within cxt, an invoke_t, if cxt doesn't yet have one
@@ -47,12 +52,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define LK_DOC3(fn, notes, desc1, sig1, desc2, sig2, desc3, sig3) if (cxt.doc_mode()) { cxt.document( lk::doc_t(fn , notes, desc1, sig1, desc2, sig2, desc3, sig3 )); return; }
 
 
+#ifndef LK_USE_WXWIDGETS
+#define LK_SHORT_STRINGS 1 // strings of narrow characters can be held in place
+#endif
+
 namespace lk {
     class vardata_t;
 
     struct fcallinfo_t;
     struct bytecode;
-    typedef unordered_map<lk_string, vardata_t *, lk_string_hash, lk_string_equal> varhash_t;
+    typedef hashmap<atom_t, vardata_t *, atom_hash, atom_equal> varhash_t;
 
 /**
 * \class error_t
@@ -94,11 +103,83 @@ namespace lk {
 *
 * Vardata_t form the execution stack of the vm: stores identifiers and expressions,
 * arguments and results for function invocations, and operations.
+*
+* Defining LK_NANBOX builds the compact layout, 8 bytes instead of 16, that keeps numbers in
+* place and every other value as a pointer boxed in a NaN.  It halves the memory of numeric
+* arrays; code using the public interface does not change.
+*
+* Copies of strings, arrays and tables share their contents, which are copied only when one of
+* the copies is changed.  Once vec(), hash(), index(), lookup() or numarray() has given out a
+* pointer into the contents of a value, its later copies get contents of their own, so that
+* writes through the pointer are not seen by the copies.
+*
+* An array of numbers can be held packed, as a NUMARRAY of doubles, which type() reports as a
+* VECTOR.  Functions that give out pointers to items, such as vec() and index(), first turn it
+* into a VECTOR; numbers(), item() and set_item() work on the packed numbers in place.
+*
+* Unless lk_string is a wxString, a short string is held in place as a SHORTSTR, which type()
+* reports as a STRING: up to 14 characters in the 16 byte layout and 5 when boxed.
 */
 
     class vardata_t {
     private:
+#ifdef LK_NANBOX
+        /** m_bits holds a NUMBER as the bits of the double itself when its only flag is
+        * ASSIGNED.  Any other value is a negative NaN with the type in bits 48 to 51 and a
+        * pointer in the low 48 bits, whose 3 low bits (always 0 in an aligned pointer) hold
+        * the flags, so that every bit pattern above -inf is a boxed value.  A NUMBER with other
+        * flags points to a double on the heap.  NaN results are stored as the positive NaN.
+        */
+        uint64_t m_bits;
+
+        static const uint64_t NB_BOX = 0xFFF0000000000000ULL;
+        static const uint64_t NB_PTR = 0x0000FFFFFFFFFFF8ULL;
+        static const uint64_t NB_FLAGS = 0x7ULL;
+
+        inline bool boxed() const { return m_bits > NB_BOX; }
+
+        /// boxed value of type 'ty' with flags 'fl' in the 3 bit form
+        static uint64_t box(unsigned char ty, uint64_t fl) { return NB_BOX | ((uint64_t) ty << 48) | fl; }
+
+        /// flags in the 3 bit form: ASSIGNED, CONSTVAL and GLOBALVAL
+        inline uint64_t box_flags() const { return boxed() ? (m_bits & NB_FLAGS) : 1; }
+
+        inline void *ptr() const { return reinterpret_cast<void *>(m_bits & NB_PTR); }
+
+        inline void set_ptr(void *p) { m_bits = (m_bits & ~NB_PTR) | reinterpret_cast<uint64_t>(p); }
+
+        inline double dbl() const {
+            if (boxed()) return *reinterpret_cast<double *>(ptr());
+            double d;
+            memcpy(&d, &m_bits, sizeof(d));
+            return d;
+        }
+
+        /// stores d in a value that is already a NUMBER
+        inline void set_dbl(double d) {
+            if (d != d) d = std::numeric_limits<double>::quiet_NaN();
+            if (boxed()) *reinterpret_cast<double *>(ptr()) = d;
+            else memcpy(&m_bits, &d, sizeof(d));
+        }
+
+        inline void reset() { m_bits = box(NULLVAL, 0); }
+
+        /// changes the type, keeping the flags; numbers move in or out of place elsewhere
+        inline void set_type(unsigned char ty) {
+            if (ty != NUMBER && boxed() && type() != NUMBER) m_bits = box(ty, m_bits & NB_FLAGS);
+            else set_number_type(ty);
+        }
+
+        void set_number_type(unsigned char ty);
+
+        /// changes the flags, given as bits of FLAGMASK, moving a NUMBER on or off the heap
+        void set_flags(unsigned char fl);
+
+        inline unsigned char flags() const { return (unsigned char) (box_flags() << 5); }
+#else
         unsigned char m_type;
+        unsigned char m_slen; ///< length of a SHORTSTR
+        char m_sbuf[6]; ///< first characters of a SHORTSTR, which continue in m_u.s
         /** \union m_u
         *
         * m_type stores both data type and flag information.
@@ -108,12 +189,77 @@ namespace lk {
         union {
             void *p;
             double v;
+            char s[8];
         } m_u;
 
+        inline void *ptr() const { return m_u.p; }
+
+        inline void set_ptr(void *p) { m_u.p = p; }
+
+        inline double dbl() const { return m_u.v; }
+
+        inline void set_dbl(double d) { m_u.v = d; }
+
+        inline void reset() { m_type = 0; }
+
+        inline unsigned char flags() const { return m_type & FLAGMASK; }
+
         void set_type(unsigned char ty);
+#endif
 
         void assert_modify();
 
+        /// assign(double) for any other value
+        void assign_number(double d);
+
+        /// container of a STRING, VECTOR or HASH, which copies of the value share until one of
+        /// them is changed.  with 'modify' set, a shared container is first copied for this value.
+        /// with 'pin' set, the caller keeps a pointer into it, and later copies get their own
+        void *payload(bool modify, bool pin = false) const;
+
+        /// vec() and hash() for changes made here, which leave the contents shareable
+        std::vector<vardata_t> *items_vec() const;
+
+        varhash_t *items_hash() const;
+
+        /// item of the table h under key, as lookup(key, create)
+        static vardata_t *key_item(varhash_t &h, const vardata_t &key, bool create);
+
+        /// drops the share of the container of a STRING, VECTOR or HASH
+        void release();
+
+        /// true if any item of an array or table, at any depth, is a reference
+        bool holds_reference() const;
+
+#ifdef LK_NANBOX
+        inline unsigned char tag() const { return boxed() ? (unsigned char) ((m_bits >> 48) & TYPEMASK) : NUMBER; }
+#else
+        inline unsigned char tag() const { return (m_type & TYPEMASK); }
+#endif
+
+        /// turns a NUMARRAY into a VECTOR of numbers and nulls
+        void unpack() const;
+
+#ifdef LK_SHORT_STRINGS
+#ifdef LK_NANBOX
+        static const size_t SHORT_MAX = 5;
+#else
+        static const size_t SHORT_MAX = 14;
+#endif
+
+        /// stores the n characters of s, at most SHORT_MAX, in a value that is already a SHORTSTR
+        void set_short(const char *s, size_t n);
+
+        /// copies the characters of a SHORTSTR to buf, returning how many there are
+        size_t short_chars(char *buf) const;
+
+        /// makes this a SHORTSTR of the n characters of s if there are few enough
+        bool assign_short(const char *s, size_t n);
+
+        /// characters of a STRING in place, or of a SHORTSTR copied to buf, setting n to their number
+        const char *chars(char *buf, size_t &n) const;
+#endif
+
     public:
         /// Data Types
         static const unsigned char NULLVAL = 1;
@@ -125,6 +271,9 @@ namespace lk {
         static const unsigned char FUNCTION = 7;    ///< code expression pointer
         static const unsigned char EXTFUNC = 8;        ///< external function pointer
         static const unsigned char INTFUNC = 9;        ///< internal function pointer
+        // values held in another form, whose low three bits give the type they are reported as
+        static const unsigned char SHORTSTR = 12;    ///< string held in place, a STRING to type()
+        static const unsigned char NUMARRAY = 13;    ///< packed array of numbers, a VECTOR to type()
 
         static const unsigned char TYPEMASK = 0x0F;
         static const unsigned char FLAGMASK = 0xF0;
@@ -138,17 +287,36 @@ namespace lk {
 
         vardata_t(const vardata_t &cp);
 
+        vardata_t(vardata_t &&rv) noexcept;
+
         ~vardata_t();
 
-        inline unsigned char type() const { return (m_type & TYPEMASK); }
+        inline unsigned char type() const {
+            unsigned char ty = tag();
+            return ty < SHORTSTR ? ty : ty & 7;
+        }
 
         const char *typestr() const;
 
-        void set_flag(unsigned char flag) { m_type |= (0x01 << flag) << 4; }
+#ifdef LK_NANBOX
+        void set_flag(unsigned char flag) { set_flags(flags() | flag_bit(flag)); }
+
+        void clear_flag(unsigned char flag) { set_flags(flags() & ~flag_bit(flag)); }
+#else
+        void set_flag(unsigned char flag) { m_type |= flag_bit(flag); }
+
+        void clear_flag(unsigned char flag) { m_type &= ~flag_bit(flag); }
+#endif
+
+        /// bit of the type byte that holds a flag
+        static unsigned char flag_bit(unsigned char flag) { return (unsigned char) ((0x01 << flag) << 4); }
 
-        void clear_flag(unsigned char flag) { m_type &= ~((0x01 << flag) << 4); }
+        /// byte offsets of the type and of the value of a NUMBER, for code generated at run time
+        static size_t type_offset();
 
-        bool flagval(unsigned char flag) const { return ((m_type >> flag) >> 4) & 0x01; }
+        static size_t number_offset();
+
+        bool flagval(unsigned char flag) const { return ((flags() >> flag) >> 4) & 0x01; }
 
         bool as_boolean() const;
 
@@ -164,22 +332,32 @@ namespace lk {
 
         bool lessthan(vardata_t &rhs) const;
 
+        /// hash of the value, the same for any two values that are equals()
+        size_t hash_value() const;
+
         void nullify(); ///< only function that override const-ness
 
         void deep_localize();
 
         bool copy(vardata_t &rhs);
 
+        bool move(vardata_t &rhs); ///< as copy, but takes the contents of rhs and leaves it null
+
         vardata_t &operator=(const vardata_t &rhs) {
             copy(const_cast<vardata_t &>(rhs));
             return *this;
         }
 
+        vardata_t &operator=(vardata_t &&rhs) {
+            move(rhs);
+            return *this;
+        }
+
         /// return referenced vardata_t
         inline vardata_t &deref() const {
             vardata_t *p = const_cast<vardata_t *>(this);
             while (p->type() == REFERENCE) {
-                vardata_t *pref = reinterpret_cast<vardata_t *>(p->m_u.p);
+                vardata_t *pref = reinterpret_cast<vardata_t *>(p->ptr());
                 if (p == pref) throw error_t("self referential reference");
                 p = pref;
             }
@@ -187,12 +365,31 @@ namespace lk {
             return *p;
         }
 
-        void assign(double d);
+        /// a value that holds no string, array or table, such as a number or a reference on the
+        /// vm stack, is changed in place
+        inline void assign(double d) {
+#ifdef LK_NANBOX
+            if (!boxed() || (tag() <= REFERENCE && box_flags() <= 1)) {
+                m_bits = 0;
+                set_dbl(d);
+                return;
+            }
+#else
+            if (tag() <= NUMBER && !flagval(CONSTVAL)) {
+                m_type = (unsigned char) ((m_type & FLAGMASK) | flag_bit(ASSIGNED) | NUMBER);
+                m_u.v = d;
+                return;
+            }
+#endif
+            assign_number(d);
+        }
 
         void assign(const char *s);
 
         void assign(const lk_string &s);
 
+        void assign(lk_string &&s);
+
         void empty_vector();
 
         void empty_hash();
@@ -214,6 +411,9 @@ namespace lk {
 
         double num() const;
 
+        /// as num() for a value whose type() is already known to be NUMBER
+        inline double num_unchecked() const { return dbl(); }
+
         lk_string str() const;
 
         expr_t *func() const;
@@ -222,17 +422,73 @@ namespace lk {
         size_t length() const;
 
         vardata_t *lookup(const lk_string &key) const; ///< returned variable inherits const-ness of parent
+
+        /// item of a table under key, converted to a string, adding a null item if there is none
+        /// and create is set.  an interned key is looked up as its atom, and any other string
+        /// keeps its hash, so it is only hashed the first time
+        vardata_t *lookup(const vardata_t &key, bool create = false);
+
+        /// holds a string with its atom, as code generators do for literal table keys, so that
+        /// lookup() compares it to the keys of a table as atoms
+        void intern();
+
+        /// true if the value is a string held with its atom by intern()
+        bool interned() const;
+
         fcallinfo_t *fcall() const;
 
         size_t faddr() const;
 
         std::vector<vardata_t> *vec() const;
 
+        /// true if the value is an array held as packed numbers
+        bool is_numarray() const { return tag() == NUMARRAY; }
+
+        /// makes this a packed array of n numbers, in which null_number() items are null
+        void assign(const double *p, size_t n);
+
+        /// as assign(p, n), taking over the storage of the numbers
+        void assign(std::vector<double> &&nums);
+
+        /// packs an array that holds only numbers and nulls, returning false if it cannot be packed
+        bool pack();
+
+        /// packed numbers of a NUMARRAY, first copied for this value if they are shared
+        std::vector<double> *numarray() const;
+
+        /// packed numbers to read, or 0 if this is not a NUMARRAY
+        const double *numbers() const;
+
+        /// copies item 'idx' of an array to x, without giving out a pointer to the item
+        void item(size_t idx, vardata_t &x) const;
+
+        /// stores d as item 'idx' of a NUMARRAY, appending it if idx is the length.  returns
+        /// false, leaving the array unchanged, for anything else
+        bool set_item(size_t idx, double d);
+
+        /// item of a NUMARRAY that holds null, a NaN that arithmetic does not produce
+        static double null_number() {
+            uint64_t b = 0x7FF8000000000001ULL;
+            double d;
+            memcpy(&d, &b, sizeof(d));
+            return d;
+        }
+
+        static bool is_null_number(double d) {
+            uint64_t b;
+            memcpy(&b, &d, sizeof(b));
+            return b == 0x7FF8000000000001ULL;
+        }
+
         void vec_append(double d);
 
         void vec_append(const lk_string &s);
 
-        void vec_append(const vardata_t vd);
+        void vec_append(lk_string &&s);
+
+        void vec_append(const vardata_t &vd);
+
+        void vec_append(vardata_t &&vd);
 
         varhash_t *hash() const;
 
@@ -242,6 +498,9 @@ namespace lk {
 
         void hash_item(const lk_string &key, const vardata_t &v);
 
+        /// as hash_item(key.as_string(), v), looking up an interned key as its atom
+        void hash_item(const vardata_t &key, const vardata_t &v);
+
         vardata_t &hash_item(const lk_string &key);
 
     };
@@ -289,7 +548,9 @@ namespace lk {
         void *user_data;
     };
 
-    typedef unordered_map<lk_string, fcallinfo_t, lk_string_hash, lk_string_equal> funchash_t;
+/// entries are allocated separately, since FUNCTION values keep pointers to them that must
+/// stay valid while the table grows
+    typedef hashmap<atom_t, fcallinfo_t *, atom_hash, atom_equal> funchash_t;
 
 
 /** Documents LK functions.
@@ -433,14 +694,15 @@ namespace lk {
 /**
 * \struct dynlib_t
 *
-*
-*
+* Library loaded by load_library: an extension using the C interface of invoke.h, which
+* provides 'functions', or a native module generated by lk::aotgen, which provides 'natives'
 *
 */
         struct dynlib_t {
             lk_string path;
             void *handle;
             lk_invokable *functions;
+            fcall_t *natives;
         };
 
     protected:
@@ -454,10 +716,14 @@ namespace lk {
 
         std::vector<dynlib_t> m_dynlibList;
 
+        unsigned int m_version;
+
         bool register_ext_func(lk_invokable f, void *user_data = 0);
 
         void unregister_ext_func(lk_invokable f);
 
+        void unregister_func(fcall_t f);
+
     public:
 
         env_t();
@@ -470,12 +736,23 @@ namespace lk {
 
         void clear_objs();
 
+        void clear_funcs();
+
+        /// moves all variables into dest, deleting variables of dest with the same names
+        void move_vars(env_t &dest);
+
         void assign(const lk_string &name, vardata_t *value);
 
+        /// as assign(name, value), without looking up the atom of the name
+        void assign(const atom_t &name, vardata_t *value);
+
         void unassign(const lk_string &name);
 
         vardata_t *lookup(const lk_string &name, bool search_hierarchy);
 
+        /// as lookup(name, search_hierarchy), comparing names as atoms
+        vardata_t *lookup(const atom_t &name, bool search_hierarchy);
+
         bool first(lk_string &key, vardata_t *&value);
 
         bool next(lk_string &key, vardata_t *&value);
@@ -502,6 +779,16 @@ namespace lk {
 
         fcallinfo_t *lookup_func(const lk_string &name);
 
+        /// as lookup_func(name), comparing names as atoms
+        fcallinfo_t *lookup_func(const atom_t &name);
+
+        /// changes whenever a variable of this environment is added, replaced or removed
+        unsigned int version() { return m_version; }
+
+        /// changes whenever a function is registered or removed in any environment, so that
+        /// results of lookup_func() can be cached until then
+        static unsigned int func_version();
+
         std::vector<lk_string> list_funcs();
 
         size_t insert_object(objref_t *o);
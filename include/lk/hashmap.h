@@ -0,0 +1,270 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __lk_hashmap_h
+#define __lk_hashmap_h
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+namespace lk {
+
+/**
+* \class hashmap
+*
+* Open-addressing hash table with linear probing, used for LK tables and for the variables
+* and functions of an environment.  Entries live inline in one array of slots, each keeping
+* the hash of its key so that probing and growing rarely need to compare or rehash keys.
+* Erased entries leave a marker behind until the next rehash, so erase() does not move other
+* entries and iteration can continue from the iterator it returns.
+*
+* Offers the parts of the std::unordered_map interface used by LK.  As there, adding an
+* entry may invalidate iterators and references to entries.  Lookups take any key that Hash
+* and Equal accept alongside K, hashing it as the K it would be stored as, so that a table of
+* atoms can be searched with a string; adding such a key stores K(key).
+*/
+    template<typename K, typename V, typename Hash, typename Equal>
+    class hashmap {
+    public:
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef std::pair<K, V> value_type;
+
+    private:
+        enum {
+            EMPTY = 0, ERASED = 1
+        };
+
+        struct slot {
+            slot() : hash(EMPTY) {}
+
+            size_t hash; // EMPTY, ERASED, or the hash of the key
+            value_type kv;
+        };
+
+        template<typename S, typename T>
+        class iter {
+            friend class hashmap;
+
+            S *m_p, *m_end;
+
+            iter(S *p, S *end) : m_p(p), m_end(end) { skip(); }
+
+            void skip() { while (m_p != m_end && m_p->hash <= ERASED) m_p++; }
+
+        public:
+            iter() : m_p(0), m_end(0) {}
+
+            template<typename S2, typename T2>
+            iter(const iter<S2, T2> &rhs) : m_p(rhs.m_p), m_end(rhs.m_end) {}
+
+            T &operator*() const { return m_p->kv; }
+
+            T *operator->() const { return &m_p->kv; }
+
+            iter &operator++() {
+                m_p++;
+                skip();
+                return *this;
+            }
+
+            iter operator++(int) {
+                iter it(*this);
+                ++(*this);
+                return it;
+            }
+
+            bool operator==(const iter &rhs) const { return m_p == rhs.m_p; }
+
+            bool operator!=(const iter &rhs) const { return m_p != rhs.m_p; }
+
+            template<typename S2, typename T2> friend class iter;
+        };
+
+    public:
+        typedef iter<slot, value_type> iterator;
+        typedef iter<const slot, const value_type> const_iterator;
+
+        hashmap() : m_size(0), m_used(0) {}
+
+        iterator begin() { return iterator(slots(), slots() + m_slots.size()); }
+
+        iterator end() { return iterator(slots() + m_slots.size(), slots() + m_slots.size()); }
+
+        const_iterator begin() const { return const_iterator(slots(), slots() + m_slots.size()); }
+
+        const_iterator end() const {
+            return const_iterator(slots() + m_slots.size(), slots() + m_slots.size());
+        }
+
+        size_t size() const { return m_size; }
+
+        bool empty() const { return m_size == 0; }
+
+        /// hash of a key as kept by the table, for the overloads taking one
+        template<typename Q>
+        static size_t hash_of(const Q &key) {
+            size_t h = Hash()(key);
+            return h > ERASED ? h : h + 2;
+        }
+
+        template<typename Q>
+        iterator find(const Q &key) { return find(key, hash_of(key)); }
+
+        template<typename Q>
+        iterator find(const Q &key, size_t h) {
+            slot *s = lookup(key, h);
+            return s ? iterator(s, slots() + m_slots.size()) : end();
+        }
+
+        template<typename Q>
+        const_iterator find(const Q &key) const {
+            const slot *s = const_cast<hashmap *>(this)->lookup(key, hash_of(key));
+            return s ? const_iterator(s, slots() + m_slots.size()) : end();
+        }
+
+        template<typename Q>
+        size_t count(const Q &key) const { return find(key) != end() ? 1 : 0; }
+
+        template<typename Q>
+        V &operator[](const Q &key) { return item(key, hash_of(key)); }
+
+        /// as operator[], given the hash of the key from hash_of()
+        template<typename Q>
+        V &item(const Q &key, size_t h) {
+            if (slot *s = lookup(key, h))
+                return s->kv.second;
+
+            if ((m_used + 1) * 4 > m_slots.size() * 3)
+                rehash(m_size + 1);
+
+            size_t mask = m_slots.size() - 1;
+            size_t i = h & mask;
+            while (m_slots[i].hash > ERASED)
+                i = (i + 1) & mask;
+
+            slot &s = m_slots[i];
+            if (s.hash == EMPTY) m_used++;
+            s.hash = h;
+            s.kv.first = K(key);
+            m_size++;
+            return s.kv.second;
+        }
+
+        /// returns the iterator following the erased entry
+        iterator erase(iterator it) {
+            slot *s = it.m_p;
+            s->hash = ERASED;
+            s->kv = value_type();
+            m_size--;
+            return ++it;
+        }
+
+        template<typename Q>
+        size_t erase(const Q &key) {
+            iterator it = find(key);
+            if (it == end()) return 0;
+            erase(it);
+            return 1;
+        }
+
+        void clear() {
+            if (m_used == 0) return;
+            for (size_t i = 0; i < m_slots.size(); i++)
+                if (m_slots[i].hash != EMPTY)
+                    m_slots[i] = slot();
+            m_size = m_used = 0;
+        }
+
+        /// makes room for n entries without growing again
+        void reserve(size_t n) {
+            if (n * 4 > m_slots.size() * 3)
+                rehash(n);
+        }
+
+        void swap(hashmap &rhs) {
+            m_slots.swap(rhs.m_slots);
+            std::swap(m_size, rhs.m_size);
+            std::swap(m_used, rhs.m_used);
+        }
+
+    private:
+        std::vector<slot> m_slots; // a power of two in size, or empty
+        size_t m_size; // entries
+        size_t m_used; // entries and erased markers
+
+        slot *slots() { return m_slots.empty() ? 0 : &m_slots[0]; }
+
+        const slot *slots() const { return m_slots.empty() ? 0 : &m_slots[0]; }
+
+        template<typename Q>
+        slot *lookup(const Q &key, size_t h) {
+            if (m_slots.empty()) return 0;
+
+            size_t mask = m_slots.size() - 1;
+            size_t i = h & mask;
+            while (m_slots[i].hash != EMPTY) {
+                if (m_slots[i].hash == h && Equal()(m_slots[i].kv.first, key))
+                    return &m_slots[i];
+                i = (i + 1) & mask;
+            }
+            return 0;
+        }
+
+        // resizes to hold n entries at no more than half full, dropping erased markers
+        void rehash(size_t n) {
+            size_t cap = 8;
+            while (cap < n * 2)
+                cap *= 2;
+
+            std::vector<slot> old(cap);
+            old.swap(m_slots);
+
+            size_t mask = cap - 1;
+            for (size_t k = 0; k < old.size(); k++) {
+                if (old[k].hash <= ERASED) continue;
+
+                size_t i = old[k].hash & mask;
+                while (m_slots[i].hash != EMPTY)
+                    i = (i + 1) & mask;
+
+                m_slots[i].hash = old[k].hash;
+                m_slots[i].kv = std::move(old[k].kv);
+            }
+
+            m_used = m_size;
+        }
+    };
+
+} // namespace lk
+
+#endif
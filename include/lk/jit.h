@@ -0,0 +1,148 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __lk_jit_h
+#define __lk_jit_h
+
+#include <lk/env.h>
+#include <lk/vm.h>
+
+namespace lk {
+
+/**
+* \class jit
+*
+* Compiles hot regions of stack bytecode, the body of a loop or of a function, to native
+* code for lk::vm.  A region is compiled only if all of its instructions compute with numbers
+* held in local or named variables and constants, calling at most a few pure functions of the
+* math library; any other instruction leaves the whole region to the interpreter.
+*
+* The native code checks that every variable it reads or writes holds a number.  When a check
+* fails it exits to the interpreter at the instruction that failed, with the operands of that
+* instruction rebuilt on the vm stack, so that the interpreter carries on as if it had run the
+* region itself.  Jumps out of the region, returns and periodic polls of the host exit the
+* same way.
+*
+* Native code is only generated for x86-64 Linux, unless LK_NO_JIT or LK_NANBOX is defined;
+* elsewhere available() is false and no region is ever compiled.
+*/
+    class jit {
+    public:
+        /// variable used by a region, resolved each time the region is entered
+        struct var {
+            enum Kind {
+                SLOT, ///< frame slot, as RLOC and LLOC
+                NAME, ///< right-hand name lookup, as RREF
+                LNAME ///< left-hand name lookup of an existing variable, as LREF
+            };
+
+            Kind kind;
+            size_t arg; ///< slot number, or identifier index
+        };
+
+        /// value rebuilt on the vm stack when the native code exits
+        struct item {
+            enum Kind {
+                NUMBER, ///< computed number, saved at its stack position in the exit buffer
+                REF, ///< reference to variable 'index' of the region
+                CONST, ///< copy of constant 'index'
+                NUL, ///< null, as pushed for the result of a call
+                FUNC ///< function about to be called
+            };
+
+            Kind kind;
+            size_t index;
+            fcallinfo_t *fci;
+        };
+
+        struct exit {
+            size_t ip; ///< where the interpreter resumes
+            bool deopt; ///< a check failed and the instruction at ip still has to run
+            std::vector<item> stack;
+        };
+
+        /// native code returns the index of the exit taken
+        typedef size_t (*native_t)(vardata_t **vars, double *buf, size_t polls);
+
+        struct region {
+            region() : start(0), end(0), fver(0), misses(0), code(0), size(0) {}
+
+            size_t start, end;
+            unsigned int fver; ///< env_t::func_version() the called functions were resolved with
+            std::vector<var> vars;
+            std::vector<exit> exits;
+            size_t misses; ///< entries that could not resolve a variable or exited on a failed check
+            native_t code;
+            size_t size;
+        };
+
+        enum {
+            HOT = 1000, ///< executions of an entry before its region is compiled
+            MAX_MISSES = 64, ///< misses before a region is given up
+            MAX_DEPTH = 14 ///< stack values a region can hold in registers
+        };
+
+        jit();
+
+        ~jit();
+
+        /// true if native code can be generated on this platform
+        static bool available();
+
+        /// forgets all regions, for a program of the given size
+        void reset(size_t program_size);
+
+        /// counts an execution of the entry at ip and returns its region once compiled.  returns
+        /// null with 'compile' set when the entry just became hot and has no region yet
+        region *lookup(size_t ip, bool &compile);
+
+        /// compiles the region from start to end, entered at start.  funcs holds the function
+        /// named by each identifier where the region is entered, or null.  returns null and gives
+        /// up the entry if the region cannot be compiled
+        region *compile(const bytecode &bc, size_t start, size_t end, const std::vector<fcallinfo_t *> &funcs);
+
+        /// drops a region: it is compiled again once hot if 'retry', otherwise never
+        void discard(region *r, bool retry);
+
+    private:
+        enum {
+            COLD = -1 ///< entry given up
+        };
+
+        std::vector<int> m_hits;
+        std::vector<region *> m_regions;
+
+        void release(region *r);
+    };
+
+} // namespace lk
+
+#endif
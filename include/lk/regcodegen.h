@@ -0,0 +1,142 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __lk_regcodegen_h
+#define __lk_regcodegen_h
+
+#include <lk/absyn.h>
+#include <lk/codegen.h>
+#include <lk/regvm.h>
+
+namespace lk {
+
+/** Produces register bytecode for lk::regvm from a tree of nodes.
+* \class regcodegen
+*
+* Arguments and locals of a function, the same names that the stack codegen assigns
+* frame slots, get the first registers of the function.  Temporaries are allocated
+* above them in stack order as expressions are generated, so that the operands of a
+* call are always the topmost registers.  generate() fails if a function needs more
+* registers, constants or identifiers than the instruction operands can address, and
+* for statements whose value the stack vm leaves on its stack, such as a bare identifier
+* or a function body that is a single expression, since that moves the results of calls
+* on the stack vm.  the stack codegen can be used for such programs instead.
+*/
+    class regcodegen {
+    public:
+        regcodegen();
+
+        lk_string error() { return m_errStr; }
+
+        bool generate(lk::node_t *root);
+
+        /// copies the program, constants, & identifers into bytecode
+        size_t get(bytecode &b);
+
+        /// writes the bytecode into assembly
+        void textout(lk_string &assembly, lk_string &bytecode);
+
+    private:
+        struct instr {
+            instr(srcpos_t sp, unsigned int c, int lbl, bool w)
+                    : pos(sp), code(c), label(lbl), word(w) {
+            }
+
+            lk::srcpos_t pos;
+            unsigned int code;
+            int label; ///< address patched into a jump, or -1
+            bool word; ///< operand word following an instruction
+        };
+
+        std::vector<instr> m_code;
+        std::vector<int> m_labelAddr;
+        std::vector<vardata_t> m_constData;
+        std::vector<lk_string> m_idList;
+        /// indices into m_idList and m_constData, as kept by the stack codegen
+        hashmap<lk_string, int, lk_string_hash, lk_string_equal> m_idIndex;
+        hashmap<size_t, int, std::hash<size_t>, std::equal_to<size_t> > m_constIndex;
+        std::vector<int> m_constNext;
+        std::vector<int> m_breakAddr, m_continueAddr;
+        lk_string m_errStr;
+        bool m_overflow;
+
+/** Registers of the function being generated.
+* \struct fstate
+*/
+        struct fstate {
+            fstate() : top(0), maxreg(0) {}
+
+            unordered_map<lk_string, int, lk_string_hash, lk_string_equal> locals;
+            int top; ///< first free register
+            int maxreg; ///< number of registers used
+        };
+
+        fstate m_fn;
+
+        bool error(const lk_string &s);
+
+        int place_identifier(const lk_string &id);
+
+        int place_const(vardata_t &d);
+
+        int const_index(lk::node_t *n);
+
+        int key(lk::node_t *n, int dst = -1);
+
+        int new_label();
+
+        void place_label(int L);
+
+        int alloc();
+
+        void emit(srcpos_t pos, unsigned int code, int label = -1);
+
+        void emit_word(srcpos_t pos, unsigned int w, int label = -1);
+
+        /// collects the names written in a function body the way the stack codegen assigns slots
+        void scan_locals(lk::node_t *root, unsigned int flags, std::vector<lk_string> &names);
+
+        /// generates the body of a function and returns the label of its entry, or -1 on failure
+        int define(lk::expr_t *n);
+
+        bool jump_false(lk::node_t *test, unsigned int flags, int label);
+
+        bool stmt(lk::node_t *root, unsigned int flags);
+
+        /// generates an expression into register dst, or any register if dst is negative,
+        /// and returns the register holding the result or -1 on failure
+        int expr(lk::node_t *root, unsigned int flags, int dst = -1);
+
+        int gen_expr(lk::node_t *root, unsigned int flags, int dst);
+    };
+}; // namespace lk
+
+#endif
@@ -0,0 +1,217 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __lk_regvm_h
+#define __lk_regvm_h
+
+#include <lk/absyn.h>
+#include <lk/env.h>
+#include <lk/vm.h>
+
+namespace lk {
+
+/**
+* \enum RegOpcode
+* Operation codes of the register instruction set.  An instruction word holds the opcode in
+* its lowest 8 bits followed by the operands A, B and C of 8 bits each, or by A and a 16 bit
+* operand Bx, or by a single 24 bit operand Ax.  Jump targets that do not fit are stored in
+* the word following the instruction.
+*/
+    enum RegOpcode {
+        R_ENTER, ///< function prologue: A parameters, B named locals, C registers, followed by B identifier words
+        R_ARGV, ///< builds '__args' in functions that refer to it
+        R_MOVE, ///< R[A] = R[B], keeping references
+        R_LOADK, ///< R[A] = constant Bx
+        R_LOADNULL, ///< R[A] = null
+        R_GETN, ///< R[A] = right-hand reference to the variable named Bx
+        R_REFL, ///< R[A] = left-hand reference to the variable named Bx
+        R_REFC, ///< R[A] = left-hand constant reference to the variable named Bx
+        R_REFG, ///< R[A] = left-hand global reference to the variable named Bx
+        R_GETS, ///< R[A] = special variable Bx
+        R_SETS, ///< special variable Bx = R[A]
+        R_WR, ///< variable referred to by R[A] = R[B]
+        R_ADDWR, ///< variable referred to by R[A] += R[B], appending to arrays
+        R_ADD, R_SUB, R_MUL, R_DIV, R_EXP, R_LT, R_GT, R_LE, R_GE, R_NE, R_EQ, R_OR, R_AND, ///< R[A] = R[B] op R[C]
+        R_ADDK, R_SUBK, R_MULK, ///< R[A] = R[B] op constant C
+        R_NOT, R_NEG, ///< R[A] = op R[B]
+        R_INC, R_DEC, ///< increments the variable referred to by R[A]
+        R_IDX, R_KEY, ///< R[A] = R[B][R[C]], R[B]{R[C]}
+        R_IDXM, R_KEYM, ///< as IDX and KEY, creating the item if needed
+        R_MAT, R_WAT, ///< R[A] = R[B] -@ R[C], R[B] ?@ R[C]
+        R_SZ, R_KEYS, ///< R[A] = sizeof R[B], keysof R[B]
+        R_TYP, ///< R[A] = typeof variable named Bx
+        R_VEC, R_HASH, ///< R[A] = vector of R[A..A+B), table of B key/value pairs from R[A]
+        R_FREF, ///< R[A] = function at the address in the next word
+        R_J, ///< jump to Ax
+        R_JT, R_JF, ///< jump to the address in the next word if R[A] is true, false
+        R_LTJF, R_GTJF, R_LEJF, R_GEJF, R_NEJF, R_EQJF, ///< jump to the address in the next word unless R[A] op R[B]
+        R_SWI, ///< jump to the R[A]'th of the B jumps that follow
+        R_CALL, ///< R[A] = R[A]( R[A+1] ... R[A+B] )
+        R_TCALL, ///< R[A] = R[A]( R[A+2] ... R[A+B+1] ) with 'this' = R[A+1]
+        R_TAIL, R_TTAIL, ///< CALL, TCALL in tail position, reusing the current frame to call an LK function
+        R_RET, ///< return R[A]
+        R_RET0, ///< return without a value
+        R_END,
+        __MaxRegOp
+    };
+
+    enum {
+        REG_MAX = 0xFF, REG_BX_MAX = 0xFFFF
+    };
+
+    inline unsigned int reg_abc(RegOpcode op, unsigned int a, unsigned int b = 0, unsigned int c = 0) {
+        return ((unsigned int) op & 0xFF) | ((a & 0xFF) << 8) | ((b & 0xFF) << 16) | ((c & 0xFF) << 24);
+    }
+
+    inline unsigned int reg_abx(RegOpcode op, unsigned int a, unsigned int bx) {
+        return ((unsigned int) op & 0xFF) | ((a & 0xFF) << 8) | ((bx & 0xFFFF) << 16);
+    }
+
+    inline unsigned int reg_ax(RegOpcode op, unsigned int ax) {
+        return ((unsigned int) op & 0xFF) | (ax << 8);
+    }
+
+    struct RegOpCodeEntry {
+        RegOpcode op;
+        const char *name;
+    };
+    extern RegOpCodeEntry regop_table[];
+
+/**
+* \class regvm
+*
+* Executes bytecode produced by regcodegen.  Each call frame owns a window of a fixed
+* register file: the first registers of a function hold references to its arguments and
+* locals, bound on first use with the same name resolution rules as the stack vm, and the
+* rest hold temporary values.  Only NORMAL execution is supported; the host is polled
+* through on_run on backward jumps and function calls.
+*/
+    class regvm {
+    public:
+        struct frame {
+            frame(lk::env_t *parent) : env(parent), base(0), entry(0), argbase(0), nargs(0),
+                                       retaddr(0), thiscall(false) {
+            }
+
+            lk::env_t env;
+            /// variables of the functions that tail called the current one, as in lk::vm
+            lk::env_t tailenv;
+            size_t base; ///< first register of the frame
+            size_t entry; ///< address of the ENTER instruction, followed by the names of the locals
+            size_t argbase; ///< register holding the first argument, in the caller's window
+            size_t nargs;
+            size_t retaddr;
+            bool thiscall;
+        };
+
+    private:
+        size_t ip;
+        std::vector<vardata_t> regs;
+        bytecode *bc;
+        std::vector<frame *> frames;
+        std::vector<frame *> pool; ///< returned frames kept for reuse by later calls
+        lk_string errStr;
+
+        /// target of the local registers that are not bound to a variable yet
+        vardata_t m_unbound;
+        /// holds a function found when resolving a local name, as the stack vm pushes it
+        vardata_t m_func;
+
+        /// indexed by identifier, as in lk::vm
+        std::vector<refcache> refcaches;
+
+        /// arguments of a tail call while the frame they are moved into is released
+        std::vector<vardata_t> tailargs;
+        std::vector<vardata_t *> tailhidden;
+
+        void tail_call(RegOpcode op, size_t a, size_t nargs);
+
+        fcallinfo_t *lookup_func(size_t id);
+
+        vardata_t *lookup_global(size_t id, bool search_hierarchy);
+
+        /// thrown by the register accessors once an error has been recorded
+        struct halt_t {
+        };
+
+        void free_frames();
+
+        frame *push_frame(lk::env_t *parent);
+
+        void pop_frame();
+
+        bool error(const char *fmt, ...);
+
+        vardata_t *resolve(frame &F, size_t r, bool lhs);
+
+        /// value read from register r of the current frame
+        inline vardata_t &value(frame &F, size_t r) {
+            vardata_t &x = regs[F.base + r].deref();
+            if (&x == &m_unbound)
+                return resolve(F, r, false)->deref();
+            return x;
+        }
+
+        /// variable written through register r of the current frame
+        inline vardata_t &target(frame &F, size_t r) {
+            vardata_t &x = regs[F.base + r].deref();
+            if (&x == &m_unbound)
+                return resolve(F, r, true)->deref();
+            return x;
+        }
+
+        bool index(frame &F, unsigned int code, bool is_key);
+
+    public:
+        regvm(size_t nregs = 16384);
+
+        virtual ~regvm();
+
+        bool initialize(lk::env_t *env);
+
+        bool run();
+
+        lk_string error() { return errStr; }
+
+        virtual bool on_run(const srcpos_t &spos);
+
+        void load(bytecode *b);
+
+        bytecode *get_bytecode() { return bc; }
+
+        virtual bool special_set(const lk_string &name, vardata_t &val);
+
+        virtual bool special_get(const lk_string &name, vardata_t &val);
+    };
+
+} // namespace lk
+
+#endif
@@ -0,0 +1,82 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __lk_vecops_h
+#define __lk_vecops_h
+
+#include <lk/env.h>
+
+namespace lk {
+
+/**
+* Element-wise arithmetic and comparison of arrays, shared by all the engines.  When either
+* operand of + - * / ^ < <= > >= or of unary - is an array, the operator applies to each item
+* and gives an array: an array operand is paired item by item with the other array, which
+* must have the same length, or with the other number.  Comparisons give masks of 1 and 0.
+* String concatenation with + and whole-array equality with == and != are unchanged, and +=
+* on an array appends to it, as it always has, rather than adding item by item.  A mask is
+* not a truth value: an element-wise comparison that is the test of an if, while, for or ?:
+* is an error, and the all() and any() functions reduce masks instead.
+*
+* Items must be numbers.  Operands are worked on as packed arrays of doubles, with SSE2 or
+* AVX2 kernels chosen at run time on x86, unless LK_NO_SIMD is defined.
+*/
+    namespace vecops {
+        enum op_t {
+            ADD, SUB, MUL, DIV, EXP, LT, LE, GT, GE
+        };
+
+        /// true if the operator applies element-wise to the operands
+        inline bool applies(const vardata_t &lhs, const vardata_t &rhs) {
+            return lhs.type() == vardata_t::VECTOR || rhs.type() == vardata_t::VECTOR;
+        }
+
+        /// result = lhs op rhs.  result may be either operand
+        void binary(op_t op, const vardata_t &lhs, const vardata_t &rhs, vardata_t &result);
+
+        /// result = -x, element-wise
+        void negate(const vardata_t &x, vardata_t &result);
+
+        /// error of an element-wise comparison used as a condition
+        lk_string mask_test_error();
+
+        /// lhs += rhs: appends rhs, or the items of an array rhs, to an array lhs, and is lhs + rhs
+        /// stored in lhs otherwise
+        void plus_eq(vardata_t &lhs, vardata_t &rhs);
+
+        /// result = items of a where mask is nonzero and of b elsewhere.  either of a and b can
+        /// be a number, used for every item
+        void select(const vardata_t &mask, const vardata_t &a, const vardata_t &b, vardata_t &result);
+    }
+
+} // namespace lk
+
+#endif
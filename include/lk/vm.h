@@ -32,6 +32,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __lk_vm_h
 #define __lk_vm_h
 
+#include <map>
+
 #include <lk/absyn.h>
 #include <lk/env.h>
 
@@ -52,15 +54,102 @@ namespace lk {
         LREF, ///< left-hand reference
         LCREF, ///< left-hand constant reference
         LGREF, ///< left-hand global reference
+        RLOC, ///< right-hand reference to a function local through its frame slot
+        LLOC, ///< left-hand reference to a function local through its frame slot
         FREF, CALL, TCALL, RET, END, SZ, KEYS, TYP, VEC, HASH,
+        ARGV, ///< builds '__args' in functions that refer to it
+        ADDWR, ///< '+=': adds the value below the top to the variable on the top, appending to arrays
+        // fused instructions produced by the codegen peephole pass
+        ADDC, SUBC, MULC, ///< arithmetic with a constant right operand: PSH c; ADD
+        LTJF, GTJF, LEJF, GEJF, NEJF, EQJF, ///< compare and jump if false: LT; JF L
+        JTK, JFK, ///< jump on the top of stack without popping it: DUP; JT L
+        INCL, DECL, ///< increment a local in place: LLOC x; INC; POP
+        WRP, ///< assignment statement: WR; POP
+        IDXWR, IDXWRP, ///< assignment to an array item: IDX; WR and IDX; WRP
+        IDXINC, IDXDEC, ///< increment of an array item: IDX; INC
+        // calls in tail position, followed by the RET that completes them for external functions
+        TAIL, TTAIL, ///< CALL, TCALL that reuse the current frame to call an LK function
+        // functions inlined by the codegen keep their arguments on the stack
+        PICK, ///< push a copy of the value 'arg' places below the top
+        DROP, ///< remove the 'arg' values below the top, whose value is kept as RET keeps a result
+        // counting loops, each followed by a J.  both test the counter against the limit on the top:
+        // FORPREP skips the J out of the loop if it runs, FORLOOP advances the counter first and
+        // skips the J back if the loop ends
+        FORPREP, FORLOOP,
+        // quickened forms that the vm rewrites its copy of the program into once an instruction
+        // sees numbers, which revert to the generic form when they see anything else.  they are
+        // in the order of the generic forms and never appear in a bytecode
+        ADDN, SUBN, MULN, DIVN, LTN, GTN, LEN, GEN, NEN, EQN, ///< ADD ... EQ on two numbers
+        ADDCN, SUBCN, MULCN, ///< ADDC, SUBC, MULC on a number
+        LTJFN, GTJFN, LEJFN, GEJFN, NEJFN, EQJFN, ///< LTJF ... EQJF on two numbers
         __MaxOp
     };
+/// RLOC and LLOC pack the frame slot into the upper 8 bits of the instruction
+/// argument and the identifier index into the lower 16 bits
+    enum {
+        SLOT_MAX = 0xFF, SLOT_ID_MAX = 0xFFFF
+    };
+
+/// FORPREP and FORLOOP pack the loop test into the upper 2 bits of the argument, and the
+/// counter's frame slot and identifier index as RLOC does in the rest
+    enum {
+        FOR_LT, FOR_LE, FOR_GT, FOR_GE, ///< i < n and i <= n with i++, i > n and i >= n with i--
+        FOR_SLOT_MAX = 0x3F, FOR_VAR_MASK = 0x3FFFFF
+    };
+
     struct OpCodeEntry {
         Opcode op;
         const char *name;
     };
     extern OpCodeEntry op_table[];
 
+    /// stack values an instruction needs below the top and the change of the stack height it makes
+    void stack_effect(Opcode op, size_t arg, int &need, int &delta);
+
+/**
+* \class linetable
+*
+* Source positions of a program's instructions, run-length encoded: consecutive instructions
+* generated from the same position share one entry, and file names are stored once and
+* referred to by index.
+*/
+    class linetable {
+    public:
+        /// position of the instructions from 'start' up to the start of the next entry
+        struct entry {
+            size_t start;
+            int file;
+            int line, stmt, stmt_end;
+        };
+
+        linetable() : m_size(0) {}
+
+        void clear();
+
+        /// appends the position of the next instruction
+        void push_back(const srcpos_t &pos);
+
+        /// number of instructions described by the table
+        size_t size() const { return m_size; }
+
+        /// entry holding the position of instruction ip, which must be less than size()
+        const entry &find(size_t ip) const;
+
+        /// position of instruction ip, or srcpos_t::npos if out of range
+        srcpos_t at(size_t ip) const;
+
+        int stmt(size_t ip) const { return ip < m_size ? find(ip).stmt : srcpos_t::npos.stmt; }
+
+        const lk_string &file(int id) const { return m_files[id]; }
+
+        const std::vector<entry> &entries() const { return m_runs; }
+
+    private:
+        std::vector<entry> m_runs;
+        std::vector<lk_string> m_files;
+        size_t m_size;
+    };
+
 /**
 * \struct bytecode
 *
@@ -70,12 +159,80 @@ namespace lk {
 */
 
     struct bytecode {
+        /// instruction set of the program: STACK code runs on lk::vm, REGISTER code on lk::regvm
+        enum Engine {
+            STACK, REGISTER
+        };
+
+        bytecode() : engine(STACK) {}
+
+        Engine engine;
         std::vector<unsigned int> program;
         std::vector<vardata_t> constants;
         std::vector<lk_string> identifiers;
-        std::vector<srcpos_t> debuginfo;
+        std::vector<atom_t> atoms; ///< atom of each identifier, which the machines look up by
+        linetable debuginfo;
+
+        /// fills atoms, as code generators do, so that identifiers are looked up as atoms
+        void intern_identifiers() {
+            atoms.clear();
+            for (size_t i = 0; i < identifiers.size(); i++)
+                atoms.push_back(atom_t(identifiers[i]));
+        }
+
+        /// source position of instruction ip, or srcpos_t::npos if out of range
+        srcpos_t srcpos(size_t ip) const { return debuginfo.at(ip); }
+    };
+
+/** Result of resolving an identifier by the vm reference instructions.
+* \struct refcache
+*
+* Every frame's environment chain ends in the same host environment and call frames do
+* not keep functions, so whether a name refers to a function only changes when
+* env_t::func_version() does.  A variable is only cached as found in the global
+* environment, for reuse by top level code while the globals are unchanged.
+*/
+    struct refcache {
+        refcache() : fver(0), fci(0), var(0), gver(0) {}
+
+        unsigned int fver; ///< function version when looked up, or 0 if never
+        fcallinfo_t *fci; ///< function named by the identifier, or null
+        vardata_t *var; ///< global variable named by the identifier, or null
+        unsigned int gver; ///< version of the global environment when var was found
+    };
+
+/**
+* \class profile_t
+*
+* Execution profile collected by lk::vm while profiling is enabled: the number of times each
+* instruction ran, and the calls and wall time of each LK function, identified by the frame
+* ids of lk::vm::frame.  Inclusive time counts the callees, exclusive time does not.  Time spent
+* under each chain of calls is kept for the collapsed stack format read by flame graph tools.
+*/
+    class profile_t {
+    public:
+        struct func_t {
+            func_t() : calls(0), inclusive(0), exclusive(0) {}
+
+            size_t calls;
+            double inclusive, exclusive; ///< seconds
+        };
+
+        std::vector<size_t> hits; ///< executions of each instruction
+        std::map<lk_string, func_t> funcs;
+        std::map<lk_string, double> stacks; ///< exclusive seconds by chain of function names
+
+        void clear();
+
+        /// function table and instructions executed per source line
+        lk_string report(const bytecode &bc) const;
+
+        /// one line per chain of calls, in microseconds: "(main);f;g 1234"
+        lk_string collapsed() const;
     };
 
+    class jit;
+
 #define OP_PROFILE 1
 
 // takes bytecode as input
@@ -101,15 +258,21 @@ namespace lk {
 */
         struct frame {
             frame(lk::env_t *parent, size_t fptr, size_t ret, size_t na)
-                    : env(parent), fp(fptr), retaddr(ret), nargs(na), iarg(0), thiscall(false) {
+                    : env(parent), fp(fptr), retaddr(ret), nargs(na), iarg(0), thiscall(false), callip(0) {
             }
 
             lk::env_t env;
+            /// variables of the functions that tail called the current one, which stay visible
+            /// to it by name as they would through the frames of a regular call
+            lk::env_t tailenv;
+            /// cached pointers to variables owned by env, indexed by the slot numbers assigned by codegen
+            std::vector<vardata_t *> slots;
             size_t fp;
             size_t retaddr;
             size_t nargs;
             size_t iarg;
             bool thiscall;
+            size_t callip; ///< address of the CALL/TCALL instruction, from which id is computed on demand
             lk_string id;
         };
 
@@ -119,6 +282,11 @@ namespace lk {
         std::vector<vardata_t> stack;
 
         bytecode *bc;
+        /// copy of bc->program in which instructions are quickened, so that a bytecode run by
+        /// several vms at once is only read
+        std::vector<unsigned int> program;
+        /// times each instruction reverted from its quickened form, up to QUICK_RETRIES
+        std::vector<unsigned char> requick;
         /*
         std::vector< unsigned int > program;
         std::vector< vardata_t > constants;
@@ -127,15 +295,78 @@ namespace lk {
         */
 
         std::vector<frame *> frames;
+        std::vector<frame *> pool; ///< returned frames kept for reuse by later calls
         std::vector<bool> brkpt; ///< breakpoints for debugging
 
         lk_string errStr;
         srcpos_t lastbrk;
 
+        /// indexed by identifier, since the result does not depend on the call site
+        std::vector<refcache> refcaches;
+
+        /// arguments of a tail call while the frame they are moved into is released
+        std::vector<vardata_t> tailargs;
+        std::vector<vardata_t *> tailhidden;
+
+        void tail_call(Opcode op, size_t nargs);
+
+        fcallinfo_t *lookup_func(size_t id);
+
+        vardata_t *lookup_global(size_t id, bool search_hierarchy);
+
         void free_frames();
 
+        frame *push_frame(lk::env_t *parent, size_t fptr, size_t ret, size_t na);
+
+        void pop_frame();
+
+        void frame_id(frame &F);
+
         bool error(const char *fmt, ...);
 
+        bool push_local(Opcode op, size_t arg);
+
+        /// IDX on the array and index on the top of the stack, after any packed array fast path
+        void index_item(size_t arg);
+
+        /// WR, or WRP if 'keep' is false
+        void write(bool keep);
+
+
+/** Function activation followed by the profiler.
+* \struct profcall
+*/
+        struct profcall {
+            frame *F;
+            size_t callip; ///< changes when a tail call reuses the frame
+            lk_string id;
+            lk_string path; ///< ids of the calls leading to this one, separated by ';'
+            bool outer; ///< not a recursive call of a function already active
+            double start; ///< time when run() last resumed or the call began
+            double elapsed, child;
+        };
+
+        bool profiling;
+        profile_t prof;
+        std::vector<profcall> profcalls;
+        std::map<lk_string, int> profdepth; ///< active calls of each function
+
+        void profile_sync();
+
+        /// adds a finished call to p and returns its inclusive time
+        double profile_close(profile_t &p, const profcall &c, double now, bool running);
+
+        /// compiles hot regions in NORMAL mode, or null if disabled
+        jit *jitc;
+        std::vector<vardata_t *> jitvars;
+        std::vector<double> jitbuf;
+
+        /// runs the native code of the region entered at 'entry' if it is compiled or just
+        /// became hot, setting 'next' to where the interpreter resumes
+        bool jit_run(size_t entry, size_t end, size_t &next);
+
+        /// as jit_run for the body of the function whose code starts at 'start'
+        bool jit_call(size_t start, size_t body, size_t &next);
 
 /// global variable keeping track of number of operation types (47)
 #ifdef OP_PROFILE
@@ -191,6 +422,26 @@ namespace lk {
 
 #endif
 
+        /// compiles the loops and functions that run often in NORMAL mode to native code, where
+        /// lk::jit supports the platform.  off unless enabled here
+        void set_jit(bool on);
+
+        bool get_jit() { return jitc != 0; }
+
+        /// collects a profile_t in later calls to run(), which then uses the debugging
+        /// instruction loop.  enabling clears any profile collected before
+        void set_profiling(bool on);
+
+        bool get_profiling() { return profiling; }
+
+        /// profile collected so far, with calls still in progress counted up to now
+        profile_t get_profile();
+
+    private:
+        /// instruction loop, instantiated with and without debugging support
+        template<bool Debug>
+        bool run_loop(ExecMode mode);
+
     };
 
 } // namespace lk
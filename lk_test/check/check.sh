@@ -0,0 +1,130 @@
+#!/bin/sh
+# Regression checks of the lk command line and runtime.
+#     sh check.sh path/to/lk path/to/funcs
+# where funcs is built from funcs.cpp.  Scripts in engines/, copies/ and vecops/ are compared
+# with the .out next to them, as is native/main.lk run with a module built from
+# native/module.lk, and the assembly of ../optimize.lk with the files in optimize/.  Prints
+# what differs and exits with 1 if anything does.
+
+LK=$1
+FUNCS=$2
+DIR=$(cd "$(dirname "$0")" && pwd)
+failed=0
+
+fail() {
+    echo "FAILED: $1"
+    failed=1
+}
+
+# functions registered while a script runs
+"$FUNCS" > /dev/null || fail "funcs"
+
+# the register engine must run the script itself rather than leave it to the stack engine
+regvm_runs() {
+    "$LK" "$1" --regvm 2>&1 > /dev/null | grep -q "running on the stack vm" \
+        && fail "$(basename "$1") refused by the register engine"
+}
+
+# the same script on the stack and register engines, whose results and errors must match
+# the recorded ones
+for f in "$DIR"/engines/*.lk; do
+    expected=${f%.lk}.out
+    "$LK" "$f" 2>&1 | cmp -s - "$expected" || fail "$(basename "$f") on the stack engine"
+    "$LK" "$f" --jit 2>&1 | cmp -s - "$expected" || fail "$(basename "$f") with the jit"
+    "$LK" "$f" --regvm 2> /dev/null | cmp -s - "$expected" || fail "$(basename "$f") on the register engine"
+    regvm_runs "$f"
+done
+
+# copies of arrays and tables and array operations, on each engine and with the jit on,
+# where the evaluator's results are the recorded ones
+for f in "$DIR"/copies/*.lk "$DIR"/vecops/*.lk; do
+    expected=${f%.lk}.out
+    for engine in "" --jit --regvm --eval; do
+        "$LK" "$f" $engine 2>&1 | cmp -s - "$expected" || fail "$(basename "$f") ${engine:-on the stack engine}"
+    done
+    regvm_runs "$f"
+done
+
+# functions compiled by --aot into a native module, built with the host's lk headers and
+# called by another script through --load on each engine
+tmpdir=$(mktemp -d)
+cp "$DIR/native/module.lk" "$tmpdir/"
+if "$LK" "$tmpdir/module.lk" --aot > /dev/null \
+    && ${CXX:-g++} -std=gnu++11 -shared -fPIC -I"$DIR/../../include" \
+        -o "$tmpdir/module.so" "$tmpdir/module.lk.cpp"; then
+    for engine in "" --jit --regvm --eval; do
+        "$LK" "$DIR/native/main.lk" --load "$tmpdir/module.so" $engine 2>&1 | cmp -s - "$DIR/native/main.out" \
+            || fail "main.lk with the native module ${engine:-on the stack engine}"
+    done
+else
+    fail "native module of module.lk"
+fi
+rm -rf "$tmpdir"
+
+# a comparison of arrays gives a mask, which is an error as the test of a condition or loop
+tmp=$(mktemp)
+for test in "if ([1, 5] < 3) outln(1);" "while ([1, 5] > 3) outln(1);" "outln([1, 5] >= 3 ? 1 : 0);" \
+    "function f(n) { for (i = 0; i < n; i++) outln(i); } f([2]);"; do
+    echo "$test" > "$tmp"
+    for engine in "" --jit --regvm --eval; do
+        "$LK" "$tmp" $engine 2>&1 | grep -q "comparison of arrays used as a condition" \
+            || fail "'$test' ${engine:-on the stack engine}"
+    done
+done
+rm -f "$tmp"
+
+# codegen passes: the assembly of optimize.lk with all passes and with each one turned off
+# must match the recorded one, the opcodes that show a pass ran must be there only when it
+# is on, and the script must print the same either way
+has() {
+    echo " $1" | grep -Eq " ($2) "
+}
+
+for pass in "" fold thread dead compact fuse inline forloop; do
+    flag=${pass:+--no-$pass}
+    name=${flag#--}
+    name=${name:-default}
+    asm=$("$LK" "$DIR/../optimize.lk" --asm $flag)
+    echo "$asm" | cmp -s - "$DIR/optimize/$name.asm" || fail "assembly of optimize.lk, $name"
+    "$LK" "$DIR/../optimize.lk" $flag | cmp -s - "$DIR/optimize/run.out" || fail "output of optimize.lk, $name"
+
+    # the opcode of each instruction, after the label and line numbers
+    ops=$(echo "$asm" | sed -n 's/^[^}]*} *\([a-z]*\).*/\1/p' | tr '\n' ' ')
+
+    # an operation on two constants, left by fold
+    constops="psh (add|sub|mul|div)c|psh psh (add|sub|mul|div|[lg][te]jf)"
+    if [ "$pass" = fold ]; then
+        has "$ops" "$constops" || fail "no constant operations with --no-fold"
+    else
+        has "$ops" "$constops" && fail "constant operations with $name"
+    fi
+
+    # fold removes the 'if (0)' block, so only dead removes the code after the return
+    if [ "$pass" = dead ]; then
+        echo "$asm" | grep -q "after return" || fail "no code after return with --no-dead"
+    else
+        echo "$asm" | grep -q "after return" && fail "code after return with $name"
+    fi
+
+    if [ "$pass" = fuse ]; then
+        has "$ops" "subc|wrp|idxwrp|idxinc" && fail "fused instructions with --no-fuse"
+    else
+        has "$ops" "subc" && has "$ops" "wrp" && has "$ops" "idxwrp" && has "$ops" "idxinc" \
+            || fail "no fused instructions with $name"
+    fi
+
+    if [ "$pass" = inline ]; then
+        has "$ops" "pick|drop" && fail "inlined call with --no-inline"
+    else
+        has "$ops" "pick" && has "$ops" "drop" || fail "no inlined call with $name"
+    fi
+
+    if [ "$pass" = forloop ]; then
+        has "$ops" "forprep|forloop" && fail "counting loop with --no-forloop"
+    else
+        has "$ops" "forprep" && has "$ops" "forloop" || fail "no counting loop with $name"
+    fi
+done
+
+[ $failed -eq 0 ] && echo "all checks passed"
+exit $failed
@@ -0,0 +1,90 @@
+/*
+  Functions registered while a script runs, as load_extension() registers those of a
+  library.  A FUNCTION value taken before must still call the same function after the
+  table of functions has grown.
+
+  g++ -std=c++11 -O2 -I../../include funcs.cpp liblk.a -o funcs
+*/
+
+#include <stdio.h>
+#include <memory>
+#include <vector>
+
+#include <lk/lex.h>
+#include <lk/parse.h>
+#include <lk/codegen.h>
+#include <lk/vm.h>
+#include <lk/stdlib.h>
+
+template<int N>
+static void fcall_grown(lk::invoke_t &cxt) {
+    LK_DOC(lk::format("grown%d", N).c_str(), "Registered by grow().", "(none):number");
+    cxt.result().assign((double) N);
+}
+
+template<int N>
+struct grown_list {
+    static void add(std::vector<lk::fcall_t> &list) {
+        grown_list<N - 1>::add(list);
+        list.push_back(fcall_grown<N>);
+    }
+};
+
+template<>
+struct grown_list<0> {
+    static void add(std::vector<lk::fcall_t> &) {}
+};
+
+static void fcall_grow(lk::invoke_t &cxt) {
+    LK_DOC("grow", "Registers 300 more functions.", "(none):none");
+    std::vector<lk::fcall_t> list;
+    grown_list<300>::add(list);
+    cxt.env()->global()->register_funcs(list);
+}
+
+static int failures = 0;
+
+static void fcall_expect(lk::invoke_t &cxt) {
+    LK_DOC("expect", "Reports a value that differs from the expected one.", "(number:value, number:expected):none");
+    lk::vardata_t &x = cxt.arg(0);
+    if (x.type() != lk::vardata_t::NUMBER || x.as_number() != cxt.arg(1).as_number()) {
+        printf("expected %g, found %s\n", cxt.arg(1).as_number(), x.as_string().c_str());
+        failures++;
+    }
+}
+
+int main() {
+    const char *script = "f = sqrt; expect(f(16), 4); grow(); expect(f(16), 4); expect(grown300(), 300);";
+
+    lk::input_string in(script);
+    lk::parser parse(in);
+    std::unique_ptr<lk::node_t> tree(parse.script());
+    if (!tree || parse.error_count() > 0) {
+        printf("parse error\n");
+        return 1;
+    }
+
+    lk::codegen C;
+    lk::bytecode bc;
+    if (!C.generate(tree.get())) {
+        printf("codegen: %s\n", C.error().c_str());
+        return 1;
+    }
+    C.get(bc);
+
+    lk::env_t env;
+    env.register_funcs(lk::stdlib_math());
+    env.register_func(fcall_grow);
+    env.register_func(fcall_expect);
+
+    lk::vm V;
+    V.load(&bc);
+    V.initialize(&env);
+    if (!V.run()) {
+        printf("vm: %s\n", V.error().c_str());
+        return 1;
+    }
+
+    printf("%s\n", failures == 0 ? "ok" : "failed");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+       11{  11}  psh 0.0174533
+       11{  11} lref deg
+       11{  11}  wrp 
+       12{  12}  psh v1.5
+       12{  12} lref ver
+       12{  12}  wrp 
+       17{  17}  nul 
+       17{  17}  psh yes
+       17{  17} rref outln
+       17{  17} call (1)
+       17{  17}  pop 
+       21{  21} rref deg
+       21{  21}  psh 0
+       21{  21} gtjf L1
+       21{  21} rref deg
+       21{  21}  psh 1
+       21{  21} gtjf L0
+       21{  21}  nul 
+       21{  21}  psh big
+       21{  21} rref outln
+       21{  21} call (1)
+       21{  21}  pop 
+       21{  21}    j L2
+  L0:  21{  21}  nul 
+       21{  21}  psh small
+       21{  21} rref outln
+       21{  21} call (1)
+       21{  21}  pop 
+       21{  21}    j L2
+  L1:  22{  22}  nul 
+       22{  22}  psh negative
+       22{  22} rref outln
+       22{  22} call (1)
+       22{  22}  pop 
+  L2:  28{  28}  psh 0
+       28{  28} lref i
+       28{  28}  wrp 
+       28{  28}  psh 3
+       28{  28} forprep i [0] <
+       28{  28}    j L6
+  L3:  29{  29} rref i
+       29{  29}  psh 10
+       29{  29} gtjf L4
+  L4:  28{  28}  psh 3
+       28{  28} forloop i [0] <
+       28{  28}    j L3
+       33{  33}    j L6
+  L5:  33{  33}  arg a
+       33{  33} rloc a [0]
+       33{  33}  ret 
+  L6:  33{  33} fref L5
+       33{  33} lcref f
+       33{  33}  wrp 
+       38{  38}  nul 
+       38{  38}  psh 6
+       38{  38} rref f
+       38{  38} call (1)
+       38{  38} subc 6
+       38{  38}  swi (2)
+       38{  38}    j L7
+       38{  38}    j L8
+  L7:  38{  38}  psh zero
+       38{  38}    j L9
+  L8:  38{  38}  psh one
+  L9:  38{  38} lref w
+       38{  38}  wrp 
+       42{  42}  psh [ 1, 2, 3 ]
+       42{  42} lref p
+       42{  42}  wrp 
+       43{  43}  psh 4
+       43{  43} lref p
+       43{  43}  psh 1
+       43{  43} idxwrp 
+       44{  44} lref p
+       44{  44}  psh 0
+       44{  44} idxinc 
+       44{  44}  pop 
+       49{  49}    j L11
+ L10:  49{  49}  arg d
+       49{  49} rloc d [0]
+       49{  49} rref deg
+       49{  49}  mul 
+       49{  49}  ret 
+ L11:  49{  49} fref L10
+       49{  49} lcref rad
+       49{  49}  wrp 
+       50{  50}  psh 90
+       49{  49} pick (0)
+       49{  49} rref deg
+       49{  49}  mul 
+       50{  50} drop (1)
+       50{  50} lref r
+       50{  50}  wrp 
+       52{  52}  nul 
+       52{  52} rref deg
+       52{  52} addc  
+       52{  52} rref ver
+       52{  52}  add 
+       52{  52} addc  
+       52{  52} rref w
+       52{  52}  add 
+       52{  52} addc  
+       52{  52} rref r
+       52{  52}  add 
+       52{  52} addc  
+       52{  52} rref p
+       52{  52}  add 
+       52{  52} rref outln
+       52{  52} call (1)
+       52{  52}  pop 
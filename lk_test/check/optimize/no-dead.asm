@@ -0,0 +1,136 @@
+       11{  11}  psh 0.0174533
+       11{  11} lref deg
+       11{  11}  wrp 
+       12{  12}  psh v1.5
+       12{  12} lref ver
+       12{  12}  wrp 
+       16{  16}    j L0
+       16{  16}  nul 
+       16{  16}  psh never
+       16{  16} rref outln
+       16{  16} call (1)
+       16{  16}  pop 
+       17{  17}    j L0
+       17{  17}  nul 
+       17{  17}  psh no
+       17{  17} rref outln
+       17{  17} call (1)
+       17{  17}  pop 
+       17{  17}    j L1
+  L0:  17{  17}  nul 
+       17{  17}  psh yes
+       17{  17} rref outln
+       17{  17} call (1)
+       17{  17}  pop 
+  L1:  21{  21} rref deg
+       21{  21}  psh 0
+       21{  21} gtjf L3
+       21{  21} rref deg
+       21{  21}  psh 1
+       21{  21} gtjf L2
+       21{  21}  nul 
+       21{  21}  psh big
+       21{  21} rref outln
+       21{  21} call (1)
+       21{  21}  pop 
+       21{  21}    j L4
+  L2:  21{  21}  nul 
+       21{  21}  psh small
+       21{  21} rref outln
+       21{  21} call (1)
+       21{  21}  pop 
+       21{  21}    j L4
+  L3:  22{  22}  nul 
+       22{  22}  psh negative
+       22{  22} rref outln
+       22{  22} call (1)
+       22{  22}  pop 
+  L4:  28{  28}  psh 0
+       28{  28} lref i
+       28{  28}  wrp 
+       28{  28}  psh 3
+       28{  28} forprep i [0] <
+       28{  28}    j L8
+  L5:  29{  29} rref i
+       29{  29}  psh 10
+       29{  29} gtjf L6
+       29{  29}    j L6
+       29{  29}  nul 
+       29{  29}  psh after break
+       29{  29} rref outln
+       29{  29} call (1)
+       29{  29}  pop 
+       29{  29}    j L5
+  L6:  28{  28}  psh 3
+       28{  28} forloop i [0] <
+       28{  28}    j L5
+       33{  33}    j L8
+  L7:  33{  33}  arg a
+       33{  33} rloc a [0]
+       33{  33}  ret 
+       33{  33}  nul 
+       33{  33}  psh after return
+       33{  33} rref outln
+       33{  33} call (1)
+       33{  33}  pop 
+       33{  33}  ret 
+  L8:  33{  33} fref L7
+       33{  33} lcref f
+       33{  33}  wrp 
+       38{  38}  nul 
+       38{  38}  psh 6
+       38{  38} rref f
+       38{  38} call (1)
+       38{  38} subc 6
+       38{  38}  swi (2)
+       38{  38}    j L9
+       38{  38}    j L10
+  L9:  38{  38}  psh zero
+       38{  38}    j L11
+ L10:  38{  38}  psh one
+ L11:  38{  38} lref w
+       38{  38}  wrp 
+       42{  42}  psh [ 1, 2, 3 ]
+       42{  42} lref p
+       42{  42}  wrp 
+       43{  43}  psh 4
+       43{  43} lref p
+       43{  43}  psh 1
+       43{  43} idxwrp 
+       44{  44} lref p
+       44{  44}  psh 0
+       44{  44} idxinc 
+       44{  44}  pop 
+       49{  49}    j L13
+ L12:  49{  49}  arg d
+       49{  49} rloc d [0]
+       49{  49} rref deg
+       49{  49}  mul 
+       49{  49}  ret 
+ L13:  49{  49} fref L12
+       49{  49} lcref rad
+       49{  49}  wrp 
+       50{  50}  psh 90
+       49{  49} pick (0)
+       49{  49} rref deg
+       49{  49}  mul 
+       50{  50} drop (1)
+       50{  50} lref r
+       50{  50}  wrp 
+       52{  52}  nul 
+       52{  52} rref deg
+       52{  52} addc  
+       52{  52} rref ver
+       52{  52}  add 
+       52{  52} addc  
+       52{  52} rref w
+       52{  52}  add 
+       52{  52} addc  
+       52{  52} rref r
+       52{  52}  add 
+       52{  52} addc  
+       52{  52} rref p
+       52{  52}  add 
+       52{  52} rref outln
+       52{  52} call (1)
+       52{  52}  pop 
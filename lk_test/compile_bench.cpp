@@ -0,0 +1,85 @@
+/*
+  Compile time of large generated scripts, such as those written by model export tools.
+
+  Builds scripts of 1,000 up to 1,000,000 statements, with a new identifier, constant
+  array or table, and label in most statements, and reports the time taken to parse
+  them and to generate stack and register bytecode.  The time per statement should
+  stay about the same as the scripts grow.
+
+  g++ -std=c++11 -O2 -I../include compile_bench.cpp liblk.a -o compile_bench
+*/
+
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <lk/lex.h>
+#include <lk/parse.h>
+#include <lk/codegen.h>
+#include <lk/regcodegen.h>
+
+static std::string script(int n)
+{
+    std::string s;
+    char buf[256];
+    for (int i = 0; i < n; i++)
+    {
+        switch (i % 4)
+        {
+        case 0: sprintf(buf, "v%d = [%d, %d.5, 'n%d'];\n", i, i, i, i); break;
+        case 1: sprintf(buf, "t%d = { 'k%d' = %d, 'z' = [1, %d] };\n", i, i, i, i); break;
+        case 2: sprintf(buf, "if (v%d[0] > %d) x%d = 'r%d'; else x%d = %d;\n", i - 2, i, i, i, i, -i); break;
+        default: sprintf(buf, "while (x%d < %d) x%d = x%d + %d.25;\n", i - 1, i, i - 1, i - 1, i); break;
+        }
+        s += buf;
+    }
+    return s;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main()
+{
+    printf("%10s %10s %10s %10s %14s\n", "statements", "parse(s)", "codegen(s)", "regcg(s)", "codegen(us/st)");
+
+    for (int n = 1000; n <= 1000000; n *= 10)
+    {
+        std::string text = script(n);
+
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        lk::input_string in(text.c_str());
+        lk::parser parse(in);
+        std::unique_ptr<lk::node_t> tree(parse.script());
+        double tparse = seconds_since(t0);
+        if (!tree || parse.error_count() > 0)
+        {
+            printf("parse error: %s\n", parse.error_count() > 0 ? parse.error(0).c_str() : "");
+            return 1;
+        }
+
+        t0 = std::chrono::steady_clock::now();
+        lk::codegen C;
+        lk::bytecode bc;
+        if (!C.generate(tree.get()))
+        {
+            printf("codegen: %s\n", C.error().c_str());
+            return 1;
+        }
+        C.get(bc);
+        double tgen = seconds_since(t0);
+
+        // large programs exceed the register operands; the time to find that out is what counts
+        t0 = std::chrono::steady_clock::now();
+        lk::regcodegen R;
+        R.generate(tree.get());
+        double treg = seconds_since(t0);
+
+        printf("%10d %10.3f %10.3f %10.3f %14.3f\n", n, tparse, tgen, treg, 1e6 * tgen / n);
+    }
+
+    return 0;
+}
@@ -308,7 +308,7 @@ public:
             m_asm->SetSelection(ip);
 
         if (ip < bc.debuginfo.size()) {
-            int line = bc.debuginfo[ip].stmt;
+            int line = bc.debuginfo.stmt(ip);
             if (line > 0 && line <= m_code->GetNumberOfLines()) {
                 int nnl = m_code->LinesOnScreen();
 
@@ -309,3 +309,49 @@ void lk::pretty_print(lk_string &str, node_t *root, int level) {
         str += "<!" + lk_tr("unknown node type") + "!>";
     }
 }
+
+static bool refers_args(lk::node_t *root) {
+    using namespace lk;
+
+    if (!root) return false;
+
+    if (list_t *n1 = dynamic_cast<list_t *>(root)) {
+        for (size_t i = 0; i < n1->items.size(); i++)
+            if (refers_args(n1->items[i]))
+                return true;
+    } else if (iter_t *n2 = dynamic_cast<iter_t *>(root)) {
+        return refers_args(n2->init) || refers_args(n2->test)
+               || refers_args(n2->adv) || refers_args(n2->block);
+    } else if (cond_t *n3 = dynamic_cast<cond_t *>(root)) {
+        return refers_args(n3->test) || refers_args(n3->on_true) || refers_args(n3->on_false);
+    } else if (expr_t *n4 = dynamic_cast<expr_t *>(root)) {
+        // a nested function gets its own '__args'
+        if (n4->oper == expr_t::DEFINE) return false;
+        return refers_args(n4->left) || refers_args(n4->right);
+    } else if (ctlstmt_t *n5 = dynamic_cast<ctlstmt_t *>(root)) {
+        return refers_args(n5->rexpr);
+    } else if (iden_t *n6 = dynamic_cast<iden_t *>(root)) {
+        return n6->name == "__args";
+    }
+
+    return false;
+}
+
+bool lk::uses_args(expr_t *define) {
+    if (args_attr_t *a = dynamic_cast<args_attr_t *>(define->attr))
+        return a->used;
+
+    bool used = refers_args(define->right);
+    if (!define->attr)
+        define->attr = new args_attr_t(used);
+
+    return used;
+}
+
+bool lk::ends_with_return(node_t *body) {
+    if (list_t *l = dynamic_cast<list_t *>(body))
+        body = l->items.size() > 0 ? l->items.back() : 0;
+
+    ctlstmt_t *c = dynamic_cast<ctlstmt_t *>(body);
+    return c != 0 && c->ictl == ctlstmt_t::RETURN;
+}
@@ -0,0 +1,868 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include <lk/aot.h>
+#include <lk/codegen.h>
+
+namespace lk {
+
+    static lk_string format(const char *fmt, ...) {
+        char buf[512];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        return lk_string(buf);
+    }
+
+    namespace aot {
+
+        frame::frame(invoke_t &c, const atom_t *i, site *s, vardata_t **l)
+                : cxt(c), env(c.env()), stmt(0), line(0), ids(i), sites(s), slots(l), iarg(0), root(0) {
+        }
+
+        void frame::fail(const lk_string &msg) {
+            throw failure(format("[%d] ", stmt) + msg);
+        }
+
+        void frame::exception(std::exception &e) {
+            fail(lk_tr("runtime exception at") + " " + lk_tr("line") + format(" %d: ", line) + e.what());
+        }
+
+        fcallinfo_t *frame::func(size_t id) {
+            // as lk::vm::lookup_func, except that a module serves every environment it is
+            // registered with, so the cache also records which one it was filled for
+            if (!root) root = env.global();
+
+            site &s = sites[id];
+            unsigned int fver = env_t::func_version();
+            if (s.fver != fver || s.global != root) {
+                s.fci = env.lookup_func(ids[id]);
+                s.fver = fver;
+                s.global = root;
+            }
+
+            return s.fci;
+        }
+
+        env_t *frame::globals() {
+            // the vm keeps global variables in an environment just below the host's
+            env_t *g = cxt.env();
+            while (g->parent() && g->parent()->parent())
+                g = g->parent();
+            return g;
+        }
+
+        void frame::arg(size_t id) {
+            if (iarg >= cxt.arg_count())
+                fail(lk_tr("too few arguments passed to function"));
+
+            vardata_t *x = new vardata_t;
+            x->assign(&cxt.arg_list()[iarg]);
+            env.assign(ids[id], x);
+            slots[iarg++] = x;
+        }
+
+        void frame::argv() {
+            vardata_t *__args = new vardata_t;
+            __args->empty_vector();
+            __args->vec()->reserve(cxt.arg_count());
+            for (size_t i = 0; i < cxt.arg_count(); i++)
+                __args->vec()->push_back(cxt.arg_list()[i]);
+
+            env.assign("__args", __args);
+        }
+
+        void frame::ref(vardata_t &top, Opcode op, size_t id) {
+            if (fcallinfo_t *fci = func(id)) {
+                top.assign_fcall(fci);
+            } else if (vardata_t *x1 = env.lookup(ids[id], op == RREF)) {
+                top.assign(x1);
+            } else if (op == LREF || op == LCREF || op == LGREF) {
+                env_t *g = globals();
+                vardata_t *x2 = g->lookup(ids[id], false);
+                if (x2 && x2->flagval(vardata_t::GLOBALVAL))
+                    top.assign(x2);
+                else {
+                    x2 = new vardata_t;
+
+                    if (op == LCREF) {
+                        x2->set_flag(vardata_t::CONSTVAL);
+                        x2->clear_flag(vardata_t::ASSIGNED);
+                    } else if (op == LGREF)
+                        x2->set_flag(vardata_t::GLOBALVAL);
+
+                    if (op == LGREF) g->assign(ids[id], x2);
+                    else env.assign(ids[id], x2);
+
+                    top.assign(x2);
+                }
+            } else
+                fail(lk_tr("referencing unassigned variable:") + ids[id].str() + "\n");
+        }
+
+        void frame::push_local(vardata_t &top, Opcode op, size_t arg) {
+            size_t slot = (arg >> 16);
+            size_t id = (arg & SLOT_ID_MAX);
+            const atom_t &name = ids[id];
+
+            vardata_t *x = 0;
+            if (fcallinfo_t *fci = func(id)) {
+                top.assign_fcall(fci);
+                return;
+            } else if ((x = env.lookup(name, false)) != 0) {
+                // local variable, cache it below
+            } else if (op == RLOC) {
+                if (vardata_t *x1 = env.lookup(name, true)) {
+                    top.assign(x1);
+                    return;
+                }
+                fail(lk_tr("referencing unassigned variable:") + name.str() + "\n");
+            } else {
+                vardata_t *x2 = globals()->lookup(name, false);
+                if (x2 && x2->flagval(vardata_t::GLOBALVAL)) {
+                    top.assign(x2);
+                    return;
+                }
+
+                x = new vardata_t;
+                env.assign(name, x);
+            }
+
+            slots[slot] = x;
+            top.assign(x);
+        }
+
+        void frame::increment(size_t arg, double d) {
+            vardata_t local;
+            vardata_t *x = slots[arg >> 16];
+            if (!x) {
+                push_local(local, LLOC, arg);
+                x = &local;
+            }
+
+            vardata_t &val = x->deref();
+            val.assign(val.num() + d);
+        }
+
+        bool frame::loop(bool advance, size_t arg, vardata_t &limit) {
+            static const vecops::op_t cmp[] = {vecops::LT, vecops::LE, vecops::GT, vecops::GE};
+            size_t test = arg >> 22;
+            vardata_t local;
+            vardata_t *x = slots[(arg >> 16) & FOR_SLOT_MAX];
+            if (!x) {
+                push_local(local, advance ? LLOC : RLOC, arg & FOR_VAR_MASK);
+                x = &local;
+            }
+
+            vardata_t &val = x->deref();
+            if (advance)
+                val.assign(val.num() + (test < FOR_GT ? 1.0 : -1.0));
+            return compare_jump(cmp[test], val, limit);
+        }
+
+        void frame::call(vardata_t *base, size_t nargs, bool thiscall) {
+            vardata_t &fn = base[nargs].deref();
+            if (vardata_t::EXTFUNC == fn.type() && !thiscall) {
+                fcallinfo_t *fci = fn.fcall();
+                invoke_t callee(&env, base[-1], fci->user_data);
+
+                for (size_t i = 0; i < nargs; i++)
+                    callee.arg_list().push_back(base[i]);
+
+                try {
+                    if (fci->f) (*(fci->f))(callee);
+                    else if (fci->f_ext) lk::external_call(fci->f_ext, callee);
+                    else callee.error(lk_tr("invalid internal reference to function"));
+                }
+                catch (failure &) {
+                    throw;
+                }
+                catch (std::exception &e) {
+                    fail(e.what());
+                }
+            } else if (vardata_t::INTFUNC == fn.type())
+                fail(lk_tr("functions defined by a script cannot be called from a native module"));
+            else
+                fail(lk_tr("invalid function access"));
+        }
+
+        void frame::swi(size_t index, size_t noptions) {
+            if (index >= noptions)
+                fail(format((const char *) lk_tr("switch statement index %d out of bounds: only %d options").c_str(),
+                            (int) index, (int) noptions));
+        }
+
+        void frame::typ(vardata_t &top, size_t id) {
+            if (vardata_t *x = env.lookup(ids[id], true))
+                top.assign(x->deref().typestr());
+            else
+                top.assign("unknown");
+        }
+
+        void frame::ret_self(size_t id) {
+            if (fcallinfo_t *fci = func(id))
+                cxt.result().assign_fcall(fci);
+            else
+                cxt.result().nullify();
+        }
+
+        void frame::mat(vardata_t &lhs, vardata_t &rhs) {
+            if (lhs.type() == vardata_t::HASH) {
+                lk::varhash_t *hh = lhs.hash();
+                lk::varhash_t::iterator it = hh->find(rhs.as_string());
+                if (it != hh->end())
+                    hh->erase(it);
+            } else if (lhs.type() == vardata_t::VECTOR) {
+                std::vector<lk::vardata_t> *vv = lhs.vec();
+                size_t idx = rhs.as_unsigned();
+                if (idx < vv->size())
+                    vv->erase(vv->begin() + idx);
+            } else
+                fail(lk_tr("-@ requires a hash or vector"));
+        }
+
+        void frame::wat(vardata_t &result, vardata_t &rhs) {
+            vardata_t &lhs = result.deref();
+            if (lhs.type() == vardata_t::HASH) {
+                lk::varhash_t *hh = lhs.hash();
+                result.assign(hh->find(rhs.as_string()) != hh->end() ? 1.0 : 0.0);
+            } else if (lhs.type() == vardata_t::VECTOR) {
+                std::vector<lk::vardata_t> *vv = lhs.vec();
+                double pos = -1.0;
+                for (size_t i = 0; i < vv->size(); i++) {
+                    if ((*vv)[i].equals(rhs)) {
+                        pos = (double) i;
+                        break;
+                    }
+                }
+                result.assign(pos);
+            } else if (lhs.type() == vardata_t::STRING) {
+                lk_string::size_type pos = lhs.str().find(rhs.as_string());
+                result.assign(pos != lk_string::npos ? (int) pos : -1.0);
+            } else
+                fail(lk_tr("?@ requires a hash, vector, or string"));
+        }
+
+        void frame::sz(vardata_t &top) {
+            vardata_t &rhs = top.deref();
+            if (rhs.type() == vardata_t::VECTOR)
+                top.assign((int) rhs.length());
+            else if (rhs.type() == vardata_t::STRING)
+                top.assign((int) rhs.str().length());
+            else if (rhs.type() == vardata_t::HASH) {
+                int count = 0;
+
+                varhash_t *h = rhs.hash();
+                for (varhash_t::iterator it = h->begin();
+                     it != h->end();
+                     ++it) {
+                    if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                        count++;
+                }
+                top.assign(count);
+            } else
+                fail(lk_tr("operand to sizeof must be a array, string, or table type"));
+        }
+
+        void frame::keys(vardata_t &top) {
+            vardata_t &rhs = top.deref();
+            if (rhs.type() == vardata_t::HASH) {
+                varhash_t *h = rhs.hash();
+
+                lk::vardata_t keys;
+                keys.empty_vector();
+                keys.vec()->reserve(h->size());
+                for (varhash_t::iterator it = h->begin();
+                     it != h->end();
+                     ++it) {
+                    if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                        keys.vec_append((*it).first);
+                }
+                top.copy(keys);
+            } else
+                fail(lk_tr("operand to @ (keysof) must be a table"));
+        }
+
+        void idx(vardata_t &top, vardata_t &i, bool is_mutable) {
+            size_t index = i.deref().as_unsigned();
+            vardata_t &arr = top.deref();
+            if (is_mutable &&
+                (arr.type() != vardata_t::VECTOR
+                 || arr.length() <= index))
+                arr.resize(index + 1);
+
+            vardata_t *x = arr.index(index);
+
+            // as in the vm, copy an element of a temporary array before it is destroyed
+            if (top.type() != lk::vardata_t::REFERENCE) {
+                vardata_t *cpy = new vardata_t;
+                cpy->copy(*x);
+                x = cpy;
+            }
+
+            top.assign(x);
+        }
+
+        void key(vardata_t &top, vardata_t &k, bool is_mutable) {
+            vardata_t &key = k.deref();
+            vardata_t &hash = top.deref();
+            vardata_t *x;
+            if (is_mutable && hash.type() != vardata_t::HASH) {
+                vardata_t cp(key); // the key may be the value replaced by the table
+                hash.empty_hash();
+                x = hash.lookup(cp, true);
+            } else
+                x = hash.lookup(key, true);
+
+            if (top.type() != lk::vardata_t::REFERENCE) {
+                vardata_t *cpy = new vardata_t;
+                cpy->copy(*x);
+                x = cpy;
+            }
+
+            top.assign(x);
+        }
+
+        void wr(vardata_t &value, vardata_t &ref) {
+            lk::vardata_t temp;
+            temp.copy(value.deref());
+            vardata_t &var = ref.deref();
+            var.copy(temp);
+            // the assigned variable is the value of the assignment, as in lk::vm
+            if (&var != &ref) value.assign(&var);
+            else value.copy(var);
+        }
+
+        void addwr(vardata_t &value, vardata_t &ref) {
+            vardata_t &var = ref.deref();
+            vecops::plus_eq(var, value.deref());
+            if (&var != &ref) value.assign(&var);
+            else value.copy(var);
+        }
+
+        void vec(vardata_t *items, size_t n) {
+            vardata_t &vv = items[0];
+            vardata_t save1;
+            save1.copy(vv.deref());
+            vv.empty_vector();
+            vv.vec()->resize(n);
+            vv.index(0)->copy(save1);
+            for (size_t i = 1; i < n; i++)
+                vv.index(i)->copy(items[i].deref());
+        }
+
+        void hash(vardata_t *items, size_t n) {
+            vardata_t &vv = items[0];
+            vardata_t key1(vv.deref()); // the first key is replaced by the table
+            vv.empty_hash();
+            for (size_t i = 0; i < 2 * n; i += 2)
+                vv.hash_item(i == 0 ? key1 : items[i].deref(), items[i + 1].deref());
+        }
+    } // namespace aot
+
+    // C++ string literal holding the utf8 encoding of s
+    static lk_string cpp_literal(const lk_string &s) {
+        std::string u(to_utf8(s));
+        std::string lit("\"");
+        bool ascii = true;
+        for (size_t i = 0; i < u.length(); i++) {
+            unsigned char c = (unsigned char) u[i];
+            if (c == '"' || c == '\\' || c == '?') {
+                lit += '\\';
+                lit += (char) c;
+            } else if (c >= 0x20 && c < 0x7f)
+                lit += (char) c;
+            else {
+                char buf[8];
+                sprintf(buf, "\\%03o", (unsigned int) c);
+                lit += buf;
+                if (c >= 0x80) ascii = false;
+            }
+        }
+        lit += '"';
+
+        if (ascii) return from_utf8(lit);
+        else return "lk::from_utf8(" + from_utf8(lit) + ")";
+    }
+
+    static lk_string cpp_number(double d) {
+        if (d != d) return "std::numeric_limits<double>::quiet_NaN()";
+        if (d == std::numeric_limits<double>::infinity()) return "std::numeric_limits<double>::infinity()";
+        if (d == -std::numeric_limits<double>::infinity()) return "-std::numeric_limits<double>::infinity()";
+
+        char buf[64];
+        sprintf(buf, "%.17g", d);
+        if (!strpbrk(buf, ".e")) strcat(buf, ".0");
+        return lk_string(buf);
+    }
+
+    aotgen::aotgen() : m_bc(0) {
+    }
+
+    bool aotgen::generate(lk::node_t *tree, const lk_string &name) {
+        codegen C;
+        if (!C.generate(tree)) {
+            m_errStr = C.error();
+            return false;
+        }
+
+        bytecode bc;
+        C.get(bc);
+        return generate(bc, name);
+    }
+
+    void aotgen::constant(lk_string &src, const lk_string &var, const vardata_t &v, int level) {
+        lk_string indent(4 * level + 8, ' ');
+        switch (v.type()) {
+            case vardata_t::NUMBER:
+                src += indent + var + ".assign(" + cpp_number(v.as_number()) + ");\n";
+                break;
+            case vardata_t::STRING:
+                src += indent + var + ".assign(lk_string(" + cpp_literal(v.str()) + "));\n";
+                if (v.interned()) src += indent + var + ".intern();\n";
+                break;
+            case vardata_t::VECTOR: {
+                if (v.is_numarray() && v.length() > 0) {
+                    const double *p = v.numbers();
+                    lk_string list;
+                    for (size_t i = 0; i < v.length(); i++) {
+                        if (i > 0) list += ", ";
+                        list += vardata_t::is_null_number(p[i]) ? lk_string("lk::vardata_t::null_number()")
+                                                                 : cpp_number(p[i]);
+                    }
+                    src += indent + "{\n" + indent + "    const double n[] = { " + list + " };\n";
+                    src += indent + "    " + var + format(".assign(n, %d);\n", (int) v.length()) + indent + "}\n";
+                    break;
+                }
+
+                src += indent + var + ".empty_vector();\n";
+                src += indent + var + format(".vec()->resize(%d);\n", (int) v.length());
+                lk_string item = format("v%d", level + 1);
+                for (size_t i = 0; i < v.length(); i++) {
+                    src += indent + "{\n" + indent + "    lk::vardata_t &" + item + " = *" + var
+                           + format(".index(%d);\n", (int) i);
+                    constant(src, item, *v.index(i), level + 1);
+                    src += indent + "}\n";
+                }
+            }
+                break;
+            case vardata_t::HASH: {
+                src += indent + var + ".empty_hash();\n";
+                lk_string item = format("v%d", level + 1);
+                varhash_t *h = v.hash();
+
+                // items are inserted in reverse, which keeps the order the table iterates in
+                std::vector<varhash_t::iterator> items;
+                for (varhash_t::iterator it = h->begin(); it != h->end(); ++it)
+                    items.push_back(it);
+
+                for (size_t i = items.size(); i > 0; i--) {
+                    src += indent + "{\n" + indent + "    lk::vardata_t &" + item + " = " + var + ".hash_item("
+                           + cpp_literal((*items[i - 1]).first) + ");\n";
+                    constant(src, item, (*items[i - 1]).second->deref(), level + 1);
+                    src += indent + "}\n";
+                }
+            }
+                break;
+            default:
+                src += indent + var + ".nullify();\n";
+        }
+    }
+
+    bool aotgen::generate(const bytecode &bc, const lk_string &name) {
+        m_src.clear();
+        m_errStr.clear();
+        m_warnings.clear();
+        m_funcs.clear();
+
+        if (bc.engine != bytecode::STACK) {
+            m_errStr = lk_tr("bytecode was not generated for the stack engine");
+            return false;
+        }
+
+        m_bc = &bc;
+        m_name = name;
+
+        // find definitions at the top level, which the codegen emits as
+        //     J Le;  body...;  Le: FREF body;  LREF name;  WR[P]
+        lk_string funcs, list;
+        size_t n = bc.program.size();
+        size_t ip = 0;
+        while (ip < n) {
+            Opcode op = (Opcode) (bc.program[ip] & 0xff);
+            size_t end = bc.program[ip] >> 8;
+            if (op == J && end > ip && end + 1 < n
+                && (Opcode) (bc.program[end] & 0xff) == FREF
+                && (bc.program[end] >> 8) == ip + 1) {
+                Opcode opname = (Opcode) (bc.program[end + 1] & 0xff);
+                size_t id = bc.program[end + 1] >> 8;
+                if ((opname == LREF || opname == LCREF || opname == LGREF) && id < bc.identifiers.size()) {
+                    lk_string fname = bc.identifiers[id];
+                    lk_string fsrc, why;
+                    if (function(ip + 1, end, id, fname, fsrc, why)) {
+                        funcs += fsrc;
+                        if (!list.empty()) list += ",\n";
+                        list += format("    lk_aot_%d", (int) m_funcs.size());
+                        m_funcs.push_back(fname);
+                    } else
+                        m_warnings.push_back(format("[%d] ", bc.srcpos(ip).line) + lk_tr("function") + " '"
+                                             + fname + "' " + lk_tr("not compiled") + ": " + why);
+                }
+
+                ip = end + 2;
+            } else
+                ip++;
+        }
+
+        if (m_funcs.empty()) {
+            m_errStr = lk_tr("no function could be compiled");
+            return false;
+        }
+
+        m_src = "// native module generated by lk from '" + name + "'\n\n";
+        m_src += "#include <cmath>\n#include <limits>\n\n#include <lk/aot.h>\n\n";
+        m_src += "namespace {\n";
+        m_src += format("    const lk::atom_t I[%d] = {\n", (int) std::max((size_t) 1, bc.identifiers.size()));
+        for (size_t i = 0; i < bc.identifiers.size(); i++)
+            m_src += "        lk::atom_t(" + cpp_literal(bc.identifiers[i]) + "),\n";
+        m_src += "    };\n\n";
+
+        m_src += format("    thread_local lk::aot::site C[%d];\n\n",
+                        (int) std::max((size_t) 1, bc.identifiers.size()));
+
+        m_src += format("    lk::vardata_t K[%d];\n\n", (int) std::max((size_t) 1, bc.constants.size()));
+        m_src += "    struct constants {\n        constants() {\n";
+        for (size_t i = 0; i < bc.constants.size(); i++)
+            constant(m_src, format("K[%d]", (int) i), bc.constants[i], 0);
+        m_src += "        }\n    } init;\n}\n";
+
+        m_src += funcs;
+        m_src += "\nLK_BEGIN_MODULE()\n" + list + "\nLK_END_MODULE()\n";
+        return true;
+    }
+
+    bool aotgen::function(size_t start, size_t end, size_t index, const lk_string &name, lk_string &fsrc,
+                          lk_string &why) {
+        const bytecode &bc = *m_bc;
+        size_t len = end - start;
+
+        // the stack height is the same whenever an instruction runs, so that each stack
+        // position can be a variable of the compiled function
+        std::vector<int> depth(len, -1);
+        std::vector<bool> label(len, false);
+        // the position is only updated where it differs from that of a preceding instruction
+        std::vector<bool> setpos(len, false);
+        setpos[0] = true;
+        std::vector<size_t> work(1, start);
+        depth[0] = 0;
+        int maxdepth = 1;
+        size_t nslots = 1;
+        lk_string params;
+
+        while (!work.empty()) {
+            size_t ip = work.back();
+            work.pop_back();
+
+            Opcode op = (Opcode) (bc.program[ip] & 0xff);
+            size_t arg = bc.program[ip] >> 8;
+            int d = depth[ip - start], need, delta;
+            // functions, external values and END need the vm
+            if (op == FREF || op == GET || op == SET || op == END) {
+                why = format("[%d] ", bc.srcpos(ip).line) + lk_tr("instruction") + " '" + op_table[op].name + "' "
+                      + lk_tr("needs the vm");
+                return false;
+            }
+
+            stack_effect(op, arg, need, delta);
+            if (d < need) {
+                why = format("[%d] ", bc.srcpos(ip).line) + lk_tr("stack underflow");
+                return false;
+            }
+
+            bool local = (op == RLOC || op == LLOC || op == INCL || op == DECL || op == FORPREP || op == FORLOOP);
+            size_t id = local ? (arg & SLOT_ID_MAX) : arg;
+            if (((op >= RREF && op <= LLOC) || op == ARG || op == TYP || local)
+                && id >= bc.identifiers.size())
+                return (why = lk_tr("invalid identifier address")), false;
+            if ((op == PSH || op == ADDC || op == SUBC || op == MULC) && arg >= bc.constants.size())
+                return (why = lk_tr("invalid constant value address")), false;
+
+            if (d + delta + 1 > maxdepth) maxdepth = d + delta + 1;
+            size_t slot = (op == FORPREP || op == FORLOOP) ? ((arg >> 16) & FOR_SLOT_MAX) : (arg >> 16);
+            if (local && slot + 1 > nslots)
+                nslots = slot + 1;
+
+            std::vector<size_t> next;
+            switch (op) {
+                case J:
+                    next.push_back(arg);
+                    break;
+                case JT: case JF: case JTK: case JFK:
+                case LTJF: case GTJF: case LEJF: case GEJF: case NEJF: case EQJF:
+                    next.push_back(ip + 1);
+                    next.push_back(arg);
+                    break;
+                case SWI:
+                    for (size_t i = 0; i < arg; i++)
+                        next.push_back(ip + 1 + i);
+                    break;
+                case FORPREP: case FORLOOP:
+                    next.push_back(ip + 1);
+                    next.push_back(ip + 2);
+                    break;
+                case RET:
+                    break;
+                default:
+                    next.push_back(ip + 1);
+            }
+
+            for (size_t i = 0; i < next.size(); i++) {
+                size_t to = next[i];
+                if (to < start || to >= end) {
+                    why = format("[%d] ", bc.srcpos(ip).line) + lk_tr("jump out of the function body");
+                    return false;
+                }
+
+                // every successor but the next instruction is reached by a goto
+                if (op == J || op == SWI || (i > 0))
+                    label[to - start] = true;
+
+                srcpos_t from = bc.srcpos(ip), here = bc.srcpos(to);
+                if (from.stmt != here.stmt || from.line != here.line)
+                    setpos[to - start] = true;
+
+                if (depth[to - start] < 0) {
+                    depth[to - start] = d + delta;
+                    work.push_back(to);
+                } else if (depth[to - start] != d + delta) {
+                    why = format("[%d] ", bc.srcpos(ip).line) + lk_tr("inconsistent stack height");
+                    return false;
+                }
+            }
+        }
+
+        size_t nargs = 0;
+        for (size_t ip = start; ip < end; ip++) {
+            if ((Opcode) (bc.program[ip] & 0xff) == ARG && depth[ip - start] >= 0) {
+                if (!params.empty()) params += ", ";
+                params += "any:" + bc.identifiers[bc.program[ip] >> 8];
+                nargs++;
+            }
+        }
+        if (nargs > nslots) nslots = nargs;
+
+        srcpos_t pos = bc.srcpos(start);
+        fsrc = "\n/* " + name + format(", line %d */\n", pos.line);
+        fsrc += format("static void lk_aot_%d(lk::invoke_t &cxt) {\n", (int) m_funcs.size());
+        fsrc += "    LK_DOC(" + cpp_literal(name) + ", " + cpp_literal(lk_tr("Native code compiled from") + " "
+                                                                + m_name + format(", line %d.", pos.line))
+                + ", " + cpp_literal("(" + params + "):any") + ");\n";
+        fsrc += format("    lk::vardata_t *L[%d] = {0};\n", (int) nslots);
+        fsrc += "    lk::aot::frame F(cxt, I, C, L);\n";
+        fsrc += format("    lk::vardata_t S[%d];\n", maxdepth);
+        fsrc += "    try {\n";
+
+        for (size_t ip = start; ip < end; ip++) {
+            int d = depth[ip - start];
+            if (d < 0) continue;
+
+            Opcode op = (Opcode) (bc.program[ip] & 0xff);
+            size_t arg = bc.program[ip] >> 8;
+
+            if (label[ip - start])
+                fsrc += format("    I%d:\n", (int) ip);
+
+            if (setpos[ip - start]) {
+                srcpos_t sp = bc.srcpos(ip);
+                fsrc += format("        F.stmt = %d; F.line = %d;\n", sp.stmt, sp.line);
+            }
+
+            // operands, as lk::vm names them
+            lk_string top = format("S[%d]", d - 1), lhs = format("S[%d]", d - 2), push = format("S[%d]", d);
+            lk_string code;
+            switch (op) {
+                case RREF: code = format("F.ref(%s, lk::RREF, %d);", (const char *) push.c_str(), (int) arg); break;
+                case LREF: code = format("F.ref(%s, lk::LREF, %d);", (const char *) push.c_str(), (int) arg); break;
+                case LCREF: code = format("F.ref(%s, lk::LCREF, %d);", (const char *) push.c_str(), (int) arg); break;
+                case LGREF: code = format("F.ref(%s, lk::LGREF, %d);", (const char *) push.c_str(), (int) arg); break;
+                case RLOC: case LLOC:
+                    code = format("F.local(%s, lk::%s, (%d << 16) | %d);", (const char *) push.c_str(), op == RLOC ? "RLOC" : "LLOC",
+                                  (int) (arg >> 16), (int) (arg & SLOT_ID_MAX));
+                    break;
+                case CALL: case TAIL:
+                    code = format("F.call(&S[%d], %d, false);", d - (int) arg - 1, (int) arg);
+                    break;
+                case TCALL: case TTAIL:
+                    code = format("F.call(&S[%d], %d, true);", d - (int) arg - 1, (int) arg);
+                    break;
+                case ARG: code = format("F.arg(%d);", (int) arg); break;
+                case ARGV: code = "F.argv();"; break;
+                case SWI: {
+                    code = "{\n            size_t index = " + top + ".deref().as_unsigned();\n";
+                    code += format("            F.swi(index, %d);\n", (int) arg);
+                    code += "            switch (index) {\n";
+                    for (size_t i = 0; i < arg; i++)
+                        code += format("                case %d: goto I%d;\n", (int) i, (int) (ip + 1 + i));
+                    code += "            }\n        }";
+                }
+                    break;
+                case PSH: code = push + format(".copy(K[%d]);", (int) arg); break;
+                case POP: break;
+                case J: code = format("goto I%d;", (int) arg); break;
+                case JT: code = "if (" + top + format(".deref().as_boolean()) goto I%d;", (int) arg); break;
+                case JF: code = "if (!" + top + format(".deref().as_boolean()) goto I%d;", (int) arg); break;
+                case JTK: code = "if (" + top + format(".deref().as_boolean()) goto I%d;", (int) arg); break;
+                case JFK: code = "if (!" + top + format(".deref().as_boolean()) goto I%d;", (int) arg); break;
+                case IDX: code = "lk::aot::idx(" + lhs + ", " + top + ((arg & 1) ? ", true);" : ", false);"); break;
+                case IDXWR: case IDXWRP: case IDXINC: case IDXDEC: {
+                    // IDX, then the instruction fused with it on the item left below
+                    lk_string item = lhs, value = format("S[%d]", d - 3);
+                    code = "lk::aot::idx(" + lhs + ", " + top + ((arg & 1) ? ", true);" : ", false);");
+                    if (op == IDXWR)
+                        code += "\n        lk::aot::wr(" + value + ", " + item + ");";
+                    else if (op == IDXWRP)
+                        code += "\n        { lk::vardata_t temp; temp.copy(" + value + ".deref()); " + item
+                                + ".deref().copy(temp); }";
+                    else
+                        code += "\n        { lk::vardata_t &rhs = " + item + ".deref(); rhs.assign(rhs.num() "
+                                + (op == IDXINC ? "+" : "-") + " 1.0); }";
+                }
+                    break;
+                case KEY: code = "lk::aot::key(" + lhs + ", " + top + (arg ? ", true);" : ", false);"); break;
+                case ADD: code = "lk::aot::add(" + lhs + ", " + top + ".deref());"; break;
+                case SUB: code = "lk::aot::sub(" + lhs + ", " + top + ".deref());"; break;
+                case MUL: code = "lk::aot::mul(" + lhs + ", " + top + ".deref());"; break;
+                case DIV: code = "lk::aot::div(" + lhs + ", " + top + ");"; break;
+                case EXP: code = "lk::aot::power(" + lhs + ", " + top + ".deref());"; break;
+                case LT: code = "lk::aot::compare(lk::vecops::LT, " + lhs + ", " + top + ".deref());"; break;
+                case LE: code = "lk::aot::compare(lk::vecops::LE, " + lhs + ", " + top + ".deref());"; break;
+                case GT: code = "lk::aot::compare(lk::vecops::GT, " + lhs + ", " + top + ".deref());"; break;
+                case GE: code = "lk::aot::compare(lk::vecops::GE, " + lhs + ", " + top + ".deref());"; break;
+                case EQ:
+                    code = lhs + ".assign(" + lhs + ".deref().equals(" + top + ".deref()) ? 1.0 : 0.0);";
+                    break;
+                case NE:
+                    code = lhs + ".assign(" + lhs + ".deref().equals(" + top + ".deref()) ? 0.0 : 1.0);";
+                    break;
+                case OR:
+                    code = lhs + ".assign((((int) " + lhs + ".deref().num()) || ((int) " + top
+                           + ".deref().num())) ? 1.0 : 0.0);";
+                    break;
+                case AND:
+                    code = lhs + ".assign((((int) " + lhs + ".deref().num()) && ((int) " + top
+                           + ".deref().num())) ? 1.0 : 0.0);";
+                    break;
+                case INC:
+                    code = "{ lk::vardata_t &rhs = " + top + ".deref(); rhs.assign(rhs.num() + 1.0); }";
+                    break;
+                case DEC:
+                    code = "{ lk::vardata_t &rhs = " + top + ".deref(); rhs.assign(rhs.num() - 1.0); }";
+                    break;
+                case NOT: code = top + ".assign(((int) " + top + ".deref().num()) ? 0.0 : 1.0);"; break;
+                case NEG: code = "lk::aot::neg(" + top + ");"; break;
+                case MAT: code = "F.mat(" + lhs + ".deref(), " + top + ".deref());"; break;
+                case WAT: code = "F.wat(" + lhs + ", " + top + ".deref());"; break;
+                case SZ: code = "F.sz(" + top + ");"; break;
+                case KEYS: code = "F.keys(" + top + ");"; break;
+                case WR: code = "lk::aot::wr(" + lhs + ", " + top + ");"; break;
+                case ADDWR: code = "lk::aot::addwr(" + lhs + ", " + top + ");"; break;
+                case WRP:
+                    code = "{ lk::vardata_t temp; temp.copy(" + lhs + ".deref()); " + top + ".deref().copy(temp); }";
+                    break;
+                case TYP: code = format("F.typ(%s, %d);", (const char *) push.c_str(), (int) arg); break;
+                case RET:
+                    if (d > 0) code = "cxt.result().copy(" + top + ".deref());\n        return;";
+                    else code = format("F.ret_self(%d);\n        return;", (int) index);
+                    break;
+                case NUL: code = push + ".nullify();"; break;
+                case DUP: code = push + ".copy(" + top + ");"; break;
+                case PICK: code = push + format(".copy(S[%d]);", d - 1 - (int) arg); break;
+                case DROP:
+                    code = "{ lk::vardata_t temp; temp.copy(" + top + ".deref()); "
+                           + format("S[%d]", d - 1 - (int) arg) + ".move(temp); }";
+                    break;
+                case VEC:
+                    if (arg > 0) code = format("lk::aot::vec(&S[%d], %d);", d - (int) arg, (int) arg);
+                    else code = push + ".empty_vector();";
+                    break;
+                case HASH:
+                    if (arg > 0) code = format("lk::aot::hash(&S[%d], %d);", d - 2 * (int) arg, (int) arg);
+                    else code = push + ".empty_hash();";
+                    break;
+                case ADDC: code = "lk::aot::add(" + top + format(", K[%d]);", (int) arg); break;
+                case SUBC: code = "lk::aot::sub(" + top + format(", K[%d]);", (int) arg); break;
+                case MULC: code = "lk::aot::mul(" + top + format(", K[%d]);", (int) arg); break;
+                case LTJF: case GTJF: case LEJF: case GEJF: case NEJF: case EQJF: {
+                    lk_string l = lhs + ".deref()", r = top + ".deref()", cond;
+                    switch (op) {
+                        case LTJF: cond = "lk::aot::compare_jump(lk::vecops::LT, " + l + ", " + r + ")"; break;
+                        case GTJF: cond = "lk::aot::compare_jump(lk::vecops::GT, " + l + ", " + r + ")"; break;
+                        case LEJF: cond = "lk::aot::compare_jump(lk::vecops::LE, " + l + ", " + r + ")"; break;
+                        case GEJF: cond = "lk::aot::compare_jump(lk::vecops::GE, " + l + ", " + r + ")"; break;
+                        case NEJF: cond = "!" + l + ".equals(" + r + ")"; break;
+                        default: cond = l + ".equals(" + r + ")"; break;
+                    }
+                    code = "if (!(" + cond + format(")) goto I%d;", (int) arg);
+                }
+                    break;
+                case INCL: case DECL:
+                    code = format("F.increment((%d << 16) | %d, %s);", (int) (arg >> 16), (int) (arg & SLOT_ID_MAX),
+                                  op == INCL ? "1.0" : "-1.0");
+                    break;
+                case FORPREP: case FORLOOP:
+                    code = format("if (%sF.loop(%s, %d, ", op == FORPREP ? "" : "!", op == FORPREP ? "false" : "true",
+                                  (int) arg) + top
+                           + format(".deref())) goto I%d;", (int) (ip + 2));
+                    break;
+                default:
+                    break;
+            }
+
+            if (!code.empty())
+                fsrc += "        " + code + "\n";
+        }
+
+        fsrc += "    }\n";
+        fsrc += "    catch (lk::aot::failure &) {\n        throw;\n    }\n";
+        fsrc += "    catch (std::exception &e) {\n        F.exception(e);\n    }\n";
+        fsrc += "}\n";
+        return true;
+    }
+
+} // namespace lk
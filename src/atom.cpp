@@ -0,0 +1,96 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <mutex>
+
+#include <lk/atom.h>
+#include <lk/hashmap.h>
+
+namespace {
+    /// the table finds an atom by its string, which the atom itself holds
+    struct rep_hash {
+        size_t operator()(const lk_string *s) const { return lk_string_hash()(*s); }
+    };
+
+    struct rep_equal {
+        bool operator()(const lk_string *a, const lk_string *b) const { return *a == *b; }
+    };
+
+    typedef lk::hashmap<const lk_string *, lk::atom_t::rep *, rep_hash, rep_equal> atom_table;
+
+    // neither is ever destroyed, as handles held by static objects may be dropped after them
+    atom_table &table() {
+        static atom_table *t = new atom_table;
+        return *t;
+    }
+
+    std::mutex &table_lock() {
+        static std::mutex *m = new std::mutex;
+        return *m;
+    }
+}
+
+lk::atom_t::atom_t(const lk_string &s) {
+    size_t h = atom_table::hash_of(&s);
+    std::lock_guard<std::mutex> lock(table_lock());
+    atom_table &t = table();
+    atom_table::iterator it = t.find(&s, h);
+    if (it != t.end()) {
+        m_p = it->second;
+        m_p->refs.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        m_p = new rep(s, lk_string_hash()(s));
+        t.item(&m_p->str, h) = m_p;
+    }
+}
+
+lk::atom_t::atom_t(const char *s) : atom_t(lk_string(s)) {}
+
+void lk::atom_t::release() {
+    // any handle but the last one drops its share without the lock.  the last one takes it, so
+    // that an atom is never removed while the table is handing it out again
+    unsigned int n = m_p->refs.load(std::memory_order_relaxed);
+    while (n > 1)
+        if (m_p->refs.compare_exchange_weak(n, n - 1, std::memory_order_release, std::memory_order_relaxed))
+            return;
+
+    std::lock_guard<std::mutex> lock(table_lock());
+    if (m_p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        atom_table &t = table();
+        t.erase(t.find(&m_p->str));
+        delete m_p;
+    }
+}
+
+const lk_string &lk::atom_t::empty_string() {
+    static const lk_string empty;
+    return empty;
+}
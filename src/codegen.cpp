@@ -29,6 +29,8 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 #include <numeric>
 
@@ -54,9 +56,11 @@ namespace lk {
 // context flags for pfgen()
 #define F_NONE 0x00
 #define F_MUTABLE 0x01
+#define F_BIND 0x02
 
-    codegen::codegen() {
-        m_labelCounter = 1;
+    codegen::codegen() : m_top(0) {
+        m_passes = OPT_ALL;
+        m_inlining = 0;
     }
 
 
@@ -65,17 +69,19 @@ namespace lk {
         if (m_asm.size() == 0) return 0;
 
         bc.program.resize(m_asm.size(), 0);
-        bc.debuginfo.resize(m_asm.size(), srcpos_t());
+        bc.debuginfo.clear();
 
         for (size_t i = 0; i < m_asm.size(); i++) {
             instr &ip = m_asm[i];
-            if (ip.label) m_asm[i].arg = m_labelAddr[*ip.label];
+            if (ip.label >= 0) ip.arg = m_labelAddr[ip.label];
             bc.program[i] = (((unsigned int) ip.op) & 0x000000FF) | (((unsigned int) ip.arg) << 8);
-            bc.debuginfo[i] = m_asm[i].pos;
+            bc.debuginfo.push_back(m_asm[i].pos);
         }
 
+        bc.engine = bytecode::STACK;
         bc.constants = m_constData;
         bc.identifiers = m_idList;
+        bc.intern_identifiers();
 
         return m_asm.size();
     }
@@ -84,24 +90,28 @@ namespace lk {
     void codegen::textout(lk_string &assembly, lk_string &bytecode) {
         char buf[128];
 
+        // labels placed at each address, chained through 'next' in order of creation
+        std::vector<int> first(m_asm.size() + 1, -1), next(m_labelAddr.size(), -1);
+        for (size_t i = m_labelAddr.size(); i-- > 0;)
+            if (m_labelAddr[i] >= 0 && m_labelAddr[i] <= (int) m_asm.size()) {
+                next[i] = first[m_labelAddr[i]];
+                first[m_labelAddr[i]] = (int) i;
+            }
+
         for (size_t i = 0; i < m_asm.size(); i++) {
             instr &ip = m_asm[i];
 
-            if (ip.label)
-                m_asm[i].arg = m_labelAddr[*ip.label];
+            if (ip.label >= 0)
+                ip.arg = m_labelAddr[ip.label];
 
-            bool has_label = false;
-            // determine if there's a label for this line (not super efficient)
-            for (LabelMap::iterator it = m_labelAddr.begin();
-                 it != m_labelAddr.end();
-                 ++it)
-                if ((int) i == it->second) {
-                    sprintf(buf, "%4s:", (const char *) it->first.c_str());
-                    assembly += buf;
-                    has_label = true;
-                }
+            for (int L = first[i]; L >= 0; L = next[L]) {
+                char name[16];
+                sprintf(name, "L%d", L);
+                sprintf(buf, "%4s:", name);
+                assembly += buf;
+            }
 
-            if (!has_label)
+            if (first[i] < 0)
                 assembly += "     ";
 
 
@@ -111,9 +121,10 @@ namespace lk {
                     sprintf(buf, "%4d{%4d} %4s ", ip.pos.line, ip.pos.stmt, op_table[j].name);
                     assembly += buf;
 
-                    if (ip.label) {
-                        assembly += (*ip.label);
-                    } else if (ip.op == PSH) {
+                    if (ip.label >= 0) {
+                        sprintf(buf, "L%d", ip.label);
+                        assembly += buf;
+                    } else if (ip.op == PSH || ip.op == ADDC || ip.op == SUBC || ip.op == MULC) {
                         static const size_t MAXWIDTH = 24;
                         lk_string nnl(m_constData[ip.arg].as_string());
                         if (nnl.size() > MAXWIDTH) {
@@ -125,7 +136,15 @@ namespace lk {
                     } else if (ip.op == SET || ip.op == GET || ip.op == RREF
                                || ip.op == LREF || ip.op == LCREF || ip.op == LGREF || ip.op == ARG) {
                         assembly += m_idList[ip.arg];
-                    } else if (ip.op == TCALL || ip.op == CALL || ip.op == VEC || ip.op == HASH || ip.op == SWI) {
+                    } else if (ip.op == RLOC || ip.op == LLOC || ip.op == INCL || ip.op == DECL) {
+                        sprintf(buf, " [%d]", ip.arg >> 16);
+                        assembly += m_idList[ip.arg & SLOT_ID_MAX] + buf;
+                    } else if (ip.op == FORPREP || ip.op == FORLOOP) {
+                        static const char *tests[] = {"<", "<=", ">", ">="};
+                        sprintf(buf, " [%d] %s", (ip.arg >> 16) & FOR_SLOT_MAX, tests[ip.arg >> 22]);
+                        assembly += m_idList[ip.arg & SLOT_ID_MAX] + buf;
+                    } else if (ip.op == TCALL || ip.op == CALL || ip.op == TAIL || ip.op == TTAIL
+                               || ip.op == VEC || ip.op == HASH || ip.op == SWI || ip.op == PICK || ip.op == DROP) {
                         sprintf(buf, "(%d)", ip.arg);
                         assembly += buf;
                     }
@@ -153,33 +172,47 @@ namespace lk {
         m_idList.clear();
         m_constData.clear();
         m_asm.clear();
+        m_idIndex.clear();
+        m_constIndex.clear();
+        m_constNext.clear();
         m_labelAddr.clear();
-        m_labelCounter = 0;
         m_breakAddr.clear();
         m_continueAddr.clear();
+        m_scopes.clear();
+        m_top = scope(0);
+        m_inlining = 0;
+        m_picks.clear();
 
-        return pfgen(root, F_NONE);
+        find_inlinable(root);
+
+        if (!pfgen(root, F_NONE))
+            return false;
+
+        optimize();
+        return true;
     }
 
 /// adds id to m_idList if not already added, return index of d
     int codegen::place_identifier(const lk_string &id) {
-        for (size_t i = 0; i < m_idList.size(); i++)
-            if (m_idList[i] == id)
-                return (int) i;
-
-        m_idList.push_back(id);
-        return m_idList.size() - 1;
+        size_t n = m_idIndex.size();
+        int &index = m_idIndex[id];
+        if (m_idIndex.size() > n) {
+            index = (int) m_idList.size();
+            m_idList.push_back(id);
+        }
+        return index;
     }
 
 /// adds d to m_constData if not already added, return index of d
     int codegen::place_const(vardata_t &d) {
-        if (d.type() == vardata_t::HASH && d.hash()->size() == 2)
-            printf("stop here");
-
-        for (size_t i = 0; i < m_constData.size(); i++)
+        size_t h = d.hash_value();
+        int latest = m_constIndex.count(h) ? m_constIndex[h] : -1;
+        for (int i = latest; i >= 0; i = m_constNext[i])
             if (m_constData[i].equals(d))
-                return (int) i;
+                return i;
 
+        m_constNext.push_back(latest);
+        m_constIndex[h] = (int) m_constData.size();
         m_constData.push_back(d);
         return (int) m_constData.size() - 1;
     }
@@ -197,14 +230,21 @@ namespace lk {
         return place_const(x);
     }
 
-    lk_string codegen::new_label() {
-        char buf[128];
-        sprintf(buf, "L%d", m_labelCounter++);
-        return lk_string(buf);
+/// generates the key of a table item: the constant of a literal key is interned, so that the
+/// table is searched for its atom
+    bool codegen::pfgen_key(lk::node_t *root) {
+        if (literal_t *lit = dynamic_cast<literal_t *>(root))
+            m_constData[const_literal(lit->value)].intern();
+        return pfgen(root, F_NONE);
+    }
+
+    int codegen::new_label() {
+        m_labelAddr.push_back(-1);
+        return (int) m_labelAddr.size() - 1;
     }
 
-    void codegen::place_label(const lk_string &s) {
-        m_labelAddr[s] = (int) m_asm.size();
+    void codegen::place_label(int L) {
+        m_labelAddr[L] = (int) m_asm.size();
     }
 
 /// makes instructions & adds to m_asm
@@ -219,14 +259,14 @@ namespace lk {
         return m_asm.size();
     }
 
-    int codegen::emit(srcpos_t pos, Opcode o, const lk_string &L) {
+    int codegen::emit_jump(srcpos_t pos, Opcode o, int L) {
         // copy previous line's position if parser doesn't know the statement line,
         // such as when generating if-elseif-else structures for the 'J' instruction
         // or for implicit function returns
         if (pos == srcpos_t::npos && m_asm.size() > 0)
             pos = m_asm.back().pos;
 
-        m_asm.push_back(instr(pos, o, 0, (const char *) L.c_str()));
+        m_asm.push_back(instr(pos, o, 0, L));
         return m_asm.size();
     }
 
@@ -246,6 +286,7 @@ namespace lk {
                     subvec.empty_vector();
                     if (!initialize_const_vec(dynamic_cast<list_t *>(expr->left), subvec))
                         return false;
+                    subvec.pack();
                     vvec.vec()->push_back(subvec);
                 } else if (expr->oper == expr_t::INITHASH) {
                     lk::vardata_t subhash;
@@ -285,6 +326,7 @@ namespace lk {
                         val.empty_vector();
                         if (!initialize_const_vec(dynamic_cast<list_t *>(expr->left), val))
                             return false;
+                        val.pack();
                     } else if (expr->oper == expr_t::INITHASH) {
                         val.empty_hash();
                         if (!initialize_const_hash(dynamic_cast<list_t *>(expr->left), val))
@@ -302,13 +344,608 @@ namespace lk {
         return true;
     }
 
+/// assigns frame slots to the arguments and locals of a function body.  arguments take
+/// the first slots in order so that ARG can fill them, and every other name written in
+/// the body itself (not in nested functions) is a local.  references to any other name
+/// are left to the environment lookup, since they resolve dynamically to callers or globals
+    void codegen::assign_slots(const scope &s, size_t end, lk::list_t *params) {
+        unordered_map<int, int> slots;
+        int nslots = 0;
+
+        if (params) {
+            for (size_t i = 0; i < params->items.size(); i++)
+                if (iden_t *id = dynamic_cast<iden_t *>(params->items[i]))
+                    slots[place_identifier(id->name)] = (int) i; // a repeated name refers to its last slot
+
+            nslots = (int) params->items.size();
+        }
+
+        for (size_t i = 0; i < s.counters.size(); i++)
+            slots[s.counters[i]] = nslots++;
+
+        for (int pass = 0; pass < 2; pass++) {
+            size_t inest = 0;
+            for (size_t i = s.start; i < end; i++) {
+                if (inest < s.nested.size() && i == s.nested[inest].first) {
+                    i = s.nested[inest++].second - 1;
+                    continue;
+                }
+
+                instr &ip = m_asm[i];
+                if (pass == 0) {
+                    if ((ip.op == LREF || ip.op == LCREF) && slots.find(ip.arg) == slots.end())
+                        slots[ip.arg] = nslots++;
+                } else if (ip.op == RREF || ip.op == LREF) {
+                    unordered_map<int, int>::iterator it = slots.find(ip.arg);
+                    if (it != slots.end() && it->second <= SLOT_MAX && ip.arg <= SLOT_ID_MAX) {
+                        ip.op = (ip.op == RREF) ? RLOC : LLOC;
+                        ip.arg = (it->second << 16) | ip.arg;
+                    }
+                }
+            }
+        }
+    }
+
+    typedef hashmap<lk_string, int, lk_string_hash, lk_string_equal> name_counts;
+
+/// largest number of nodes in the returned expression of an inlinable function
+    static const int INLINE_MAX_NODES = 24;
+
+/// returns the variable written by an assignment to target, such as x, x[i] or x{k}
+    static iden_t *written_root(node_t *target) {
+        while (expr_t *e = dynamic_cast<expr_t *>(target)) {
+            if (e->oper != expr_t::INDEX && e->oper != expr_t::HASH) return 0;
+            target = e->left;
+        }
+        return dynamic_cast<iden_t *>(target);
+    }
+
+    static bool is_write(int oper) {
+        switch (oper) {
+            case expr_t::ASSIGN:
+            case expr_t::PLUSEQ:
+            case expr_t::MINUSEQ:
+            case expr_t::MULTEQ:
+            case expr_t::DIVEQ:
+            case expr_t::INCR:
+            case expr_t::DECR:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+/// counts the assignments to each name in the tree, including function parameters
+    static void count_writes(node_t *root, name_counts &writes) {
+        if (!root) return;
+
+        if (list_t *n1 = dynamic_cast<list_t *>(root)) {
+            for (size_t i = 0; i < n1->items.size(); i++)
+                count_writes(n1->items[i], writes);
+        } else if (iter_t *n2 = dynamic_cast<iter_t *>(root)) {
+            count_writes(n2->init, writes);
+            count_writes(n2->test, writes);
+            count_writes(n2->adv, writes);
+            count_writes(n2->block, writes);
+        } else if (cond_t *n3 = dynamic_cast<cond_t *>(root)) {
+            count_writes(n3->test, writes);
+            count_writes(n3->on_true, writes);
+            count_writes(n3->on_false, writes);
+        } else if (expr_t *n4 = dynamic_cast<expr_t *>(root)) {
+            if (is_write(n4->oper))
+                if (iden_t *id = written_root(n4->left))
+                    writes[id->name]++;
+
+            if (n4->oper == expr_t::DEFINE)
+                if (list_t *p = dynamic_cast<list_t *>(n4->left))
+                    for (size_t i = 0; i < p->items.size(); i++)
+                        if (iden_t *id = dynamic_cast<iden_t *>(p->items[i]))
+                            writes[id->name]++;
+
+            count_writes(n4->left, writes);
+            count_writes(n4->right, writes);
+        } else if (ctlstmt_t *n5 = dynamic_cast<ctlstmt_t *>(root)) {
+            count_writes(n5->rexpr, writes);
+        }
+    }
+
+/// returns true if an expression gives the same result generated in place of a call as in
+/// the function's own frame, and counts its nodes.  it may not write anything, and may only
+/// call functions that are not defined in the script, which would otherwise see the
+/// parameters by name in the scope of their caller.  parameters are not passed on to them,
+/// since a copy of an argument that is changed by a function is not the argument itself
+    static bool inline_safe(node_t *root, const std::vector<lk_string> &params, name_counts &writes, int &nodes) {
+        if (!root) return true;
+
+        nodes++;
+        if (list_t *n1 = dynamic_cast<list_t *>(root)) {
+            for (size_t i = 0; i < n1->items.size(); i++)
+                if (!inline_safe(n1->items[i], params, writes, nodes))
+                    return false;
+        } else if (cond_t *n3 = dynamic_cast<cond_t *>(root)) {
+            return inline_safe(n3->test, params, writes, nodes)
+                   && inline_safe(n3->on_true, params, writes, nodes)
+                   && inline_safe(n3->on_false, params, writes, nodes);
+        } else if (expr_t *n4 = dynamic_cast<expr_t *>(root)) {
+            if (is_write(n4->oper) || n4->oper == expr_t::DEFINE
+                || n4->oper == expr_t::THISCALL || n4->oper == expr_t::TYPEOF)
+                return false;
+
+            if (n4->oper == expr_t::INITHASH) {
+                // the items of a table are 'key = value' pairs
+                if (list_t *p = dynamic_cast<list_t *>(n4->left)) {
+                    for (size_t i = 0; i < p->items.size(); i++) {
+                        expr_t *assign = dynamic_cast<expr_t *>(p->items[i]);
+                        if (!assign || !inline_safe(assign->left, params, writes, nodes)
+                            || !inline_safe(assign->right, params, writes, nodes))
+                            return false;
+                    }
+                }
+                return true;
+            }
+
+            if (n4->oper == expr_t::CALL) {
+                iden_t *fn = dynamic_cast<iden_t *>(n4->left);
+                if (!fn || fn->special || writes.count(fn->name) > 0)
+                    return false;
+
+                if (list_t *args = dynamic_cast<list_t *>(n4->right))
+                    for (size_t i = 0; i < args->items.size(); i++)
+                        if (iden_t *id = written_root(args->items[i]))
+                            if (std::find(params.begin(), params.end(), id->name) != params.end())
+                                return false;
+            }
+
+            return inline_safe(n4->left, params, writes, nodes)
+                   && inline_safe(n4->right, params, writes, nodes);
+        } else if (iden_t *n6 = dynamic_cast<iden_t *>(root)) {
+            return n6->name != "__args";
+        } else if (dynamic_cast<iter_t *>(root) || dynamic_cast<ctlstmt_t *>(root)) {
+            return false;
+        }
+
+        return true;
+    }
+
+/// finds the functions whose calls can be generated in place: those defined once by a top level
+/// statement, so that the name refers to the function wherever it is called after the definition,
+/// with a body that is a single 'return' of a small expression accepted by inline_safe().  a host
+/// function registered with the same name would be called instead of the script function, and is
+/// assumed not to exist.  calls from function bodies are generated in place even if the function
+/// could run before the definition, which would fail when not inlined
+    void codegen::find_inlinable(lk::node_t *root) {
+        m_inlinable.clear();
+
+        list_t *stmts = dynamic_cast<list_t *>(root);
+        if (!stmts || !(m_passes & OPT_INLINE))
+            return;
+
+        name_counts writes;
+        count_writes(root, writes);
+
+        for (size_t i = 0; i < stmts->items.size(); i++) {
+            expr_t *assign = dynamic_cast<expr_t *>(stmts->items[i]);
+            if (!assign || assign->oper != expr_t::ASSIGN)
+                continue;
+
+            iden_t *name = dynamic_cast<iden_t *>(assign->left);
+            expr_t *define = dynamic_cast<expr_t *>(assign->right);
+            if (!name || !name->constval || name->special || name->globalval
+                || !define || define->oper != expr_t::DEFINE || writes[name->name] != 1)
+                continue;
+
+            ctlstmt_t *ret = dynamic_cast<ctlstmt_t *>(define->right);
+            if (!ret || ret->ictl != ctlstmt_t::RETURN || !ret->rexpr)
+                continue;
+
+            inlinable fn;
+            fn.define = define;
+
+            bool ok = true;
+            if (list_t *p = dynamic_cast<list_t *>(define->left)) {
+                for (size_t k = 0; k < p->items.size(); k++) {
+                    iden_t *id = dynamic_cast<iden_t *>(p->items[k]);
+                    if (id) fn.params.push_back(id->name);
+                    else ok = false;
+                }
+            }
+
+            int nodes = 0;
+            if (ok && inline_safe(ret->rexpr, fn.params, writes, nodes) && nodes <= INLINE_MAX_NODES)
+                m_inlinable[name->name] = fn;
+        }
+    }
+
+/// generates the arguments of a call as for CALL, and then the returned expression of the
+/// function, which reads the arguments on the stack with PICK.  DROP leaves the result in place
+/// of the arguments, as RET leaves it in place of the arguments and function.  the expression
+/// keeps the source positions of the function body so that errors in it are reported there
+    bool codegen::inline_call(lk::expr_t *call) {
+        iden_t *name = dynamic_cast<iden_t *>(call->left);
+        if (!name || name->special || m_inlining != 0)
+            return false;
+
+        hashmap<lk_string, inlinable, lk_string_hash, lk_string_equal>::iterator it = m_inlinable.find(name->name);
+        if (it == m_inlinable.end())
+            return false;
+
+        inlinable &fn = it->second;
+        list_t *argvals = dynamic_cast<list_t *>(call->right);
+        size_t nargs = argvals ? argvals->items.size() : 0;
+
+        // at the top level, a call before the definition fails as it would otherwise
+        if (nargs != fn.params.size() || (m_scopes.size() == 0 && !fn.defined))
+            return false;
+
+        for (size_t i = 0; i < nargs; i++) {
+            expr_t *aexpr = dynamic_cast<expr_t *>(argvals->items[i]);
+            pfgen(argvals->items[i], (aexpr && aexpr->oper == expr_t::INDEX) ? F_BIND : F_NONE);
+        }
+
+        size_t start = m_asm.size();
+        m_inlining = &fn;
+        m_picks.clear();
+        pfgen(dynamic_cast<ctlstmt_t *>(fn.define->right)->rexpr, F_NONE);
+        m_inlining = 0;
+
+        // the number of values above the arguments at each instruction of the expression,
+        // whose only jumps are forward ones for conditionals and switches
+        std::vector<int> depth(m_asm.size() - start + 1, 0);
+        for (size_t i = start; i < m_asm.size(); i++) {
+            instr &ip = m_asm[i];
+            int need = 0, delta = 0;
+            stack_effect(ip.op, (size_t) ip.arg, need, delta);
+            int d = depth[i - start] + delta;
+
+            if (ip.label >= 0 && m_labelAddr[ip.label] >= (int) start)
+                depth[m_labelAddr[ip.label] - start] = d;
+
+            if (ip.op == SWI)
+                for (int k = 1; k <= ip.arg; k++)
+                    depth[i + k - start] = d;
+            else if (ip.op != J)
+                depth[i + 1 - start] = d;
+        }
+
+        for (size_t i = 0; i < m_picks.size(); i++) {
+            size_t at = m_picks[i].first;
+            m_asm[at].arg = (int) nargs - 1 - m_picks[i].second + depth[at - start];
+        }
+
+        emit(call->srcpos(), DROP, (int) nargs);
+        return true;
+    }
+
+/// fused instructions may only replace sequences from a single source line and statement,
+/// so that debugging information and breakpoint positions are unchanged
+    static bool same_pos(const srcpos_t &a, const srcpos_t &b) {
+        return a.line == b.line && a.stmt == b.stmt && a.file == b.file;
+    }
+
+    void codegen::optimize() {
+        if (m_passes & OPT_FOLD) fold_constants();
+        if (m_passes & OPT_THREAD) thread_jumps();
+        if (m_passes & OPT_DEAD) remove_dead_code();
+        if (m_passes & OPT_COMPACT) compact_labels();
+        if (m_passes & OPT_FUSE) peephole();
+    }
+
+    std::vector<bool> codegen::jump_targets() {
+        std::vector<bool> target(m_asm.size() + 1, false);
+        for (size_t i = 0; i < m_labelAddr.size(); i++)
+            if (m_labelAddr[i] >= 0 && m_labelAddr[i] <= (int) m_asm.size())
+                target[m_labelAddr[i]] = true;
+        return target;
+    }
+
+    void codegen::relocate(std::vector<instr> &code, const std::vector<int> &remap) {
+        for (size_t i = 0; i < m_labelAddr.size(); i++)
+            if (m_labelAddr[i] >= 0 && m_labelAddr[i] <= (int) m_asm.size())
+                m_labelAddr[i] = remap[m_labelAddr[i]];
+
+        m_asm.swap(code);
+    }
+
+/// evaluates a binary operator on constants as the vm does, if it cannot fail or depend on
+/// the program state
+    static bool fold_binary(Opcode op, vardata_t &a, vardata_t &b, vardata_t &result) {
+        bool num = a.type() == vardata_t::NUMBER && b.type() == vardata_t::NUMBER;
+        bool scalar = (a.type() == vardata_t::NUMBER || a.type() == vardata_t::STRING)
+                      && (b.type() == vardata_t::NUMBER || b.type() == vardata_t::STRING);
+
+        switch (op) {
+            case ADD:
+                if (num) result.assign(a.as_number() + b.as_number());
+                else if (scalar) result.assign(a.as_string() + b.as_string());
+                else return false;
+                return true;
+            case SUB:
+                if (!num) return false;
+                result.assign(a.as_number() - b.as_number());
+                return true;
+            case MUL:
+                if (!num) return false;
+                result.assign(a.as_number() * b.as_number());
+                return true;
+            case DIV:
+                if (!num) return false;
+                if (b.as_number() == 0.0) result.assign(std::numeric_limits<double>::quiet_NaN());
+                else result.assign(a.as_number() / b.as_number());
+                return true;
+            case EXP:
+                if (!num) return false;
+                result.assign(::pow(a.as_number(), b.as_number()));
+                return true;
+            case LT: case LE: case GT: case GE: case EQ: case NE: {
+                if (!scalar) return false;
+                bool cond;
+                switch (op) {
+                    case LT: cond = a.lessthan(b); break;
+                    case LE: cond = a.lessthan(b) || a.equals(b); break;
+                    case GT: cond = !a.lessthan(b) && !a.equals(b); break;
+                    case GE: cond = !a.lessthan(b); break;
+                    case EQ: cond = a.equals(b); break;
+                    default: cond = !a.equals(b); break;
+                }
+                result.assign(cond ? 1.0 : 0.0);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    bool codegen::fold_last(std::vector<instr> &code, const std::vector<bool> &target) {
+        size_t n = code.size();
+        if (n < 2 || target[n - 1]) return false;
+
+        instr &x = code[n - 2];
+        instr &op = code[n - 1];
+        if (x.op != PSH || !same_pos(x.pos, op.pos)) return false;
+
+        vardata_t result;
+        switch (op.op) {
+            case NEG:
+            case NOT:
+                if (m_constData[x.arg].type() != vardata_t::NUMBER) return false;
+                if (op.op == NEG) result.assign(0.0 - m_constData[x.arg].as_number());
+                else result.assign(((int) m_constData[x.arg].as_number()) ? 0.0 : 1.0);
+                x.arg = place_const(result);
+                code.pop_back();
+                return true;
+
+            case DUP:
+                op = x; // the copy is the same constant
+                return false;
+
+            case JF:
+            case JT: {
+                // a branch on a constant is always or never taken
+                bool cond = m_constData[x.arg].as_boolean();
+                if ((op.op == JT) == cond) {
+                    x = instr(op.pos, J, 0, op.label);
+                    code.pop_back();
+                } else
+                    code.erase(code.end() - 2, code.end());
+                return true;
+            }
+
+            default:
+                if (n < 3 || target[n - 2]) return false;
+                instr &y = code[n - 3];
+                if (y.op != PSH || !same_pos(y.pos, x.pos)
+                    || !fold_binary(op.op, m_constData[y.arg], m_constData[x.arg], result))
+                    return false;
+                y.arg = place_const(result);
+                code.erase(code.end() - 2, code.end());
+                return true;
+        }
+    }
+
+    void codegen::fold_constants() {
+        std::vector<bool> target = jump_targets();
+        std::vector<bool> out_target;
+        std::vector<instr> out;
+        std::vector<int> remap(m_asm.size() + 1, 0);
+        out.reserve(m_asm.size());
+
+        // labels on removed instructions move to the next one, which is then a target too
+        bool moved = false;
+        for (size_t i = 0; i < m_asm.size(); i++) {
+            remap[i] = (int) out.size();
+            out.push_back(m_asm[i]);
+            out_target.push_back(target[i] || moved);
+            moved = false;
+            while (fold_last(out, out_target)) {
+                for (size_t k = out.size(); k < out_target.size(); k++)
+                    moved = moved || out_target[k];
+                out_target.resize(out.size());
+            }
+        }
+        remap[m_asm.size()] = (int) out.size();
+
+        relocate(out, remap);
+    }
+
+    void codegen::thread_jumps() {
+        for (size_t i = 0; i < m_asm.size(); i++) {
+            instr &ip = m_asm[i];
+            if (ip.label < 0 || (ip.op != J && ip.op != JF && ip.op != JT))
+                continue;
+
+            // the hop count ends endless loops made only of jumps
+            int L = ip.label;
+            for (size_t hops = 0; hops < m_asm.size(); hops++) {
+                int addr = m_labelAddr[L];
+                if (addr < 0 || addr >= (int) m_asm.size() || m_asm[addr].op != J || m_asm[addr].label < 0)
+                    break;
+                L = m_asm[addr].label;
+            }
+            ip.label = L;
+        }
+    }
+
+    void codegen::remove_dead_code() {
+        size_t n = m_asm.size();
+        std::vector<bool> live(n, false), table(n, false);
+        std::vector<size_t> work(1, 0);
+
+        while (!work.empty()) {
+            size_t a = work.back();
+            work.pop_back();
+            while (a < n && !live[a]) {
+                instr &ip = m_asm[a];
+                live[a] = true;
+                if (ip.label >= 0 && m_labelAddr[ip.label] >= 0)
+                    work.push_back((size_t) m_labelAddr[ip.label]);
+                if (ip.op == SWI) // followed by a table of jumps, one per case
+                    for (int k = 1; k <= ip.arg && a + k < n; k++) {
+                        work.push_back(a + k);
+                        table[a + k] = true;
+                    }
+                if ((ip.op == FORPREP || ip.op == FORLOOP) && a + 2 <= n) {
+                    // followed by a jump that the loop skips
+                    work.push_back(a + 2);
+                    table[a + 1] = true;
+                }
+                if (ip.op == J || ip.op == RET || ip.op == END)
+                    break;
+                a++;
+            }
+        }
+
+        // a jump to the next live instruction does nothing, unless it is in the jump table
+        // of a SWI or follows a FORPREP or FORLOOP.  next[i] is the first live instruction
+        // at or after i
+        std::vector<size_t> next(n + 1, n);
+        for (size_t i = n; i-- > 0;) {
+            instr &ip = m_asm[i];
+            if (live[i] && ip.op == J && ip.label >= 0 && m_labelAddr[ip.label] > (int) i
+                && next[std::min((size_t) m_labelAddr[ip.label], n)] == next[i + 1] && !table[i])
+                live[i] = false;
+            next[i] = live[i] ? i : next[i + 1];
+        }
+
+        std::vector<instr> out;
+        std::vector<int> remap(n + 1, 0);
+        out.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            remap[i] = (int) out.size();
+            if (live[i]) out.push_back(m_asm[i]);
+        }
+        remap[n] = (int) out.size();
+
+        relocate(out, remap);
+    }
+
+    void codegen::compact_labels() {
+        std::vector<std::pair<int, int> > used; // address and label
+        std::vector<int> id(m_labelAddr.size(), -1);
+        for (size_t i = 0; i < m_asm.size(); i++) {
+            int L = m_asm[i].label;
+            if (L >= 0 && id[L] < 0) {
+                id[L] = 0;
+                used.push_back(std::make_pair(m_labelAddr[L], L));
+            }
+        }
+
+        // labels at the same address become one
+        std::sort(used.begin(), used.end());
+        std::vector<int> addr;
+        for (size_t k = 0; k < used.size(); k++) {
+            if (addr.empty() || addr.back() != used[k].first)
+                addr.push_back(used[k].first);
+            id[used[k].second] = (int) addr.size() - 1;
+        }
+
+        for (size_t i = 0; i < m_asm.size(); i++)
+            if (m_asm[i].label >= 0)
+                m_asm[i].label = id[m_asm[i].label];
+
+        m_labelAddr.swap(addr);
+    }
+
+    void codegen::peephole() {
+        std::vector<bool> target = jump_targets();
+
+        std::vector<instr> out;
+        std::vector<int> remap(m_asm.size() + 1, 0);
+        out.reserve(m_asm.size());
+
+        size_t i = 0;
+        while (i < m_asm.size()) {
+            instr &a = m_asm[i];
+            size_t n = 1;
+            Opcode fused = a.op;
+            int arg = a.arg;
+            int label = -1;
+
+            // number of instructions available for fusion: none may be a jump target
+            size_t avail = 1;
+            while (avail < 3 && i + avail < m_asm.size()
+                   && !target[i + avail] && same_pos(m_asm[i + avail].pos, a.pos))
+                avail++;
+
+            Opcode b = avail > 1 ? m_asm[i + 1].op : __MaxOp;
+            Opcode c = avail > 2 ? m_asm[i + 2].op : __MaxOp;
+
+            if (a.op == PSH && (b == ADD || b == SUB || b == MUL)) {
+                fused = (b == ADD) ? ADDC : (b == SUB) ? SUBC : MULC;
+                n = 2;
+            } else if (b == JF && m_asm[i + 1].label >= 0
+                       && (a.op == LT || a.op == GT || a.op == LE || a.op == GE || a.op == NE || a.op == EQ)) {
+                switch (a.op) {
+                    case LT: fused = LTJF; break;
+                    case GT: fused = GTJF; break;
+                    case LE: fused = LEJF; break;
+                    case GE: fused = GEJF; break;
+                    case NE: fused = NEJF; break;
+                    default: fused = EQJF; break;
+                }
+                label = m_asm[i + 1].label;
+                n = 2;
+            } else if (a.op == DUP && (b == JT || b == JF) && m_asm[i + 1].label >= 0) {
+                fused = (b == JT) ? JTK : JFK;
+                label = m_asm[i + 1].label;
+                n = 2;
+            } else if (a.op == LLOC && (b == INC || b == DEC) && c == POP) {
+                fused = (b == INC) ? INCL : DECL;
+                n = 3;
+            } else if (a.op == IDX && b == WR) {
+                fused = (c == POP) ? IDXWRP : IDXWR;
+                n = (c == POP) ? 3 : 2;
+            } else if (a.op == IDX && (b == INC || b == DEC)) {
+                fused = (b == INC) ? IDXINC : IDXDEC;
+                n = 2;
+            } else if (a.op == WR && b == POP) {
+                fused = WRP;
+                n = 2;
+            }
+
+            for (size_t k = 0; k < n; k++)
+                remap[i + k] = (int) out.size();
+
+            if (n == 1)
+                out.push_back(a);
+            else
+                out.push_back(instr(a.pos, fused, arg, label));
+
+            i += n;
+        }
+        remap[m_asm.size()] = (int) out.size();
+
+        relocate(out, remap);
+    }
+
 /// handles stack popping for statements by adding a POP instruction
     bool codegen::pfgen_stmt(lk::node_t *root, unsigned int flags) {
         bool ok = pfgen(root, flags);
 
-        // expressions always leave their value on the stack, so clean it up
-        if (expr_t *e = dynamic_cast<expr_t *>(root)) {
-            emit(e->srcpos(), POP);
+        // expressions always leave their value on the stack, so clean it up, as for a
+        // statement that is only a value, such as 'global x;'
+        if (dynamic_cast<expr_t *>(root) || dynamic_cast<iden_t *>(root) || dynamic_cast<constant_t *>(root)
+            || dynamic_cast<literal_t *>(root) || dynamic_cast<null_t *>(root)) {
+            emit(root->srcpos(), POP);
         } else if (cond_t *c = dynamic_cast<cond_t *>(root)) {
             // inline ternary expressions also leave value on stack
             if (c->ternary)
@@ -317,6 +954,85 @@ namespace lk {
         return ok;
     }
 
+/// returns true if the limit of a counting loop has the same value evaluated before the counter
+/// is advanced as after it: it may not read the counter, write anything, or call a function,
+/// which could read the counter by name
+    static bool limit_safe(node_t *root, const lk_string &counter) {
+        if (expr_t *n4 = dynamic_cast<expr_t *>(root)) {
+            switch (n4->oper) {
+                case expr_t::PLUS: case expr_t::MINUS: case expr_t::MULT: case expr_t::DIV: case expr_t::EXP:
+                case expr_t::NEG: case expr_t::INDEX: case expr_t::HASH: case expr_t::SIZEOF:
+                    return (!n4->left || limit_safe(n4->left, counter))
+                           && (!n4->right || limit_safe(n4->right, counter));
+                default:
+                    return false;
+            }
+        } else if (iden_t *n6 = dynamic_cast<iden_t *>(root)) {
+            return !n6->special && n6->name != counter;
+        }
+
+        return dynamic_cast<constant_t *>(root) != 0 || dynamic_cast<literal_t *>(root) != 0;
+    }
+
+/// recognizes 'for (...; i < n; i++)', also with <= and ++, or with > or >= and --.  the
+/// limit is evaluated before FORPREP and FORLOOP, which compare the counter with it and
+/// advance the counter in its frame slot, so it must be accepted by limit_safe().  loops
+/// whose block also assigns the counter are left to the generic form.  var is the argument
+/// of FORPREP and FORLOOP
+    bool codegen::counting_loop(iter_t *loop, int &var) {
+        expr_t *test = dynamic_cast<expr_t *>(loop->test);
+        expr_t *adv = dynamic_cast<expr_t *>(loop->adv);
+        if (!(m_passes & OPT_FORLOOP) || !test || !adv)
+            return false;
+
+        iden_t *i = dynamic_cast<iden_t *>(test->left);
+        iden_t *ia = dynamic_cast<iden_t *>(adv->left);
+        if (!i || !ia || i->special || ia->special || i->name != ia->name)
+            return false;
+
+        int kind;
+        switch (test->oper) {
+            case expr_t::LT: kind = FOR_LT; break;
+            case expr_t::LE: kind = FOR_LE; break;
+            case expr_t::GT: kind = FOR_GT; break;
+            case expr_t::GE: kind = FOR_GE; break;
+            default: return false;
+        }
+
+        if (adv->oper != (kind < FOR_GT ? expr_t::INCR : expr_t::DECR) || !limit_safe(test->right, i->name))
+            return false;
+
+        name_counts writes;
+        count_writes(loop->block, writes);
+        if (writes.count(i->name) > 0)
+            return false;
+
+        int slot = counter_slot(i->name);
+        if (slot < 0)
+            return false;
+
+        var = (kind << 22) | (slot << 16) | place_identifier(i->name);
+        return true;
+    }
+
+/// slots of loop counters follow those of the arguments.  an argument is not given one, since
+/// it may be a reference to a value that the limit also reads
+    int codegen::counter_slot(const lk_string &name) {
+        int id = place_identifier(name);
+        scope &s = m_scopes.empty() ? m_top : m_scopes.back();
+        if (id > SLOT_ID_MAX || std::find(s.params.begin(), s.params.end(), id) != s.params.end())
+            return -1;
+
+        size_t k = std::find(s.counters.begin(), s.counters.end(), id) - s.counters.begin();
+        int slot = (int) (s.params.size() + k);
+        if (slot > FOR_SLOT_MAX)
+            return -1;
+
+        if (k == s.counters.size())
+            s.counters.push_back(id);
+        return slot;
+    }
+
 /// returns true if instruction stack generation successful
     bool codegen::pfgen(lk::node_t *root, unsigned int flags) {
         if (!root) return true;
@@ -331,25 +1047,41 @@ namespace lk {
             if (n2->init && !pfgen_stmt(n2->init, flags)) return false;
 
             // labels for beginning, advancement, and outside end of loop
-            lk_string Lb = new_label();
-            lk_string Lc = new_label();
-            lk_string Le = new_label();
+            int Lb = new_label();
+            int Lc = new_label();
+            int Le = new_label();
 
             m_continueAddr.push_back(Lc);
             m_breakAddr.push_back(Le);
 
-            place_label(Lb);
+            int var;
+            if (counting_loop(n2, var)) {
+                // limit; FORPREP i; J Le; Lb: block; Lc: limit; FORLOOP i; J Lb; Le:
+                node_t *limit = dynamic_cast<expr_t *>(n2->test)->right;
+                if (!pfgen(limit, flags)) return false;
+                emit(n2->test->srcpos(), FORPREP, var);
+                emit_jump(n2->srcpos(), J, Le);
 
-            if (!pfgen(n2->test, flags)) return false;
+                place_label(Lb);
+                pfgen_stmt(n2->block, flags);
+
+                place_label(Lc);
+                if (!pfgen(limit, flags)) return false;
+                emit(n2->adv->srcpos(), FORLOOP, var);
+            } else {
+                place_label(Lb);
 
-            emit(n2->srcpos(), JF, Le);
+                if (!pfgen(n2->test, flags)) return false;
 
-            pfgen_stmt(n2->block, flags);
+                emit_jump(n2->srcpos(), JF, Le);
 
-            place_label(Lc);
-            if (n2->adv && !pfgen_stmt(n2->adv, flags)) return false;
+                pfgen_stmt(n2->block, flags);
 
-            emit(n2->srcpos(), J, Lb);
+                place_label(Lc);
+                if (n2->adv && !pfgen_stmt(n2->adv, flags)) return false;
+            }
+
+            emit_jump(n2->srcpos(), J, Lb);
             place_label(Le);
 
             m_continueAddr.pop_back();
@@ -357,11 +1089,11 @@ namespace lk {
         } else if (cond_t *n3 = dynamic_cast<cond_t *>( root )) {
             bool ternary = n3->ternary;
 
-            lk_string L1 = new_label();
-            lk_string L2 = L1;
+            int L1 = new_label();
+            int L2 = L1;
 
             pfgen(n3->test, flags);
-            emit(n3->srcpos(), JF, L1);
+            emit_jump(n3->srcpos(), JF, L1);
 
             // if an inline ternary conditional expression,
             // don't pop the expression value off the stack as in
@@ -374,7 +1106,7 @@ namespace lk {
 
                 // use previous assembly output line as statement position for debugging
                 // since it's unknown at parse time
-                emit(srcpos_t::npos, J, L2);
+                emit_jump(srcpos_t::npos, J, L2);
                 place_label(L1);
 
                 if (ternary) pfgen(n3->on_false, false);
@@ -442,20 +1174,20 @@ namespace lk {
                     emit(n4->srcpos(), DEC);
                     break;
                 case expr_t::LOGIOR: {
-                    lk_string Lsc = new_label();
+                    int Lsc = new_label();
                     pfgen(n4->left, flags);
                     emit(n4->srcpos(), DUP);
-                    emit(n4->srcpos(), JT, Lsc);
+                    emit_jump(n4->srcpos(), JT, Lsc);
                     pfgen(n4->right, flags);
                     emit(n4->srcpos(), OR);
                     place_label(Lsc);
                 }
                     break;
                 case expr_t::LOGIAND: {
-                    lk_string Lsc = new_label();
+                    int Lsc = new_label();
                     pfgen(n4->left, flags);
                     emit(n4->srcpos(), DUP);
-                    emit(n4->srcpos(), JF, Lsc);
+                    emit_jump(n4->srcpos(), JF, Lsc);
                     pfgen(n4->right, flags);
                     emit(n4->srcpos(), AND);
                     place_label(Lsc);
@@ -477,11 +1209,11 @@ namespace lk {
                 case expr_t::INDEX:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), IDX, flags & F_MUTABLE);
+                    emit(n4->srcpos(), IDX, (flags & F_MUTABLE) | (flags & F_BIND));
                     break;
                 case expr_t::HASH:
                     pfgen(n4->left, flags);
-                    pfgen(n4->right, F_NONE);
+                    pfgen_key(n4->right);
                     emit(n4->srcpos(), KEY, flags & F_MUTABLE);
                     break;
                 case expr_t::MINUSAT:
@@ -495,11 +1227,10 @@ namespace lk {
                     emit(n4->srcpos(), WAT);
                     break;
                 case expr_t::PLUSEQ:
-                    pfgen(n4->left, F_NONE);
+                    // evaluated in place as eval does, so that += appends to an array
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), ADD);
                     pfgen(n4->left, F_MUTABLE);
-                    emit(n4->srcpos(), WR);
+                    emit(n4->srcpos(), ADDWR);
                     break;
                 case expr_t::MINUSEQ:
                     pfgen(n4->left, F_NONE);
@@ -536,10 +1267,19 @@ namespace lk {
 
                     if (!pfgen(n4->left, F_MUTABLE)) return false;
                     emit(n4->srcpos(), WR);
+
+                    if (lk::iden_t *iden = dynamic_cast<lk::iden_t *>(n4->left)) {
+                        hashmap<lk_string, inlinable, lk_string_hash, lk_string_equal>::iterator it = m_inlinable.find(iden->name);
+                        if (it != m_inlinable.end() && it->second.define == n4->right)
+                            it->second.defined = true;
+                    }
                 }
                     break;
                 case expr_t::CALL:
                 case expr_t::THISCALL: {
+                    if (n4->oper == expr_t::CALL && inline_call(n4))
+                        break;
+
                     // make space on stack for the return value
                     emit(n4->srcpos(), NUL);
 
@@ -550,7 +1290,10 @@ namespace lk {
                         for (std::vector<node_t *>::iterator it = argvals->items.begin();
                              it != argvals->items.end();
                              ++it) {
-                            pfgen(*it, F_NONE);
+                            // an array item passed directly stays bound to the item, so that
+                            // the function can change it as it can change any other argument
+                            expr_t *aexpr = dynamic_cast<expr_t *>(*it);
+                            pfgen(*it, (aexpr && aexpr->oper == expr_t::INDEX) ? F_BIND : F_NONE);
                             nargs++;
                         }
                     }
@@ -558,7 +1301,7 @@ namespace lk {
                     if (n4->oper == expr_t::THISCALL && 0 != lexpr) {
                         pfgen(lexpr->left, F_NONE);
                         emit(n4->srcpos(), DUP);
-                        pfgen(lexpr->right, F_NONE);
+                        pfgen_key(lexpr->right);
                         emit(n4->srcpos(), KEY);
                     } else
                         pfgen(n4->left, F_NONE);
@@ -585,6 +1328,7 @@ namespace lk {
                     vardata_t cvec;
                     cvec.empty_vector();
                     if (p && initialize_const_vec(p, cvec)) {
+                        cvec.pack();
                         emit(n4->srcpos(), PSH, place_const(cvec));
                     } else {
                         int len = 0;
@@ -614,7 +1358,7 @@ namespace lk {
                                  ++it) {
                                 expr_t *assign = dynamic_cast<expr_t *>(*it);
                                 if (assign && assign->oper == expr_t::ASSIGN) {
-                                    pfgen(assign->left, F_NONE);
+                                    pfgen_key(assign->left);
                                     pfgen(assign->right, F_NONE);
                                     len++;
                                 }
@@ -626,8 +1370,8 @@ namespace lk {
                 }
                     break;
                 case expr_t::SWITCH: {
-                    lk_string Le(new_label());
-                    std::vector<lk_string> labels;
+                    int Le = new_label();
+                    std::vector<int> labels;
 
                     list_t *p = dynamic_cast<list_t *>(n4->right);
 
@@ -637,14 +1381,14 @@ namespace lk {
                     if (p) {
                         for (size_t i = 0; i < p->items.size(); i++) {
                             labels.push_back(new_label());
-                            emit(n4->srcpos(), J, labels.back());
+                            emit_jump(n4->srcpos(), J, labels.back());
                         }
 
                         for (size_t i = 0; i < p->items.size(); i++) {
                             place_label(labels[i]);
                             pfgen(p->items[i], F_NONE);
                             if (i < p->items.size() - 1)
-                                emit(p->items[i] ? p->items[i]->srcpos() : n4->srcpos(), J, Le);
+                                emit_jump(p->items[i] ? p->items[i]->srcpos() : n4->srcpos(), J, Le);
                         }
                     }
 
@@ -653,32 +1397,44 @@ namespace lk {
                     break;
 
                 case expr_t::DEFINE: {
-                    lk_string Le(new_label());
-                    lk_string Lf(new_label());
-                    emit(n4->srcpos(), J, Le);
+                    int Le = new_label();
+                    int Lf = new_label();
+                    emit_jump(n4->srcpos(), J, Le);
                     place_label(Lf);
+                    m_scopes.push_back(scope(m_asm.size()));
 
                     list_t *p = dynamic_cast<list_t *>(n4->left);
                     if (p) {
                         for (size_t i = 0; i < p->items.size(); i++) {
                             iden_t *id = dynamic_cast<iden_t *>(p->items[i]);
+                            m_scopes.back().params.push_back(id ? place_identifier(id->name) : -1);
                             emit(p->items[i] ? p->items[i]->srcpos() : n4->srcpos(), ARG, place_identifier(id->name));
                         }
                     }
 
-                    pfgen(n4->right, F_NONE);
+                    // the vm only builds '__args' for functions that refer to it
+                    if (uses_args(n4))
+                        emit(n4->srcpos(), ARGV);
+
+                    pfgen_stmt(n4->right, F_NONE);
 
                     // if the last statement in the function block,
                     // is not a return issue an implicit return statement
-                    if (m_asm.back().op != RET) {
+                    if (!ends_with_return(n4->right)) {
                         // for implicit return at end of function, use last code line number of block
                         srcpos_t posend = n4->srcpos();
                         posend.stmt = posend.stmt_end;
                         emit(posend, RET, 0);
                     }
 
+                    assign_slots(m_scopes.back(), m_asm.size(), p);
+                    if (m_scopes.size() > 1)
+                        m_scopes[m_scopes.size() - 2].nested.push_back(
+                                std::make_pair(m_scopes.back().start, m_asm.size()));
+                    m_scopes.pop_back();
+
                     place_label(Le);
-                    emit(n4->srcpos(), FREF, Lf);
+                    emit_jump(n4->srcpos(), FREF, Lf);
                 }
                     break;
 
@@ -687,23 +1443,32 @@ namespace lk {
             }
         } else if (ctlstmt_t *n5 = dynamic_cast<ctlstmt_t *>(root)) {
             switch (n5->ictl) {
-                case ctlstmt_t::RETURN:
+                case ctlstmt_t::RETURN: {
                     pfgen(n5->rexpr, F_NONE);
+
+                    // a call returned from a function reuses the function's frame
+                    expr_t *call = dynamic_cast<expr_t *>(n5->rexpr);
+                    if (m_scopes.size() > 0 && call != 0
+                        && (call->oper == expr_t::CALL || call->oper == expr_t::THISCALL)
+                        && m_asm.size() > 0 && (m_asm.back().op == CALL || m_asm.back().op == TCALL))
+                        m_asm.back().op = (m_asm.back().op == CALL) ? TAIL : TTAIL;
+
                     emit(n5->srcpos(), RET, n5->rexpr ? 1 : 0);
+                }
                     break;
 
                 case ctlstmt_t::BREAK:
                     if (m_breakAddr.size() == 0)
                         return error(lk_tr("cannot break from outside a loop"));
 
-                    emit(n5->srcpos(), J, m_breakAddr.back());
+                    emit_jump(n5->srcpos(), J, m_breakAddr.back());
                     break;
 
                 case ctlstmt_t::CONTINUE:
                     if (m_continueAddr.size() == 0)
                         return error(lk_tr("cannot continue from outside a loop"));
 
-                    emit(n5->srcpos(), J, m_continueAddr.back());
+                    emit_jump(n5->srcpos(), J, m_continueAddr.back());
                     break;
 
                 case ctlstmt_t::EXIT:
@@ -718,6 +1483,19 @@ namespace lk {
                 emit(n6->srcpos(), GET, place_identifier(n6->name));
                 return true;
             } else {
+                // a parameter of a function generated in place is a copy of its argument,
+                // at a depth found once the whole expression is generated
+                if (m_inlining != 0) {
+                    std::vector<lk_string> &params = m_inlining->params;
+                    for (size_t k = params.size(); k > 0; k--) {
+                        if (params[k - 1] == n6->name) {
+                            m_picks.push_back(std::make_pair(m_asm.size(), (int) k - 1));
+                            emit(n6->srcpos(), PICK, 0);
+                            return true;
+                        }
+                    }
+                }
+
                 Opcode op = RREF;
 
                 if (flags & F_MUTABLE) {
@@ -30,11 +30,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstring>
 #include <cstdlib>
 #include <limits>
 #include <cmath>
+#include <utility>
 
+#include <lk/aot.h>
 #include <lk/env.h>
 #include <lk/eval.h>
 
@@ -62,41 +66,371 @@ static void *dll_sym(void *handle, const char *name) { return dlsym(handle, name
 #endif
 
 lk::vardata_t::vardata_t() {
-    m_type = 0;
+    reset();
     set_type(NULLVAL);
 }
 
 lk::vardata_t::vardata_t(const vardata_t &cp) {
-    m_type = 0;
+    reset();
     set_type(NULLVAL);
     copy(const_cast<vardata_t &>(cp));
 }
 
+lk::vardata_t::vardata_t(vardata_t &&rv) noexcept {
+    reset();
+    set_type(NULLVAL);
+    move(rv);
+}
+
 lk::vardata_t::~vardata_t() {
     nullify();
 }
 
 /* private member functions */
+#ifdef LK_NANBOX
+static_assert(sizeof(lk::vardata_t) == 8 && sizeof(void *) <= 8, "boxed values need 64 bits and at most 48 bit pointers");
+
+void lk::vardata_t::set_number_type(unsigned char ty) {
+    if (!boxed()) { // a number held in place, flagged as assigned only
+        if (ty != NUMBER) m_bits = box(ty, 1);
+        return;
+    }
+
+    uint64_t fl = m_bits & NB_FLAGS;
+    if (type() == NUMBER)
+        delete reinterpret_cast<double *>(ptr());
+
+    if (ty != NUMBER) {
+        m_bits = box(ty, fl);
+    } else if (fl == 1) {
+        m_bits = 0; // 0.0, held in place
+    } else {
+        m_bits = box(NUMBER, fl);
+        set_ptr(new double(0.0));
+    }
+}
+
+void lk::vardata_t::set_flags(unsigned char fl) {
+    uint64_t bf = (fl >> 5) & NB_FLAGS;
+    if (bf == box_flags()) return;
+
+    if (type() != NUMBER) {
+        m_bits = (m_bits & ~NB_FLAGS) | bf;
+        return;
+    }
+
+    double d = dbl();
+    set_type(NULLVAL);
+    m_bits = (m_bits & ~NB_FLAGS) | bf;
+    set_type(NUMBER);
+    set_dbl(d);
+}
+
+size_t lk::vardata_t::type_offset() {
+    return offsetof(vardata_t, m_bits); // not used: the jit is not built with boxed values
+}
+
+size_t lk::vardata_t::number_offset() {
+    return offsetof(vardata_t, m_bits);
+}
+#else
 void lk::vardata_t::set_type(unsigned char ty) {
     m_type &= FLAGMASK; // clear all type info
     m_type |= (ty & TYPEMASK); // set lower 4 bits to type
 }
 
+size_t lk::vardata_t::type_offset() {
+    return offsetof(vardata_t, m_type);
+}
+
+size_t lk::vardata_t::number_offset() {
+    return offsetof(vardata_t, m_u); // members of a union start at its address
+}
+#endif
+
+#ifdef LK_SHORT_STRINGS
+#ifdef LK_NANBOX
+void lk::vardata_t::set_short(const char *s, size_t n) {
+    // the length goes in bits 3 to 5 and the characters from bit 8 up, below the type
+    uint64_t b = (uint64_t) n << 3;
+    for (size_t i = 0; i < n; i++)
+        b |= (uint64_t) (unsigned char) s[i] << (8 + 8 * i);
+    m_bits = (m_bits & ~NB_PTR) | b;
+}
+
+size_t lk::vardata_t::short_chars(char *buf) const {
+    size_t n = (size_t) ((m_bits >> 3) & 7);
+    for (size_t i = 0; i < n; i++)
+        buf[i] = (char) (m_bits >> (8 + 8 * i));
+    return n;
+}
+#else
+void lk::vardata_t::set_short(const char *s, size_t n) {
+    m_slen = (unsigned char) n;
+    size_t n1 = n < sizeof(m_sbuf) ? n : sizeof(m_sbuf);
+    memcpy(m_sbuf, s, n1);
+    if (n > n1) memcpy(m_u.s, s + n1, n - n1);
+}
+
+size_t lk::vardata_t::short_chars(char *buf) const {
+    size_t n = m_slen;
+    size_t n1 = n < sizeof(m_sbuf) ? n : sizeof(m_sbuf);
+    memcpy(buf, m_sbuf, n1);
+    if (n > n1) memcpy(buf + n1, m_u.s, n - n1);
+    return n;
+}
+#endif
+
+bool lk::vardata_t::assign_short(const char *s, size_t n) {
+    if (n > SHORT_MAX) return false;
+
+    if (tag() != SHORTSTR) {
+        char buf[SHORT_MAX];
+        memcpy(buf, s, n); // s may be held by the value let go of here
+        nullify();
+        set_type(SHORTSTR);
+        set_short(buf, n);
+    } else
+        set_short(s, n);
+    return true;
+}
+
+const char *lk::vardata_t::chars(char *buf, size_t &n) const {
+    if (tag() == SHORTSTR) {
+        n = short_chars(buf);
+        return buf;
+    }
+
+    const lk_string &s = *reinterpret_cast<lk_string *>(payload(false));
+    n = s.length();
+    return s.c_str();
+}
+#endif
+
 /// checks if value has been assigned and is constant
 void lk::vardata_t::assert_modify() {
+#ifdef LK_NANBOX
+    if (!boxed()) return; // numbers held in place are assigned and not constant
+    if ((m_bits & 3) == 3) throw error_t(lk_tr("cannot modify a constant value")); // CONSTVAL and ASSIGNED
+    if (!(m_bits & 1)) set_flag(ASSIGNED);
+#else
     if (flagval(CONSTVAL)
         && flagval(ASSIGNED)) {
         throw error_t(lk_tr("cannot modify a constant value"));
     }
 
     set_flag(ASSIGNED);
+#endif
+}
+
+namespace {
+    /// container of a string, array or table, with the number of values sharing it
+    template<typename T>
+    struct shared_t {
+        shared_t() : refs(1), pinned(false) {}
+
+        shared_t(const T &d) : data(d), refs(1), pinned(false) {}
+
+        shared_t(T &&d) : data(std::move(d)), refs(1), pinned(false) {}
+
+        T data;
+        std::atomic<unsigned int> refs;
+        std::atomic<bool> pinned; // a pointer into data was given out, so copies get their own
+    };
+
+    /// a shared string also keeps its hash as a table key once it has been used as one, and
+    /// its atom if it was interned
+    struct shared_str : shared_t<lk_string> {
+        shared_str(const char *s) : shared_t<lk_string>(lk_string(s)), hash(0) {}
+
+        shared_str(const lk_string &s) : shared_t<lk_string>(s), hash(0) {}
+
+        shared_str(lk_string &&s) : shared_t<lk_string>(std::move(s)), hash(0) {}
+
+        std::atomic<size_t> hash; // varhash_t::hash_of(data), or 0 if not known yet
+        lk::atom_t key; // atom of data, set by intern() before the string is shared
+    };
+
+    typedef shared_t<std::vector<lk::vardata_t> > shared_vec;
+    typedef shared_t<lk::varhash_t> shared_hash;
+    typedef shared_t<std::vector<double> > shared_num;
+
+    void delete_items(lk::varhash_t &h) {
+        for (lk::varhash_t::iterator it = h.begin(); it != h.end(); ++it)
+            delete it->second;
+    }
+
+    /// a container of its own with the contents of p, of a value of type ty
+    void *clone(unsigned char ty, void *p) {
+        switch (ty) {
+            case lk::vardata_t::STRING: {
+                shared_str *s = reinterpret_cast<shared_str *>(p);
+                shared_str *q = new shared_str(s->data);
+                q->hash.store(s->hash.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                q->key = s->key;
+                return q;
+            }
+            case lk::vardata_t::VECTOR:
+                // items are copied by sharing their own contents in turn
+                return new shared_vec(reinterpret_cast<shared_vec *>(p)->data);
+            case lk::vardata_t::HASH: {
+                // copying the table keeps the order it iterates in, then each item gets its own copy
+                shared_hash *q = new shared_hash(reinterpret_cast<shared_hash *>(p)->data);
+                for (lk::varhash_t::iterator it = q->data.begin(); it != q->data.end(); ++it) {
+                    lk::vardata_t *cp = new lk::vardata_t;
+                    cp->copy(*it->second);
+                    it->second = cp;
+                }
+                return q;
+            }
+            default:
+                return new shared_num(reinterpret_cast<shared_num *>(p)->data);
+        }
+    }
+
+    /// takes a share of the container p of type S, or returns a copy of it if a pointer into it
+    /// was given out, which the copy must not see writes through
+    template<typename S>
+    void *share(unsigned char ty, void *p) {
+        S *s = reinterpret_cast<S *>(p);
+        if (s->pinned.load(std::memory_order_acquire))
+            return clone(ty, p);
+        s->refs++;
+        return p;
+    }
+}
+
+void *lk::vardata_t::payload(bool modify, bool pin) const {
+    vardata_t *self = const_cast<vardata_t *>(this);
+    switch (tag()) {
+        case STRING: {
+            shared_str *p = reinterpret_cast<shared_str *>(ptr());
+            if (modify && p->refs.load(std::memory_order_acquire) > 1) {
+                shared_str *q = reinterpret_cast<shared_str *>(clone(STRING, p));
+                self->release();
+                self->set_ptr(q);
+                p = q;
+            }
+            if (pin) p->pinned.store(true, std::memory_order_release);
+            if (modify) {
+                p->hash.store(0, std::memory_order_relaxed);
+                if (!p->key.empty()) p->key = lk::atom_t();
+            }
+            return &p->data;
+        }
+        case VECTOR: {
+            shared_vec *p = reinterpret_cast<shared_vec *>(ptr());
+            if (modify && p->refs.load(std::memory_order_acquire) > 1) {
+                shared_vec *q = reinterpret_cast<shared_vec *>(clone(VECTOR, p));
+                self->release();
+                self->set_ptr(q);
+                p = q;
+            }
+            if (pin) p->pinned.store(true, std::memory_order_release);
+            return &p->data;
+        }
+        case HASH: {
+            shared_hash *p = reinterpret_cast<shared_hash *>(ptr());
+            if (modify && p->refs.load(std::memory_order_acquire) > 1) {
+                shared_hash *q = reinterpret_cast<shared_hash *>(clone(HASH, p));
+                self->release();
+                self->set_ptr(q);
+                p = q;
+            }
+            if (pin) p->pinned.store(true, std::memory_order_release);
+            return &p->data;
+        }
+        case NUMARRAY: {
+            shared_num *p = reinterpret_cast<shared_num *>(ptr());
+            if (modify && p->refs.load(std::memory_order_acquire) > 1) {
+                shared_num *q = reinterpret_cast<shared_num *>(clone(NUMARRAY, p));
+                self->release();
+                self->set_ptr(q);
+                p = q;
+            }
+            if (pin) p->pinned.store(true, std::memory_order_release);
+            return &p->data;
+        }
+        default:
+            return 0;
+    }
+}
+
+void lk::vardata_t::release() {
+    switch (tag()) {
+        case STRING: {
+            shared_str *p = reinterpret_cast<shared_str *>(ptr());
+            if (p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete p;
+        }
+            break;
+        case VECTOR: {
+            shared_vec *p = reinterpret_cast<shared_vec *>(ptr());
+            if (p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete p;
+        }
+            break;
+        case HASH: {
+            shared_hash *p = reinterpret_cast<shared_hash *>(ptr());
+            if (p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete_items(p->data);
+                delete p;
+            }
+        }
+            break;
+        case NUMARRAY: {
+            shared_num *p = reinterpret_cast<shared_num *>(ptr());
+            if (p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete p;
+        }
+            break;
+    }
+}
+
+void lk::vardata_t::unpack() const {
+    if (tag() != NUMARRAY) return;
+
+    const std::vector<double> &nv = *reinterpret_cast<std::vector<double> *>(payload(false));
+    shared_vec *q = new shared_vec;
+    q->data.resize(nv.size());
+    for (size_t i = 0; i < nv.size(); i++)
+        if (!is_null_number(nv[i]))
+            q->data[i].assign(nv[i]);
+
+    vardata_t *self = const_cast<vardata_t *>(this);
+    self->release();
+    self->set_type(VECTOR);
+    self->set_ptr(q);
+}
+
+bool lk::vardata_t::holds_reference() const {
+    switch (tag()) {
+        case REFERENCE:
+            return true;
+        case VECTOR: {
+            std::vector<vardata_t> &v = *reinterpret_cast<std::vector<vardata_t> *>(payload(false));
+            for (size_t i = 0; i < v.size(); i++)
+                if (v[i].holds_reference())
+                    return true;
+        }
+            return false;
+        case HASH: {
+            varhash_t &h = *reinterpret_cast<varhash_t *>(payload(false));
+            for (varhash_t::iterator it = h.begin(); it != h.end(); ++it)
+                if (it->second->holds_reference())
+                    return true;
+        }
+            return false;
+        default:
+            return false;
+    }
 }
 
 /* public interface */
 
 bool lk::vardata_t::as_boolean() const {
     if (type() == NUMBER
-        && m_u.v == 0.0)
+        && dbl() == 0.0)
         return false;
 
     if (type() == STRING) {
@@ -124,22 +458,28 @@ int lk::vardata_t::as_integer() const {
 
 lk_string lk::vardata_t::as_string() const {
     char buf[512];
-    switch (type()) {
+    switch (tag()) {
         case NULLVAL:
             return "<null>";
         case REFERENCE:
             return deref().as_string();
         case NUMBER: {
-            if (((double) ((int) m_u.v)) == m_u.v)
-                sprintf(buf, "%d", (int) m_u.v);
+            if (((double) ((int) dbl())) == dbl())
+                sprintf(buf, "%d", (int) dbl());
             else
-                sprintf(buf, "%lg", m_u.v);
+                sprintf(buf, "%lg", dbl());
             return lk_string(buf);
         }
         case STRING:
-            return *reinterpret_cast<lk_string *>(m_u.p);
+            return *reinterpret_cast<lk_string *>(payload(false));
+#ifdef LK_SHORT_STRINGS
+        case SHORTSTR: {
+            char buf[SHORT_MAX];
+            return lk_string(buf, short_chars(buf));
+        }
+#endif
         case VECTOR: {
-            std::vector<vardata_t> &v = *reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
+            std::vector<vardata_t> &v = *reinterpret_cast<std::vector<vardata_t> *>(payload(false));
 
             lk_string s("[ ");
             for (size_t i = 0; i < v.size(); i++) {
@@ -152,8 +492,23 @@ lk_string lk::vardata_t::as_string() const {
 
             return s;
         }
+        case NUMARRAY: {
+            lk_string s("[ ");
+            size_t n = length();
+            vardata_t x;
+            for (size_t i = 0; i < n; i++) {
+                item(i, x);
+                s += x.as_string();
+                if (n > 1 && i < n - 1)
+                    s += ", ";
+            }
+
+            s += " ]";
+
+            return s;
+        }
         case HASH: {
-            varhash_t &h = *reinterpret_cast<varhash_t *>(m_u.p);
+            varhash_t &h = *reinterpret_cast<varhash_t *>(payload(false));
             lk_string s("{ ");
 
             for (varhash_t::iterator it = h.begin(); it != h.end(); ++it) {
@@ -200,7 +555,7 @@ double lk::vardata_t::as_number() const {
         case NULLVAL:
             return 0;
         case NUMBER:
-            return m_u.v;
+            return dbl();
         case STRING:
             return my_atof((const char *) str().c_str());
         case REFERENCE:
@@ -211,16 +566,18 @@ double lk::vardata_t::as_number() const {
 }
 
 void lk::vardata_t::deep_localize() {
-    switch (type()) {
+    switch (tag()) {
         case REFERENCE:
             copy(deref());
             break;
         case VECTOR: {
+            if (!holds_reference()) break; // leaves the contents shared
             for (size_t i = 0; i < length(); i++)
                 index(i)->deep_localize();
         }
             break;
         case HASH: {
+            if (!holds_reference()) break;
             varhash_t &hh = *hash();
             for (varhash_t::iterator it = hh.begin();
                  it != hh.end();
@@ -232,7 +589,7 @@ void lk::vardata_t::deep_localize() {
 }
 
 bool lk::vardata_t::copy(vardata_t &rhs) {
-    switch (rhs.type()) {
+    switch (rhs.tag()) {
         case NULLVAL:
             assert_modify();
             nullify();
@@ -241,36 +598,45 @@ bool lk::vardata_t::copy(vardata_t &rhs) {
             assert_modify();
             nullify();
             set_type(REFERENCE);
-            if (rhs.m_u.p == this)
+            if (rhs.ptr() == this)
                 throw error_t(lk_tr("internal error: copying self-referential reference"));
-            m_u.p = rhs.m_u.p;
+            set_ptr(rhs.ptr());
             return true;
         case NUMBER:
-            assign(rhs.m_u.v);
-            return true;
-        case STRING:
-            assign(rhs.str());
+            assign(rhs.dbl());
             return true;
-        case VECTOR: {
-            resize(rhs.length());
-            std::vector<vardata_t> &v = *reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
-            std::vector<vardata_t> *rv = rhs.vec();
-            for (size_t i = 0; i < v.size(); i++)
-                v[i].copy((*rv)[i]);
+#ifdef LK_SHORT_STRINGS
+        case SHORTSTR: {
+            assert_modify();
+            char buf[SHORT_MAX];
+            size_t n = rhs.short_chars(buf); // before letting go of this value, which may hold rhs
+            if (tag() != SHORTSTR) {
+                nullify();
+                set_type(SHORTSTR);
+            }
+            set_short(buf, n);
         }
             return true;
-        case HASH: {
-            empty_hash();
-            varhash_t &h = (*reinterpret_cast<varhash_t *>(m_u.p));
-            varhash_t &rh = (*reinterpret_cast<varhash_t *>(rhs.m_u.p));
+#endif
+        case STRING:
+        case VECTOR:
+        case HASH:
+        case NUMARRAY: {
+            assert_modify();
+            void *p = rhs.ptr();
+            unsigned char ty = rhs.tag();
+            if (tag() == ty && ptr() == p)
+                return true;
 
-            for (varhash_t::iterator it = rh.begin();
-                 it != rh.end();
-                 ++it) {
-                vardata_t *cp = new vardata_t;
-                cp->copy(*it->second);
-                h[(*it).first] = cp;
-            }
+            // take the share before letting go of the current value, which may hold rhs
+            if (ty == STRING) p = share<shared_str>(ty, p);
+            else if (ty == VECTOR) p = share<shared_vec>(ty, p);
+            else if (ty == HASH) p = share<shared_hash>(ty, p);
+            else p = share<shared_num>(ty, p);
+
+            nullify();
+            set_type(ty);
+            set_ptr(p);
         }
             return true;
 
@@ -280,7 +646,7 @@ bool lk::vardata_t::copy(vardata_t &rhs) {
             assert_modify();
             nullify();
             set_type(rhs.type());
-            m_u.p = rhs.m_u.p;
+            set_ptr(rhs.ptr());
             return true;
 
         default:
@@ -288,6 +654,33 @@ bool lk::vardata_t::copy(vardata_t &rhs) {
     }
 }
 
+bool lk::vardata_t::move(vardata_t &rhs) {
+    if (&rhs == this) return true;
+
+    switch (rhs.tag()) {
+        case STRING:
+        case VECTOR:
+        case HASH:
+        case NUMARRAY: {
+            assert_modify();
+            unsigned char ty = rhs.tag();
+            void *p = rhs.ptr();
+
+            // rhs lets go of the contents first, in case it is an item of this value
+            rhs.set_type(NULLVAL);
+            nullify();
+            set_type(ty);
+            set_ptr(p);
+        }
+            return true;
+        default:
+            if (!copy(rhs))
+                return false;
+            rhs.nullify();
+            return true;
+    }
+}
+
 bool lk::vardata_t::equals(vardata_t &rhs) const {
     if (type() != rhs.type()) return false;
 
@@ -296,17 +689,45 @@ bool lk::vardata_t::equals(vardata_t &rhs) const {
             return true;
 
         case NUMBER:
-            return m_u.v == rhs.m_u.v;
-
-        case STRING:
+            return dbl() == rhs.dbl();
+
+        case STRING: {
+#ifdef LK_SHORT_STRINGS
+            char b1[SHORT_MAX], b2[SHORT_MAX];
+            size_t n1, n2;
+            const char *s1 = chars(b1, n1), *s2 = rhs.chars(b2, n2);
+            return n1 == n2 && memcmp(s1, s2, n1) == 0;
+#else
             return str() == rhs.str();
+#endif
+        }
 
         case VECTOR: {
-            size_t len = vec()->size();
-            if (len != rhs.vec()->size())
+            if (is_numarray() || rhs.is_numarray()) {
+                size_t len = length();
+                if (len != rhs.length())
+                    return false;
+                if (ptr() == rhs.ptr())
+                    return true;
+                vardata_t x1, x2;
+                for (size_t i = 0; i < len; i++) {
+                    item(i, x1);
+                    rhs.item(i, x2);
+                    if (!x1.equals(x2))
+                        return false;
+                }
+                return true;
+            }
+
+            std::vector<vardata_t> &v1 = *reinterpret_cast<std::vector<vardata_t> *>(payload(false));
+            std::vector<vardata_t> &v2 = *reinterpret_cast<std::vector<vardata_t> *>(rhs.payload(false));
+            if (&v1 == &v2)
+                return true;
+            size_t len = v1.size();
+            if (len != v2.size())
                 return false;
             for (size_t i = 0; i < len; i++)
-                if (!(*vec())[i].equals((*rhs.vec())[i]))
+                if (!v1[i].equals(v2[i]))
                     return false;
 
             return true;
@@ -314,8 +735,8 @@ bool lk::vardata_t::equals(vardata_t &rhs) const {
             break;
 
         case HASH: {
-            varhash_t *h1 = hash();
-            varhash_t *h2 = rhs.hash();
+            varhash_t *h1 = reinterpret_cast<varhash_t *>(payload(false));
+            varhash_t *h2 = reinterpret_cast<varhash_t *>(rhs.payload(false));
 
             // if number of pairs is different, not equal
             if (h1->size() != h2->size())
@@ -357,14 +778,74 @@ bool lk::vardata_t::lessthan(vardata_t &rhs) const {
 
     switch (type()) {
         case NUMBER:
-            return m_u.v < rhs.m_u.v;
-        case STRING:
+            return dbl() < rhs.dbl();
+        case STRING: {
+#ifdef LK_SHORT_STRINGS
+            char b1[SHORT_MAX], b2[SHORT_MAX];
+            size_t n1, n2;
+            const char *s1 = chars(b1, n1), *s2 = rhs.chars(b2, n2);
+            int c = memcmp(s1, s2, n1 < n2 ? n1 : n2);
+            return c < 0 || (c == 0 && n1 < n2);
+#else
             return str() < rhs.str();
+#endif
+        }
         default:
             return false;
     }
 }
 
+size_t lk::vardata_t::hash_value() const {
+    switch (type()) {
+        case NUMBER: {
+            double d = dbl();
+            if (d == 0.0) return NUMBER; // 0 and -0 are equal
+            unsigned long long bits;
+            memcpy(&bits, &d, sizeof(bits));
+            bits = (bits ^ (bits >> 33)) * 0xff51afd7ed558ccdULL; // small integers differ only in high bits
+            return (size_t) (bits ^ (bits >> 33));
+        }
+
+        case STRING: {
+#ifdef LK_SHORT_STRINGS
+            char b[SHORT_MAX];
+            size_t n;
+            const char *s = chars(b, n);
+            size_t h = 2166136261u;
+            for (size_t i = 0; i < n; i++)
+                h = (h ^ (unsigned char) s[i]) * 16777619u;
+            return h;
+#else
+            return lk_string_hash()(str());
+#endif
+        }
+
+        case VECTOR: {
+            // packed and unpacked arrays of the same items are equal, so hash item by item
+            size_t len = length();
+            size_t h = len;
+            vardata_t x;
+            for (size_t i = 0; i < len; i++) {
+                item(i, x);
+                h = h * 31 + x.hash_value();
+            }
+            return h;
+        }
+
+        case HASH: {
+            // independent of the order of the pairs in the table
+            varhash_t *t = reinterpret_cast<varhash_t *>(payload(false));
+            size_t h = t->size();
+            for (varhash_t::iterator it = t->begin(); it != t->end(); ++it)
+                h += varhash_t::hash_of(it->first) * 31 + it->second->hash_value();
+            return h;
+        }
+
+        default:
+            return type();
+    }
+}
+
 const char *lk::vardata_t::typestr() const {
     switch (type()) {
         case NULLVAL:
@@ -388,49 +869,35 @@ const char *lk::vardata_t::typestr() const {
     }
 }
 
-/// deletes value, ie object to which m_u.p points
+/// deletes value, ie object to which ptr() points, once no other copy shares it
 void lk::vardata_t::nullify() {
-    switch (type()) {
-        case STRING:
-            delete reinterpret_cast<lk_string *>(m_u.p);
-            break;
-        case HASH: {
-            varhash_t *h = reinterpret_cast<varhash_t *>(m_u.p);
-            for (varhash_t::iterator it = h->begin();
-                 it != h->end();
-                 ++it)
-                delete it->second;
-            delete h;
-        }
-            break;
-        case VECTOR:
-            delete reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
-            break;
-
-            // note: functions not deleted here because they
-            // are pointers into the abstract syntax tree
-    }
-
+    // note: functions not deleted here because they
+    // are pointers into the abstract syntax tree
+    release();
     set_type(NULLVAL);
 }
 
-void lk::vardata_t::assign(double d) {
+void lk::vardata_t::assign_number(double d) {
     assert_modify();
 
     nullify();
     set_type(NUMBER);
-    m_u.v = d;
+    set_dbl(d);
 }
 
 void lk::vardata_t::assign(const char *s) {
     assert_modify();
 
-    if (type() != STRING) {
+#ifdef LK_SHORT_STRINGS
+    if (assign_short(s, strlen(s))) return;
+#endif
+
+    if (tag() != STRING || reinterpret_cast<shared_str *>(ptr())->refs.load(std::memory_order_acquire) > 1) {
         nullify();
         set_type(STRING);
-        m_u.p = new lk_string(s);
+        set_ptr(new shared_str(s));
     } else {
-        *reinterpret_cast<lk_string *>(m_u.p) = s;
+        *reinterpret_cast<lk_string *>(payload(true)) = s;
     }
 }
 
@@ -438,13 +905,33 @@ void lk::vardata_t::assign(const char *s) {
 void lk::vardata_t::assign(const lk_string &s) {
     assert_modify();
 
+#ifdef LK_SHORT_STRINGS
+    if (assign_short(s.c_str(), s.length())) return;
+#endif
+
     // checks if previously assigned
-    if (type() != STRING) {
+    if (tag() != STRING || reinterpret_cast<shared_str *>(ptr())->refs.load(std::memory_order_acquire) > 1) {
         nullify();
         set_type(STRING);
-        m_u.p = new lk_string(s);
+        set_ptr(new shared_str(s));
     } else {
-        *reinterpret_cast<lk_string *>(m_u.p) = s;
+        *reinterpret_cast<lk_string *>(payload(true)) = s;
+    }
+}
+
+void lk::vardata_t::assign(lk_string &&s) {
+    assert_modify();
+
+#ifdef LK_SHORT_STRINGS
+    if (assign_short(s.c_str(), s.length())) return;
+#endif
+
+    if (tag() != STRING || reinterpret_cast<shared_str *>(ptr())->refs.load(std::memory_order_acquire) > 1) {
+        nullify();
+        set_type(STRING);
+        set_ptr(new shared_str(std::move(s)));
+    } else {
+        *reinterpret_cast<lk_string *>(payload(true)) = std::move(s);
     }
 }
 
@@ -453,7 +940,7 @@ void lk::vardata_t::empty_vector() {
 
     nullify();
     set_type(VECTOR);
-    m_u.p = new std::vector<vardata_t>;
+    set_ptr(new shared_vec);
 }
 
 void lk::vardata_t::empty_hash() {
@@ -461,7 +948,7 @@ void lk::vardata_t::empty_hash() {
 
     nullify();
     set_type(HASH);
-    m_u.p = new varhash_t;
+    set_ptr(new shared_hash);
 }
 
 void lk::vardata_t::assign(const lk_string &key, vardata_t *val) {
@@ -470,10 +957,10 @@ void lk::vardata_t::assign(const lk_string &key, vardata_t *val) {
     if (type() != HASH) {
         nullify();
         set_type(HASH);
-        m_u.p = new varhash_t;
+        set_ptr(new shared_hash);
     }
 
-    (*reinterpret_cast<varhash_t *>(m_u.p))[key] = val;
+    (*reinterpret_cast<varhash_t *>(payload(true)))[key] = val;
 }
 
 void lk::vardata_t::unassign(const lk_string &key) {
@@ -481,7 +968,7 @@ void lk::vardata_t::unassign(const lk_string &key) {
 
     if (type() != HASH) return;
 
-    varhash_t &h = (*reinterpret_cast<varhash_t *>(m_u.p));
+    varhash_t &h = (*reinterpret_cast<varhash_t *>(payload(true)));
 
     varhash_t::iterator it = h.find(key);
     if (it != h.end()) {
@@ -495,7 +982,7 @@ void lk::vardata_t::assign(expr_t *func) {
 
     nullify();
     set_type(FUNCTION);
-    m_u.p = func;
+    set_ptr(func);
 }
 
 void lk::vardata_t::assign(vardata_t *ref) {
@@ -505,7 +992,7 @@ void lk::vardata_t::assign(vardata_t *ref) {
     set_type(REFERENCE);
     if (ref == this)
         throw error_t(lk_tr("internal error: assigning self-referential reference"));
-    m_u.p = ref;
+    set_ptr(ref);
 }
 
 /// assigns as EXTFUNC type whose value points to the function's fci
@@ -514,7 +1001,7 @@ void lk::vardata_t::assign_fcall(fcallinfo_t *fci) {
 
     nullify();
     set_type(EXTFUNC);
-    m_u.p = fci;
+    set_ptr(fci);
 }
 
 void lk::vardata_t::assign_faddr(size_t ip) {
@@ -522,49 +1009,156 @@ void lk::vardata_t::assign_faddr(size_t ip) {
 
     nullify();
     set_type(INTFUNC);
-    m_u.p = (void *) ip;
+    set_ptr((void *) (ip << 3)); // kept clear of the low bits, as a pointer would be
 }
 
 void lk::vardata_t::resize(size_t n) {
     assert_modify();
 
+    if (tag() == NUMARRAY) {
+        reinterpret_cast<std::vector<double> *>(payload(true))->resize(n, null_number());
+        return;
+    }
+
     if (type() != VECTOR) {
+        // a new array starts out packed, as nulls
         nullify();
-        set_type(VECTOR);
-        m_u.p = new std::vector<vardata_t>;
+        set_type(NUMARRAY);
+        set_ptr(new shared_num(std::vector<double>(n, null_number())));
+        return;
     }
 
-    reinterpret_cast<std::vector<vardata_t> *>(m_u.p)->resize(n);
+    reinterpret_cast<std::vector<vardata_t> *>(payload(true))->resize(n);
 }
 
 double lk::vardata_t::num() const {
     if (type() != NUMBER) throw error_t(lk_tr("access violation: expected numeric, but found") + " " + typestr());
-    return m_u.v;
+    return dbl();
 }
 
 lk_string lk::vardata_t::str() const {
     if (type() != STRING) throw error_t(lk_tr("access violation: expected string, but found") + " " + typestr());
-    return *reinterpret_cast<lk_string *>(m_u.p);
+#ifdef LK_SHORT_STRINGS
+    if (tag() == SHORTSTR) {
+        char buf[SHORT_MAX];
+        return lk_string(buf, short_chars(buf));
+    }
+#endif
+    return *reinterpret_cast<lk_string *>(payload(false));
 }
 
 lk::vardata_t *lk::vardata_t::ref() const {
     if (type() != REFERENCE)
         return 0;
     else
-        return reinterpret_cast<vardata_t *>(m_u.p);
+        return reinterpret_cast<vardata_t *>(ptr());
 }
 
 std::vector<lk::vardata_t> *lk::vardata_t::vec() const {
     if (type() != VECTOR) throw error_t(lk_tr("access violation: expected array, but found ") + " " + typestr());
-    return reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
+    unpack();
+    return reinterpret_cast<std::vector<vardata_t> *>(payload(true, true));
+}
+
+void lk::vardata_t::assign(const double *p, size_t n) {
+    assert_modify();
+
+    shared_num *q = new shared_num;
+    q->data.assign(p, p + n);
+
+    nullify();
+    set_type(NUMARRAY);
+    set_ptr(q);
+}
+
+void lk::vardata_t::assign(std::vector<double> &&nums) {
+    assert_modify();
+
+    shared_num *q = new shared_num(std::move(nums));
+
+    nullify();
+    set_type(NUMARRAY);
+    set_ptr(q);
+}
+
+bool lk::vardata_t::pack() {
+    if (tag() == NUMARRAY) return true;
+    if (tag() != VECTOR) return false;
+
+    const std::vector<vardata_t> &v = *reinterpret_cast<std::vector<vardata_t> *>(payload(false));
+    for (size_t i = 0; i < v.size(); i++)
+        if (v[i].tag() != NUMBER && v[i].tag() != NULLVAL)
+            return false;
+
+    shared_num *q = new shared_num;
+    q->data.resize(v.size());
+    for (size_t i = 0; i < v.size(); i++)
+        q->data[i] = (v[i].tag() == NULLVAL) ? null_number()
+                     : is_null_number(v[i].dbl()) ? std::numeric_limits<double>::quiet_NaN() : v[i].dbl();
+
+    release();
+    set_type(NUMARRAY);
+    set_ptr(q);
+    return true;
+}
+
+std::vector<double> *lk::vardata_t::numarray() const {
+    if (tag() != NUMARRAY) throw error_t(lk_tr("access violation: expected packed array, but found") + " " + typestr());
+    return reinterpret_cast<std::vector<double> *>(payload(true, true));
+}
+
+const double *lk::vardata_t::numbers() const {
+    if (tag() != NUMARRAY) return 0;
+    return reinterpret_cast<std::vector<double> *>(payload(false))->data();
+}
+
+static void index_error(size_t idx, size_t len) {
+    throw lk::error_t((const char *) lk_tr("array index out of bounds at %d (length: %d)").c_str(), (int) idx,
+                      (int) len);
+}
+
+void lk::vardata_t::item(size_t idx, vardata_t &x) const {
+    if (tag() == NUMARRAY) {
+        const std::vector<double> &nv = *reinterpret_cast<std::vector<double> *>(payload(false));
+        if (idx >= nv.size()) index_error(idx, nv.size());
+        if (is_null_number(nv[idx])) x.nullify();
+        else x.assign(nv[idx]);
+        return;
+    }
+
+    if (type() != VECTOR)
+        throw error_t(lk_tr("access violation: expected array for indexing, but found") + " " + typestr());
+    std::vector<vardata_t> &m = *reinterpret_cast<std::vector<vardata_t> *>(payload(false));
+    if (idx >= m.size()) index_error(idx, m.size());
+    x.copy(m[idx]);
+}
+
+bool lk::vardata_t::set_item(size_t idx, double d) {
+    if (tag() != NUMARRAY) return false;
+
+    size_t len = reinterpret_cast<std::vector<double> *>(payload(false))->size();
+    if (idx > len) return false;
+    if (idx == len) assert_modify(); // growing the array changes it, as resize() does
+
+    std::vector<double> &nv = *reinterpret_cast<std::vector<double> *>(payload(true));
+    if (is_null_number(d)) d = std::numeric_limits<double>::quiet_NaN();
+    if (idx == len) nv.push_back(d);
+    else nv[idx] = d;
+    return true;
 }
 
 void lk::vardata_t::vec_append(double d) {
     assert_modify();
 
+    if (tag() == NUMARRAY) {
+        reinterpret_cast<std::vector<double> *>(payload(true))->push_back(
+                is_null_number(d) ? std::numeric_limits<double>::quiet_NaN() : d);
+        return;
+    }
+
     vardata_t v;
     v.assign(d);
-    vec()->push_back(v);
+    items_vec()->push_back(std::move(v));
 }
 
 void lk::vardata_t::vec_append(const lk_string &s) {
@@ -572,19 +1166,35 @@ void lk::vardata_t::vec_append(const lk_string &s) {
 
     vardata_t v;
     v.assign(s);
-    vec()->push_back(v);
+    items_vec()->push_back(std::move(v));
 }
 
-void lk::vardata_t::vec_append(const vardata_t vd) {
+void lk::vardata_t::vec_append(lk_string &&s) {
     assert_modify();
 
-    vec()->push_back(vd);
+    vardata_t v;
+    v.assign(std::move(s));
+    items_vec()->push_back(std::move(v));
+}
+
+void lk::vardata_t::vec_append(const vardata_t &vd) {
+    assert_modify();
+
+    items_vec()->push_back(vd);
+}
+
+void lk::vardata_t::vec_append(vardata_t &&vd) {
+    assert_modify();
+
+    items_vec()->push_back(std::move(vd));
 }
 
 size_t lk::vardata_t::length() const {
-    switch (type()) {
+    switch (tag()) {
         case VECTOR:
-            return reinterpret_cast<std::vector<vardata_t> *>(m_u.p)->size();
+            return reinterpret_cast<std::vector<vardata_t> *>(payload(false))->size();
+        case NUMARRAY:
+            return reinterpret_cast<std::vector<double> *>(payload(false))->size();
         default:
             return 0;
     }
@@ -593,30 +1203,41 @@ size_t lk::vardata_t::length() const {
 lk::expr_t *lk::vardata_t::func() const {
     if (type() != FUNCTION)
         throw error_t(lk_tr("access violation: expected code expression pointer, but found") + " " + typestr());
-    return reinterpret_cast<expr_t *>(m_u.p);
+    return reinterpret_cast<expr_t *>(ptr());
 }
 
 lk::fcallinfo_t *lk::vardata_t::fcall() const {
     if (type() != EXTFUNC)
         throw error_t(lk_tr("access violation: expected external function pointer, but found") + " " + typestr());
-    return reinterpret_cast<fcallinfo_t *>(m_u.p);
+    return reinterpret_cast<fcallinfo_t *>(ptr());
 }
 
 size_t lk::vardata_t::faddr() const {
     if (type() != INTFUNC)
         throw error_t(lk_tr("access violation: expected internal function pointer, but found") + " " + typestr());
-    return reinterpret_cast<size_t>(m_u.p);
+    return reinterpret_cast<size_t>(ptr()) >> 3;
+}
+
+std::vector<lk::vardata_t> *lk::vardata_t::items_vec() const {
+    if (type() != VECTOR) throw error_t(lk_tr("access violation: expected array, but found ") + " " + typestr());
+    unpack();
+    return reinterpret_cast<std::vector<vardata_t> *>(payload(true));
+}
+
+lk::varhash_t *lk::vardata_t::items_hash() const {
+    if (type() != HASH) throw error_t(lk_tr("access violation: expected hash table, but found") + " " + typestr());
+    return reinterpret_cast<varhash_t *> (payload(true));
 }
 
 lk::varhash_t *lk::vardata_t::hash() const {
     if (type() != HASH) throw error_t(lk_tr("access violation: expected hash table, but found") + " " + typestr());
-    return reinterpret_cast<varhash_t *> (m_u.p);
+    return reinterpret_cast<varhash_t *> (payload(true, true));
 }
 
 void lk::vardata_t::hash_item(const lk_string &key, double d) {
     assert_modify();
 
-    varhash_t *h = hash();
+    varhash_t *h = items_hash();
     varhash_t::iterator it = h->find(key);
     if (it != h->end())
         (*it).second->assign(d);
@@ -630,7 +1251,7 @@ void lk::vardata_t::hash_item(const lk_string &key, double d) {
 void lk::vardata_t::hash_item(const lk_string &key, const lk_string &s) {
     assert_modify();
 
-    varhash_t *h = hash();
+    varhash_t *h = items_hash();
     varhash_t::iterator it = h->find(key);
     if (it != h->end())
         (*it).second->assign(s);
@@ -644,7 +1265,7 @@ void lk::vardata_t::hash_item(const lk_string &key, const lk_string &s) {
 void lk::vardata_t::hash_item(const lk_string &key, const vardata_t &v) {
     assert_modify();
 
-    varhash_t *h = hash();
+    varhash_t *h = items_hash();
     varhash_t::iterator it = h->find(key);
     if (it != h->end())
         (*it).second->copy(const_cast<vardata_t &>(v));
@@ -655,6 +1276,11 @@ void lk::vardata_t::hash_item(const lk_string &key, const vardata_t &v) {
     }
 }
 
+void lk::vardata_t::hash_item(const vardata_t &key, const vardata_t &v) {
+    assert_modify();
+    key_item(*items_hash(), key, true)->copy(const_cast<vardata_t &>(v));
+}
+
 lk::vardata_t &lk::vardata_t::hash_item(const lk_string &key) {
     assert_modify();
 
@@ -673,10 +1299,9 @@ lk::vardata_t &lk::vardata_t::hash_item(const lk_string &key) {
 lk::vardata_t *lk::vardata_t::index(size_t idx) const {
     if (type() != VECTOR)
         throw error_t(lk_tr("access violation: expected array for indexing, but found") + " " + typestr());
-    std::vector<vardata_t> &m = *reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
-    if (idx >= m.size())
-        throw error_t((const char *) lk_tr("array index out of bounds at %d (length: %d)").c_str(), (int) idx,
-                      (int) m.size());
+    unpack();
+    std::vector<vardata_t> &m = *reinterpret_cast<std::vector<vardata_t> *>(payload(true, true));
+    if (idx >= m.size()) index_error(idx, m.size());
 
     return &m[idx];
 }
@@ -684,7 +1309,7 @@ lk::vardata_t *lk::vardata_t::index(size_t idx) const {
 lk::vardata_t *lk::vardata_t::lookup(const lk_string &key) const {
     if (!this) throw error_t(lk_tr("access violation: expected hash table, but found null")); // Check nullptr before the next line throws uncatchable errors
     if (type() != HASH) throw error_t(lk_tr("access violation: expected hash table, but found") + " " + typestr());
-    varhash_t &h = *reinterpret_cast<varhash_t *>(m_u.p);
+    varhash_t &h = *reinterpret_cast<varhash_t *>(payload(true, true));
     varhash_t::iterator it = h.find(key);
     if (it != h.end())
         return (*it).second;
@@ -692,13 +1317,80 @@ lk::vardata_t *lk::vardata_t::lookup(const lk_string &key) const {
         return 0;
 }
 
-lk::env_t::env_t() : m_parent(0), m_varIter(m_varHash.begin()) {}
+lk::vardata_t *lk::vardata_t::lookup(const vardata_t &key, bool create) {
+    if (type() != HASH) throw error_t(lk_tr("access violation: expected hash table, but found") + " " + typestr());
+    return key_item(*reinterpret_cast<varhash_t *>(payload(true, true)), key, create);
+}
+
+lk::vardata_t *lk::vardata_t::key_item(varhash_t &h, const vardata_t &key, bool create) {
+    if (key.tag() == STRING) {
+        shared_str *p = reinterpret_cast<shared_str *>(key.ptr());
+        if (!p->key.empty()) {
+            // an interned key, such as a literal one, is found among the atoms by pointer
+            varhash_t::iterator it = h.find(p->key);
+            if (it != h.end()) return (*it).second;
+            if (!create) return 0;
+            return h[p->key] = new vardata_t;
+        }
 
-lk::env_t::env_t(env_t *p) : m_parent(p), m_varIter(m_varHash.begin()) {}
+        // any other string keeps its hash, so that keys used again are only hashed once
+        size_t hh = p->hash.load(std::memory_order_relaxed);
+        if (hh == 0) {
+            hh = varhash_t::hash_of(p->data);
+            p->hash.store(hh, std::memory_order_relaxed);
+        }
+
+        varhash_t::iterator it = h.find(p->data, hh);
+        if (it != h.end()) return (*it).second;
+        if (!create) return 0;
+        return h.item(p->data, hh) = new vardata_t;
+    }
+
+    lk_string s(key.as_string());
+    size_t hh = varhash_t::hash_of(s);
+    varhash_t::iterator it = h.find(s, hh);
+    if (it != h.end()) return (*it).second;
+    if (!create) return 0;
+    return h.item(s, hh) = new vardata_t;
+}
+
+void lk::vardata_t::intern() {
+    if (type() != STRING) throw error_t(lk_tr("cannot intern a value that is not a string"));
+
+    if (tag() != STRING) {
+        // a string held in place moves into a container, which keeps the atom
+        lk_string s(as_string());
+        nullify();
+        set_type(STRING);
+        set_ptr(new shared_str(s));
+    }
+
+    if (!interned()) {
+        payload(true); // a container of its own, since the atom is kept only while unshared
+        shared_str *p = reinterpret_cast<shared_str *>(ptr());
+        p->key = atom_t(p->data);
+    }
+}
+
+bool lk::vardata_t::interned() const {
+    return tag() == STRING && !reinterpret_cast<shared_str *>(ptr())->key.empty();
+}
+
+// starts at 1 so that caches can use 0 as empty
+static std::atomic<unsigned int> g_funcVersion(1);
+
+unsigned int lk::env_t::func_version() {
+    return g_funcVersion.load(std::memory_order_relaxed);
+}
+
+lk::env_t::env_t() : m_parent(0), m_varIter(m_varHash.begin()), m_version(0) {}
+
+lk::env_t::env_t(env_t *p) : m_parent(p), m_varIter(m_varHash.begin()), m_version(0) {}
 
 lk::env_t::~env_t() {
     clear_objs();
     clear_vars();
+    clear_funcs();
 
     // unload any extension dlls
     for (std::vector<dynlib_t>::iterator it = m_dynlibList.begin();
@@ -722,16 +1414,47 @@ void lk::env_t::clear_vars() {
     for (varhash_t::iterator it = m_varHash.begin(); it != m_varHash.end(); ++it)
         delete it->second; // delete the var_data object
     m_varHash.clear();
+    m_version++;
 }
 
-/// assigns an identifer to a vardata_t with value
-void lk::env_t::assign(const lk_string &name, vardata_t *value) {
-    vardata_t *x = lookup(name, false);
+void lk::env_t::clear_funcs() {
+    if (m_funcHash.size() > 0) {
+        for (funchash_t::iterator it = m_funcHash.begin(); it != m_funcHash.end(); ++it)
+            delete it->second;
+        m_funcHash.clear();
+        g_funcVersion++;
+    }
+}
+
+void lk::env_t::move_vars(env_t &dest) {
+    for (varhash_t::iterator it = m_varHash.begin(); it != m_varHash.end(); ++it)
+        dest.assign(it->first, it->second);
+    m_varHash.clear();
+    m_version++;
+}
 
-    if (x && x != value)
+/// stores value in the variable x, deleting the one it replaces: true if x changed
+static bool replace_var(lk::vardata_t *&x, lk::vardata_t *value) {
+    if (x == value)
+        return false;
+
+    if (x)
         delete x;
 
-    m_varHash[name] = value;
+    x = value;
+    return true;
+}
+
+/// assigns an identifer to a vardata_t with value.  the name is made an atom only when the
+/// variable is new
+void lk::env_t::assign(const lk_string &name, vardata_t *value) {
+    if (replace_var(m_varHash[name], value))
+        m_version++;
+}
+
+void lk::env_t::assign(const atom_t &name, vardata_t *value) {
+    if (replace_var(m_varHash[name], value))
+        m_version++;
 }
 
 void lk::env_t::unassign(const lk_string &name) {
@@ -739,17 +1462,27 @@ void lk::env_t::unassign(const lk_string &name) {
     if (it != m_varHash.end()) {
         delete (*it).second; // delete the associated data
         m_varHash.erase(it);
+        m_version++;
     }
 }
 
 lk::vardata_t *lk::env_t::lookup(const lk_string &name, bool search_hierarchy) {
-    varhash_t::iterator it = m_varHash.find(name);
-    if (it != m_varHash.end())
-        return (*it).second;
-    else if (search_hierarchy && m_parent)
-        return m_parent->lookup(name, true);
-    else
-        return 0;
+    size_t hash = varhash_t::hash_of(name);
+    for (env_t *e = this; e != 0; e = search_hierarchy ? e->m_parent : 0) {
+        varhash_t::iterator it = e->m_varHash.find(name, hash);
+        if (it != e->m_varHash.end())
+            return (*it).second;
+    }
+    return 0;
+}
+
+lk::vardata_t *lk::env_t::lookup(const atom_t &name, bool search_hierarchy) {
+    for (env_t *e = this; e != 0; e = search_hierarchy ? e->m_parent : 0) {
+        varhash_t::iterator it = e->m_varHash.find(name);
+        if (it != e->m_varHash.end())
+            return (*it).second;
+    }
+    return 0;
 }
 
 bool lk::env_t::first(lk_string &key, vardata_t *&value) {
@@ -799,11 +1532,13 @@ unsigned int lk::env_t::size() {
 bool lk::env_t::register_ext_func(lk_invokable f, void *user_data) {
     lk::doc_t d;
     if (lk::doc_t::info(f, d) && !d.func_name.empty()) {
-        fcallinfo_t x;
-        x.f = 0;
-        x.f_ext = f;
-        x.user_data = user_data;
-        m_funcHash[d.func_name] = x;
+        // a function registered again keeps its entry, which FUNCTION values may refer to
+        fcallinfo_t *&x = m_funcHash[d.func_name];
+        if (!x) x = new fcallinfo_t;
+        x->f = 0;
+        x->f_ext = f;
+        x->user_data = user_data;
+        g_funcVersion++;
         return true;
     }
 
@@ -811,24 +1546,39 @@ bool lk::env_t::register_ext_func(lk_invokable f, void *user_data) {
 }
 
 void lk::env_t::unregister_ext_func(lk_invokable f) {
-    for (lk::funchash_t::iterator it = m_funcHash.begin();
-         it != m_funcHash.end();
-         it++) {
-        if ((*it).second.f_ext == f)
-            m_funcHash.erase(it);
+    lk::funchash_t::iterator it = m_funcHash.begin();
+    while (it != m_funcHash.end()) {
+        if ((*it).second->f_ext == f) {
+            delete (*it).second;
+            it = m_funcHash.erase(it);
+            g_funcVersion++;
+        } else
+            ++it;
     }
 }
 
+void lk::env_t::unregister_func(fcall_t f) {
+    lk::funchash_t::iterator it = m_funcHash.begin();
+    while (it != m_funcHash.end()) {
+        if ((*it).second->f == f) {
+            delete (*it).second;
+            it = m_funcHash.erase(it);
+            g_funcVersion++;
+        } else
+            ++it;
+    }
+}
 
 /// doc_t documentation, invoke_t fx arguments, and and invokable
 bool lk::env_t::register_func(fcall_t f, void *user_data) {
     lk::doc_t d;
     if (lk::doc_t::info(f, d) && !d.func_name.empty()) {
-        fcallinfo_t x;
-        x.f = f;
-        x.f_ext = 0;
-        x.user_data = user_data;
-        m_funcHash[d.func_name] = x;
+        fcallinfo_t *&x = m_funcHash[d.func_name];
+        if (!x) x = new fcallinfo_t;
+        x->f = f;
+        x->f_ext = 0;
+        x->user_data = user_data;
+        g_funcVersion++;
         return true;
     }
 
@@ -852,14 +1602,22 @@ bool lk::env_t::register_funcs(fcall_t list[], void *user_data) {
 
 /// looks for function fcallinfo in current & parent environments
 lk::fcallinfo_t *lk::env_t::lookup_func(const lk_string &name) {
-    funchash_t::iterator it = m_funcHash.find(name);
-    if (it != m_funcHash.end()) {
-        return &(*it).second;
-    } else if (m_parent) {
-        return m_parent->lookup_func(name);
-    } else {
-        return 0;
+    size_t hash = funchash_t::hash_of(name);
+    for (env_t *e = this; e != 0; e = e->m_parent) {
+        funchash_t::iterator it = e->m_funcHash.find(name, hash);
+        if (it != e->m_funcHash.end())
+            return (*it).second;
     }
+    return 0;
+}
+
+lk::fcallinfo_t *lk::env_t::lookup_func(const atom_t &name) {
+    for (env_t *e = this; e != 0; e = e->m_parent) {
+        funchash_t::iterator it = e->m_funcHash.find(name);
+        if (it != e->m_funcHash.end())
+            return (*it).second;
+    }
+    return 0;
 }
 
 std::vector<lk_string> lk::env_t::list_funcs() {
@@ -937,11 +1695,15 @@ void lk::env_t::call(const lk_string &name, std::vector<vardata_t> &args, vardat
         if (nargs_given < nargs_expected)
             throw error_t(lk_tr("too few arguments provided in env::call internal method to function: ") + name);
 
-        vardata_t *__args = new vardata_t;
-        __args->empty_vector();
+        vardata_t *__args = 0;
+        if (uses_args(def)) {
+            __args = new vardata_t;
+            __args->empty_vector();
+        }
 
         for (size_t aidx = 0; aidx < args.size(); aidx++) {
-            __args->vec()->push_back(vardata_t(args[aidx]));
+            if (__args)
+                __args->vec()->push_back(vardata_t(args[aidx]));
 
             if (argnames && aidx < argnames->items.size()) {
                 if (iden_t *id = dynamic_cast<iden_t *>(argnames->items[aidx]))
@@ -949,7 +1711,8 @@ void lk::env_t::call(const lk_string &name, std::vector<vardata_t> &args, vardat
             }
         }
 
-        frame.assign("__args", __args);
+        if (__args)
+            frame.assign("__args", __args);
 
         lk::eval ev(block, &frame);
         if (!ev.run())
@@ -966,10 +1729,35 @@ bool lk::env_t::load_library(const lk_string &path) {
 
     dynlib_t x;
     x.path = path;
+    x.functions = 0;
+    x.natives = 0;
     void *pdll = ::dll_open(path.c_str());
     if (!pdll)
         return false;
 
+    // native modules generated by lk::aotgen register their functions directly
+    if (int (*modver)() = (int (*)()) dll_sym(pdll, "lk_module_api_version")) {
+        int ver = modver();
+        if (ver != LK_MODULE_API_VERSION) {
+            dll_close(pdll);
+            throw error_t((const char *) lk_tr("invalid native module version: %d (engine api: %d)\n").c_str(), ver,
+                          LK_MODULE_API_VERSION);
+        }
+
+        fcall_t *(*modfuncs)() = (fcall_t *(*)()) dll_sym(pdll, "lk_module_functions");
+        if (modfuncs == 0) {
+            dll_close(pdll);
+            throw error_t(lk_tr("could not locate symbol") + " 'lk_module_functions'\n");
+        }
+
+        x.handle = pdll;
+        x.natives = modfuncs();
+        global()->register_funcs(x.natives);
+
+        m_dynlibList.push_back(x);
+        return true;
+    }
+
     int (*verfunc)() = (int (*)()) dll_sym(pdll, "lk_extension_api_version");
     if (verfunc == 0) {
         dll_close(pdll);
@@ -1016,10 +1804,18 @@ bool lk::env_t::unload_library(const lk_string &path) {
          it != m_dynlibList.end();
          ++it) {
         if ((*it).path == path) {
-            lk_invokable *list = (*it).functions;
-            while (*list != 0) {
-                global()->unregister_ext_func(*list);
-                list++;
+            if (lk_invokable *list = (*it).functions) {
+                while (*list != 0) {
+                    global()->unregister_ext_func(*list);
+                    list++;
+                }
+            }
+
+            if (fcall_t *list = (*it).natives) {
+                while (*list != 0) {
+                    global()->unregister_func(*list);
+                    list++;
+                }
             }
 
             dll_close((*it).handle);
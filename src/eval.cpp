@@ -35,12 +35,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <limits>
 
 #include <lk/eval.h>
+#include <lk/vecops.h>
 #include <lk/invoke.h>
 
 
 char *replace_char(const char *input, char find, char replace) {
 
-    char *output = (char *) malloc(strlen(input));
+    char *output = (char *) malloc(strlen(input) + 1);
 
     for (size_t i = 0; i < strlen(input); i++) {
         if (input[i] == find) output[i] = replace;
@@ -104,6 +105,17 @@ bool lk::eval::special_get(const lk_string &name, vardata_t &) {
     throw error_t(lk_tr("no defined mechanism to get special variable") + " '" + name + "'");
 }
 
+/// true if the test of a loop or condition is an element-wise comparison, whose mask is not a
+/// truth value
+static bool mask_test(lk::node_t *test, const lk::vardata_t &outcome) {
+    lk::expr_t *e = dynamic_cast<lk::expr_t *>(test);
+    if (!e || outcome.type() != lk::vardata_t::VECTOR)
+        return false;
+
+    return e->oper == lk::expr_t::LT || e->oper == lk::expr_t::LE
+           || e->oper == lk::expr_t::GT || e->oper == lk::expr_t::GE;
+}
+
 static void do_plus_eq(lk::vardata_t &l, lk::vardata_t &r) {
     if (l.deref().type() == lk::vardata_t::STRING)
         l.deref().assign(l.deref().as_string() + r.deref().as_string());
@@ -119,15 +131,24 @@ static void do_plus_eq(lk::vardata_t &l, lk::vardata_t &r) {
 }
 
 static void do_minus_eq(lk::vardata_t &l, lk::vardata_t &r) {
-    l.deref().assign(l.deref().num() - r.deref().num());
+    if (lk::vecops::applies(l.deref(), r.deref()))
+        lk::vecops::binary(lk::vecops::SUB, l.deref(), r.deref(), l.deref());
+    else
+        l.deref().assign(l.deref().num() - r.deref().num());
 }
 
 static void do_mult_eq(lk::vardata_t &l, lk::vardata_t &r) {
-    l.deref().assign(l.deref().num() * r.deref().num());
+    if (lk::vecops::applies(l.deref(), r.deref()))
+        lk::vecops::binary(lk::vecops::MUL, l.deref(), r.deref(), l.deref());
+    else
+        l.deref().assign(l.deref().num() * r.deref().num());
 }
 
 static void do_div_eq(lk::vardata_t &l, lk::vardata_t &r) {
-    l.deref().assign(l.deref().num() / r.deref().num());
+    if (lk::vecops::applies(l.deref(), r.deref()))
+        lk::vecops::binary(lk::vecops::DIV, l.deref(), r.deref(), l.deref());
+    else
+        l.deref().assign(l.deref().num() / r.deref().num());
 }
 
 bool lk::eval::interpret(node_t *root,
@@ -168,6 +189,11 @@ bool lk::eval::interpret(node_t *root,
                 return false;
             }
 
+            if (mask_test(n2->test, outcome)) {
+                m_errors.push_back(make_error(n2->test, (const char *) lk::vecops::mask_test_error().c_str()));
+                return false;
+            }
+
             if (!outcome.as_boolean())
                 break;
 
@@ -200,6 +226,11 @@ bool lk::eval::interpret(node_t *root,
             return false;
         }
 
+        if (mask_test(n3->test, outcome)) {
+            m_errors.push_back(make_error(n3->test, (const char *) lk::vecops::mask_test_error().c_str()));
+            return false;
+        }
+
         if (outcome.as_boolean())
             return interpret(n3->on_true, cur_env, result, flags, ctl_id);
         else
@@ -217,23 +248,33 @@ bool lk::eval::interpret(node_t *root,
                     if (l.deref().type() == vardata_t::STRING
                         || r.deref().type() == vardata_t::STRING) {
                         result.assign(l.deref().as_string() + r.deref().as_string());
-                    } else
+                    } else if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::ADD, l.deref(), r.deref(), result);
+                    else
                         result.assign(l.deref().num() + r.deref().num());
                     return ok;
                 case expr_t::MINUS:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    result.assign(l.deref().num() - r.deref().num());
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::SUB, l.deref(), r.deref(), result);
+                    else
+                        result.assign(l.deref().num() - r.deref().num());
                     return ok;
                 case expr_t::MULT:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    result.assign(l.deref().num() * r.deref().num());
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::MUL, l.deref(), r.deref(), result);
+                    else
+                        result.assign(l.deref().num() * r.deref().num());
                     return ok;
                 case expr_t::DIV:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    if (r.deref().num() == 0)
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::DIV, l.deref(), r.deref(), result);
+                    else if (r.deref().num() == 0)
                         result.assign(std::numeric_limits<double>::quiet_NaN());
                     else
                         result.assign(l.deref().num() / r.deref().num());
@@ -342,31 +383,49 @@ bool lk::eval::interpret(node_t *root,
                 case expr_t::LT:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    result.assign(l.deref().lessthan(r.deref()) ? 1 : 0);
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::LT, l.deref(), r.deref(), result);
+                    else
+                        result.assign(l.deref().lessthan(r.deref()) ? 1 : 0);
                     return ok;
                 case expr_t::LE:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    result.assign(l.deref().lessthan(r.deref()) || l.deref().equals(r.deref()) ? 1 : 0);
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::LE, l.deref(), r.deref(), result);
+                    else
+                        result.assign(l.deref().lessthan(r.deref()) || l.deref().equals(r.deref()) ? 1 : 0);
                     return ok;
                 case expr_t::GT:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    result.assign(!l.deref().lessthan(r.deref()) && !l.deref().equals(r.deref()) ? 1 : 0);
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::GT, l.deref(), r.deref(), result);
+                    else
+                        result.assign(!l.deref().lessthan(r.deref()) && !l.deref().equals(r.deref()) ? 1 : 0);
                     return ok;
                 case expr_t::GE:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    result.assign(!l.deref().lessthan(r.deref()) ? 1 : 0);
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::GE, l.deref(), r.deref(), result);
+                    else
+                        result.assign(!l.deref().lessthan(r.deref()) ? 1 : 0);
                     return ok;
                 case expr_t::EXP:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
                     ok = ok && interpret(n4->right, cur_env, r, flags, ctl_id);
-                    result.assign(pow(l.deref().num(), r.deref().num()));
+                    if (vecops::applies(l.deref(), r.deref()))
+                        vecops::binary(vecops::EXP, l.deref(), r.deref(), result);
+                    else
+                        result.assign(pow(l.deref().num(), r.deref().num()));
                     return ok;
                 case expr_t::NEG:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
-                    result.assign(0 - l.deref().num());
+                    if (l.deref().type() == vardata_t::VECTOR)
+                        vecops::negate(l.deref(), result);
+                    else
+                        result.assign(0 - l.deref().num());
                     return ok;
                 case expr_t::WHEREAT:
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
@@ -437,15 +496,14 @@ bool lk::eval::interpret(node_t *root,
                     ok = ok && interpret(n4->right, cur_env, r, 0, ctl_id);
                     vardata_t &val = r.deref();
 
-                    vardata_t *x = hash.lookup(val.as_string());
+                    vardata_t *x = hash.lookup(val);
                     if (x) {
                         if (anonymous)
                             result.copy(*x);
                         else
                             result.assign(x);
                     } else if ((flags & ENV_MUTABLE)) {
-                        hash.assign(val.as_string(), x = new vardata_t);
-                        result.assign(x);
+                        result.assign(hash.lookup(val, true));
                     } else
                         result.nullify();
 
@@ -474,7 +532,9 @@ bool lk::eval::interpret(node_t *root,
                                     lk::vardata_t &argval = cxt.arg_list()[iarg];
                                     if (!interpret(argvals->items[iarg], cur_env, argval, flags, c)) {
                                         lk_string err;
-                                        err << "[" << argvals->line() << "]:failed to evaluate function call argument number " << iarg  << ", value = " << dynamic_cast<iden_t*>(argvals->items[iarg])->name;
+                                        err << "[" << argvals->line() << "]:failed to evaluate function call argument number " << iarg;
+                                        if (iden_t *argname = dynamic_cast<iden_t *>(argvals->items[iarg]))
+                                            err << ", value = " << argname->name;
                                         m_errors.push_back(err +"\n");
 //                                        make_error(argvals, (const char*)lk_string(lk_tr("failed to evaluate function call argument %d to '%s()'\n")).c_str(), (int)iarg));
                                         return false;
@@ -560,8 +620,12 @@ bool lk::eval::interpret(node_t *root,
                         frame.assign("this", new vardata_t(thisobj));
                     }
 
-                    vardata_t *__args = new vardata_t;
-                    __args->empty_vector();
+                    // only build '__args' for functions that use it
+                    vardata_t *__args = 0;
+                    if (uses_args(define)) {
+                        __args = new vardata_t;
+                        __args->empty_vector();
+                    }
 
                     if (argvals) {
                         for (size_t argindex = 0;
@@ -581,11 +645,13 @@ bool lk::eval::interpret(node_t *root,
                                 ((id = dynamic_cast<iden_t *>(argnames->items[argindex])) != 0))
                                 frame.assign(id->name, new vardata_t(v));
 
-                            __args->vec()->push_back(vardata_t(v));
+                            if (__args)
+                                __args->vec()->push_back(vardata_t(v));
                         }
                     }
 
-                    frame.assign("__args", __args);
+                    if (__args)
+                        frame.assign("__args", __args);
 
                     // now evaluate the function block in the new environment
                     if (!interpret(block, &frame, result, flags, ctl_id)) {
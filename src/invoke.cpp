@@ -198,11 +198,7 @@ void _CC_set_number(struct __lk_invoke_t *, lk_var_t vv, double val) {
 
 void _CC_set_number_vec(struct __lk_invoke_t *, lk_var_t vv, double *arr, int len) {
     if (vv != 0 && arr != 0 && len > 0) {
-        lk::vardata_t &v = *((lk::vardata_t *) vv);
-        v.empty_vector();
-        v.vec()->reserve(len);
-        for (int i = 0; i < len; i++)
-            v.vec_append(arr[i]);
+        ((lk::vardata_t *) vv)->assign(arr, (size_t) len);
     }
 }
 
@@ -0,0 +1,1143 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+
+#include <lk/jit.h>
+#include <lk/stdlib.h>
+
+#if !defined(LK_NO_JIT) && !defined(LK_NANBOX) && defined(__x86_64__) && defined(__linux__)
+#define LK_JIT_X64 1
+#include <sys/mman.h>
+#endif
+
+namespace lk {
+
+    jit::jit() {
+    }
+
+    jit::~jit() {
+        reset(0);
+    }
+
+    bool jit::available() {
+#ifdef LK_JIT_X64
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void jit::release(region *r) {
+#ifdef LK_JIT_X64
+        if (r->code)
+            munmap((void *) r->code, r->size);
+#endif
+        delete r;
+    }
+
+    void jit::reset(size_t program_size) {
+        for (size_t i = 0; i < m_regions.size(); i++)
+            if (m_regions[i])
+                release(m_regions[i]);
+
+        m_regions.assign(program_size, 0);
+        m_hits.assign(program_size, 0);
+    }
+
+    jit::region *jit::lookup(size_t ip, bool &compile) {
+        compile = false;
+        if (ip >= m_hits.size() || m_hits[ip] == COLD)
+            return 0;
+
+        if (m_regions[ip])
+            return m_regions[ip];
+
+        compile = (++m_hits[ip] >= HOT);
+        return 0;
+    }
+
+    void jit::discard(region *r, bool retry) {
+        size_t ip = r->start;
+        m_regions[ip] = 0;
+        m_hits[ip] = retry ? 0 : COLD;
+        release(r);
+    }
+
+#ifndef LK_JIT_X64
+
+    jit::region *jit::compile(const bytecode &, size_t start, size_t, const std::vector<fcallinfo_t *> &) {
+        if (start < m_hits.size())
+            m_hits[start] = COLD;
+        return 0;
+    }
+
+#else
+
+/// math library functions that the native code calls directly, matched by address so that
+/// a host function registered under the same name is still called through the vm
+    static double jit_mod(double x, double y) { return (double) (((int) x) % ((int) y)); }
+
+    static double jit_abs(double x) { return std::abs(x); }
+
+    static double jit_sqrt(double x) { return ::sqrt(x); }
+
+    static double jit_floor(double x) { return ::floor(x); }
+
+    static double jit_ceil(double x) { return ::ceil(x); }
+
+    static double jit_round(double x) { return ::round(x); }
+
+    static double jit_exp(double x) { return ::exp(x); }
+
+    static double jit_log(double x) { return ::log(x); }
+
+    static double jit_log10(double x) { return ::log10(x); }
+
+    static double jit_sin(double x) { return ::sin(x); }
+
+    static double jit_cos(double x) { return ::cos(x); }
+
+    static double jit_tan(double x) { return ::tan(x); }
+
+    static double jit_pow(double x, double y) { return ::pow(x, y); }
+
+    struct intrinsic {
+        const char *name;
+        size_t nargs;
+        void *f; ///< double(*)(double) or double(*)(double,double)
+        fcall_t lib; ///< library function of that name
+    };
+
+    static intrinsic *intrinsics() {
+        static intrinsic list[] = {
+                {"mod",   2, (void *) jit_mod,   0},
+                {"abs",   1, (void *) jit_abs,   0},
+                {"sqrt",  1, (void *) jit_sqrt,  0},
+                {"floor", 1, (void *) jit_floor, 0},
+                {"ceil",  1, (void *) jit_ceil,  0},
+                {"round", 1, (void *) jit_round, 0},
+                {"exp",   1, (void *) jit_exp,   0},
+                {"log",   1, (void *) jit_log,   0},
+                {"log10", 1, (void *) jit_log10, 0},
+                {"sin",   1, (void *) jit_sin,   0},
+                {"cos",   1, (void *) jit_cos,   0},
+                {"tan",   1, (void *) jit_tan,   0},
+                {"pow",   2, (void *) jit_pow,   0},
+                {0,       0, 0,                  0}};
+
+        static bool matched = false;
+        if (!matched) {
+            for (fcall_t *f = stdlib_math(); *f != 0; f++) {
+                doc_t d;
+                if (!doc_t::info(*f, d))
+                    continue;
+                for (intrinsic *in = list; in->name != 0; in++)
+                    if (d.func_name == in->name)
+                        in->lib = *f;
+            }
+            matched = true;
+        }
+
+        return list;
+    }
+
+/// the few x86-64 instructions needed by the compiler, with rel32 jumps to labels
+    class x64asm {
+    public:
+        enum {
+            RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R12 = 12, R13 = 13
+        };
+        /// condition codes
+        enum {
+            CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5, CC_BE = 6, CC_A = 7, CC_P = 0xA, CC_NP = 0xB
+        };
+
+        std::vector<unsigned char> code;
+
+        int label() {
+            m_labels.push_back(-1);
+            return (int) m_labels.size() - 1;
+        }
+
+        void bind(int L) { m_labels[L] = (int) code.size(); }
+
+        bool bound(int L) const { return m_labels[L] >= 0; }
+
+        /// resolves the jumps, false if a label was never bound
+        bool link() {
+            for (size_t i = 0; i < m_fixups.size(); i++) {
+                int target = m_labels[m_fixups[i].second];
+                if (target < 0)
+                    return false;
+                int rel = target - (int) (m_fixups[i].first + 4);
+                memcpy(&code[m_fixups[i].first], &rel, 4);
+            }
+            return true;
+        }
+
+        void byte(unsigned int c) { code.push_back((unsigned char) c); }
+
+        void imm32(unsigned int v) {
+            for (int i = 0; i < 4; i++)
+                byte((v >> (8 * i)) & 0xFF);
+        }
+
+        void imm64(unsigned long long v) {
+            for (int i = 0; i < 8; i++)
+                byte((unsigned int) ((v >> (8 * i)) & 0xFF));
+        }
+
+        void jmp(int L) {
+            byte(0xE9);
+            rel(L);
+        }
+
+        void jcc(int cc, int L) {
+            byte(0x0F);
+            byte(0x80 | cc);
+            rel(L);
+        }
+
+        void push(int r) {
+            if (r & 8) byte(0x41);
+            byte(0x50 | (r & 7));
+        }
+
+        void pop(int r) {
+            if (r & 8) byte(0x41);
+            byte(0x58 | (r & 7));
+        }
+
+        void ret() { byte(0xC3); }
+
+        /// mov dst, src for 64 bit registers
+        void mov(int dst, int src) {
+            rex(true, src, dst);
+            byte(0x89);
+            byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+        }
+
+        /// mov r, qword [base + disp]
+        void load(int r, int base, int disp) {
+            rex(true, r, base);
+            byte(0x8B);
+            mem(r, base, disp);
+        }
+
+        void mov_imm64(int r, unsigned long long v) {
+            rex(true, 0, r);
+            byte(0xB8 | (r & 7));
+            imm64(v);
+        }
+
+        void mov_imm32(int r, unsigned int v) {
+            rex(false, 0, r);
+            byte(0xB8 | (r & 7));
+            imm32(v);
+        }
+
+        /// movzx r32, byte [base + disp]
+        void load_byte(int r, int base, int disp) {
+            rex(false, r, base);
+            byte(0x0F);
+            byte(0xB6);
+            mem(r, base, disp);
+        }
+
+        /// and/or/cmp r32, imm8 (sign extended)
+        void and_imm(int r, int v) { alu_imm(4, r, v); }
+
+        void cmp_imm(int r, int v) { alu_imm(7, r, v); }
+
+        /// test r32, imm32
+        void test_imm(int r, unsigned int v) {
+            rex(false, 0, r);
+            byte(0xF7);
+            byte(0xC0 | (r & 7));
+            imm32(v);
+        }
+
+        /// test r32, r32
+        void test(int a, int b) {
+            rex(false, b, a);
+            byte(0x85);
+            byte(0xC0 | ((b & 7) << 3) | (a & 7));
+        }
+
+        /// and/or byte [base + disp], imm8
+        void and_byte(int base, int disp, unsigned int v) { byte_imm(4, base, disp, v); }
+
+        void or_byte(int base, int disp, unsigned int v) { byte_imm(1, base, disp, v); }
+
+        void dec(int r) {
+            rex(true, 0, r);
+            byte(0xFF);
+            byte(0xC8 | (r & 7));
+        }
+
+        void call(int r) {
+            rex(false, 0, r);
+            byte(0xFF);
+            byte(0xD0 | (r & 7));
+        }
+
+        /// movsd x, qword [base + disp] and back
+        void movsd_load(int x, int base, int disp) { sse_mem(0xF2, 0x10, x, base, disp); }
+
+        void movsd_store(int x, int base, int disp) { sse_mem(0xF2, 0x11, x, base, disp); }
+
+        void movsd(int dst, int src) { if (dst != src) sse(0xF2, 0x10, dst, src); }
+
+        void addsd(int dst, int src) { sse(0xF2, 0x58, dst, src); }
+
+        void mulsd(int dst, int src) { sse(0xF2, 0x59, dst, src); }
+
+        void subsd(int dst, int src) { sse(0xF2, 0x5C, dst, src); }
+
+        void divsd(int dst, int src) { sse(0xF2, 0x5E, dst, src); }
+
+        void ucomisd(int a, int b) { sse(0x66, 0x2E, a, b); }
+
+        void xorpd(int dst, int src) { sse(0x66, 0x57, dst, src); }
+
+        /// cvttsd2si r32, x
+        void cvttsd2si(int r, int x) { sse(0xF2, 0x2C, r, x); }
+
+        /// movq x, r64
+        void movq(int x, int r) {
+            byte(0x66);
+            rex(true, x, r);
+            byte(0x0F);
+            byte(0x6E);
+            byte(0xC0 | ((x & 7) << 3) | (r & 7));
+        }
+
+    private:
+        std::vector<int> m_labels;
+        std::vector<std::pair<size_t, int> > m_fixups;
+
+        void rel(int L) {
+            m_fixups.push_back(std::make_pair(code.size(), L));
+            imm32(0);
+        }
+
+        void rex(bool w, int r, int b) {
+            unsigned int v = 0x40 | (w ? 8 : 0) | ((r & 8) ? 4 : 0) | ((b & 8) ? 1 : 0);
+            if (v != 0x40) byte(v);
+        }
+
+        void mem(int r, int base, int disp) {
+            byte(0x80 | ((r & 7) << 3) | (base & 7));
+            if ((base & 7) == RSP) byte(0x24);
+            imm32((unsigned int) disp);
+        }
+
+        void sse(unsigned int prefix, unsigned int op, int dst, int src) {
+            byte(prefix);
+            rex(false, dst, src);
+            byte(0x0F);
+            byte(op);
+            byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+        }
+
+        void sse_mem(unsigned int prefix, unsigned int op, int x, int base, int disp) {
+            byte(prefix);
+            rex(false, x, base);
+            byte(0x0F);
+            byte(op);
+            mem(x, base, disp);
+        }
+
+        void alu_imm(int ext, int r, int v) {
+            rex(false, 0, r);
+            byte(0x83);
+            byte(0xC0 | (ext << 3) | (r & 7));
+            byte((unsigned int) v & 0xFF);
+        }
+
+        void byte_imm(int ext, int base, int disp, unsigned int v) {
+            rex(false, 0, base);
+            byte(0x80);
+            mem(ext, base, disp);
+            byte(v);
+        }
+    };
+
+/** Translates a region of stack bytecode.
+* \class jitcompiler
+*
+* The vm stack is followed at compile time: value i of the stack, counted from the entry of
+* the region, lives in register xmm2+i once computed, while references and constants are only
+* loaded when an instruction uses them.  Registers xmm0 and xmm1 are scratch, rbx holds the
+* variables, r13 the exit buffer and r12 the number of backward jumps left before the host is
+* polled.
+*/
+    class jitcompiler {
+    public:
+        jitcompiler(const bytecode &bc, size_t start, size_t end, const std::vector<fcallinfo_t *> &funcs,
+                    jit::region &r)
+                : m_bc(bc), m_start(start), m_end(end), m_funcs(funcs), m_r(r), m_ip(start), m_deopt(-1),
+                  m_ok(true) {
+        }
+
+        bool compile();
+
+        const std::vector<unsigned char> &code() const { return m_a.code; }
+
+    private:
+        typedef std::vector<jit::item> state;
+
+        const bytecode &m_bc;
+        size_t m_start, m_end;
+        const std::vector<fcallinfo_t *> &m_funcs;
+        jit::region &m_r;
+        x64asm m_a;
+
+        state m_st; ///< stack values from the entry of the region
+        state m_pre; ///< stack at the start of the current instruction
+        size_t m_ip;
+        int m_deopt; ///< exit of the current instruction on a failed check, or -1
+        bool m_ok;
+        int m_epilogue;
+
+        std::map<size_t, int> m_labels; ///< instruction address to asm label
+        std::map<size_t, state> m_states; ///< stack where jumps meet
+        std::map<std::pair<int, size_t>, size_t> m_vars;
+        std::vector<std::pair<int, size_t> > m_stubs; ///< exit label and exit index
+        /// backward jumps: label, target, exit on poll
+        struct backjump {
+            int label;
+            size_t target;
+            int poll;
+        };
+        std::vector<backjump> m_backjumps;
+
+        enum {
+            X0 = 0, X1 = 1
+        };
+
+        static int reg(size_t i) { return 2 + (int) i; }
+
+        bool fail() { return m_ok = false; }
+
+        Opcode opcode(size_t ip) const { return (Opcode) (unsigned char) m_bc.program[ip]; }
+
+        size_t argument(size_t ip) const { return m_bc.program[ip] >> 8; }
+
+        bool inside(size_t ip) const { return ip >= m_start && ip < m_end; }
+
+        int label(size_t ip) {
+            std::map<size_t, int>::iterator it = m_labels.find(ip);
+            if (it != m_labels.end())
+                return it->second;
+            int L = m_a.label();
+            m_labels[ip] = L;
+            return L;
+        }
+
+        size_t variable(jit::var::Kind kind, size_t arg) {
+            std::pair<int, size_t> key((int) kind, arg);
+            std::map<std::pair<int, size_t>, size_t>::iterator it = m_vars.find(key);
+            if (it != m_vars.end())
+                return it->second;
+
+            jit::var v;
+            v.kind = kind;
+            v.arg = arg;
+            m_r.vars.push_back(v);
+            return m_vars[key] = m_r.vars.size() - 1;
+        }
+
+        /// label of a new exit to ip with the given stack
+        int exit_to(size_t ip, const state &st, bool deopt) {
+            jit::exit x;
+            x.ip = ip;
+            x.deopt = deopt;
+            x.stack = st;
+            for (size_t i = 0; i < x.stack.size(); i++)
+                if (x.stack[i].kind == jit::item::NUMBER)
+                    x.stack[i].index = i;
+            m_r.exits.push_back(x);
+
+            int L = m_a.label();
+            m_stubs.push_back(std::make_pair(L, m_r.exits.size() - 1));
+            return L;
+        }
+
+        /// exit taken when a check of the current instruction fails
+        int deopt() {
+            if (m_deopt < 0)
+                m_deopt = exit_to(m_ip, m_pre, true);
+            return m_deopt;
+        }
+
+        void load_const(int x, double d) {
+            unsigned long long bits;
+            memcpy(&bits, &d, sizeof(bits));
+            if (bits == 0)
+                m_a.xorpd(x, x);
+            else {
+                m_a.mov_imm64(x64asm::RAX, bits);
+                m_a.movq(x, x64asm::RAX);
+            }
+        }
+
+        /// loads variable v into x, exiting if it is not a number.  leaves the variable in rax
+        void load_var(int x, size_t v) {
+            m_a.load(x64asm::RAX, x64asm::RBX, (int) (v * sizeof(void *)));
+            m_a.load_byte(x64asm::RCX, x64asm::RAX, (int) vardata_t::type_offset());
+            m_a.and_imm(x64asm::RCX, vardata_t::TYPEMASK);
+            m_a.cmp_imm(x64asm::RCX, vardata_t::NUMBER);
+            m_a.jcc(x64asm::CC_NE, deopt());
+            m_a.movsd_load(x, x64asm::RAX, (int) vardata_t::number_offset());
+        }
+
+        /// stores x into variable v as vardata_t::assign would, exiting if the variable is
+        /// constant or holds something other than a number or null.  'number' if the
+        /// variable was just read by load_var
+        void store_var(int x, size_t v, bool number) {
+            int toff = (int) vardata_t::type_offset();
+            m_a.load(x64asm::RAX, x64asm::RBX, (int) (v * sizeof(void *)));
+            m_a.load_byte(x64asm::RCX, x64asm::RAX, toff);
+            m_a.test_imm(x64asm::RCX, vardata_t::flag_bit(vardata_t::CONSTVAL));
+            m_a.jcc(x64asm::CC_NE, deopt());
+            if (!number) {
+                int ok = m_a.label();
+                m_a.and_imm(x64asm::RCX, vardata_t::TYPEMASK);
+                m_a.cmp_imm(x64asm::RCX, vardata_t::NUMBER);
+                m_a.jcc(x64asm::CC_E, ok);
+                m_a.cmp_imm(x64asm::RCX, vardata_t::NULLVAL);
+                m_a.jcc(x64asm::CC_NE, deopt());
+                m_a.bind(ok);
+                m_a.and_byte(x64asm::RAX, toff, vardata_t::FLAGMASK);
+                m_a.or_byte(x64asm::RAX, toff, vardata_t::NUMBER);
+            }
+            m_a.or_byte(x64asm::RAX, toff, vardata_t::flag_bit(vardata_t::ASSIGNED));
+            m_a.movsd_store(x, x64asm::RAX, (int) vardata_t::number_offset());
+        }
+
+        /// computes stack value i into its register
+        bool value(size_t i) {
+            jit::item &it = m_st[i];
+            switch (it.kind) {
+                case jit::item::NUMBER:
+                    return true;
+                case jit::item::REF:
+                    load_var(reg(i), it.index);
+                    break;
+                case jit::item::CONST:
+                    load_const(reg(i), m_bc.constants[it.index].num());
+                    break;
+                default:
+                    return fail();
+            }
+            it.kind = jit::item::NUMBER;
+            return true;
+        }
+
+        /// computes every value left on the stack, the state in which jumps meet
+        bool normalize() {
+            for (size_t i = 0; i < m_st.size(); i++)
+                if ((m_st[i].kind == jit::item::REF || m_st[i].kind == jit::item::CONST) && !value(i))
+                    return false;
+            return true;
+        }
+
+        static bool same(const state &a, const state &b) {
+            if (a.size() != b.size())
+                return false;
+            for (size_t i = 0; i < a.size(); i++)
+                if (a[i].kind != b[i].kind || (a[i].kind == jit::item::FUNC && a[i].index != b[i].index))
+                    return false;
+            return true;
+        }
+
+        /// records or checks the stack at a jump target inside the region
+        bool meet(size_t target) {
+            std::map<size_t, state>::iterator it = m_states.find(target);
+            if (it == m_states.end()) {
+                if (target <= m_ip)
+                    return fail(); // backward jump to code that was not reachable
+                m_states[target] = m_st;
+                return true;
+            }
+            return same(it->second, m_st) || fail();
+        }
+
+        /// jumps to target on condition cc, or always if cc is negative.  the stack must be
+        /// normalized if the target is inside the region
+        void jump(int cc, size_t target) {
+            int L;
+            if (!inside(target))
+                L = exit_to(target, m_st, false);
+            else {
+                if (!meet(target))
+                    return;
+                if (target <= m_ip) {
+                    // poll the host every so many backward jumps
+                    backjump b;
+                    b.label = m_a.label();
+                    b.target = target;
+                    b.poll = exit_to(m_ip, m_pre, false);
+                    m_backjumps.push_back(b);
+                    L = b.label;
+                } else
+                    L = label(target);
+            }
+
+            if (cc < 0)
+                m_a.jmp(L);
+            else
+                m_a.jcc(cc, L);
+        }
+
+        /// compares a and b and jumps to target if 'cmp' is 'want', with the semantics of
+        /// vardata_t::lessthan and equals on numbers.  either target or label L is used
+        void compare_jump(Opcode cmp, bool want, int a, int b, size_t target, int L) {
+            bool eq = (cmp == EQ || cmp == NE);
+            if (cmp == NE) {
+                cmp = EQ;
+                want = !want;
+            }
+
+            if (eq) {
+                m_a.ucomisd(a, b);
+                if (want) {
+                    // equal and ordered
+                    int skip = m_a.label();
+                    m_a.jcc(x64asm::CC_P, skip);
+                    branch(x64asm::CC_E, target, L);
+                    m_a.bind(skip);
+                } else {
+                    branch(x64asm::CC_P, target, L);
+                    branch(x64asm::CC_NE, target, L);
+                }
+                return;
+            }
+
+            // compare b with a: 'above' is a < b, unordered sets the carry
+            m_a.ucomisd(b, a);
+            int cc;
+            switch (cmp) {
+                case LT: cc = x64asm::CC_A; break;
+                case LE: cc = x64asm::CC_AE; break;
+                case GT: cc = x64asm::CC_B; break; // !(a <= b)
+                default: cc = x64asm::CC_BE; break; // GE: !(a < b)
+            }
+            branch(want ? cc : (cc ^ 1), target, L);
+        }
+
+        void branch(int cc, size_t target, int L) {
+            if (L >= 0)
+                m_a.jcc(cc, L);
+            else
+                jump(cc, target);
+        }
+
+        /// sets x to 1 or 0 from the flags tested by a jump to 'no'
+        void boolean(int x, int no) {
+            int done = m_a.label();
+            load_const(x, 1.0);
+            m_a.jmp(done);
+            m_a.bind(no);
+            m_a.xorpd(x, x);
+            m_a.bind(done);
+        }
+
+        /// calls a C function of one or two numbers with the stack below 'keep' preserved
+        void call(void *f, size_t keep) {
+            for (size_t i = 0; i < keep; i++)
+                if (m_st[i].kind == jit::item::NUMBER)
+                    m_a.movsd_store(reg(i), x64asm::R13, (int) (i * sizeof(double)));
+
+            m_a.mov_imm64(x64asm::RAX, (unsigned long long) f);
+            m_a.call(x64asm::RAX);
+
+            for (size_t i = 0; i < keep; i++)
+                if (m_st[i].kind == jit::item::NUMBER)
+                    m_a.movsd_load(reg(i), x64asm::R13, (int) (i * sizeof(double)));
+        }
+
+        void push(jit::item::Kind kind, size_t index, fcallinfo_t *fci = 0) {
+            jit::item it;
+            it.kind = kind;
+            it.index = index;
+            it.fci = fci;
+            m_st.push_back(it);
+        }
+
+        bool instruction(Opcode op, size_t arg, bool &reachable);
+    };
+
+    bool jitcompiler::compile() {
+        std::vector<size_t> targets;
+        for (size_t ip = m_start; ip < m_end; ip++) {
+            switch (opcode(ip)) {
+                case J: case JF: case JT: case JTK: case JFK:
+                case LTJF: case GTJF: case LEJF: case GEJF: case NEJF: case EQJF:
+                    if (inside(argument(ip)))
+                        label(argument(ip));
+                    break;
+                case FORPREP: case FORLOOP:
+                    // the loop runs on past the J that follows
+                    if (inside(ip + 2))
+                        label(ip + 2);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        m_epilogue = m_a.label();
+
+        // size_t code(vardata_t **vars, double *buf, size_t polls)
+        m_a.push(x64asm::RBX);
+        m_a.push(x64asm::R12);
+        m_a.push(x64asm::R13);
+        m_a.mov(x64asm::RBX, x64asm::RDI);
+        m_a.mov(x64asm::R13, x64asm::RSI);
+        m_a.mov(x64asm::R12, x64asm::RDX);
+
+        m_states[m_start] = state();
+        bool reachable = true;
+        for (m_ip = m_start; m_ip < m_end && m_ok; m_ip++) {
+            if (m_labels.find(m_ip) != m_labels.end()) {
+                if (reachable) {
+                    if (!normalize())
+                        break;
+                    std::map<size_t, state>::iterator it = m_states.find(m_ip);
+                    if (it == m_states.end())
+                        m_states[m_ip] = m_st;
+                    else if (!same(it->second, m_st))
+                        return false;
+                } else {
+                    std::map<size_t, state>::iterator it = m_states.find(m_ip);
+                    if (it != m_states.end()) {
+                        m_st = it->second;
+                        reachable = true;
+                    }
+                }
+                m_a.bind(label(m_ip));
+            }
+
+            if (!reachable)
+                continue;
+
+            m_pre = m_st;
+            m_deopt = -1;
+            if (!instruction(opcode(m_ip), argument(m_ip), reachable))
+                return false;
+            if (m_st.size() > jit::MAX_DEPTH)
+                return false;
+        }
+
+        if (!m_ok)
+            return false;
+
+        // falling off the end of the region resumes after it
+        if (reachable)
+            m_a.jmp(exit_to(m_end, m_st, false));
+
+        for (size_t i = 0; i < m_backjumps.size(); i++) {
+            m_a.bind(m_backjumps[i].label);
+            m_a.dec(x64asm::R12);
+            m_a.jcc(x64asm::CC_E, m_backjumps[i].poll);
+            m_a.jmp(label(m_backjumps[i].target));
+        }
+
+        for (size_t i = 0; i < m_stubs.size(); i++) {
+            m_a.bind(m_stubs[i].first);
+            const jit::exit &x = m_r.exits[m_stubs[i].second];
+            for (size_t k = 0; k < x.stack.size(); k++)
+                if (x.stack[k].kind == jit::item::NUMBER)
+                    m_a.movsd_store(reg(k), x64asm::R13, (int) (k * sizeof(double)));
+            m_a.mov_imm32(x64asm::RAX, (unsigned int) m_stubs[i].second);
+            m_a.jmp(m_epilogue);
+        }
+
+        m_a.bind(m_epilogue);
+        m_a.pop(x64asm::R13);
+        m_a.pop(x64asm::R12);
+        m_a.pop(x64asm::RBX);
+        m_a.ret();
+
+        return m_a.link() && m_ok;
+    }
+
+    bool jitcompiler::instruction(Opcode op, size_t arg, bool &reachable) {
+        size_t n = m_st.size();
+        switch (op) {
+            case PSH:
+                if (arg >= m_bc.constants.size() || m_bc.constants[arg].type() != vardata_t::NUMBER)
+                    return false;
+                push(jit::item::CONST, arg);
+                break;
+
+            case NUL:
+                push(jit::item::NUL, 0);
+                break;
+
+            case POP:
+                if (n < 1) return false;
+                m_st.pop_back();
+                break;
+
+            case DUP:
+                if (n < 1) return false;
+                m_st.push_back(m_st[n - 1]);
+                if (m_st[n].kind == jit::item::NUMBER)
+                    m_a.movsd(reg(n), reg(n - 1));
+                break;
+
+            case PICK:
+                if (n < arg + 1) return false;
+                m_st.push_back(m_st[n - 1 - arg]);
+                if (m_st[n].kind == jit::item::NUMBER)
+                    m_a.movsd(reg(n), reg(n - 1 - arg));
+                break;
+
+            case DROP:
+                // the result of an inlined function is a value, as after RET
+                if (n < arg + 1 || (m_st[n - 1].kind == jit::item::REF && !value(n - 1)))
+                    return false;
+                if (m_st[n - 1].kind != jit::item::NUMBER && m_st[n - 1].kind != jit::item::CONST)
+                    return false;
+                if (arg > 0) {
+                    if (m_st[n - 1].kind == jit::item::NUMBER)
+                        m_a.movsd(reg(n - 1 - arg), reg(n - 1));
+                    m_st[n - 1 - arg] = m_st[n - 1];
+                    m_st.resize(n - arg);
+                }
+                break;
+
+            case RLOC:
+            case LLOC:
+                push(jit::item::REF, variable(jit::var::SLOT, arg >> 16));
+                break;
+
+            case RREF:
+            case LREF:
+                if (arg >= m_funcs.size())
+                    return false;
+                if (fcallinfo_t *fci = m_funcs[arg]) {
+                    // only calls to the math functions above are compiled
+                    if (fci->f == 0)
+                        return false;
+                    intrinsic *in = intrinsics();
+                    size_t i = 0;
+                    while (in[i].name != 0 && in[i].lib != fci->f)
+                        i++;
+                    if (in[i].name == 0)
+                        return false;
+                    push(jit::item::FUNC, i, fci);
+                } else
+                    push(jit::item::REF, variable(op == RREF ? jit::var::NAME : jit::var::LNAME, arg));
+                break;
+
+            case INCL:
+            case DECL: {
+                size_t v = variable(jit::var::SLOT, arg >> 16);
+                load_var(X0, v);
+                load_const(X1, 1.0);
+                if (op == INCL) m_a.addsd(X0, X1);
+                else m_a.subsd(X0, X1);
+                store_var(X0, v, true);
+            }
+                break;
+
+            case FORPREP:
+            case FORLOOP: {
+                if (n < 1 || !value(n - 1)) return false;
+                size_t test = arg >> 22, v = variable(jit::var::SLOT, (arg >> 16) & FOR_SLOT_MAX);
+                load_var(X0, v);
+                if (op == FORLOOP) {
+                    load_const(X1, 1.0);
+                    if (test < FOR_GT) m_a.addsd(X0, X1);
+                    else m_a.subsd(X0, X1);
+                    store_var(X0, v, true);
+                }
+                int limit = reg(n - 1);
+                m_st.pop_back();
+                if (inside(m_ip + 2) && !normalize())
+                    return false;
+                static const Opcode cmp[] = {LT, LE, GT, GE};
+                compare_jump(cmp[test], op == FORPREP, X0, limit, m_ip + 2, -1);
+            }
+                break;
+
+            case INC:
+            case DEC: {
+                if (n < 1 || m_st[n - 1].kind != jit::item::REF) return false;
+                size_t v = m_st[n - 1].index;
+                load_var(X0, v);
+                load_const(X1, 1.0);
+                if (op == INC) m_a.addsd(X0, X1);
+                else m_a.subsd(X0, X1);
+                store_var(X0, v, true);
+            }
+                break;
+
+            case WR:
+            case WRP: {
+                if (n < 2 || m_st[n - 1].kind != jit::item::REF) return false;
+                size_t v = m_st[n - 1].index;
+                if (!value(n - 2)) return false;
+                store_var(reg(n - 2), v, false);
+                m_st.pop_back();
+                if (op == WRP)
+                    m_st.pop_back();
+                else {
+                    // WR leaves a reference to the assigned variable
+                    m_st[n - 2].kind = jit::item::REF;
+                    m_st[n - 2].index = v;
+                }
+            }
+                break;
+
+            case ADDWR: {
+                // anything but a number variable, such as an array appended to, is left to the vm
+                if (n < 2 || m_st[n - 1].kind != jit::item::REF) return false;
+                size_t v = m_st[n - 1].index;
+                if (!value(n - 2)) return false;
+                load_var(X0, v);
+                m_a.addsd(X0, reg(n - 2));
+                store_var(X0, v, true);
+                m_st.pop_back();
+                m_st[n - 2].kind = jit::item::REF;
+                m_st[n - 2].index = v;
+            }
+                break;
+
+            case ADD: case SUB: case MUL: case DIV: case EXP:
+            case LT: case GT: case LE: case GE: case NE: case EQ:
+            case OR: case AND: {
+                if (n < 2 || !value(n - 2) || !value(n - 1)) return false;
+                int a = reg(n - 2), b = reg(n - 1);
+                switch (op) {
+                    case ADD: m_a.addsd(a, b); break;
+                    case SUB: m_a.subsd(a, b); break;
+                    case MUL: m_a.mulsd(a, b); break;
+                    case DIV: {
+                        // division by zero gives NaN, as in the interpreter
+                        int div = m_a.label(), done = m_a.label();
+                        m_a.xorpd(X0, X0);
+                        m_a.ucomisd(b, X0);
+                        m_a.jcc(x64asm::CC_P, div);
+                        m_a.jcc(x64asm::CC_NE, div);
+                        load_const(a, std::numeric_limits<double>::quiet_NaN());
+                        m_a.jmp(done);
+                        m_a.bind(div);
+                        m_a.divsd(a, b);
+                        m_a.bind(done);
+                    }
+                        break;
+                    case EXP:
+                        m_a.movsd(X0, a);
+                        m_a.movsd(X1, b);
+                        call((void *) jit_pow, n - 2);
+                        m_a.movsd(a, X0);
+                        break;
+                    case OR:
+                    case AND: {
+                        int no = m_a.label();
+                        m_a.cvttsd2si(x64asm::RAX, a);
+                        m_a.cvttsd2si(x64asm::RCX, b);
+                        if (op == OR) {
+                            int yes = m_a.label();
+                            m_a.test(x64asm::RAX, x64asm::RAX);
+                            m_a.jcc(x64asm::CC_NE, yes);
+                            m_a.test(x64asm::RCX, x64asm::RCX);
+                            m_a.jcc(x64asm::CC_E, no);
+                            m_a.bind(yes);
+                        } else {
+                            m_a.test(x64asm::RAX, x64asm::RAX);
+                            m_a.jcc(x64asm::CC_E, no);
+                            m_a.test(x64asm::RCX, x64asm::RCX);
+                            m_a.jcc(x64asm::CC_E, no);
+                        }
+                        boolean(a, no);
+                    }
+                        break;
+                    default: {
+                        int no = m_a.label();
+                        compare_jump(op, false, a, b, 0, no);
+                        boolean(a, no);
+                    }
+                        break;
+                }
+                m_st.pop_back();
+            }
+                break;
+
+            case ADDC:
+            case SUBC:
+            case MULC: {
+                if (n < 1 || arg >= m_bc.constants.size() || m_bc.constants[arg].type() != vardata_t::NUMBER
+                    || !value(n - 1))
+                    return false;
+                load_const(X0, m_bc.constants[arg].num());
+                if (op == ADDC) m_a.addsd(reg(n - 1), X0);
+                else if (op == SUBC) m_a.subsd(reg(n - 1), X0);
+                else m_a.mulsd(reg(n - 1), X0);
+            }
+                break;
+
+            case NEG:
+                if (n < 1 || !value(n - 1)) return false;
+                m_a.xorpd(X0, X0);
+                m_a.subsd(X0, reg(n - 1));
+                m_a.movsd(reg(n - 1), X0);
+                break;
+
+            case NOT: {
+                if (n < 1 || !value(n - 1)) return false;
+                int no = m_a.label();
+                m_a.cvttsd2si(x64asm::RAX, reg(n - 1));
+                m_a.test(x64asm::RAX, x64asm::RAX);
+                m_a.jcc(x64asm::CC_NE, no);
+                boolean(reg(n - 1), no);
+            }
+                break;
+
+            case CALL: {
+                // nul, arguments, function: only the math functions are compiled
+                if (n < arg + 2 || m_st[n - 1].kind != jit::item::FUNC || m_st[n - arg - 2].kind != jit::item::NUL)
+                    return false;
+                intrinsic &in = intrinsics()[m_st[n - 1].index];
+                if (in.nargs != arg)
+                    return false;
+                for (size_t i = 0; i < arg; i++)
+                    if (!value(n - arg - 1 + i))
+                        return false;
+
+                size_t result = n - arg - 2;
+                m_a.movsd(X0, reg(result + 1));
+                if (arg > 1)
+                    m_a.movsd(X1, reg(result + 2));
+                call(in.f, result);
+                m_a.movsd(reg(result), X0);
+
+                m_st.resize(result + 1);
+                m_st[result].kind = jit::item::NUMBER;
+            }
+                break;
+
+            case J:
+                if (inside(arg) && !normalize())
+                    return false;
+                jump(-1, arg);
+                reachable = false;
+                break;
+
+            case JF:
+            case JT:
+            case JFK:
+            case JTK: {
+                // numbers are false only when zero
+                if (n < 1 || !value(n - 1)) return false;
+                int x = reg(n - 1);
+                if (op == JF || op == JT)
+                    m_st.pop_back();
+                if (inside(arg) && !normalize())
+                    return false;
+                m_a.xorpd(X0, X0);
+                compare_jump(EQ, op == JF || op == JFK, x, X0, arg, -1);
+            }
+                break;
+
+            case LTJF: case GTJF: case LEJF: case GEJF: case NEJF: case EQJF: {
+                if (n < 2 || !value(n - 2) || !value(n - 1)) return false;
+                int a = reg(n - 2), b = reg(n - 1);
+                m_st.resize(n - 2);
+                if (inside(arg) && !normalize())
+                    return false;
+                static const Opcode cmp[] = {LT, GT, LE, GE, NE, EQ};
+                compare_jump(cmp[op - LTJF], false, a, b, arg, -1);
+            }
+                break;
+
+            case RET:
+                m_a.jmp(exit_to(m_ip, m_st, false));
+                reachable = false;
+                break;
+
+            default:
+                return false;
+        }
+
+        return m_ok;
+    }
+
+    jit::region *jit::compile(const bytecode &bc, size_t start, size_t end, const std::vector<fcallinfo_t *> &funcs) {
+        if (start >= m_hits.size())
+            return 0;
+        if (end > bc.program.size())
+            end = bc.program.size();
+
+        region *r = new region;
+        r->start = start;
+        r->end = end;
+        r->fver = env_t::func_version();
+
+        jitcompiler C(bc, start, end, funcs, *r);
+        void *mem = MAP_FAILED;
+        if (C.compile()) {
+            // written, then made executable but no longer writable
+            r->size = C.code().size();
+            mem = mmap(0, r->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem != MAP_FAILED) {
+                memcpy(mem, &C.code()[0], r->size);
+                if (mprotect(mem, r->size, PROT_READ | PROT_EXEC) != 0) {
+                    munmap(mem, r->size);
+                    mem = MAP_FAILED;
+                }
+            }
+        }
+
+        if (mem == MAP_FAILED) {
+            delete r;
+            m_hits[start] = COLD;
+            return 0;
+        }
+
+        r->code = (native_t) mem;
+        m_regions[start] = r;
+        return r;
+    }
+
+#endif
+
+} // namespace lk
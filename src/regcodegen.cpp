@@ -0,0 +1,983 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <lk/stdlib.h>
+#include <lk/regcodegen.h>
+
+namespace lk {
+
+// context flags for expr(), as for codegen::pfgen()
+#define F_NONE 0x00
+#define F_MUTABLE 0x01
+
+    regcodegen::regcodegen() {
+        m_overflow = false;
+    }
+
+    bool regcodegen::error(const lk_string &s) {
+        m_errStr = s;
+        return false;
+    }
+
+/// transfers the program, constants and identifiers to bytecode
+    size_t regcodegen::get(bytecode &bc) {
+        if (m_code.size() == 0) return 0;
+
+        bc.engine = bytecode::REGISTER;
+        bc.program.resize(m_code.size(), 0);
+        bc.debuginfo.clear();
+
+        for (size_t i = 0; i < m_code.size(); i++) {
+            instr &ip = m_code[i];
+            unsigned int code = ip.code;
+            if (ip.label >= 0)
+                code = ip.word ? (unsigned int) m_labelAddr[ip.label]
+                               : reg_ax((RegOpcode) (unsigned char) code, m_labelAddr[ip.label]);
+
+            bc.program[i] = code;
+            bc.debuginfo.push_back(ip.pos);
+        }
+
+        bc.constants = m_constData;
+        bc.identifiers = m_idList;
+        bc.intern_identifiers();
+
+        return m_code.size();
+    }
+
+/// generates assembly code
+    void regcodegen::textout(lk_string &assembly, lk_string &bytecode) {
+        char buf[128];
+
+        std::vector<int> labels(m_code.size() + 1, -1);
+        for (size_t i = 0; i < m_labelAddr.size(); i++)
+            if (m_labelAddr[i] >= 0 && m_labelAddr[i] <= (int) m_code.size())
+                labels[m_labelAddr[i]] = (int) i;
+
+        RegOpcode op = __MaxRegOp;
+        for (size_t i = 0; i < m_code.size(); i++) {
+            instr &ip = m_code[i];
+            unsigned int code = ip.code;
+            if (ip.label >= 0)
+                code = ip.word ? (unsigned int) m_labelAddr[ip.label]
+                               : reg_ax((RegOpcode) (unsigned char) code, m_labelAddr[ip.label]);
+
+            if (labels[i] >= 0) {
+                char label[16];
+                sprintf(label, "L%d:", labels[i]);
+                sprintf(buf, "%5s", label);
+                assembly += buf;
+            } else
+                assembly += "     ";
+
+            sprintf(buf, "%4d{%4d} ", ip.pos.line, ip.pos.stmt);
+            assembly += buf;
+
+            if (ip.word) {
+                // operand words hold the names of a function's locals or a jump address
+                if (op == R_ENTER)
+                    assembly += "         " + m_idList[code];
+                else if (ip.label >= 0) {
+                    sprintf(buf, "         L%d", ip.label);
+                    assembly += buf;
+                }
+            } else {
+                op = (RegOpcode) (unsigned char) code;
+                unsigned int a = (code >> 8) & 0xFF, b = (code >> 16) & 0xFF, c = (code >> 24), bx = (code >> 16);
+
+                sprintf(buf, "%-8s ", op < __MaxRegOp ? regop_table[op].name : "???");
+                assembly += buf;
+
+                switch (op) {
+                    case R_ENTER:
+                        sprintf(buf, "np=%d nl=%d nr=%d", a, b, c);
+                        break;
+                    case R_ARGV:
+                    case R_RET0:
+                    case R_END:
+                        buf[0] = 0;
+                        break;
+                    case R_LOADK: {
+                        static const size_t MAXWIDTH = 24;
+                        lk_string nnl(m_constData[bx].as_string());
+                        if (nnl.size() > MAXWIDTH) {
+                            nnl = nnl.substr(0, MAXWIDTH);
+                            nnl += "...";
+                        }
+                        lk::replace(nnl, "\n", "");
+                        sprintf(buf, "r%d ", a);
+                        assembly += buf;
+                        assembly += nnl;
+                        buf[0] = 0;
+                    }
+                        break;
+                    case R_GETN:
+                    case R_REFL:
+                    case R_REFC:
+                    case R_REFG:
+                    case R_GETS:
+                    case R_SETS:
+                    case R_TYP:
+                        sprintf(buf, "r%d ", a);
+                        assembly += buf + m_idList[bx];
+                        buf[0] = 0;
+                        break;
+                    case R_ADDK:
+                    case R_SUBK:
+                    case R_MULK:
+                        sprintf(buf, "r%d r%d ", a, b);
+                        assembly += buf + m_constData[c].as_string();
+                        buf[0] = 0;
+                        break;
+                    case R_J:
+                        if (ip.label >= 0) sprintf(buf, "L%d", ip.label);
+                        else sprintf(buf, "%d", code >> 8);
+                        break;
+                    case R_LOADNULL:
+                    case R_INC:
+                    case R_DEC:
+                    case R_FREF:
+                    case R_JT:
+                    case R_JF:
+                    case R_RET:
+                        sprintf(buf, "r%d", a);
+                        break;
+                    case R_MOVE:
+                    case R_WR:
+                    case R_ADDWR:
+                    case R_NOT:
+                    case R_NEG:
+                    case R_SZ:
+                    case R_KEYS:
+                    case R_LTJF:
+                    case R_GTJF:
+                    case R_LEJF:
+                    case R_GEJF:
+                    case R_NEJF:
+                    case R_EQJF:
+                        sprintf(buf, "r%d r%d", a, b);
+                        break;
+                    case R_VEC:
+                    case R_HASH:
+                    case R_SWI:
+                    case R_CALL:
+                    case R_TCALL:
+                    case R_TAIL:
+                    case R_TTAIL:
+                        sprintf(buf, "r%d (%d)", a, b);
+                        break;
+                    default:
+                        sprintf(buf, "r%d r%d r%d", a, b, c);
+                        break;
+                }
+                assembly += buf;
+            }
+
+            assembly += '\n';
+
+            sprintf(buf, "0x%08X\n", code);
+            bytecode += buf;
+        }
+
+        for (size_t i = 0; i < m_constData.size(); i++)
+            bytecode += ".data " + m_constData[i].as_string() + "\n";
+
+        for (size_t i = 0; i < m_idList.size(); i++)
+            bytecode += ".id " + m_idList[i] + "\n";
+    }
+
+/// returns true if the program fits the register instruction set
+    bool regcodegen::generate(lk::node_t *root) {
+        m_idList.clear();
+        m_constData.clear();
+        m_idIndex.clear();
+        m_constIndex.clear();
+        m_constNext.clear();
+        m_code.clear();
+        m_labelAddr.clear();
+        m_breakAddr.clear();
+        m_continueAddr.clear();
+        m_errStr.clear();
+        m_overflow = false;
+        m_fn = fstate();
+
+        // top level code only has temporary registers, counted once it is generated
+        emit(root ? root->srcpos() : srcpos_t::npos, reg_abc(R_ENTER, 0, 0, 0));
+
+        if (!stmt(root, F_NONE))
+            return false;
+
+        m_code[0].code = reg_abc(R_ENTER, 0, 0, m_fn.maxreg);
+
+        if (m_overflow)
+            return error(lk_tr("program exceeds the limits of the register instruction set"));
+
+        return true;
+    }
+
+/// adds id to m_idList if not already added, return index of d
+    int regcodegen::place_identifier(const lk_string &id) {
+        size_t n = m_idIndex.size();
+        int &index = m_idIndex[id];
+        if (m_idIndex.size() > n) {
+            index = (int) m_idList.size();
+            m_idList.push_back(id);
+            if (m_idList.size() > REG_BX_MAX) m_overflow = true;
+        }
+        return index;
+    }
+
+/// adds d to m_constData if not already added, return index of d
+    int regcodegen::place_const(vardata_t &d) {
+        size_t h = d.hash_value();
+        int latest = m_constIndex.count(h) ? m_constIndex[h] : -1;
+        for (int i = latest; i >= 0; i = m_constNext[i])
+            if (m_constData[i].equals(d))
+                return i;
+
+        m_constNext.push_back(latest);
+        m_constIndex[h] = (int) m_constData.size();
+        m_constData.push_back(d);
+        if (m_constData.size() > REG_BX_MAX) m_overflow = true;
+        return (int) m_constData.size() - 1;
+    }
+
+/// returns the constant index of a number or string literal, or -1 for other nodes
+    int regcodegen::const_index(lk::node_t *n) {
+        vardata_t x;
+        if (constant_t *c = dynamic_cast<constant_t *>(n))
+            x.assign(c->value);
+        else if (literal_t *l = dynamic_cast<literal_t *>(n))
+            x.assign(l->value);
+        else
+            return -1;
+
+        return place_const(x);
+    }
+
+/// register of the key of a table item: the constant of a literal key is interned, so that the
+/// table is searched for its atom
+    int regcodegen::key(lk::node_t *n, int dst) {
+        if (dynamic_cast<literal_t *>(n))
+            m_constData[const_index(n)].intern();
+        return expr(n, F_NONE, dst);
+    }
+
+    int regcodegen::new_label() {
+        m_labelAddr.push_back(-1);
+        return (int) m_labelAddr.size() - 1;
+    }
+
+    void regcodegen::place_label(int L) {
+        m_labelAddr[L] = (int) m_code.size();
+    }
+
+/// allocates the next temporary register of the current function
+    int regcodegen::alloc() {
+        if (m_fn.top >= REG_MAX) {
+            m_overflow = true;
+            return REG_MAX - 1;
+        }
+
+        int r = m_fn.top++;
+        if (m_fn.top > m_fn.maxreg) m_fn.maxreg = m_fn.top;
+        return r;
+    }
+
+    void regcodegen::emit(srcpos_t pos, unsigned int code, int label) {
+        // copy previous line's position if parser doesn't know the statement line,
+        // as in codegen::emit
+        if (pos == srcpos_t::npos && m_code.size() > 0)
+            pos = m_code.back().pos;
+
+        m_code.push_back(instr(pos, code, label, false));
+    }
+
+    void regcodegen::emit_word(srcpos_t pos, unsigned int w, int label) {
+        if (pos == srcpos_t::npos && m_code.size() > 0)
+            pos = m_code.back().pos;
+
+        m_code.push_back(instr(pos, w, label, true));
+    }
+
+/// follows the context flags of codegen::pfgen to find the names referenced with LREF or LCREF
+    void regcodegen::scan_locals(lk::node_t *root, unsigned int flags, std::vector<lk_string> &names) {
+        if (!root) return;
+
+        if (list_t *n1 = dynamic_cast<list_t *>(root)) {
+            for (size_t i = 0; i < n1->items.size(); i++)
+                scan_locals(n1->items[i], flags, names);
+        } else if (iter_t *n2 = dynamic_cast<iter_t *>(root)) {
+            scan_locals(n2->init, flags, names);
+            scan_locals(n2->test, flags, names);
+            scan_locals(n2->block, flags, names);
+            scan_locals(n2->adv, flags, names);
+        } else if (cond_t *n3 = dynamic_cast<cond_t *>(root)) {
+            scan_locals(n3->test, flags, names);
+            scan_locals(n3->on_true, n3->ternary ? F_NONE : flags, names);
+            scan_locals(n3->on_false, n3->ternary ? F_NONE : flags, names);
+        } else if (expr_t *n4 = dynamic_cast<expr_t *>(root)) {
+            switch (n4->oper) {
+                case expr_t::INCR:
+                case expr_t::DECR:
+                    scan_locals(n4->left, flags | F_MUTABLE, names);
+                    break;
+                case expr_t::NOT:
+                case expr_t::NEG:
+                    scan_locals(n4->left, flags, names);
+                    break;
+                case expr_t::INDEX:
+                case expr_t::HASH:
+                    scan_locals(n4->left, flags, names);
+                    scan_locals(n4->right, F_NONE, names);
+                    break;
+                case expr_t::MINUSAT:
+                case expr_t::WHEREAT:
+                    scan_locals(n4->left, F_NONE, names);
+                    scan_locals(n4->right, flags, names);
+                    break;
+                case expr_t::PLUSEQ:
+                case expr_t::MINUSEQ:
+                case expr_t::MULTEQ:
+                case expr_t::DIVEQ:
+                    scan_locals(n4->left, F_NONE, names);
+                    scan_locals(n4->right, F_NONE, names);
+                    scan_locals(n4->left, F_MUTABLE, names);
+                    break;
+                case expr_t::ASSIGN: {
+                    scan_locals(n4->right, flags, names);
+                    iden_t *iden = dynamic_cast<iden_t *>(n4->left);
+                    if (!iden || !iden->special)
+                        scan_locals(n4->left, F_MUTABLE, names);
+                }
+                    break;
+                case expr_t::CALL:
+                case expr_t::THISCALL: {
+                    scan_locals(n4->right, F_NONE, names);
+                    expr_t *lexpr = dynamic_cast<expr_t *>(n4->left);
+                    if (n4->oper == expr_t::THISCALL && 0 != lexpr) {
+                        scan_locals(lexpr->left, F_NONE, names);
+                        scan_locals(lexpr->right, F_NONE, names);
+                    } else
+                        scan_locals(n4->left, F_NONE, names);
+                }
+                    break;
+                case expr_t::SIZEOF:
+                case expr_t::KEYSOF:
+                    scan_locals(n4->left, F_NONE, names);
+                    break;
+                case expr_t::INITVEC:
+                case expr_t::INITHASH:
+                case expr_t::SWITCH:
+                    scan_locals(n4->left, F_NONE, names);
+                    scan_locals(n4->right, F_NONE, names);
+                    break;
+                case expr_t::TYPEOF:
+                case expr_t::DEFINE:
+                    // nested functions have their own locals
+                    break;
+                default:
+                    scan_locals(n4->left, flags, names);
+                    scan_locals(n4->right, flags, names);
+                    break;
+            }
+        } else if (ctlstmt_t *n5 = dynamic_cast<ctlstmt_t *>(root)) {
+            scan_locals(n5->rexpr, F_NONE, names);
+        } else if (iden_t *n6 = dynamic_cast<iden_t *>(root)) {
+            if ((flags & F_MUTABLE) && !n6->special && !n6->globalval
+                && m_fn.locals.find(n6->name) == m_fn.locals.end()) {
+                m_fn.locals[n6->name] = (int) names.size();
+                names.push_back(n6->name);
+            }
+        }
+    }
+
+/// generates a function body: the prologue binds the arguments to the first registers and
+/// names the locals after them, which the vm binds on first use
+    int regcodegen::define(lk::expr_t *n4) {
+        fstate outer = m_fn;
+        m_fn = fstate();
+
+        std::vector<lk_string> names;
+        std::vector<srcpos_t> pos;
+        list_t *p = dynamic_cast<list_t *>(n4->left);
+        if (p) {
+            for (size_t i = 0; i < p->items.size(); i++) {
+                iden_t *id = dynamic_cast<iden_t *>(p->items[i]);
+                m_fn.locals[id->name] = (int) i; // a repeated name refers to its last register
+                names.push_back(id->name);
+                pos.push_back(id->srcpos());
+            }
+        }
+
+        size_t nparams = names.size();
+        scan_locals(n4->right, F_NONE, names);
+        pos.resize(names.size(), n4->srcpos());
+        if (names.size() > REG_MAX) m_overflow = true;
+
+        m_fn.top = m_fn.maxreg = (int) names.size();
+
+        int Lf = new_label();
+        place_label(Lf);
+        size_t entry = m_code.size();
+        emit(n4->srcpos(), reg_abc(R_ENTER, 0, 0, 0));
+        for (size_t i = 0; i < names.size(); i++)
+            emit_word(pos[i], place_identifier(names[i]));
+
+        // the vm only builds '__args' for functions that refer to it
+        if (uses_args(n4))
+            emit(n4->srcpos(), reg_abc(R_ARGV, 0));
+
+        // for implicit return at end of function, use last code line number of block
+        srcpos_t posend = n4->srcpos();
+        posend.stmt = posend.stmt_end;
+
+        if (!stmt(n4->right, F_NONE)) return -1;
+        if (!ends_with_return(n4->right))
+            emit(posend, reg_abc(R_RET0, 0));
+
+        m_code[entry].code = reg_abc(R_ENTER, (unsigned int) nparams, (unsigned int) names.size(), m_fn.maxreg);
+
+        m_fn = outer;
+        return Lf;
+    }
+
+/// jumps to label if the test is false, fusing comparisons with the jump
+    bool regcodegen::jump_false(lk::node_t *test, unsigned int flags, int label) {
+        if (!test) return true;
+
+        int mark = m_fn.top;
+        expr_t *e = dynamic_cast<expr_t *>(test);
+        RegOpcode op = __MaxRegOp;
+        if (e) {
+            switch (e->oper) {
+                case expr_t::LT: op = R_LTJF; break;
+                case expr_t::GT: op = R_GTJF; break;
+                case expr_t::LE: op = R_LEJF; break;
+                case expr_t::GE: op = R_GEJF; break;
+                case expr_t::NE: op = R_NEJF; break;
+                case expr_t::EQ: op = R_EQJF; break;
+                default: break;
+            }
+        }
+
+        if (op != __MaxRegOp) {
+            int l = expr(e->left, flags);
+            int r = expr(e->right, flags);
+            if (l < 0 || r < 0) return false;
+            emit(e->srcpos(), reg_abc(op, l, r));
+        } else {
+            int r = expr(test, flags);
+            if (r < 0) return false;
+            emit(test->srcpos(), reg_abc(R_JF, r));
+        }
+        emit_word(srcpos_t::npos, 0, label);
+
+        m_fn.top = mark;
+        return true;
+    }
+
+/// generates a statement, releasing any temporary registers it used
+    bool regcodegen::stmt(lk::node_t *root, unsigned int flags) {
+        if (!root) return true;
+
+        int mark = m_fn.top;
+
+        if (list_t *n1 = dynamic_cast<list_t *>(root)) {
+            for (std::vector<node_t *>::iterator it = n1->items.begin();
+                 it != n1->items.end();
+                 ++it)
+                if (!stmt(*it, flags))
+                    return false;
+        } else if (iter_t *n2 = dynamic_cast<iter_t *>(root)) {
+            if (n2->init && !stmt(n2->init, flags)) return false;
+
+            // labels for beginning, advancement, and outside end of loop
+            int Lb = new_label();
+            int Lc = new_label();
+            int Le = new_label();
+
+            m_continueAddr.push_back(Lc);
+            m_breakAddr.push_back(Le);
+
+            place_label(Lb);
+
+            // a loop without a test runs until it is broken
+            if (!jump_false(n2->test, flags, Le)) return false;
+
+            if (!stmt(n2->block, flags)) return false;
+
+            place_label(Lc);
+            if (n2->adv && !stmt(n2->adv, flags)) return false;
+
+            emit(n2->srcpos(), reg_ax(R_J, 0), Lb);
+            place_label(Le);
+
+            m_continueAddr.pop_back();
+            m_breakAddr.pop_back();
+        } else if (cond_t *n3 = dynamic_cast<cond_t *>(root)) {
+            if (n3->ternary) {
+                if (expr(n3, flags) < 0) return false;
+            } else {
+                int L1 = new_label();
+                int L2 = L1;
+
+                if (!jump_false(n3->test, flags, L1)) return false;
+                if (!stmt(n3->on_true, flags)) return false;
+
+                if (n3->on_false) {
+                    L2 = new_label();
+
+                    // use previous assembly output line as statement position for debugging
+                    // since it's unknown at parse time
+                    emit(srcpos_t::npos, reg_ax(R_J, 0), L2);
+                    place_label(L1);
+
+                    if (!stmt(n3->on_false, flags)) return false;
+                }
+                place_label(L2);
+            }
+        } else if (ctlstmt_t *n5 = dynamic_cast<ctlstmt_t *>(root)) {
+            switch (n5->ictl) {
+                case ctlstmt_t::RETURN:
+                    if (n5->rexpr) {
+                        int r = expr(n5->rexpr, F_NONE);
+                        if (r < 0) return false;
+
+                        // a returned call reuses the frame when it calls an LK function
+                        expr_t *call = dynamic_cast<expr_t *>(n5->rexpr);
+                        if (call && (call->oper == expr_t::CALL || call->oper == expr_t::THISCALL)
+                            && m_code.size() > 0 && !m_code.back().word) {
+                            unsigned int &code = m_code.back().code;
+                            RegOpcode last = (RegOpcode) (code & 0xFF);
+                            if ((last == R_CALL || last == R_TCALL) && ((code >> 8) & 0xFF) == (unsigned int) r)
+                                code = (code & ~0xFFu) | (last == R_CALL ? R_TAIL : R_TTAIL);
+                        }
+
+                        emit(n5->srcpos(), reg_abc(R_RET, r));
+                    } else
+                        emit(n5->srcpos(), reg_abc(R_RET0, 0));
+                    break;
+
+                case ctlstmt_t::BREAK:
+                    if (m_breakAddr.size() == 0)
+                        return error(lk_tr("cannot break from outside a loop"));
+
+                    emit(n5->srcpos(), reg_ax(R_J, 0), m_breakAddr.back());
+                    break;
+
+                case ctlstmt_t::CONTINUE:
+                    if (m_continueAddr.size() == 0)
+                        return error(lk_tr("cannot continue from outside a loop"));
+
+                    emit(n5->srcpos(), reg_ax(R_J, 0), m_continueAddr.back());
+                    break;
+
+                case ctlstmt_t::EXIT:
+                    emit(n5->srcpos(), reg_abc(R_END, 0));
+                    break;
+
+                default:
+                    return false;
+            }
+        } else if (expr(root, flags) < 0)
+            return false;
+
+        m_fn.top = mark;
+        return true;
+    }
+
+    int regcodegen::expr(lk::node_t *root, unsigned int flags, int dst) {
+        int mark = m_fn.top;
+        int r = gen_expr(root, flags, dst);
+        if (r < 0) return -1;
+
+        if (dst >= 0 && r != dst) {
+            emit(root->srcpos(), reg_abc(R_MOVE, dst, r));
+            r = dst;
+        }
+
+        // keep the result register allocated if it is a temporary
+        m_fn.top = (r >= mark) ? r + 1 : mark;
+        return r;
+    }
+
+// result register of an expression, taken once its operands are generated
+#define RESULT() (m_fn.top = mark, dst >= 0 ? dst : alloc())
+// first register of a block of consecutive registers: the destination can start the
+// block when it is the last register allocated
+#define BLOCK() (m_fn.top = mark, (dst >= 0 && dst == mark - 1) ? (m_fn.top = mark - 1, alloc()) : alloc())
+
+    int regcodegen::gen_expr(lk::node_t *root, unsigned int flags, int dst) {
+        if (!root) return error(lk_tr("invalid expression")), -1;
+
+        int mark = m_fn.top;
+
+        if (cond_t *n3 = dynamic_cast<cond_t *>(root)) {
+            if (!n3->ternary) return error(lk_tr("invalid expression")), -1;
+
+            int t = RESULT();
+            int L1 = new_label();
+            int L2 = L1;
+
+            if (!jump_false(n3->test, flags, L1)) return -1;
+            if (expr(n3->on_true, F_NONE, t) < 0) return -1;
+
+            if (n3->on_false) {
+                L2 = new_label();
+                emit(srcpos_t::npos, reg_ax(R_J, 0), L2);
+                place_label(L1);
+                if (expr(n3->on_false, F_NONE, t) < 0) return -1;
+            }
+            place_label(L2);
+            return t;
+        } else if (iden_t *n6 = dynamic_cast<iden_t *>(root)) {
+            int id = place_identifier(n6->name);
+            if (n6->special) {
+                int t = RESULT();
+                emit(n6->srcpos(), reg_abx(R_GETS, t, id));
+                return t;
+            }
+
+            RegOpcode op = R_GETN;
+            if (flags & F_MUTABLE) {
+                if (n6->globalval) op = R_REFG;
+                else if (n6->constval) op = R_REFC;
+                else op = R_REFL;
+            }
+
+            if (op == R_GETN || op == R_REFL) {
+                unordered_map<lk_string, int, lk_string_hash, lk_string_equal>::iterator it = m_fn.locals.find(
+                        n6->name);
+                if (it != m_fn.locals.end())
+                    return it->second;
+            }
+
+            int t = RESULT();
+            emit(n6->srcpos(), reg_abx(op, t, id));
+            return t;
+        } else if (dynamic_cast<null_t *>(root)) {
+            int t = RESULT();
+            emit(root->srcpos(), reg_abc(R_LOADNULL, t));
+            return t;
+        } else if (constant_t *n8 = dynamic_cast<constant_t *>(root)) {
+            int t = RESULT();
+            emit(n8->srcpos(), reg_abx(R_LOADK, t, const_index(n8)));
+            return t;
+        } else if (literal_t *n9 = dynamic_cast<literal_t *>(root)) {
+            int t = RESULT();
+            emit(n9->srcpos(), reg_abx(R_LOADK, t, const_index(n9)));
+            return t;
+        }
+
+        expr_t *n4 = dynamic_cast<expr_t *>(root);
+        if (!n4) return error(lk_tr("invalid expression")), -1;
+
+        RegOpcode op = __MaxRegOp;
+        switch (n4->oper) {
+            case expr_t::PLUS:
+            case expr_t::MINUS:
+            case expr_t::MULT: {
+                // arithmetic with a constant right operand
+                int k = const_index(n4->right);
+                if (k >= 0 && k <= REG_MAX) {
+                    int l = expr(n4->left, flags);
+                    if (l < 0) return -1;
+                    int t = RESULT();
+                    op = (n4->oper == expr_t::PLUS) ? R_ADDK : (n4->oper == expr_t::MINUS) ? R_SUBK : R_MULK;
+                    emit(n4->srcpos(), reg_abc(op, t, l, k));
+                    return t;
+                }
+                op = (n4->oper == expr_t::PLUS) ? R_ADD : (n4->oper == expr_t::MINUS) ? R_SUB : R_MUL;
+            }
+                break;
+            case expr_t::DIV: op = R_DIV; break;
+            case expr_t::EXP: op = R_EXP; break;
+            case expr_t::LT: op = R_LT; break;
+            case expr_t::GT: op = R_GT; break;
+            case expr_t::LE: op = R_LE; break;
+            case expr_t::GE: op = R_GE; break;
+            case expr_t::NE: op = R_NE; break;
+            case expr_t::EQ: op = R_EQ; break;
+            default: break;
+        }
+
+        if (op != __MaxRegOp) {
+            int l = expr(n4->left, flags);
+            int r = expr(n4->right, flags);
+            if (l < 0 || r < 0) return -1;
+            int t = RESULT();
+            emit(n4->srcpos(), reg_abc(op, t, l, r));
+            return t;
+        }
+
+        switch (n4->oper) {
+            case expr_t::INCR:
+            case expr_t::DECR: {
+                int r = expr(n4->left, flags | F_MUTABLE);
+                if (r < 0) return -1;
+                emit(n4->srcpos(), reg_abc(n4->oper == expr_t::INCR ? R_INC : R_DEC, r));
+                return r;
+            }
+            case expr_t::LOGIOR:
+            case expr_t::LOGIAND: {
+                // the left value is the result when it decides the outcome
+                int t = RESULT();
+                int Lsc = new_label();
+                if (expr(n4->left, flags, t) < 0) return -1;
+                emit(n4->srcpos(), reg_abc(n4->oper == expr_t::LOGIOR ? R_JT : R_JF, t));
+                emit_word(n4->srcpos(), 0, Lsc);
+                int r = expr(n4->right, flags);
+                if (r < 0) return -1;
+                emit(n4->srcpos(), reg_abc(n4->oper == expr_t::LOGIOR ? R_OR : R_AND, t, t, r));
+                place_label(Lsc);
+                return t;
+            }
+            case expr_t::NOT:
+            case expr_t::NEG:
+            case expr_t::SIZEOF:
+            case expr_t::KEYSOF: {
+                bool unary = (n4->oper == expr_t::NOT || n4->oper == expr_t::NEG);
+                int r = expr(n4->left, unary ? flags : F_NONE);
+                if (r < 0) return -1;
+                int t = RESULT();
+                switch (n4->oper) {
+                    case expr_t::NOT: op = R_NOT; break;
+                    case expr_t::NEG: op = R_NEG; break;
+                    case expr_t::SIZEOF: op = R_SZ; break;
+                    default: op = R_KEYS; break;
+                }
+                emit(n4->srcpos(), reg_abc(op, t, r));
+                return t;
+            }
+            case expr_t::INDEX:
+            case expr_t::HASH: {
+                int c = expr(n4->left, flags);
+                int i = (n4->oper == expr_t::HASH) ? key(n4->right) : expr(n4->right, F_NONE);
+                if (c < 0 || i < 0) return -1;
+                int t = RESULT();
+                if (n4->oper == expr_t::INDEX) op = (flags & F_MUTABLE) ? R_IDXM : R_IDX;
+                else op = (flags & F_MUTABLE) ? R_KEYM : R_KEY;
+                emit(n4->srcpos(), reg_abc(op, t, c, i));
+                return t;
+            }
+            case expr_t::MINUSAT:
+            case expr_t::WHEREAT: {
+                int l = expr(n4->left, F_NONE);
+                int r = expr(n4->right, flags);
+                if (l < 0 || r < 0) return -1;
+                int t = RESULT();
+                emit(n4->srcpos(), reg_abc(n4->oper == expr_t::MINUSAT ? R_MAT : R_WAT, t, l, r));
+                return t;
+            }
+            case expr_t::PLUSEQ: {
+                // evaluated in place as eval does, so that += appends to an array
+                int v = expr(n4->right, F_NONE);
+                if (v < 0) return -1;
+                int d = expr(n4->left, F_MUTABLE);
+                if (d < 0) return -1;
+                emit(n4->srcpos(), reg_abc(R_ADDWR, d, v));
+                return d;
+            }
+            case expr_t::MINUSEQ:
+            case expr_t::MULTEQ:
+            case expr_t::DIVEQ: {
+                int l = expr(n4->left, F_NONE);
+                int r = expr(n4->right, F_NONE);
+                if (l < 0 || r < 0) return -1;
+                m_fn.top = mark;
+                int v = alloc();
+                switch (n4->oper) {
+                    case expr_t::MINUSEQ: op = R_SUB; break;
+                    case expr_t::MULTEQ: op = R_MUL; break;
+                    default: op = R_DIV; break;
+                }
+                emit(n4->srcpos(), reg_abc(op, v, l, r));
+                int d = expr(n4->left, F_MUTABLE);
+                if (d < 0) return -1;
+                emit(n4->srcpos(), reg_abc(R_WR, d, v));
+                return d;
+            }
+            case expr_t::ASSIGN: {
+                int v = expr(n4->right, flags);
+                if (v < 0) return -1;
+
+                // a special variable on the left i.e. ${xy} is written through the host
+                if (lk::iden_t *iden = dynamic_cast<lk::iden_t *>(n4->left)) {
+                    if (iden->special) {
+                        emit(n4->srcpos(), reg_abx(R_SETS, v, place_identifier(iden->name)));
+                        return v;
+                    }
+                }
+
+                int d = expr(n4->left, F_MUTABLE);
+                if (d < 0) return -1;
+                emit(n4->srcpos(), reg_abc(R_WR, d, v));
+                return d;
+            }
+            case expr_t::CALL:
+            case expr_t::THISCALL: {
+                // the function, 'this' and the arguments occupy consecutive registers
+                bool thiscall = (n4->oper == expr_t::THISCALL);
+                int a = BLOCK();
+                if (thiscall) alloc();
+
+                list_t *argvals = dynamic_cast<list_t *>(n4->right);
+                int nargs = 0;
+                if (argvals) {
+                    for (std::vector<node_t *>::iterator it = argvals->items.begin();
+                         it != argvals->items.end();
+                         ++it) {
+                        if (expr(*it, F_NONE, alloc()) < 0) return -1;
+                        nargs++;
+                    }
+                }
+                if (nargs > REG_MAX) m_overflow = true;
+
+                expr_t *lexpr = dynamic_cast<expr_t *>(n4->left);
+                if (thiscall && 0 != lexpr) {
+                    if (expr(lexpr->left, F_NONE, a + 1) < 0) return -1;
+                    int k = key(lexpr->right);
+                    if (k < 0) return -1;
+                    emit(n4->srcpos(), reg_abc(R_KEY, a, a + 1, k));
+                } else if (expr(n4->left, F_NONE, a) < 0)
+                    return -1;
+
+                emit(n4->srcpos(), reg_abc(thiscall ? R_TCALL : R_CALL, a, nargs));
+                return a;
+            }
+            case expr_t::TYPEOF:
+                if (iden_t *iden = dynamic_cast<iden_t *>(n4->left)) {
+                    int t = RESULT();
+                    emit(n4->srcpos(), reg_abx(R_TYP, t, place_identifier(iden->name)));
+                    return t;
+                } else
+                    return error(lk_tr("invalid 'typeof' expression, identifier required")), -1;
+            case expr_t::INITVEC: {
+                list_t *p = dynamic_cast<list_t *>(n4->left);
+                vardata_t cvec;
+                cvec.empty_vector();
+                if (p && codegen::initialize_const_vec(p, cvec)) {
+                    int t = RESULT();
+                    emit(n4->srcpos(), reg_abx(R_LOADK, t, place_const(cvec)));
+                    return t;
+                }
+
+                int t = BLOCK();
+                int len = 0;
+                if (p) {
+                    for (std::vector<node_t *>::iterator it = p->items.begin();
+                         it != p->items.end();
+                         ++it) {
+                        if (expr(*it, F_NONE, len == 0 ? t : alloc()) < 0) return -1;
+                        len++;
+                    }
+                }
+                if (len > REG_MAX) m_overflow = true;
+
+                emit(n4->srcpos(), reg_abc(R_VEC, t, len));
+                return t;
+            }
+            case expr_t::INITHASH: {
+                list_t *p = dynamic_cast<list_t *>(n4->left);
+                vardata_t chash;
+                chash.empty_hash();
+                if (p && codegen::initialize_const_hash(p, chash)) {
+                    int t = RESULT();
+                    emit(n4->srcpos(), reg_abx(R_LOADK, t, place_const(chash)));
+                    return t;
+                }
+
+                int t = BLOCK();
+                int len = 0;
+                if (p) {
+                    for (std::vector<node_t *>::iterator it = p->items.begin();
+                         it != p->items.end();
+                         ++it) {
+                        expr_t *assign = dynamic_cast<expr_t *>(*it);
+                        if (assign && assign->oper == expr_t::ASSIGN) {
+                            if (key(assign->left, len == 0 ? t : alloc()) < 0) return -1;
+                            if (expr(assign->right, F_NONE, alloc()) < 0) return -1;
+                            len++;
+                        }
+                    }
+                }
+                if (len > REG_MAX) m_overflow = true;
+
+                emit(n4->srcpos(), reg_abc(R_HASH, t, len));
+                return t;
+            }
+            case expr_t::SWITCH: {
+                int Le = new_label();
+                std::vector<int> labels;
+
+                list_t *p = dynamic_cast<list_t *>(n4->right);
+                int n = p ? (int) p->items.size() : 0;
+                if (n > REG_MAX) m_overflow = true;
+
+                int s = expr(n4->left, F_NONE);
+                if (s < 0) return -1;
+                int t = RESULT();
+                emit(n4->srcpos(), reg_abc(R_SWI, s, n));
+
+                for (int i = 0; i < n; i++) {
+                    labels.push_back(new_label());
+                    emit(n4->srcpos(), reg_ax(R_J, 0), labels.back());
+                }
+
+                for (int i = 0; i < n; i++) {
+                    place_label(labels[i]);
+                    if (expr(p->items[i], F_NONE, t) < 0) return -1;
+                    if (i < n - 1)
+                        emit(p->items[i] ? p->items[i]->srcpos() : n4->srcpos(), reg_ax(R_J, 0), Le);
+                }
+
+                place_label(Le);
+                return t;
+            }
+            case expr_t::DEFINE: {
+                int Le = new_label();
+                emit(n4->srcpos(), reg_ax(R_J, 0), Le);
+
+                int Lf = define(n4);
+                if (Lf < 0) return -1;
+
+                place_label(Le);
+                int t = RESULT();
+                emit(n4->srcpos(), reg_abc(R_FREF, t));
+                emit_word(n4->srcpos(), 0, Lf);
+                return t;
+            }
+            default:
+                return error(lk_tr("invalid expression")), -1;
+        }
+    }
+}; // namespace lk
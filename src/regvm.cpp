@@ -0,0 +1,1088 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <numeric>
+#include <limits>
+#include <cmath>
+
+#include <lk/regvm.h>
+#include <lk/vecops.h>
+
+namespace lk {
+    RegOpCodeEntry regop_table[] = {
+            {R_ENTER,    "enter"},
+            {R_ARGV,     "argv"},
+            {R_MOVE,     "move"},
+            {R_LOADK,    "loadk"},
+            {R_LOADNULL, "loadnull"},
+            {R_GETN,     "getn"},
+            {R_REFL,     "refl"},
+            {R_REFC,     "refc"},
+            {R_REFG,     "refg"},
+            {R_GETS,     "gets"},
+            {R_SETS,     "sets"},
+            {R_WR,       "wr"},
+            {R_ADDWR,    "addwr"},
+            {R_ADD,      "add"},
+            {R_SUB,      "sub"},
+            {R_MUL,      "mul"},
+            {R_DIV,      "div"},
+            {R_EXP,      "exp"},
+            {R_LT,       "lt"},
+            {R_GT,       "gt"},
+            {R_LE,       "le"},
+            {R_GE,       "ge"},
+            {R_NE,       "ne"},
+            {R_EQ,       "eq"},
+            {R_OR,       "or"},
+            {R_AND,      "and"},
+            {R_ADDK,     "addk"},
+            {R_SUBK,     "subk"},
+            {R_MULK,     "mulk"},
+            {R_NOT,      "not"},
+            {R_NEG,      "neg"},
+            {R_INC,      "inc"},
+            {R_DEC,      "dec"},
+            {R_IDX,      "idx"},
+            {R_KEY,      "key"},
+            {R_IDXM,     "idxm"},
+            {R_KEYM,     "keym"},
+            {R_MAT,      "mat"},
+            {R_WAT,      "wat"},
+            {R_SZ,       "sz"},
+            {R_KEYS,     "keys"},
+            {R_TYP,      "typ"},
+            {R_VEC,      "vec"},
+            {R_HASH,     "hash"},
+            {R_FREF,     "fref"},
+            {R_J,        "j"},
+            {R_JT,       "jt"},
+            {R_JF,       "jf"},
+            {R_LTJF,     "ltjf"},
+            {R_GTJF,     "gtjf"},
+            {R_LEJF,     "lejf"},
+            {R_GEJF,     "gejf"},
+            {R_NEJF,     "nejf"},
+            {R_EQJF,     "eqjf"},
+            {R_SWI,      "swi"},
+            {R_CALL,     "call"},
+            {R_TCALL,    "tcall"},
+            {R_TAIL,     "tail"},
+            {R_TTAIL,    "ttail"},
+            {R_RET,      "ret"},
+            {R_RET0,     "ret0"},
+            {R_END,      "end"},
+            {__MaxRegOp, 0}};
+
+/// initializes a vm with a register file of the given size
+    regvm::regvm(size_t nregs) {
+        bc = 0;
+        ip = 0;
+        regs.resize(nregs, vardata_t());
+        frames.reserve(16);
+    }
+
+    regvm::~regvm() {
+        free_frames();
+
+        for (size_t i = 0; i < pool.size(); i++)
+            delete pool[i];
+    }
+
+    bool regvm::on_run(const srcpos_t &) {
+        return true;
+    }
+
+    void regvm::free_frames() {
+        for (size_t i = 0; i < frames.size(); i++)
+            delete frames[i];
+        frames.clear();
+    }
+
+    regvm::frame *regvm::push_frame(lk::env_t *parent) {
+        frame *F;
+        if (pool.size() > 0) {
+            F = pool.back();
+            pool.pop_back();
+            F->env.set_parent(parent);
+            F->thiscall = false;
+        } else
+            F = new frame(parent);
+
+        frames.push_back(F);
+        return F;
+    }
+
+    void regvm::pop_frame() {
+        frame *F = frames.back();
+        frames.pop_back();
+
+        F->env.clear_vars();
+        F->env.clear_funcs();
+        F->tailenv.clear_vars();
+        pool.push_back(F);
+    }
+
+/// true if p is v itself or an item held by v at any depth
+    static bool holds(vardata_t &v, const vardata_t *p) {
+        if (&v == p)
+            return true;
+
+        if (v.type() == vardata_t::VECTOR) {
+            std::vector<vardata_t> &items = *v.vec();
+            for (size_t i = 0; i < items.size(); i++)
+                if (holds(items[i], p))
+                    return true;
+        } else if (v.type() == vardata_t::HASH) {
+            varhash_t &items = *v.hash();
+            for (varhash_t::iterator it = items.begin(); it != items.end(); ++it)
+                if (holds(*it->second, p))
+                    return true;
+        }
+
+        return false;
+    }
+
+/// replaces the current frame's function by the one called with R_TAIL or R_TTAIL from
+/// register a, as lk::vm::tail_call does: the callee, 'this' and the arguments move down to
+/// the registers of the current function's callee and arguments in the caller's window, and
+/// the variables of the current function move to the frame's tailenv.  references into the
+/// registers being reused, or to the tailenv variables they replace, are copied
+    void regvm::tail_call(RegOpcode op, size_t a, size_t nargs) {
+        frame &F = *frames.back();
+        size_t base = F.argbase - (F.thiscall ? 2 : 1);
+        size_t n = nargs + (op == R_TTAIL ? 2 : 1);
+        vardata_t *wbegin = &regs[base], *wend = &regs[0] + regs.size();
+
+        if (F.env.parent() != &F.tailenv) {
+            F.tailenv.set_parent(F.env.parent());
+            F.env.set_parent(&F.tailenv);
+        }
+
+        // tailenv variables that the current function's variables will replace
+        std::vector<vardata_t *> &hidden = tailhidden;
+        hidden.clear();
+        lk_string key;
+        vardata_t *var;
+        for (bool more = F.env.first(key, var); more; more = F.env.next(key, var))
+            if (vardata_t *x = F.tailenv.lookup(key, false))
+                hidden.push_back(x);
+
+        tailargs.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            vardata_t &x = regs[a + i].deref();
+            bool owned = (&x >= wbegin && &x < wend);
+            for (size_t k = 0; !owned && k < hidden.size(); k++)
+                owned = holds(*hidden[k], &x);
+
+            if (regs[a + i].type() == vardata_t::REFERENCE && !owned && &x != &m_func)
+                tailargs[i].assign(&x);
+            else
+                tailargs[i].copy(x);
+        }
+
+        // arguments of the current function refer to the caller's registers
+        for (bool more = F.env.first(key, var); more; more = F.env.next(key, var)) {
+            if (var->type() == vardata_t::REFERENCE) {
+                vardata_t &x = var->deref();
+                if (&x >= wbegin && &x < wend) {
+                    vardata_t temp;
+                    temp.copy(x);
+                    var->copy(temp);
+                }
+            }
+        }
+
+        F.env.move_vars(F.tailenv);
+        F.env.clear_funcs();
+
+        for (size_t i = 0; i < n; i++) {
+            regs[base + i].copy(tailargs[i]);
+            tailargs[i].nullify();
+        }
+
+        F.thiscall = (op == R_TTAIL);
+        F.argbase = base + (F.thiscall ? 2 : 1);
+        F.nargs = nargs;
+        F.base = F.argbase + nargs;
+
+        if (F.thiscall)
+            F.env.assign("this", new vardata_t(regs[base + 1]));
+    }
+
+    fcallinfo_t *regvm::lookup_func(size_t id) {
+        if (id >= refcaches.size())
+            refcaches.resize(bc->identifiers.size());
+
+        refcache &C = refcaches[id];
+        unsigned int version = env_t::func_version();
+        if (C.fver != version) {
+            C.fci = frames.back()->env.lookup_func(bc->atoms[id]);
+            C.fver = version;
+        }
+
+        return C.fci;
+    }
+
+    vardata_t *regvm::lookup_global(size_t id, bool search_hierarchy) {
+        env_t &globals = frames.front()->env;
+        refcache &C = refcaches[id];
+        if (C.var != 0 && C.gver == globals.version())
+            return C.var;
+
+        const atom_t &name = bc->atoms[id];
+        if (vardata_t *x = globals.lookup(name, false)) {
+            C.var = x;
+            C.gver = globals.version();
+            return x;
+        }
+
+        return (search_hierarchy && globals.parent()) ? globals.parent()->lookup(name, true) : 0;
+    }
+
+    void regvm::load(bytecode *b) {
+        bc = b;
+        free_frames();
+    }
+
+    bool regvm::special_set(const lk_string &name, vardata_t &) {
+        throw error_t(lk_tr("no defined mechanism to set special variable") + " '" + name + "'");
+    }
+
+    bool regvm::special_get(const lk_string &name, vardata_t &) {
+        throw error_t(lk_tr("no defined mechanism to get special variable") + " '" + name + "'");
+    }
+
+    bool regvm::initialize(lk::env_t *env) {
+        free_frames();
+        errStr.clear();
+
+        if (!bc) {
+            errStr = lk_tr("no bytecode loaded");
+            return false;
+        }
+
+        ip = 0;
+        for (size_t i = 0; i < regs.size(); i++)
+            regs[i].nullify();
+
+        frames.push_back(new frame(env));
+
+        if (bc->atoms.size() != bc->identifiers.size())
+            bc->intern_identifiers(); // assembled without a code generator
+        refcaches.assign(bc->identifiers.size(), refcache());
+        return true;
+    }
+
+/// binds a local register that is not bound yet, resolving its name as the stack vm does for
+/// RLOC (lhs false) or LLOC (lhs true).  the register is bound only to variables owned by
+/// the frame's environment: functions, variables of callers and globals are looked up again
+/// on the next access
+    vardata_t *regvm::resolve(frame &F, size_t r, bool lhs) {
+        env_t &globals = frames.front()->env;
+        size_t id = bc->program[F.entry + 1 + r];
+        const lk_string &name = bc->identifiers[id];
+        const atom_t &atom = bc->atoms[id];
+
+        vardata_t *x = 0;
+        if (fcallinfo_t *fci = lookup_func(id)) {
+            m_func.assign_fcall(fci);
+            return &m_func;
+        } else if ((x = F.env.lookup(atom, false)) != 0) {
+            // local variable, bind it below
+        } else if (!lhs) {
+            if (vardata_t *x1 = F.env.lookup(atom, true))
+                return x1;
+
+            error((const char *) lk_string(lk_tr("referencing unassigned variable:") + name + "\n").c_str());
+            throw halt_t();
+        } else {
+            vardata_t *x2 = globals.lookup(atom, false);
+            if (x2 && x2->flagval(vardata_t::GLOBALVAL))
+                return x2;
+
+            x = new vardata_t;
+            F.env.assign(atom, x);
+        }
+
+        regs[F.base + r].assign(x);
+        return x;
+    }
+
+/// IDX, KEY and their mutable forms: the container register is resolved like any other
+/// operand, and an item of a container that is not referenced by the register is copied
+/// since the register holding it may be overwritten by the result
+    bool regvm::index(frame &F, unsigned int code, bool is_key) {
+        RegOpcode op = (RegOpcode) (unsigned char) code;
+        size_t a = (code >> 8) & 0xFF, b = (code >> 16) & 0xFF, c = (code >> 24);
+        bool is_mutable = (op == R_IDXM || op == R_KEYM);
+
+        vardata_t &cont = regs[F.base + b];
+        vardata_t *arr = &cont.deref();
+        bool is_ref = (cont.type() == vardata_t::REFERENCE);
+        if (arr == &m_unbound) {
+            vardata_t *p = resolve(F, b, is_mutable);
+            arr = &p->deref();
+            is_ref = (p != &m_func);
+        }
+
+        vardata_t *x;
+        if (is_key) {
+            vardata_t &key = value(F, c);
+            if (is_mutable && arr->type() != vardata_t::HASH) {
+                vardata_t k(key); // the key may be the value replaced by the table
+                arr->empty_hash();
+                x = arr->lookup(k, true);
+            } else
+                x = arr->lookup(key, true);
+        } else {
+            size_t idx = value(F, c).as_unsigned();
+            if (is_mutable &&
+                (arr->type() != vardata_t::VECTOR
+                 || arr->length() <= idx))
+                arr->resize(idx + 1);
+
+            x = arr->index(idx);
+        }
+
+        if (is_ref)
+            regs[F.base + a].assign(x);
+        else {
+            vardata_t temp;
+            temp.copy(*x);
+            regs[F.base + a].copy(temp);
+        }
+
+        return true;
+    }
+
+// the loop uses labels-as-values dispatch where the compiler supports it, as lk::vm
+// does.  define LK_NO_COMPUTED_GOTO to force the portable switch dispatch.
+#if !defined(LK_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define LK_COMPUTED_GOTO 1
+#endif
+
+#ifdef LK_COMPUTED_GOTO
+#define VM_OP(x) case x: op_##x:
+#define VM_DISPATCH() goto *dispatch[op]
+#define VM_CHECK_OPCODE() if (op >= __MaxRegOp) goto op_invalid
+#else
+#define VM_OP(x) case x:
+#define VM_DISPATCH() goto dispatch_switch
+#define VM_CHECK_OPCODE()
+#endif
+
+#define VM_FETCH() \
+    if (ip >= code_size) goto done; \
+    code = bc->program[ip]; \
+    op = (RegOpcode) (unsigned char) code; \
+    next_ip = ip + 1; \
+    VM_CHECK_OPCODE()
+
+#define VM_NEXT() { \
+    ip = next_ip; \
+    nexecuted++; \
+    VM_FETCH(); \
+    VM_DISPATCH(); }
+
+#define VM_POLL() if (!on_run(bc->srcpos(ip))) \
+    return error((const char *) lk_tr("halted by user after %d ops").c_str(), nexecuted)
+
+// instruction operands
+#define RA ((code >> 8) & 0xFF)
+#define RB ((code >> 16) & 0xFF)
+#define RC (code >> 24)
+#define RBX (code >> 16)
+#define RAX (code >> 8)
+#define R(x) regs[F.base + (x)]
+#define NEXTWORD (next_ip = ip + 2, (size_t) bc->program[ip + 1])
+
+    bool regvm::run() {
+        if (!bc || bc->program.size() == 0) return error((const char *) lk_tr("no bytecode loaded").c_str());
+        if (bc->engine != bytecode::REGISTER)
+            return error((const char *) lk_tr("bytecode was not generated for the register engine").c_str());
+        if (frames.size() == 0)
+            return error((const char *) lk_tr("vm not initialized").c_str()); // must initialize first.
+
+        size_t nexecuted = 0;
+        const size_t code_size = bc->program.size();
+        size_t next_ip = code_size;
+        unsigned int code;
+        RegOpcode op;
+
+        // environment where all 'global' variables go
+        env_t &globals = frames.front()->env;
+
+#ifdef LK_COMPUTED_GOTO
+        // must be in the same order as the RegOpcode enumeration
+        static const void *const dispatch[] = {
+                &&op_R_ENTER, &&op_R_ARGV, &&op_R_MOVE, &&op_R_LOADK, &&op_R_LOADNULL,
+                &&op_R_GETN, &&op_R_REFL, &&op_R_REFC, &&op_R_REFG, &&op_R_GETS, &&op_R_SETS, &&op_R_WR, &&op_R_ADDWR,
+                &&op_R_ADD, &&op_R_SUB, &&op_R_MUL, &&op_R_DIV, &&op_R_EXP, &&op_R_LT, &&op_R_GT, &&op_R_LE,
+                &&op_R_GE, &&op_R_NE, &&op_R_EQ, &&op_R_OR, &&op_R_AND,
+                &&op_R_ADDK, &&op_R_SUBK, &&op_R_MULK, &&op_R_NOT, &&op_R_NEG, &&op_R_INC, &&op_R_DEC,
+                &&op_R_IDX, &&op_R_KEY, &&op_R_IDXM, &&op_R_KEYM, &&op_R_MAT, &&op_R_WAT,
+                &&op_R_SZ, &&op_R_KEYS, &&op_R_TYP, &&op_R_VEC, &&op_R_HASH, &&op_R_FREF,
+                &&op_R_J, &&op_R_JT, &&op_R_JF,
+                &&op_R_LTJF, &&op_R_GTJF, &&op_R_LEJF, &&op_R_GEJF, &&op_R_NEJF, &&op_R_EQJF,
+                &&op_R_SWI, &&op_R_CALL, &&op_R_TCALL, &&op_R_TAIL, &&op_R_TTAIL, &&op_R_RET, &&op_R_RET0, &&op_R_END};
+        static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == __MaxRegOp, "dispatch table out of date");
+#endif
+
+        try {
+            VM_FETCH();
+            VM_DISPATCH();
+
+#ifndef LK_COMPUTED_GOTO
+            dispatch_switch:
+#endif
+            switch (op) {
+                VM_OP(R_ENTER) {
+                    frame &F = *frames.back();
+                    size_t np = RA, nl = RB, nr = RC;
+                    if (F.base + nr > regs.size())
+                        return error((const char *) lk_tr("stack overflow [sp=%d]").c_str(), regs.size());
+
+                    F.entry = ip;
+                    next_ip = ip + 1 + nl;
+
+                    for (size_t i = 0; i < nl; i++)
+                        R(i).assign(&m_unbound);
+
+                    if (frames.size() > 1) {
+                        if (F.nargs < np) {
+                            // report the error at the first missing parameter, like the ARG instruction
+                            ip += 1 + F.nargs;
+                            return error(lk_tr("too few arguments passed to function").c_str());
+                        }
+
+                        for (size_t i = 0; i < np; i++) {
+                            vardata_t *x = new vardata_t;
+                            x->assign(&regs[F.argbase + i]);
+                            size_t id = bc->program[ip + 1 + i];
+                            F.env.assign(bc->atoms[id], x);
+                            R(i).assign(x);
+                        }
+                    }
+                }
+                VM_NEXT();
+
+                VM_OP(R_ARGV) {
+                    frame &F = *frames.back();
+                    vardata_t *__args = new vardata_t;
+                    __args->empty_vector();
+                    __args->vec()->reserve(F.nargs);
+                    for (size_t i = 0; i < F.nargs; i++)
+                        __args->vec()->push_back(regs[F.argbase + i]);
+
+                    F.env.assign("__args", __args);
+                }
+                VM_NEXT();
+
+                VM_OP(R_MOVE) {
+                    frame &F = *frames.back();
+                    vardata_t &src = R(RB);
+                    if (&src.deref() == &m_unbound) {
+                        vardata_t *x = resolve(F, RB, false);
+                        if (x == &m_func) R(RA).copy(m_func);
+                        else R(RA).assign(x);
+                    } else
+                        R(RA).copy(src);
+                }
+                VM_NEXT();
+
+                VM_OP(R_LOADK) {
+                    frame &F = *frames.back();
+                    R(RA).copy(bc->constants[RBX]);
+                }
+                VM_NEXT();
+
+                VM_OP(R_LOADNULL) {
+                    frame &F = *frames.back();
+                    R(RA).nullify();
+                }
+                VM_NEXT();
+
+                VM_OP(R_GETN)
+                VM_OP(R_REFL)
+                VM_OP(R_REFC)
+                VM_OP(R_REFG) {
+                    frame &F = *frames.back();
+                    const lk_string &name = bc->identifiers[RBX];
+                    const atom_t &atom = bc->atoms[RBX];
+                    vardata_t &dst = R(RA);
+
+                    if (fcallinfo_t *fci = lookup_func(RBX)) {
+                        dst.assign_fcall(fci);
+                    } else if (vardata_t *x1 = (&F == frames.front()) ? lookup_global(RBX, op == R_GETN)
+                                                                     : F.env.lookup(atom, op == R_GETN)) {
+                        dst.assign(x1);
+                    } else if (op != R_GETN) {
+                        // globals are editable from any context if they were flagged as such when created
+                        vardata_t *x2 = globals.lookup(atom, false);
+                        if (x2 && x2->flagval(vardata_t::GLOBALVAL))
+                            dst.assign(x2);
+                        else {
+                            x2 = new vardata_t;
+
+                            if (op == R_REFC) {
+                                x2->set_flag(vardata_t::CONSTVAL);
+                                x2->clear_flag(vardata_t::ASSIGNED);
+                            } else if (op == R_REFG)
+                                x2->set_flag(vardata_t::GLOBALVAL);
+
+                            if (op == R_REFG) globals.assign(atom, x2);
+                            else F.env.assign(atom, x2);
+
+                            dst.assign(x2);
+                        }
+                    } else
+                        return error((const char *) lk_string(
+                                lk_tr("referencing unassigned variable:") + name + "\n").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(R_GETS) {
+                    frame &F = *frames.back();
+                    if (!special_get(bc->identifiers[RBX], R(RA)))
+                        return error((const char *) lk_string(
+                                lk_tr("failed to read external value") + " '" + bc->identifiers[RBX] +
+                                "'").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(R_SETS) {
+                    frame &F = *frames.back();
+                    if (!special_set(bc->identifiers[RBX], value(F, RA)))
+                        return error((const char *) lk_string(
+                                lk_tr("failed to write external value") + " '" + bc->identifiers[RBX] +
+                                "'").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(R_WR) {
+                    frame &F = *frames.back();
+                    // copy the value into a temporary first in case
+                    // the reference being assigned will erase the value
+                    //   e.g.    x = [ 1, 2, 3 ];  x = x[1];
+                    lk::vardata_t temp;
+                    temp.copy(value(F, RB));
+                    target(F, RA).copy(temp);
+                }
+                VM_NEXT();
+
+                VM_OP(R_ADDWR) {
+                    frame &F = *frames.back();
+                    vardata_t &rhs = value(F, RB);
+                    vecops::plus_eq(target(F, RA), rhs);
+                }
+                VM_NEXT();
+
+                VM_OP(R_ADD) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    vardata_t &rhs = value(F, RC);
+                    if (lhs.type() == vardata_t::STRING || rhs.type() == vardata_t::STRING)
+                        R(RA).assign(lhs.as_string() + rhs.as_string());
+                    else if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::ADD, lhs, rhs, R(RA));
+                    else
+                        R(RA).assign(lhs.num() + rhs.num());
+                }
+                VM_NEXT();
+
+                VM_OP(R_SUB) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    vardata_t &rhs = value(F, RC);
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::SUB, lhs, rhs, R(RA));
+                    else
+                        R(RA).assign(lhs.num() - rhs.num());
+                }
+                VM_NEXT();
+
+                VM_OP(R_MUL) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    vardata_t &rhs = value(F, RC);
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::MUL, lhs, rhs, R(RA));
+                    else
+                        R(RA).assign(lhs.num() * rhs.num());
+                }
+                VM_NEXT();
+
+                VM_OP(R_DIV) {
+                    frame &F = *frames.back();
+                    if (vecops::applies(value(F, RB), value(F, RC))) {
+                        vecops::binary(vecops::DIV, value(F, RB), value(F, RC), R(RA));
+                        VM_NEXT();
+                    }
+                    double num = value(F, RB).num();
+                    double den = value(F, RC).num();
+                    if (den == 0.0)
+                        R(RA).assign(std::numeric_limits<double>::quiet_NaN());
+                    else
+                        R(RA).assign(num / den);
+                }
+                VM_NEXT();
+
+                VM_OP(R_EXP) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    vardata_t &rhs = value(F, RC);
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::EXP, lhs, rhs, R(RA));
+                    else
+                        R(RA).assign(::pow(lhs.num(), rhs.num()));
+                }
+                VM_NEXT();
+
+                VM_OP(R_LT)
+                VM_OP(R_GT)
+                VM_OP(R_LE)
+                VM_OP(R_GE)
+                VM_OP(R_NE)
+                VM_OP(R_EQ) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    vardata_t &rhs = value(F, RC);
+                    if (op != R_NE && op != R_EQ && vecops::applies(lhs, rhs)) {
+                        vecops::binary(op == R_LT ? vecops::LT : op == R_GT ? vecops::GT : op == R_LE ? vecops::LE : vecops::GE,
+                                       lhs, rhs, R(RA));
+                        VM_NEXT();
+                    }
+
+                    bool cond;
+                    switch (op) {
+                        case R_LT: cond = lhs.lessthan(rhs); break;
+                        case R_GT: cond = !lhs.lessthan(rhs) && !lhs.equals(rhs); break;
+                        case R_LE: cond = lhs.lessthan(rhs) || lhs.equals(rhs); break;
+                        case R_GE: cond = !lhs.lessthan(rhs); break;
+                        case R_NE: cond = !lhs.equals(rhs); break;
+                        default: cond = lhs.equals(rhs); break;
+                    }
+                    R(RA).assign(cond ? 1.0 : 0.0);
+                }
+                VM_NEXT();
+
+                VM_OP(R_OR) {
+                    frame &F = *frames.back();
+                    R(RA).assign((((int) value(F, RB).num()) || ((int) value(F, RC).num())) ? 1 : 0);
+                }
+                VM_NEXT();
+
+                VM_OP(R_AND) {
+                    frame &F = *frames.back();
+                    R(RA).assign((((int) value(F, RB).num()) && ((int) value(F, RC).num())) ? 1 : 0);
+                }
+                VM_NEXT();
+
+                VM_OP(R_ADDK) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    const vardata_t &rhs = bc->constants[RC];
+                    if (lhs.type() == vardata_t::STRING || rhs.type() == vardata_t::STRING)
+                        R(RA).assign(lhs.as_string() + rhs.as_string());
+                    else if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::ADD, lhs, rhs, R(RA));
+                    else
+                        R(RA).assign(lhs.num() + rhs.num());
+                }
+                VM_NEXT();
+
+                VM_OP(R_SUBK)
+                VM_OP(R_MULK) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    const vardata_t &rhs = bc->constants[RC];
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(op == R_SUBK ? vecops::SUB : vecops::MUL, lhs, rhs, R(RA));
+                    else if (op == R_SUBK)
+                        R(RA).assign(lhs.num() - rhs.num());
+                    else
+                        R(RA).assign(lhs.num() * rhs.num());
+                }
+                VM_NEXT();
+
+                VM_OP(R_NOT) {
+                    frame &F = *frames.back();
+                    R(RA).assign(((int) value(F, RB).num()) ? 0.0 : 1.0);
+                }
+                VM_NEXT();
+
+                VM_OP(R_NEG) {
+                    frame &F = *frames.back();
+                    if (value(F, RB).type() == vardata_t::VECTOR)
+                        vecops::negate(value(F, RB), R(RA));
+                    else
+                        R(RA).assign(0.0 - value(F, RB).num());
+                }
+                VM_NEXT();
+
+                VM_OP(R_INC)
+                VM_OP(R_DEC) {
+                    frame &F = *frames.back();
+                    vardata_t &val = target(F, RA);
+                    val.assign(val.num() + (op == R_INC ? 1.0 : -1.0));
+                }
+                VM_NEXT();
+
+                VM_OP(R_IDX)
+                VM_OP(R_IDXM)
+                index(*frames.back(), code, false);
+                VM_NEXT();
+
+                VM_OP(R_KEY)
+                VM_OP(R_KEYM)
+                index(*frames.back(), code, true);
+                VM_NEXT();
+
+                VM_OP(R_MAT) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    vardata_t &rhs = value(F, RC);
+                    if (lhs.type() == vardata_t::HASH) {
+                        lk::varhash_t *hh = lhs.hash();
+                        lk::varhash_t::iterator it = hh->find(rhs.as_string());
+                        if (it != hh->end())
+                            hh->erase(it);
+                    } else if (lhs.type() == vardata_t::VECTOR) {
+                        std::vector<lk::vardata_t> *vv = lhs.vec();
+                        size_t idx = rhs.as_unsigned();
+                        if (idx < vv->size())
+                            vv->erase(vv->begin() + idx);
+                    } else
+                        return error(lk_tr("-@ requires a hash or vector").c_str());
+
+                    // the result is the container itself
+                    if (RA != RB) {
+                        if (&R(RB).deref() == &lhs) R(RA).copy(R(RB));
+                        else R(RA).assign(&lhs);
+                    }
+                }
+                VM_NEXT();
+
+                VM_OP(R_WAT) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RB);
+                    vardata_t &rhs = value(F, RC);
+                    double result;
+                    if (lhs.type() == vardata_t::HASH) {
+                        lk::varhash_t *hh = lhs.hash();
+                        result = hh->find(rhs.as_string()) != hh->end() ? 1.0 : 0.0;
+                    } else if (lhs.type() == vardata_t::VECTOR) {
+                        std::vector<lk::vardata_t> *vv = lhs.vec();
+                        result = -1.0;
+                        for (size_t i = 0; i < vv->size(); i++) {
+                            if ((*vv)[i].equals(rhs)) {
+                                result = (double) i;
+                                break;
+                            }
+                        }
+                    } else if (lhs.type() == vardata_t::STRING) {
+                        lk_string::size_type pos = lhs.str().find(rhs.as_string());
+                        result = pos != lk_string::npos ? (int) pos : -1.0;
+                    } else
+                        return error(lk_tr("?@ requires a hash, vector, or string").c_str());
+
+                    R(RA).assign(result);
+                }
+                VM_NEXT();
+
+                VM_OP(R_SZ) {
+                    frame &F = *frames.back();
+                    vardata_t &rhs = value(F, RB);
+                    int count = 0;
+                    if (rhs.type() == vardata_t::VECTOR)
+                        count = (int) rhs.length();
+                    else if (rhs.type() == vardata_t::STRING)
+                        count = (int) rhs.str().length();
+                    else if (rhs.type() == vardata_t::HASH) {
+                        varhash_t *h = rhs.hash();
+                        for (varhash_t::iterator it = h->begin();
+                             it != h->end();
+                             ++it) {
+                            if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                                count++;
+                        }
+                    } else
+                        return error(lk_tr("operand to sizeof must be a array, string, or table type").c_str());
+
+                    R(RA).assign(count);
+                }
+                VM_NEXT();
+
+                VM_OP(R_KEYS) {
+                    frame &F = *frames.back();
+                    vardata_t &rhs = value(F, RB);
+                    if (rhs.type() == vardata_t::HASH) {
+                        varhash_t *h = rhs.hash();
+
+                        lk::vardata_t keys;
+                        keys.empty_vector();
+                        keys.vec()->reserve(h->size());
+                        for (varhash_t::iterator it = h->begin();
+                             it != h->end();
+                             ++it) {
+                            if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                                keys.vec_append((*it).first);
+                        }
+                        R(RA).copy(keys);
+                    } else
+                        return error(lk_tr("operand to @ (keysof) must be a table").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(R_TYP) {
+                    frame &F = *frames.back();
+                    if (vardata_t *x = F.env.lookup(bc->atoms[RBX], true))
+                        R(RA).assign(x->deref().typestr());
+                    else
+                        R(RA).assign("unknown");
+                }
+                VM_NEXT();
+
+                VM_OP(R_VEC) {
+                    frame &F = *frames.back();
+                    size_t n = RB;
+                    vardata_t &vv = R(RA);
+                    if (n > 0) {
+                        vardata_t save1;
+                        save1.copy(vv.deref());
+                        vv.empty_vector();
+                        vv.vec()->resize(n);
+                        vv.index(0)->copy(save1);
+                        for (size_t i = 1; i < n; i++)
+                            vv.index(i)->copy(R(RA + i).deref());
+                    } else
+                        vv.empty_vector();
+                }
+                VM_NEXT();
+
+                VM_OP(R_HASH) {
+                    frame &F = *frames.back();
+                    size_t N = RB * 2;
+                    vardata_t &vv = R(RA);
+                    vardata_t key1(vv.deref()); // the first key is replaced by the table
+                    vv.empty_hash();
+                    for (size_t i = 0; i < N; i += 2)
+                        vv.hash_item(i == 0 ? key1 : R(RA + i).deref(), R(RA + i + 1).deref());
+                }
+                VM_NEXT();
+
+                VM_OP(R_FREF) {
+                    frame &F = *frames.back();
+                    R(RA).assign_faddr(NEXTWORD);
+                }
+                VM_NEXT();
+
+                VM_OP(R_J)
+                if (RAX <= ip) VM_POLL();
+                next_ip = RAX;
+                VM_NEXT();
+
+                VM_OP(R_JT)
+                VM_OP(R_JF) {
+                    frame &F = *frames.back();
+                    size_t addr = NEXTWORD;
+                    if (value(F, RA).as_boolean() == (op == R_JT)) next_ip = addr;
+                }
+                VM_NEXT();
+
+                VM_OP(R_LTJF)
+                VM_OP(R_GTJF)
+                VM_OP(R_LEJF)
+                VM_OP(R_GEJF)
+                VM_OP(R_NEJF)
+                VM_OP(R_EQJF) {
+                    frame &F = *frames.back();
+                    vardata_t &lhs = value(F, RA);
+                    vardata_t &rhs = value(F, RB);
+                    bool cond;
+                    if (op != R_NEJF && op != R_EQJF && vecops::applies(lhs, rhs))
+                        throw error_t(vecops::mask_test_error());
+
+                    switch (op) {
+                        case R_LTJF: cond = lhs.lessthan(rhs); break;
+                        case R_GTJF: cond = !lhs.lessthan(rhs) && !lhs.equals(rhs); break;
+                        case R_LEJF: cond = lhs.lessthan(rhs) || lhs.equals(rhs); break;
+                        case R_GEJF: cond = !lhs.lessthan(rhs); break;
+                        case R_NEJF: cond = !lhs.equals(rhs); break;
+                        default: cond = lhs.equals(rhs); break;
+                    }
+                    size_t addr = NEXTWORD;
+                    if (!cond) next_ip = addr;
+                }
+                VM_NEXT();
+
+                VM_OP(R_SWI) {
+                    frame &F = *frames.back();
+                    size_t index = value(F, RA).as_unsigned();
+                    size_t noptions = RB;
+
+                    if (index >= noptions)
+                        return error((const char *) lk_tr(
+                                             "switch statement index %d out of bounds: only %d options").c_str(), (int) index,
+                                     (int) (noptions));
+
+                    // advance instruction pointer to the correct jump based on the index number
+                    next_ip = ip + 1 + index;
+                }
+                VM_NEXT();
+
+                VM_OP(R_TAIL)
+                VM_OP(R_TTAIL) {
+                    frame &F = *frames.back();
+                    size_t a = F.base + RA;
+                    if (frames.size() > 1 && regs[a].deref().type() == vardata_t::INTFUNC) {
+                        VM_POLL();
+
+                        tail_call(op, a, RB);
+                        next_ip = regs[F.argbase - (F.thiscall ? 2 : 1)].deref().faddr();
+                        VM_NEXT();
+                    }
+                    // other calls complete with the R_RET that follows
+                    op = (op == R_TTAIL) ? R_TCALL : R_CALL;
+                }
+
+                VM_OP(R_CALL)
+                VM_OP(R_TCALL) {
+                    frame &F = *frames.back();
+                    size_t a = F.base + RA;
+                    size_t nargs = RB;
+                    vardata_t &fn = regs[a].deref();
+                    if (vardata_t::EXTFUNC == fn.type() && op == R_CALL) {
+                        fcallinfo_t *fci = fn.fcall();
+
+                        // the function register receives the return value (even if null)
+                        vardata_t &retval = regs[a];
+                        retval.nullify();
+                        invoke_t cxt(&F.env, retval, fci->user_data, bc);
+
+                        for (size_t i = 0; i < nargs; i++)
+                            cxt.arg_list().push_back(regs[a + 1 + i]);
+
+                        try {
+                            if (fci->f) (*(fci->f))(cxt);
+                            else if (fci->f_ext) lk::external_call(fci->f_ext, cxt);
+                            else cxt.error(lk_tr("invalid internal reference to function"));
+                        }
+                        catch (std::exception &e) {
+                            return error(e.what());
+                        }
+                    } else if (vardata_t::INTFUNC == fn.type()) {
+                        VM_POLL();
+
+                        size_t addr = fn.faddr();
+                        size_t argbase = a + (op == R_TCALL ? 2 : 1);
+
+                        frame &NF = *push_frame(&F.env);
+                        NF.base = argbase + nargs;
+                        NF.argbase = argbase;
+                        NF.nargs = nargs;
+                        NF.retaddr = next_ip;
+
+                        if (op == R_TCALL) {
+                            NF.env.assign("this", new vardata_t(regs[a + 1]));
+                            NF.thiscall = true;
+                        }
+
+                        next_ip = addr;
+                    } else
+                        return error(lk_tr("invalid function access").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(R_RET)
+                VM_OP(R_RET0)
+                if (frames.size() > 1) {
+                    frame &F = *frames.back();
+                    vardata_t &retval = regs[F.argbase - (F.thiscall ? 2 : 1)];
+                    if (op == R_RET)
+                        retval.copy(value(F, RA));
+                    else if (retval.type() == vardata_t::REFERENCE) {
+                        // a function without a return value returns itself, as on the stack vm
+                        vardata_t temp;
+                        temp.copy(retval.deref());
+                        retval.copy(temp);
+                    }
+
+                    next_ip = F.retaddr;
+                    pop_frame();
+                } else
+                    next_ip = code_size;
+                VM_NEXT();
+
+                VM_OP(R_END)
+                next_ip = code_size;
+                VM_NEXT();
+
+                default:
+#ifdef LK_COMPUTED_GOTO
+                op_invalid:
+#endif
+                    return error((const char *) lk_string(lk_tr("invalid instruction") + " (0x%02X)").c_str(),
+                                 (unsigned int) op);
+            };
+
+            done:;
+        }
+        catch (halt_t &) {
+            return false;
+        }
+        catch (std::exception &exc) {
+            srcpos_t spos = bc->srcpos(ip);
+
+            return error((const char *) lk_string(lk_tr("runtime exception at") + " %s %d: %s").c_str(),
+                         spos.line < 0 ? "ip" : (const char *) lk_string(lk_tr("line")).c_str(),
+                         spos.line < 0 ? (int) ip : (int) spos.line,
+                         exc.what());
+        }
+
+        return true;
+    }
+
+    bool regvm::error(const char *fmt, ...) {
+        char buf[512];
+        sprintf(buf, "[%d] ", bc ? bc->debuginfo.stmt(ip) : srcpos_t::npos.stmt);
+        errStr = buf;
+
+        va_list args;
+        va_start(args, fmt);
+        vsprintf(buf, fmt, args);
+        va_end(args);
+        errStr += buf;
+
+        return false;
+    }
+} // namespace lk
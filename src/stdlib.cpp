@@ -37,6 +37,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <algorithm>
 #include <limits>
 #include <climits>
+#include <utility>
 // threading
 #include <thread>
 #include <future>
@@ -45,6 +46,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 
 #include <lk/stdlib.h>
+#include <lk/vecops.h>
 
 // threading
 #include <lk/vm.h>
@@ -788,14 +790,15 @@ static void _alloc(lk::invoke_t &cxt) {
     if (dim1 < 1)
         return;
 
-    cxt.result().resize(dim1);
-
+    // rows of nulls are allocated as packed numbers, ready to be filled in
     if (dim2 > 0) {
-        for (int i = 0; i < dim1; i++) {
-            lk::vardata_t *item = cxt.result().index(i);
-            item->empty_vector();
-            item->resize(dim2);
-        }
+        std::vector<double> row(dim2, lk::vardata_t::null_number());
+        cxt.result().resize(dim1);
+        for (int i = 0; i < dim1; i++)
+            cxt.result().index(i)->assign(row.data(), row.size());
+    } else {
+        std::vector<double> row(dim1, lk::vardata_t::null_number());
+        cxt.result().assign(row.data(), row.size());
     }
 }
 
@@ -811,7 +814,7 @@ static void _dir_list(lk::invoke_t &cxt) {
     std::vector<lk_string> list = lk::dir_list(path, ext, dirs_also);
     cxt.result().empty_vector();
     for (size_t i = 0; i < list.size(); i++)
-        cxt.result().vec_append(list[i]);
+        cxt.result().vec_append(std::move(list[i]));
 }
 
 static void _file_exists(lk::invoke_t &cxt) {
@@ -1542,7 +1545,12 @@ public:
                 out("[ ");
                 level++;
                 for (int i = 0; i < (int) x.length(); i++) {
-                    write(*x.index(i));
+                    if (x.is_numarray()) {
+                        lk::vardata_t item;
+                        x.item(i, item);
+                        write(item);
+                    } else
+                        write(*x.index(i));
                     if (i < (int) x.length() - 1)
                         out(", ");
                 }
@@ -1560,7 +1568,7 @@ public:
                      it != x.hash()->end();
                      ++it) {
                     indent();
-                    out("\"" + it->first + "\" : ");
+                    out("\"" + it->first.str() + "\" : ");
                     write(*it->second);
                     if (i++ < n - 1)
                         out(",\n");
@@ -1688,7 +1696,7 @@ public:
             if (!parse(item))
                 return false;
 
-            x.vec()->push_back(item);
+            x.vec()->push_back(std::move(item));
 
             if (tok == lk::lexer::SEP_COMMA)
                 skip();
@@ -1696,6 +1704,7 @@ public:
                 break;
         }
 
+        x.pack();
         return match(lk::lexer::SEP_RBRACK);
     }
 
@@ -2018,7 +2027,7 @@ static void _split(lk::invoke_t &cxt) {
     cxt.result().empty_vector();
     cxt.result().resize(list.size());
     for (size_t i = 0; i < list.size(); i++)
-        cxt.result().index(i)->assign(list[i]);
+        cxt.result().index(i)->assign(std::move(list[i]));
 }
 
 static void _join(lk::invoke_t &cxt) {
@@ -2039,14 +2048,27 @@ static void _real_array(lk::invoke_t &cxt) {
     LK_DOC("real_array", "Splits a whitespace delimited string into an array of real numbers.", "(string):array");
 
     std::vector<lk_string> list = lk::split(cxt.arg(0).as_string(), " \t\n\r,;:", false, false);
-    cxt.result().empty_vector();
+    std::vector<double> values(list.size());
     for (size_t i = 0; i < list.size(); i++)
-        cxt.result().vec_append(atof((const char *) list[i].c_str()));
+        values[i] = atof((const char *) list[i].c_str());
+    cxt.result().assign(values.data(), values.size());
 }
 
 static void _ff_sum(lk::vardata_t &x, double mean, double *sum, double *sumsqr, int *nvalues) {
     switch (x.type()) {
         case lk::vardata_t::VECTOR: {
+            if (const double *p = x.numbers()) {
+                // packed numbers, skipping the nulls
+                size_t n = x.length();
+                for (size_t i = 0; i < n; i++) {
+                    if (lk::vardata_t::is_null_number(p[i])) continue;
+                    (*nvalues)++;
+                    (*sum) += p[i];
+                    (*sumsqr) += (p[i] - mean) * (p[i] - mean);
+                }
+                break;
+            }
+
             for (size_t i = 0; i < x.length(); i++)
                 _ff_sum(*(x.index(i)), mean, sum, sumsqr, nvalues);
         }
@@ -2173,10 +2195,21 @@ static void _mmin(lk::invoke_t &cxt) {
                && cxt.arg(0).type() == lk::vardata_t::VECTOR
                && cxt.arg(0).length() > 0) {
         lk::vardata_t &arr = cxt.arg(0);
-        double m = arr.index(0)->as_number();
-        for (size_t i = 1; i < arr.length(); i++) {
-            double t = arr.index(i)->as_number();
-            if (t < m) m = t;
+        double m;
+        if (const double *p = arr.numbers()) {
+            // a null item counts as 0, as it does below
+            size_t n = arr.length();
+            m = lk::vardata_t::is_null_number(p[0]) ? 0.0 : p[0];
+            for (size_t i = 1; i < n; i++) {
+                double t = lk::vardata_t::is_null_number(p[i]) ? 0.0 : p[i];
+                if (t < m) m = t;
+            }
+        } else {
+            m = arr.index(0)->as_number();
+            for (size_t i = 1; i < arr.length(); i++) {
+                double t = arr.index(i)->as_number();
+                if (t < m) m = t;
+            }
         }
         cxt.result().assign(m);
     } else
@@ -2197,16 +2230,70 @@ static void _mmax(lk::invoke_t &cxt) {
                && cxt.arg(0).type() == lk::vardata_t::VECTOR
                && cxt.arg(0).length() > 0) {
         lk::vardata_t &arr = cxt.arg(0);
-        double m = arr.index(0)->as_number();
-        for (size_t i = 1; i < arr.length(); i++) {
-            double t = arr.index(i)->as_number();
-            if (t > m) m = t;
+        double m;
+        if (const double *p = arr.numbers()) {
+            // a null item counts as 0, as it does below
+            size_t n = arr.length();
+            m = lk::vardata_t::is_null_number(p[0]) ? 0.0 : p[0];
+            for (size_t i = 1; i < n; i++) {
+                double t = lk::vardata_t::is_null_number(p[i]) ? 0.0 : p[i];
+                if (t > m) m = t;
+            }
+        } else {
+            m = arr.index(0)->as_number();
+            for (size_t i = 1; i < arr.length(); i++) {
+                double t = arr.index(i)->as_number();
+                if (t > m) m = t;
+            }
         }
         cxt.result().assign(m);
     } else
         cxt.error("invalid arguments to the max() function");
 }
 
+static void _mselect(lk::invoke_t &cxt) {
+    LK_DOC("select",
+           "Selects the items of a where a mask, such as the result of an array comparison, is nonzero and the items of b elsewhere. Either of a and b can be a number used for every item.",
+           "(array:mask, variant:a, variant:b):array");
+    if (cxt.arg_count() != 3 || cxt.arg(0).type() != lk::vardata_t::VECTOR) {
+        cxt.error("invalid arguments to the select() function");
+        return;
+    }
+
+    lk::vecops::select(cxt.arg(0), cxt.arg(1), cxt.arg(2), cxt.result());
+}
+
+static void mask_reduce(lk::invoke_t &cxt, const char *name, bool all) {
+    if (cxt.arg_count() != 1 || cxt.arg(0).type() != lk::vardata_t::VECTOR) {
+        cxt.error(lk_string("invalid arguments to the ") + name + "() function");
+        return;
+    }
+
+    lk::vardata_t &mask = cxt.arg(0);
+    lk::vardata_t x;
+    bool result = all;
+    for (size_t i = 0; result == all && i < mask.length(); i++) {
+        mask.item(i, x);
+        result = x.as_boolean();
+    }
+
+    cxt.result().assign(result ? 1.0 : 0.0);
+}
+
+static void _mall(lk::invoke_t &cxt) {
+    LK_DOC("all",
+           "True if every item of an array, such as the mask of an array comparison, is true. A comparison of arrays cannot be the condition of an if, while or for itself.",
+           "(array:mask):boolean");
+    mask_reduce(cxt, "all", true);
+}
+
+static void _many(lk::invoke_t &cxt) {
+    LK_DOC("any",
+           "True if any item of an array, such as the mask of an array comparison, is true. A comparison of arrays cannot be the condition of an if, while or for itself.",
+           "(array:mask):boolean");
+    mask_reduce(cxt, "any", false);
+}
+
 static void _mceil(lk::invoke_t &cxt) {
     LK_DOC("ceil", "Round to the smallest integral value not less than x.", "(real:x):real");
     cxt.result().assign(::ceil(cxt.arg(0).as_number()));
@@ -2563,15 +2650,12 @@ void _sql_exec(lk::invoke_t &cxt) {
                             hexstr += buf;
                         }
 
-                        row.vec_append(hexstr);
+                        row.vec_append(std::move(hexstr));
                     }
                         break;
 
-                    case SQLITE_NULL: {
-                        lk::vardata_t nv;
-                        nv.nullify();
-                        row.vec()->push_back(nv);
-                    }
+                    case SQLITE_NULL:
+                        row.vec()->push_back(lk::vardata_t());
                         break;
                 };
             } // value column loop
@@ -2697,6 +2781,9 @@ lk::fcall_t *lk::stdlib_math() {
             _msum,
             _mmin,
             _mmax,
+            _mselect,
+            _mall,
+            _many,
             _mmean,
             _mmedian,
             _mstddev,
@@ -2780,7 +2867,7 @@ std::vector<lk_string> lk::split(const lk_string &str, const lk_string &delim, b
         if (token.empty() && !ret_empty)
             continue;
 
-        list.push_back(token);
+        list.push_back(std::move(token));
 
         if (ret_delim && cur_delim != 0 && m_pos < str.length())
             list.push_back(to_string(cur_delim));
@@ -0,0 +1,328 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) Alliance for Sustainable Energy, LLC. See also https://github.com/NREL/lk/blob/develop/LICENSE
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <lk/vecops.h>
+
+#if !defined(LK_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64)) \
+    && (defined(__GNUC__) || defined(_MSC_VER))
+#define LK_VECOPS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LK_TARGET_AVX2
+#else
+#define LK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace lk {
+    namespace vecops {
+
+        namespace {
+            /// items of an operand, or a number used for every item (stride 0)
+            struct operand {
+                operand() : p(0), n(0), stride(0), x(0) {}
+
+                vardata_t packed; ///< share of the items, kept until the result is assigned
+                const double *p;
+                size_t n, stride;
+                double x;
+            };
+
+            void fetch(const vardata_t &v, operand &o) {
+                if (v.type() != vardata_t::VECTOR) {
+                    o.x = v.num();
+                    o.p = &o.x;
+                    o.n = 1;
+                    o.stride = 0;
+                    return;
+                }
+
+                o.packed.copy(const_cast<vardata_t &>(v));
+                if (!o.packed.pack())
+                    throw error_t(lk_tr("element-wise operators require arrays of numbers"));
+
+                o.p = o.packed.numbers();
+                o.n = o.packed.length();
+                o.stride = 1;
+                for (size_t i = 0; i < o.n; i++)
+                    if (vardata_t::is_null_number(o.p[i]))
+                        throw error_t(lk_tr("access violation: expected numeric, but found") + " null");
+            }
+
+            /// length of the result, which is that of the array operands
+            size_t length(const operand &a, const operand &b) {
+                if (a.stride && b.stride && a.n != b.n)
+                    throw error_t((const char *) lk_tr("element-wise operands differ in length (%d and %d)").c_str(),
+                                  (int) a.n, (int) b.n);
+                return a.stride ? a.n : b.n;
+            }
+
+            template<int OP>
+            inline double apply(double x, double y) {
+                switch (OP) {
+                    case ADD: return x + y;
+                    case SUB: return x - y;
+                    case MUL: return x * y;
+                    case DIV: return (y == 0.0) ? std::numeric_limits<double>::quiet_NaN() : x / y;
+                    case EXP: return ::pow(x, y);
+                    // as vardata_t::lessthan and equals, so that NaN compares as the scalar operators do
+                    case LT: return (x < y) ? 1.0 : 0.0;
+                    case LE: return (x < y || x == y) ? 1.0 : 0.0;
+                    case GT: return (!(x < y) && !(x == y)) ? 1.0 : 0.0;
+                    default: return !(x < y) ? 1.0 : 0.0;
+                }
+            }
+
+            template<int OP>
+            void scalar_loop(const double *a, size_t sa, const double *b, size_t sb, double *r, size_t i, size_t n) {
+                for (; i < n; i++)
+                    r[i] = apply<OP>(a[i * sa], b[i * sb]);
+            }
+
+            void scalar_select(const double *m, const double *a, size_t sa, const double *b, size_t sb, double *r,
+                               size_t i, size_t n) {
+                for (; i < n; i++)
+                    r[i] = (m[i] != 0.0) ? a[i * sa] : b[i * sb];
+            }
+
+#ifdef LK_VECOPS_X86
+            template<int OP>
+            void sse2_loop(const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                const __m128d one = _mm_set1_pd(1.0);
+                const __m128d nan = _mm_set1_pd(std::numeric_limits<double>::quiet_NaN());
+                size_t i = 0;
+                if (OP != EXP) {
+                    for (; i + 2 <= n; i += 2) {
+                        __m128d x = sa ? _mm_loadu_pd(a + i) : _mm_set1_pd(a[0]);
+                        __m128d y = sb ? _mm_loadu_pd(b + i) : _mm_set1_pd(b[0]);
+                        __m128d z;
+                        switch (OP) {
+                            case ADD: z = _mm_add_pd(x, y); break;
+                            case SUB: z = _mm_sub_pd(x, y); break;
+                            case MUL: z = _mm_mul_pd(x, y); break;
+                            case DIV: {
+                                __m128d zero = _mm_cmpeq_pd(y, _mm_setzero_pd());
+                                z = _mm_or_pd(_mm_andnot_pd(zero, _mm_div_pd(x, y)), _mm_and_pd(zero, nan));
+                            }
+                                break;
+                            case LT: z = _mm_and_pd(_mm_cmplt_pd(x, y), one); break;
+                            case LE: z = _mm_and_pd(_mm_cmple_pd(x, y), one); break;
+                            case GT: z = _mm_and_pd(_mm_cmpnle_pd(x, y), one); break;
+                            default: z = _mm_and_pd(_mm_cmpnlt_pd(x, y), one); break;
+                        }
+                        _mm_storeu_pd(r + i, z);
+                    }
+                }
+                scalar_loop<OP>(a, sa, b, sb, r, i, n);
+            }
+
+            void sse2_select(const double *m, const double *a, size_t sa, const double *b, size_t sb, double *r,
+                             size_t n) {
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2) {
+                    __m128d x = sa ? _mm_loadu_pd(a + i) : _mm_set1_pd(a[0]);
+                    __m128d y = sb ? _mm_loadu_pd(b + i) : _mm_set1_pd(b[0]);
+                    __m128d on = _mm_cmpneq_pd(_mm_loadu_pd(m + i), _mm_setzero_pd());
+                    _mm_storeu_pd(r + i, _mm_or_pd(_mm_and_pd(on, x), _mm_andnot_pd(on, y)));
+                }
+                scalar_select(m, a, sa, b, sb, r, i, n);
+            }
+
+            template<int OP>
+            LK_TARGET_AVX2 void avx2_loop(const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                const __m256d one = _mm256_set1_pd(1.0);
+                const __m256d nan = _mm256_set1_pd(std::numeric_limits<double>::quiet_NaN());
+                size_t i = 0;
+                if (OP != EXP) {
+                    for (; i + 4 <= n; i += 4) {
+                        __m256d x = sa ? _mm256_loadu_pd(a + i) : _mm256_set1_pd(a[0]);
+                        __m256d y = sb ? _mm256_loadu_pd(b + i) : _mm256_set1_pd(b[0]);
+                        __m256d z;
+                        switch (OP) {
+                            case ADD: z = _mm256_add_pd(x, y); break;
+                            case SUB: z = _mm256_sub_pd(x, y); break;
+                            case MUL: z = _mm256_mul_pd(x, y); break;
+                            case DIV:
+                                z = _mm256_blendv_pd(_mm256_div_pd(x, y), nan,
+                                                     _mm256_cmp_pd(y, _mm256_setzero_pd(), _CMP_EQ_OQ));
+                                break;
+                            case LT: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LT_OQ), one); break;
+                            case LE: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LE_OQ), one); break;
+                            case GT: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_NLE_UQ), one); break;
+                            default: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_NLT_UQ), one); break;
+                        }
+                        _mm256_storeu_pd(r + i, z);
+                    }
+                }
+                scalar_loop<OP>(a, sa, b, sb, r, i, n);
+            }
+
+            LK_TARGET_AVX2 void avx2_select(const double *m, const double *a, size_t sa, const double *b, size_t sb,
+                                            double *r, size_t n) {
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    __m256d x = sa ? _mm256_loadu_pd(a + i) : _mm256_set1_pd(a[0]);
+                    __m256d y = sb ? _mm256_loadu_pd(b + i) : _mm256_set1_pd(b[0]);
+                    __m256d on = _mm256_cmp_pd(_mm256_loadu_pd(m + i), _mm256_setzero_pd(), _CMP_NEQ_UQ);
+                    _mm256_storeu_pd(r + i, _mm256_blendv_pd(y, x, on));
+                }
+                scalar_select(m, a, sa, b, sb, r, i, n);
+            }
+
+            bool has_avx2() {
+#ifdef _MSC_VER
+                int info[4];
+                __cpuid(info, 0);
+                if (info[0] < 7) return false;
+                __cpuid(info, 1);
+                if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return false; // OSXSAVE, and ymm state
+                __cpuidex(info, 7, 0);
+                return (info[1] & (1 << 5)) != 0;
+#else
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2") != 0;
+#endif
+            }
+
+            enum isa_t {
+                SCALAR, SSE2, AVX2
+            };
+
+            isa_t detect() {
+                return has_avx2() ? AVX2 : SSE2;
+            }
+
+            isa_t selected() {
+                static const isa_t sel = detect();
+                return sel;
+            }
+#endif
+
+            template<int OP>
+            void run(const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+#ifdef LK_VECOPS_X86
+                switch (selected()) {
+                    case AVX2: avx2_loop<OP>(a, sa, b, sb, r, n); return;
+                    case SSE2: sse2_loop<OP>(a, sa, b, sb, r, n); return;
+                    default: break;
+                }
+#endif
+                scalar_loop<OP>(a, sa, b, sb, r, 0, n);
+            }
+        }
+
+        void binary(op_t op, const vardata_t &lhs, const vardata_t &rhs, vardata_t &result) {
+            operand a, b;
+            fetch(lhs, a);
+            fetch(rhs, b);
+            size_t n = length(a, b);
+
+            std::vector<double> r(n);
+            if (n > 0) {
+                switch (op) {
+                    case ADD: run<ADD>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case SUB: run<SUB>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case MUL: run<MUL>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case DIV: run<DIV>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case EXP: run<EXP>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case LT: run<LT>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case LE: run<LE>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case GT: run<GT>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                    case GE: run<GE>(a.p, a.stride, b.p, b.stride, r.data(), n); break;
+                }
+            }
+
+            result.assign(std::move(r));
+        }
+
+        void negate(const vardata_t &x, vardata_t &result) {
+            vardata_t zero;
+            zero.assign(0.0);
+            binary(SUB, zero, x, result);
+        }
+
+        lk_string mask_test_error() {
+            return lk_tr("comparison of arrays used as a condition: test its mask with all() or any()");
+        }
+
+        void plus_eq(vardata_t &lhs, vardata_t &rhs) {
+            if (lhs.type() != vardata_t::VECTOR) {
+                if (lhs.type() == vardata_t::STRING || rhs.type() == vardata_t::STRING)
+                    lhs.assign(lhs.as_string() + rhs.as_string());
+                else if (applies(lhs, rhs))
+                    binary(ADD, lhs, rhs, lhs);
+                else
+                    lhs.assign(lhs.num() + rhs.num());
+                return;
+            }
+
+            // rhs may be lhs itself or one of its items, which appending can move
+            vardata_t items;
+            items.copy(rhs);
+            size_t n = (items.type() == vardata_t::VECTOR) ? items.length() : 1;
+            vardata_t x;
+            for (size_t i = 0; i < n; i++) {
+                if (items.type() == vardata_t::VECTOR) items.item(i, x);
+                else x.copy(items);
+
+                // numbers keep a packed array packed
+                if (x.type() == vardata_t::NUMBER) lhs.vec_append(x.num());
+                else lhs.vec_append(std::move(x));
+            }
+        }
+
+        void select(const vardata_t &mask, const vardata_t &a, const vardata_t &b, vardata_t &result) {
+            operand m, x, y;
+            fetch(mask, m);
+            fetch(a, x);
+            fetch(b, y);
+            if (!m.stride)
+                throw error_t(lk_tr("element-wise selection requires an array mask"));
+            size_t n = length(m, x);
+            length(m, y);
+
+            std::vector<double> r(n);
+#ifdef LK_VECOPS_X86
+            if (selected() == AVX2) avx2_select(m.p, x.p, x.stride, y.p, y.stride, r.data(), n);
+            else sse2_select(m.p, x.p, x.stride, y.p, y.stride, r.data(), n);
+#else
+            scalar_select(m.p, x.p, x.stride, y.p, y.stride, r.data(), 0, n);
+#endif
+            result.assign(std::move(r));
+        }
+
+    }
+} // namespace lk
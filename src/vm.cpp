@@ -29,11 +29,16 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
+#include <chrono>
 #include <numeric>
 #include <limits>
 #include <cmath>
 
+#include <lk/aot.h>
 #include <lk/vm.h>
+#include <lk/jit.h>
+#include <lk/vecops.h>
 
 namespace lk {
     OpCodeEntry op_table[] = {
@@ -74,6 +79,8 @@ namespace lk {
             {LREF,    "lref"}, // impl
             {LCREF,   "lcref"}, // impl
             {LGREF,   "lgref"}, // impl
+            {RLOC,    "rloc"}, // impl
+            {LLOC,    "lloc"}, // impl
             {FREF,    "fref"}, // impl
             {CALL,    "call"}, // impl
             {TCALL,   "tcall"}, // impl
@@ -84,8 +91,241 @@ namespace lk {
             {TYP,     "typ"}, // impl
             {VEC,     "vec"},
             {HASH,    "hash"},
+            {ARGV,    "argv"},
+            {ADDWR,   "addwr"},
+            {ADDC,    "addc"},
+            {SUBC,    "subc"},
+            {MULC,    "mulc"},
+            {LTJF,    "ltjf"},
+            {GTJF,    "gtjf"},
+            {LEJF,    "lejf"},
+            {GEJF,    "gejf"},
+            {NEJF,    "nejf"},
+            {EQJF,    "eqjf"},
+            {JTK,     "jtk"},
+            {JFK,     "jfk"},
+            {INCL,    "incl"},
+            {DECL,    "decl"},
+            {WRP,     "wrp"},
+            {IDXWR,   "idxwr"},
+            {IDXWRP,  "idxwrp"},
+            {IDXINC,  "idxinc"},
+            {IDXDEC,  "idxdec"},
+            {TAIL,    "tail"},
+            {TTAIL,   "ttail"},
+            {PICK,    "pick"},
+            {DROP,    "drop"},
+            {FORPREP, "forprep"},
+            {FORLOOP, "forloop"},
+            {ADDN,    "addn"},
+            {SUBN,    "subn"},
+            {MULN,    "muln"},
+            {DIVN,    "divn"},
+            {LTN,     "ltn"},
+            {GTN,     "gtn"},
+            {LEN,     "len"},
+            {GEN,     "gen"},
+            {NEN,     "nen"},
+            {EQN,     "eqn"},
+            {ADDCN,   "addcn"},
+            {SUBCN,   "subcn"},
+            {MULCN,   "mulcn"},
+            {LTJFN,   "ltjfn"},
+            {GTJFN,   "gtjfn"},
+            {LEJFN,   "lejfn"},
+            {GEJFN,   "gejfn"},
+            {NEJFN,   "nejfn"},
+            {EQJFN,   "eqjfn"},
             {__MaxOp, 0}};
 
+    void stack_effect(Opcode op, size_t arg, int &need, int &delta) {
+        need = 0;
+        delta = 0;
+        switch (op) {
+            case RREF: case LREF: case LCREF: case LGREF: case RLOC: case LLOC:
+            case PSH: case NUL: case TYP: case GET: case FREF:
+                delta = 1;
+                break;
+            case DUP:
+                need = 1;
+                delta = 1;
+                break;
+            case PICK:
+                need = (int) arg + 1;
+                delta = 1;
+                break;
+            case DROP:
+                need = (int) arg + 1;
+                delta = -(int) arg;
+                break;
+            case CALL: case TCALL: case TAIL: case TTAIL:
+                need = (int) arg + 2;
+                delta = -((int) arg + 1);
+                break;
+            case SWI: case POP: case JT: case JF: case SET: case FORPREP: case FORLOOP:
+                need = 1;
+                delta = -1;
+                break;
+            case JTK: case JFK: case INC: case DEC: case NOT: case NEG: case SZ: case KEYS:
+            case ADDC: case SUBC: case MULC: case ADDCN: case SUBCN: case MULCN:
+                need = 1;
+                break;
+            case IDX: case KEY: case ADD: case SUB: case MUL: case DIV: case EXP:
+            case LT: case LE: case GT: case GE: case EQ: case NE: case OR: case AND:
+            case MAT: case WAT: case WR: case ADDWR: case IDXINC: case IDXDEC:
+            case ADDN: case SUBN: case MULN: case DIVN:
+            case LTN: case GTN: case LEN: case GEN: case NEN: case EQN:
+                need = 2;
+                delta = -1;
+                break;
+            case LTJF: case GTJF: case LEJF: case GEJF: case NEJF: case EQJF: case WRP:
+            case LTJFN: case GTJFN: case LEJFN: case GEJFN: case NEJFN: case EQJFN:
+                need = 2;
+                delta = -2;
+                break;
+            case IDXWR:
+                need = 3;
+                delta = -2;
+                break;
+            case IDXWRP:
+                need = 3;
+                delta = -3;
+                break;
+            case VEC:
+                need = (int) arg;
+                delta = arg > 0 ? 1 - (int) arg : 1;
+                break;
+            case HASH:
+                need = 2 * (int) arg;
+                delta = 1 - 2 * (int) arg;
+                break;
+            default:
+                // ARG, ARGV, J, INCL, DECL, RET and END
+                break;
+        }
+    }
+
+    static double prof_clock() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void profile_t::clear() {
+        hits.clear();
+        funcs.clear();
+        stacks.clear();
+    }
+
+    lk_string profile_t::report(const bytecode &bc) const {
+        char buf[256];
+        lk_string out;
+
+        // functions by decreasing exclusive time
+        std::vector<std::pair<double, lk_string> > order;
+        for (std::map<lk_string, func_t>::const_iterator it = funcs.begin(); it != funcs.end(); ++it)
+            order.push_back(std::make_pair(it->second.exclusive, it->first));
+        std::sort(order.rbegin(), order.rend());
+
+        sprintf(buf, "%-32s %10s %14s %14s\n", "function", "calls", "inclusive ms", "exclusive ms");
+        out += buf;
+        for (size_t i = 0; i < order.size(); i++) {
+            const func_t &f = funcs.find(order[i].second)->second;
+            sprintf(buf, "%-32s %10llu %14.3f %14.3f\n", (const char *) order[i].second.substr(0, 32).c_str(),
+                    (unsigned long long) f.calls, f.inclusive * 1000.0, f.exclusive * 1000.0);
+            out += buf;
+        }
+
+        // instructions executed per source line, in order of file and line
+        std::map<std::pair<int, int>, size_t> lines;
+        const std::vector<linetable::entry> &runs = bc.debuginfo.entries();
+        for (size_t r = 0; r < runs.size(); r++) {
+            size_t end = (r + 1 < runs.size()) ? runs[r + 1].start : bc.debuginfo.size();
+            size_t n = 0;
+            for (size_t i = runs[r].start; i < end && i < hits.size(); i++)
+                n += hits[i];
+            if (n > 0)
+                lines[std::make_pair(runs[r].file, runs[r].line)] += n;
+        }
+
+        sprintf(buf, "\n%-32s %14s\n", "line", "instructions");
+        out += buf;
+        for (std::map<std::pair<int, int>, size_t>::iterator it = lines.begin(); it != lines.end(); ++it) {
+            const lk_string &file = bc.debuginfo.file(it->first.first);
+            sprintf(buf, "%d", it->first.second);
+            lk_string where = file.empty() ? lk_string(buf) : file + ":" + buf;
+            sprintf(buf, "%-32s %14llu\n", (const char *) where.c_str(), (unsigned long long) it->second);
+            out += buf;
+        }
+
+        return out;
+    }
+
+    lk_string profile_t::collapsed() const {
+        char buf[64];
+        lk_string out;
+        for (std::map<lk_string, double>::const_iterator it = stacks.begin(); it != stacks.end(); ++it) {
+            unsigned long long usec = (unsigned long long) (it->second * 1e6 + 0.5);
+            if (usec > 0) {
+                sprintf(buf, " %llu\n", usec);
+                out += it->first + buf;
+            }
+        }
+        return out;
+    }
+
+    void linetable::clear() {
+        m_runs.clear();
+        m_files.clear();
+        m_size = 0;
+    }
+
+    void linetable::push_back(const srcpos_t &pos) {
+        // most programs come from a single file, so check the last one first
+        int file = m_files.size() > 0 && m_files.back() == pos.file ? (int) m_files.size() - 1 : -1;
+        for (size_t i = 0; file < 0 && i < m_files.size(); i++)
+            if (m_files[i] == pos.file)
+                file = (int) i;
+
+        if (file < 0) {
+            m_files.push_back(pos.file);
+            file = (int) m_files.size() - 1;
+        }
+
+        if (m_runs.size() == 0
+            || m_runs.back().file != file
+            || m_runs.back().line != pos.line
+            || m_runs.back().stmt != pos.stmt
+            || m_runs.back().stmt_end != pos.stmt_end) {
+            entry e;
+            e.start = m_size;
+            e.file = file;
+            e.line = pos.line;
+            e.stmt = pos.stmt;
+            e.stmt_end = pos.stmt_end;
+            m_runs.push_back(e);
+        }
+
+        m_size++;
+    }
+
+    const linetable::entry &linetable::find(size_t ip) const {
+        // last entry starting at or before ip
+        size_t lo = 0, hi = m_runs.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (m_runs[mid].start <= ip) lo = mid;
+            else hi = mid;
+        }
+
+        return m_runs[lo];
+    }
+
+    srcpos_t linetable::at(size_t ip) const {
+        if (ip >= m_size) return srcpos_t::npos;
+
+        const entry &e = find(ip);
+        return srcpos_t(m_files[e.file], e.line, e.stmt, e.stmt_end);
+    }
+
 #ifdef OP_PROFILE
 
 /// resets operation count
@@ -100,6 +340,9 @@ namespace lk {
     vm::vm(size_t ssize) {
         bc = 0;
         ip = sp = 0;
+        profiling = false;
+        jitc = 0;
+        jitbuf.resize(jit::MAX_DEPTH, 0.0);
         stack.resize(ssize, vardata_t());
         frames.reserve(16);
 
@@ -119,6 +362,10 @@ namespace lk {
 
     vm::~vm() {
         free_frames();
+        delete jitc;
+
+        for (size_t i = 0; i < pool.size(); i++)
+            delete pool[i];
     }
 
     bool vm::on_run(const srcpos_t &) {
@@ -132,7 +379,193 @@ namespace lk {
         frames.clear();
     }
 
+/// takes a frame from the pool, or allocates one if the pool is empty.  pooled frames keep
+/// the storage of their environment's hash tables and slot vectors from earlier calls
+    vm::frame *vm::push_frame(lk::env_t *parent, size_t fptr, size_t ret, size_t na) {
+        frame *F;
+        if (pool.size() > 0) {
+            F = pool.back();
+            pool.pop_back();
+            F->env.set_parent(parent);
+            F->fp = fptr;
+            F->retaddr = ret;
+            F->nargs = na;
+            F->iarg = 0;
+            F->thiscall = false;
+            F->id.clear();
+        } else
+            F = new frame(parent, fptr, ret, na);
+
+        frames.push_back(F);
+        return F;
+    }
+
+/// returns the innermost frame to the pool after releasing its variables
+    void vm::pop_frame() {
+        frame *F = frames.back();
+        frames.pop_back();
+
+        F->env.clear_vars();
+        F->env.clear_funcs();
+        F->tailenv.clear_vars();
+        F->slots.clear();
+        pool.push_back(F);
+    }
+
+/// true if p is v itself or an item held by v at any depth
+    static bool holds(vardata_t &v, const vardata_t *p) {
+        if (&v == p)
+            return true;
+
+        if (v.type() == vardata_t::VECTOR) {
+            std::vector<vardata_t> &items = *v.vec();
+            for (size_t i = 0; i < items.size(); i++)
+                if (holds(items[i], p))
+                    return true;
+        } else if (v.type() == vardata_t::HASH) {
+            varhash_t &items = *v.hash();
+            for (varhash_t::iterator it = items.begin(); it != items.end(); ++it)
+                if (holds(*it->second, p))
+                    return true;
+        }
+
+        return false;
+    }
+
+/// replaces the current frame's function by the one called with TAIL or TTAIL: the callee,
+/// 'this' and the arguments on top of the stack are moved down to where the current
+/// function's arguments are, and the frame is reset as CALL would set up a new one.  the
+/// variables of the current function move to the frame's tailenv, between the callee and
+/// the caller, replacing those of earlier tail calls that they hide.  references into the
+/// stack window being reused, or to the replaced variables, are copied
+    void vm::tail_call(Opcode op, size_t nargs) {
+        frame &F = *frames.back();
+        size_t base = F.fp - F.nargs - (F.thiscall ? 2 : 1);
+        size_t n = nargs + (op == TTAIL ? 2 : 1);
+        size_t src = sp - n;
+        vardata_t *wbegin = &stack[base], *wend = &stack[0] + sp;
+
+        if (F.env.parent() != &F.tailenv) {
+            F.tailenv.set_parent(F.env.parent());
+            F.env.set_parent(&F.tailenv);
+        }
+
+        // tailenv variables that the current function's variables will replace
+        std::vector<vardata_t *> &hidden = tailhidden;
+        hidden.clear();
+        lk_string key;
+        vardata_t *var;
+        for (bool more = F.env.first(key, var); more; more = F.env.next(key, var))
+            if (vardata_t *x = F.tailenv.lookup(key, false))
+                hidden.push_back(x);
+
+        tailargs.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            vardata_t &x = stack[src + i].deref();
+            bool owned = (&x >= wbegin && &x < wend);
+            for (size_t k = 0; !owned && k < hidden.size(); k++)
+                owned = holds(*hidden[k], &x);
+
+            if (stack[src + i].type() == vardata_t::REFERENCE && !owned)
+                tailargs[i].assign(&x);
+            else
+                tailargs[i].copy(x);
+        }
+
+        // arguments of the current function refer to the stack window
+        for (bool more = F.env.first(key, var); more; more = F.env.next(key, var)) {
+            if (var->type() == vardata_t::REFERENCE) {
+                vardata_t &x = var->deref();
+                if (&x >= wbegin && &x < wend) {
+                    vardata_t temp;
+                    temp.copy(x);
+                    var->copy(temp);
+                }
+            }
+        }
+
+        F.env.move_vars(F.tailenv);
+        F.env.clear_funcs();
+        F.slots.clear();
+
+        for (size_t i = 0; i < n; i++) {
+            stack[base + i].copy(tailargs[i]);
+            tailargs[i].nullify();
+        }
+
+        sp = (int) (base + n);
+        F.fp = sp;
+        F.nargs = nargs;
+        F.iarg = 0;
+        F.thiscall = (op == TTAIL);
+        F.id.clear();
+
+        if (F.thiscall)
+            F.env.assign("this", new vardata_t(stack[sp - 2]));
+    }
+
+/// looks up the function named by identifier id, as env_t::lookup_func from the current frame
+    fcallinfo_t *vm::lookup_func(size_t id) {
+        if (id >= refcaches.size())
+            refcaches.resize(bc->identifiers.size());
+
+        refcache &C = refcaches[id];
+        unsigned int version = env_t::func_version();
+        if (C.fver != version) {
+            C.fci = frames.back()->env.lookup_func(bc->atoms[id]);
+            C.fver = version;
+        }
+
+        return C.fci;
+    }
+
+/// looks up the variable named by identifier id from the top level frame, as env_t::lookup
+    vardata_t *vm::lookup_global(size_t id, bool search_hierarchy) {
+        env_t &globals = frames.front()->env;
+        refcache &C = refcaches[id];
+        if (C.var != 0 && C.gver == globals.version())
+            return C.var;
+
+        const atom_t &name = bc->atoms[id];
+        if (vardata_t *x = globals.lookup(name, false)) {
+            C.var = x;
+            C.gver = globals.version();
+            return x;
+        }
+
+        return (search_hierarchy && globals.parent()) ? globals.parent()->lookup(name, true) : 0;
+    }
+
+/// determines the name of the function called by a frame from its call site
+    void vm::frame_id(frame &F) {
+        if (!F.id.empty() || !bc || F.callip >= bc->program.size() || &F == frames.front())
+            return;
+
+        size_t cip = F.callip;
+        if (F.thiscall) {
+            if (cip > 2 && PSH == (Opcode) (unsigned char) bc->program[cip - 2]) {
+                size_t arg_tmp = (bc->program[cip - 2] >> 8);
+                F.id = "->" + bc->constants[arg_tmp].as_string();
+            } else if (vardata_t *self = F.env.lookup("this", false)) {
+                // the value the call was made on, which TCALL keeps as 'this'
+                F.id = "->" + self->deref().as_string();
+            } else
+                F.id = "->???";
+        } else {
+            Opcode op_tmp = (cip > 1) ? (Opcode) (unsigned char) bc->program[cip - 1] : __MaxOp;
+            if (RREF == op_tmp || RLOC == op_tmp) {
+                size_t arg_tmp = (bc->program[cip - 1] >> 8);
+                if (op_tmp == RLOC) arg_tmp &= SLOT_ID_MAX;
+                F.id = bc->identifiers[arg_tmp];
+            } else
+                F.id = "???";
+        }
+    }
+
     vm::frame **vm::get_frames(size_t *nfrm) {
+        for (size_t i = 0; i < frames.size(); i++)
+            frame_id(*frames[i]);
+
         *nfrm = frames.size();
         if (frames.size() > 0) return &frames[0];
         else return 0;
@@ -177,6 +610,16 @@ namespace lk {
 
         frames.push_back(new frame(env, 0, 0, 0));
 
+        if (bc->atoms.size() != bc->identifiers.size())
+            bc->intern_identifiers(); // assembled without a code generator
+        refcaches.assign(bc->identifiers.size(), refcache());
+        program = bc->program;
+        requick.assign(program.size(), 0);
+        if (jitc)
+            jitc->reset(bc->program.size());
+        if (profiling)
+            set_profiling(true);
+
         brkpt.resize(bc->program.size(), false);
 
         // initialize to no valid break position
@@ -186,586 +629,1282 @@ namespace lk {
         return true;
     }
 
+    static const unsigned char QUICK_RETRIES = 4;
+
+    static_assert(EQN - ADDN == EQ - ADD && MULCN - ADDCN == MULC - ADDC && EQJFN - LTJFN == EQJF - LTJF,
+                  "quickened instructions out of order");
+
+/// quickened form of ADD ... EQ, ADDC ... MULC or LTJF ... EQJF
+    static inline Opcode quick_form(Opcode op) {
+        if (op <= EQ) return (Opcode) (ADDN + (op - ADD));
+        if (op <= MULC) return (Opcode) (ADDCN + (op - ADDC));
+        return (Opcode) (LTJFN + (op - LTJF));
+    }
+
+    static inline Opcode generic_form(Opcode op) {
+        if (op <= EQN) return (Opcode) (ADD + (op - ADDN));
+        if (op <= MULCN) return (Opcode) (ADDC + (op - ADDCN));
+        return (Opcode) (LTJF + (op - LTJFN));
+    }
+
+/// test of a counting loop, FOR_LT ... FOR_GE, as LTJF ... GEJF make it
+    static inline bool for_test(size_t test, vardata_t &val, vardata_t &limit) {
+        if (val.type() == vardata_t::NUMBER && limit.type() == vardata_t::NUMBER) {
+            double a = val.num_unchecked(), b = limit.num_unchecked();
+            switch (test) {
+                case FOR_LT: return a < b;
+                case FOR_LE: return a < b || a == b;
+                case FOR_GT: return !(a < b) && a != b;
+                default: return !(a < b);
+            }
+        }
+
+        if (vecops::applies(val, limit))
+            throw error_t(vecops::mask_test_error());
+
+        switch (test) {
+            case FOR_LT: return val.lessthan(limit);
+            case FOR_LE: return val.lessthan(limit) || val.equals(limit);
+            case FOR_GT: return !val.lessthan(limit) && !val.equals(limit);
+            default: return !val.lessthan(limit);
+        }
+    }
+
 #define CHECK_FOR_ARGS(n) if ( sp < (int)(n) ) return error( (const char*)lk_tr("stack [sp=%d] error, %d arguments required").c_str(), sp, n );
 #define CHECK_OVERFLOW() if ( sp >= (int)stack.size() ) return error( (const char*)lk_tr("stack overflow [sp=%d]").c_str(), stack.size())
 #define CHECK_CONSTANT() if ( arg >= bc->constants.size() ) return error( (const char*)lk_tr("invalid constant value address: %d\n").c_str(), arg )
 #define CHECK_IDENTIFIER() if ( arg >= bc->identifiers.size() ) return error( (const char*)lk_tr("invalid identifier address: %d\n").c_str(), arg )
 
+// the NORMAL mode loop uses labels-as-values dispatch where the compiler supports it,
+// so that each opcode handler jumps directly to the next one.  define LK_NO_COMPUTED_GOTO
+// to force the portable switch dispatch.
+#if !defined(LK_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define LK_COMPUTED_GOTO 1
+#endif
+
+#ifdef LK_COMPUTED_GOTO
+#define VM_OP(x) case x: op_##x:
+#define VM_DISPATCH() goto *dispatch[op]
+#define VM_CHECK_OPCODE() if (op >= __MaxOp) goto op_invalid
+#else
+#define VM_OP(x) case x:
+#define VM_DISPATCH() goto dispatch_switch
+#define VM_CHECK_OPCODE()
+#endif
+
+#define VM_FETCH() \
+    if (ip >= code_size) goto done; \
+    op = (Opcode) (unsigned char) code[ip]; \
+    arg = (code[ip] >> 8); \
+    next_ip = ip + 1; \
+    VM_CHECK_OPCODE(); \
+    if (sp < 0) throw error_t(lk_tr("stack corruption"))
+
+// an instruction that sees numbers is rewritten into its quickened form, unless it reverted
+// from it QUICK_RETRIES times already.  the quickened form reverts to the generic one, and
+// runs it, when an operand is not a number
+#define VM_QUICKEN(numbers) \
+    if ((numbers) && requick[ip] < QUICK_RETRIES) code[ip] = (code[ip] & ~0xFFu) | (unsigned int) quick_form(op)
+
+#define VM_DEOPT() { \
+    op = generic_form(op); \
+    code[ip] = (code[ip] & ~0xFFu) | (unsigned int) op; \
+    requick[ip]++; \
+    VM_DISPATCH(); }
+
+// advance to the next instruction: the debugging loop goes back through the
+// per-instruction bookkeeping, the normal loop dispatches directly
+#define VM_NEXT() { \
+    ip = next_ip; \
+    nexecuted++; \
+    if (Debug) { \
+        if (mode == SINGLE) return true; \
+        goto loop_top; \
+    } \
+    VM_FETCH(); \
+    VM_DISPATCH(); }
+
+// in NORMAL mode the host is only polled on backward jumps and function calls, which
+// is enough to interrupt any long running loop or recursion
+#define VM_POLL() if (!Debug && !on_run(bc->srcpos(ip))) \
+    return error((const char *) lk_tr("halted by user after %d ops").c_str(), nexecuted)
+
     bool vm::run(ExecMode mode) {
         if (!bc || bc->program.size() == 0) return error((const char *) lk_tr("no bytecode loaded").c_str());
+        if (bc->engine != bytecode::STACK)
+            return error((const char *) lk_tr("bytecode was not generated for the stack engine").c_str());
         if (frames.size() == 0)
             return error((const char *) lk_tr("vm not initialized").c_str()); // must initialize first.
 
-        vardata_t nullval;
+        if (!profiling)
+            return (mode == NORMAL) ? run_loop<false>(mode) : run_loop<true>(mode);
+
+        // calls in progress are timed only while running
+        prof.hits.resize(bc->program.size(), 0);
+        double now = prof_clock();
+        for (size_t i = 0; i < profcalls.size(); i++)
+            profcalls[i].start = now;
+
+        bool ok = run_loop<true>(mode);
+
+        profile_sync();
+        now = prof_clock();
+        for (size_t i = 0; i < profcalls.size(); i++)
+            profcalls[i].elapsed += now - profcalls[i].start;
+
+        return ok;
+    }
+
+    void vm::set_profiling(bool on) {
+        profiling = on;
+        prof.clear();
+        profcalls.clear();
+        profdepth.clear();
+    }
+
+/// matches the profiled calls to the frames, closing the calls that returned and opening the
+/// ones made since the last instruction
+    void vm::profile_sync() {
+        if (profcalls.size() == frames.size() && profcalls.size() > 0
+            && profcalls.back().F == frames.back() && profcalls.back().callip == frames.back()->callip)
+            return;
+
+        size_t n = 0;
+        while (n < profcalls.size() && n < frames.size()
+               && profcalls[n].F == frames[n] && profcalls[n].callip == frames[n]->callip)
+            n++;
+
+        double now = prof_clock();
+        while (profcalls.size() > n) {
+            profcall &c = profcalls.back();
+            double elapsed = profile_close(prof, c, now, true);
+            profdepth[c.id]--;
+            profcalls.pop_back();
+            if (profcalls.size() > 0)
+                profcalls.back().child += elapsed;
+        }
+
+        for (size_t i = n; i < frames.size(); i++) {
+            frame_id(*frames[i]);
+
+            profcall c;
+            c.F = frames[i];
+            c.callip = frames[i]->callip;
+            c.id = (i == 0) ? lk_string("(main)") : frames[i]->id;
+            c.path = (i == 0) ? c.id : profcalls.back().path + ";" + c.id;
+            c.outer = (profdepth[c.id]++ == 0);
+            c.start = now;
+            c.elapsed = c.child = 0;
+            prof.funcs[c.id].calls++;
+            profcalls.push_back(c);
+        }
+    }
+
+    double vm::profile_close(profile_t &p, const profcall &c, double now, bool running) {
+        double elapsed = c.elapsed + (running ? now - c.start : 0.0);
+        double exclusive = elapsed - c.child;
+
+        profile_t::func_t &f = p.funcs[c.id];
+        f.exclusive += exclusive;
+        if (c.outer)
+            f.inclusive += elapsed;
+        p.stacks[c.path] += exclusive;
+
+        return elapsed;
+    }
+
+    profile_t vm::get_profile() {
+        profile_t p(prof);
+
+        double child = 0;
+        for (size_t i = profcalls.size(); i > 0; i--) {
+            profcall c(profcalls[i - 1]);
+            c.child += child;
+            child = profile_close(p, c, 0.0, false);
+        }
+
+        return p;
+    }
+
+    void vm::set_jit(bool on) {
+        delete jitc;
+        jitc = (on && jit::available()) ? new jit : 0;
+        if (jitc && bc)
+            jitc->reset(bc->program.size());
+    }
+
+/// backward jumps run by native code between polls of the host
+    static const size_t JIT_POLL = 1 << 14;
+
+    bool vm::jit_run(size_t entry, size_t end, size_t &next) {
+        bool compile;
+        jit::region *R = jitc->lookup(entry, compile);
+        if (!R) {
+            if (!compile)
+                return false;
+
+            std::vector<fcallinfo_t *> funcs(bc->identifiers.size(), 0);
+            for (size_t i = 0; i < funcs.size(); i++)
+                funcs[i] = lookup_func(i);
+
+            if (!(R = jitc->compile(*bc, entry, end, funcs)))
+                return false;
+        }
+
+        // calls were compiled for the functions registered at the time
+        if (R->fver != env_t::func_version()) {
+            jitc->discard(R, true);
+            return false;
+        }
+
+        // find the variables as the reference instructions would, without creating any
+        frame &F = *frames.back();
+        jitvars.resize(R->vars.size());
+        for (size_t i = 0; i < R->vars.size(); i++) {
+            const jit::var &v = R->vars[i];
+            vardata_t *x;
+            if (v.kind == jit::var::SLOT)
+                x = (v.arg < F.slots.size()) ? F.slots[v.arg] : 0;
+            else if (&F == frames.front())
+                x = lookup_global(v.arg, v.kind == jit::var::NAME);
+            else
+                x = F.env.lookup(bc->atoms[v.arg], v.kind == jit::var::NAME);
+
+            if (!x && v.kind == jit::var::LNAME) {
+                x = frames.front()->env.lookup(bc->atoms[v.arg], false);
+                if (x && !x->flagval(vardata_t::GLOBALVAL))
+                    x = 0;
+            }
+
+            if (!x) {
+                // not bound yet, which the interpreter may still do
+                if (++R->misses > jit::MAX_MISSES)
+                    jitc->discard(R, false);
+                return false;
+            }
+
+            jitvars[i] = &x->deref();
+        }
+
+        const jit::exit &X = R->exits[R->code(jitvars.size() > 0 ? &jitvars[0] : 0, &jitbuf[0], JIT_POLL)];
+
+        // rebuild the stack the interpreter resumes with
+        if (sp + X.stack.size() > stack.size())
+            throw error_t(lk_tr("stack overflow"));
+
+        for (size_t i = 0; i < X.stack.size(); i++) {
+            const jit::item &it = X.stack[i];
+            vardata_t &d = stack[sp++];
+            switch (it.kind) {
+                case jit::item::NUMBER: d.assign(jitbuf[it.index]); break;
+                case jit::item::REF: d.assign(jitvars[it.index]); break;
+                case jit::item::CONST: d.copy(bc->constants[it.index]); break;
+                case jit::item::FUNC: d.assign_fcall(it.fci); break;
+                default: d.nullify(); break;
+            }
+        }
+
+        next = X.ip;
+        if (X.deopt && ++R->misses > jit::MAX_MISSES)
+            jitc->discard(R, false);
+
+        return true;
+    }
+
+    bool vm::jit_call(size_t start, size_t body, size_t &next) {
+        // functions are generated as 'J end; ARG ...; body; end:' and entered after the ARGs
+        if (start == 0 || body >= bc->program.size())
+            return false;
+
+        Opcode first = (Opcode) (unsigned char) bc->program[body];
+        if (first == ARG || first == ARGV || (Opcode) (unsigned char) bc->program[start - 1] != J)
+            return false;
+
+        size_t end = bc->program[start - 1] >> 8;
+        return end > body && jit_run(body, end, next);
+    }
+
+/// interpreter loop: the Debug instantiation handles breakpoints, stepping, opcode counts and
+/// polls on_run before every instruction, the other one only executes instructions
+    template<bool Debug>
+    bool vm::run_loop(ExecMode mode) {
         size_t nexecuted = 0;
-        const size_t code_size = bc->program.size();
+        const size_t code_size = program.size();
+        unsigned int *code = &program[0];
         size_t next_ip = code_size;
-        vardata_t *lhs, *rhs;
+        Opcode op;
+        size_t arg;
 
         // environment where all 'global' variables go
         env_t &globals = frames.front()->env;
 
+#ifdef LK_COMPUTED_GOTO
+        // must be in the same order as the Opcode enumeration
+        static const void *const dispatch[] = {
+                &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_LT, &&op_GT, &&op_LE, &&op_GE, &&op_NE, &&op_EQ,
+                &&op_INC, &&op_DEC, &&op_OR, &&op_AND, &&op_NOT, &&op_NEG, &&op_EXP,
+                &&op_PSH, &&op_POP, &&op_DUP, &&op_NUL, &&op_ARG, &&op_SWI,
+                &&op_J, &&op_JF, &&op_JT, &&op_IDX, &&op_KEY, &&op_MAT, &&op_WAT, &&op_SET, &&op_GET, &&op_WR,
+                &&op_RREF, &&op_LREF, &&op_LCREF, &&op_LGREF, &&op_RLOC, &&op_LLOC,
+                &&op_FREF, &&op_CALL, &&op_TCALL, &&op_RET, &&op_END, &&op_SZ, &&op_KEYS, &&op_TYP,
+                &&op_VEC, &&op_HASH, &&op_ARGV, &&op_ADDWR,
+                &&op_ADDC, &&op_SUBC, &&op_MULC, &&op_LTJF, &&op_GTJF, &&op_LEJF, &&op_GEJF, &&op_NEJF, &&op_EQJF,
+                &&op_JTK, &&op_JFK, &&op_INCL, &&op_DECL, &&op_WRP,
+                &&op_IDXWR, &&op_IDXWRP, &&op_IDXINC, &&op_IDXDEC, &&op_TAIL, &&op_TTAIL,
+                &&op_PICK, &&op_DROP, &&op_FORPREP, &&op_FORLOOP,
+                &&op_ADDN, &&op_SUBN, &&op_MULN, &&op_DIVN, &&op_LTN, &&op_GTN, &&op_LEN, &&op_GEN, &&op_NEN, &&op_EQN,
+                &&op_ADDCN, &&op_SUBCN, &&op_MULCN, &&op_LTJFN, &&op_GTJFN, &&op_LEJFN, &&op_GEJFN, &&op_NEJFN, &&op_EQJFN};
+        static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == __MaxOp, "dispatch table out of date");
+#endif
+
         // initialize the last code point for debugging
-        if (ip < bc->debuginfo.size())
-            lastbrk = bc->debuginfo[ip];
+        if (Debug && ip < bc->debuginfo.size())
+            lastbrk = bc->srcpos(ip);
 
         try {
-            while (ip < code_size) {
-                Opcode op = (Opcode) (unsigned char) bc->program[ip];
-                size_t arg = (bc->program[ip] >> 8);
+            loop_top:
+            VM_FETCH();
 
+            if (Debug) {
 #ifdef OP_PROFILE
                 opcount[op]++;
 #endif
 
-                if (mode != NORMAL && ip < bc->debuginfo.size() && ip < brkpt.size()) {
-                    const srcpos_t &di = bc->debuginfo[ip];
+                if (profiling) {
+                    prof.hits[ip]++;
+                    profile_sync();
+                }
+
+                if (ip < bc->debuginfo.size() && ip < brkpt.size()) {
                     if (mode == DEBUG) {
                         if (brkpt[ip] && (nexecuted > 0 || ip == 0))
                             return true;
-                    } else if (mode == STEP
-                               && di.stmt != lastbrk.stmt
-                               && di.file == lastbrk.file) {
-                        return true;
+                    } else if (mode == STEP) {
+                        const linetable::entry &di = bc->debuginfo.find(ip);
+                        if (di.stmt != lastbrk.stmt
+                            && bc->debuginfo.file(di.file) == lastbrk.file)
+                            return true;
                     }
                 }
 
-                const srcpos_t &spos = (ip < bc->debuginfo.size()) ? bc->debuginfo[ip] : srcpos_t::npos;
-
                 // expression & (constant-1) is equivalent to expression % constant where
                 // constant is a power of two: so use bitwise operator for better performance
                 // see https://en.wikipedia.org/wiki/Modulo_operation#Performance_issues
-                if ((nexecuted & 7) && !on_run(spos))
+                if ((nexecuted & 7) && !on_run(bc->srcpos(ip)))
                     return error((const char *) lk_tr("halted by user after %d ops").c_str(), nexecuted);
+            }
 
-                next_ip = ip + 1;
+            VM_DISPATCH();
 
-                if (sp < 0) throw error_t(lk_tr("stack corruption"));
+#ifndef LK_COMPUTED_GOTO
+            dispatch_switch:
+#endif
+            switch (op) {
+                VM_OP(RREF)
+                VM_OP(LREF)
+                VM_OP(LCREF)
+                VM_OP(LGREF) {
+                    frame &F = *frames.back();
+                    CHECK_OVERFLOW();
+                    CHECK_IDENTIFIER();
+
+                    if (fcallinfo_t *fci = lookup_func(arg)) {
+                        stack[sp++].assign_fcall(fci);
+                    } else if (vardata_t *x1 = (&F == frames.front()) ? lookup_global(arg, op == RREF)
+                                                                     : F.env.lookup(bc->atoms[arg],
+                                                                                    op == RREF)) {
+                        stack[sp++].assign(x1);
+                    } else if (op == LREF || op == LCREF || op == LGREF) {
+                        // if this is lefthand side lookup, check if the variable
+                        // is in the global frame and was created as a global variable
+                        // if so, then place it on the stack.  globals are editable from
+                        // any context if they were flagged as such when created
+                        vardata_t *x2 = globals.lookup(bc->atoms[arg], false);
+                        if (x2 && x2->flagval(vardata_t::GLOBALVAL))
+                            stack[sp++].assign(x2);
+                        else {
+                            x2 = new vardata_t;
+
+                            // set up flags
+                            if (op == LCREF) {
+                                x2->set_flag(vardata_t::CONSTVAL);
+                                x2->clear_flag(vardata_t::ASSIGNED);
+                            } else if (op == LGREF)
+                                x2->set_flag(vardata_t::GLOBALVAL);
+
+                            // now insert record
+                            if (op == LGREF) globals.assign(bc->atoms[arg], x2); // global frame
+                            else F.env.assign(bc->atoms[arg], x2); // local frame
+
+                            stack[sp++].assign(x2);
+                        }
+                    } else
+                        return error((const char *) lk_string(
+                                lk_tr("referencing unassigned variable:") + bc->identifiers[arg] + "\n").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(RLOC)
+                VM_OP(LLOC) {
+                    frame &F = *frames.back();
+                    CHECK_OVERFLOW();
+
+                    size_t slot = (arg >> 16);
+                    if (slot < F.slots.size() && F.slots[slot] != 0)
+                        stack[sp++].assign(F.slots[slot]);
+                    else if (!push_local(op, arg))
+                        return false;
+                }
+                VM_NEXT();
 
-                rhs = (sp >= 1) ? &stack[sp - 1] : NULL;
-                lhs = (sp >= 2) ? &stack[sp - 2] : NULL;
+                VM_OP(TAIL)
+                VM_OP(TTAIL)
+                CHECK_FOR_ARGS(arg + 2);
+                if (frames.size() > 1 && stack[sp - 1].deref().type() == vardata_t::INTFUNC) {
+                    VM_POLL();
 
-                vardata_t &rhs_deref(rhs ? rhs->deref() : nullval);
-                vardata_t &lhs_deref(lhs ? lhs->deref() : nullval);
-                vardata_t &result(lhs ? *lhs : *rhs);
+                    tail_call(op, arg);
 
-                switch (op) {
-                    case RREF:
-                    case LREF:
-                    case LCREF:
-                    case LGREF: {
+                    frames.back()->callip = ip;
+                    next_ip = stack[sp - 1].deref().faddr();
+                    if (!Debug && jitc)
+                        jit_call(next_ip, next_ip, next_ip);
+                    VM_NEXT();
+                }
+                // other calls complete with the RET that follows
+                op = (op == TTAIL) ? TCALL : CALL;
+
+                VM_OP(CALL)
+                VM_OP(TCALL) {
+                    CHECK_FOR_ARGS(arg + 2);
+                    vardata_t &fn = stack[sp - 1].deref();
+                    if (vardata_t::EXTFUNC == fn.type() && op == CALL) {
                         frame &F = *frames.back();
-                        CHECK_OVERFLOW();
-                        CHECK_IDENTIFIER();
-
-                        if (fcallinfo_t *fci = F.env.lookup_func(bc->identifiers[arg])) {
-                            stack[sp++].assign_fcall(fci);
-                        } else if (vardata_t *x1 = F.env.lookup(bc->identifiers[arg], op == RREF)) {
-                            stack[sp++].assign(x1);
-                        } else if (op == LREF || op == LCREF || op == LGREF) {
-                            // if this is lefthand side lookup, check if the variable
-                            // is in the global frame and was created as a global variable
-                            // if so, then place it on the stack.  globals are editable from
-                            // any context if they were flagged as such when created
-                            vardata_t *x2 = globals.lookup(bc->identifiers[arg], false);
-                            if (x2 && x2->flagval(vardata_t::GLOBALVAL))
-                                stack[sp++].assign(x2);
-                            else {
-                                x2 = new vardata_t;
-
-                                // set up flags
-                                if (op == LCREF) {
-                                    x2->set_flag(vardata_t::CONSTVAL);
-                                    x2->clear_flag(vardata_t::ASSIGNED);
-                                } else if (op == LGREF)
-                                    x2->set_flag(vardata_t::GLOBALVAL);
-
-                                // now insert record
-                                if (op == LGREF) globals.assign(bc->identifiers[arg], x2); // global frame
-                                else F.env.assign(bc->identifiers[arg], x2); // local frame
-
-                                stack[sp++].assign(x2);
-                            }
-                        } else
-                            return error((const char *) lk_string(
-                                    lk_tr("referencing unassigned variable:") + bc->identifiers[arg] + "\n").c_str());
+                        fcallinfo_t *fci = fn.fcall();
+                        vardata_t &retval = stack[sp - arg - 2];
+                        invoke_t cxt(&F.env, retval, fci->user_data, bc);
+
+                        // arguments that are not references are temporaries, which the call consumes
+                        cxt.arg_list().reserve(arg);
+                        for (size_t i = 0; i < arg; i++) {
+                            vardata_t &a = stack[sp - arg - 1 + i];
+                            if (a.type() == vardata_t::REFERENCE) cxt.arg_list().push_back(a);
+                            else cxt.arg_list().push_back(std::move(a));
+                        }
 
-                        break;
-                    }
+                        try {
+                            if (fci->f) (*(fci->f))(cxt);
+                            else if (fci->f_ext) lk::external_call(fci->f_ext, cxt);
+                            else cxt.error(lk_tr("invalid internal reference to function"));
 
-                    case CALL:
-                    case TCALL: {
-                        CHECK_FOR_ARGS(arg + 2);
-                        if (vardata_t::EXTFUNC == rhs_deref.type() && op == CALL) {
-                            frame &F = *frames.back();
-                            fcallinfo_t *fci = rhs_deref.fcall();
-                            vardata_t &retval = stack[sp - arg - 2];
-                            invoke_t cxt(&F.env, retval, fci->user_data, bc);
+                            sp -= (arg + 1); // leave return value on stack (even if null)
+                        }
+                        catch (aot::failure &e) {
+                            // native modules report errors at their own statements, as the vm would
+                            errStr = e.what();
+                            return false;
+                        }
+                        catch (std::exception &e) {
+                            return error(e.what());
+                        }
+                    } else if (vardata_t::INTFUNC == fn.type()) {
+                        VM_POLL();
 
-                            for (size_t i = 0; i < arg; i++)
-                                cxt.arg_list().push_back(stack[sp - arg - 1 + i]);
+                        frame &F = *push_frame(&frames.back()->env, sp, next_ip, arg);
+                        F.callip = ip;
 
-                            try {
-                                if (fci->f) (*(fci->f))(cxt);
-                                else if (fci->f_ext) lk::external_call(fci->f_ext, cxt);
-                                else cxt.error(lk_tr("invalid internal reference to function"));
+                        if (op == TCALL) {
+                            F.env.assign("this", new vardata_t(stack[sp - 2]));
+                            F.thiscall = true;
+                        }
 
-                                sp -= (arg + 1); // leave return value on stack (even if null)
-                            }
-                            catch (std::exception &e) {
-                                return error(e.what());
-                            }
-                        } else if (vardata_t::INTFUNC == rhs_deref.type()) {
-                            frames.push_back(new frame(&frames.back()->env, sp, next_ip, arg));
-                            frame &F = *frames.back();
-
-                            vardata_t *__args = new vardata_t;
-                            __args->empty_vector();
-
-                            size_t offset = 1;
-                            if (op == TCALL) {
-                                offset = 2;
-                                F.env.assign("this", new vardata_t(stack[sp - 2]));
-                                F.thiscall = true;
-
-                                if (ip > 2 && PSH == (Opcode) (unsigned char) bc->program[ip - 2]) {
-                                    size_t arg_tmp = (bc->program[ip - 2] >> 8);
-                                    F.id = "->" + bc->constants[arg_tmp].as_string();
-                                } else if (lhs != 0) {
-                                    F.id = "->" + lhs->as_string();
-                                } else F.id = "->???";
-                            } else {
-                                if (ip > 1 && RREF == (Opcode) (unsigned char) bc->program[ip - 1]) {
-                                    size_t arg_tmp = (bc->program[ip - 1] >> 8);
-                                    F.id = bc->identifiers[arg_tmp];
-                                } else
-                                    F.id = "???";
-                            }
+                        next_ip = fn.faddr();
+                        if (!Debug && jitc)
+                            jit_call(next_ip, next_ip, next_ip);
+                    } else
+                        return error(lk_tr("invalid function access").c_str());
+                }
+                VM_NEXT();
 
-                            for (size_t i = 0; i < arg; i++)
-                                __args->vec()->push_back(stack[sp - arg - offset + i]);
+                VM_OP(ARG)
+                if (frames.size() > 0) {
+                    frame &F = *frames.back();
+                    if (F.iarg >= F.nargs)
+                        return error(lk_tr("too few arguments passed to function").c_str());
 
-                            F.env.assign("__args", __args);
+                    size_t offset = F.thiscall ? 2 : 1;
+                    size_t idx = F.fp - F.nargs - offset + F.iarg;
 
-                            next_ip = rhs_deref.faddr();
-                        } else
-                            return error(lk_tr("invalid function access").c_str());
-                    }
-                        break;
+                    vardata_t *x = new vardata_t;
+                    x->assign(&stack[idx]);
+                    F.env.assign(bc->atoms[arg], x);
 
-                    case ARG:
-                        if (frames.size() > 0) {
-                            frame &F = *frames.back();
-                            if (F.iarg >= F.nargs)
-                                return error(lk_tr("too few arguments passed to function").c_str());
+                    // arguments occupy the first frame slots in order
+                    if (F.iarg >= F.slots.size())
+                        F.slots.resize(F.iarg + 1, 0);
+                    F.slots[F.iarg] = x;
+                    F.iarg++;
 
-                            size_t offset = F.thiscall ? 2 : 1;
-                            size_t idx = F.fp - F.nargs - offset + F.iarg;
+                    if (!Debug && jitc)
+                        jit_call(ip + 1 - F.iarg, next_ip, next_ip);
+                }
+                VM_NEXT();
 
-                            vardata_t *x = new vardata_t;
-                            x->assign(&stack[idx]);
-                            F.env.assign(bc->identifiers[arg], x);
-                            F.iarg++;
-                        }
-                        break;
+                VM_OP(ARGV) {
+                    frame &F = *frames.back();
+                    size_t offset = F.thiscall ? 2 : 1;
 
-                    case SWI: {
-                        CHECK_FOR_ARGS(1);
-                        size_t index = rhs_deref.as_unsigned();
-                        size_t noptions = arg;
+                    vardata_t *__args = new vardata_t;
+                    __args->empty_vector();
+                    __args->vec()->reserve(F.nargs);
+                    for (size_t i = 0; i < F.nargs; i++)
+                        __args->vec()->push_back(stack[F.fp - F.nargs - offset + i]);
 
-                        if (index >= noptions)
-                            return error((const char *) lk_tr(
-                                                 "switch statement index %d out of bounds: only %d options").c_str(), (int) index,
-                                         (int) (noptions));
+                    F.env.assign("__args", __args);
 
-                        // advance instruction pointer to the correct jump based on the index number
-                        next_ip = ip + 1 + index;
+                    if (!Debug && jitc)
+                        jit_call(ip - F.iarg, next_ip, next_ip);
+                }
+                VM_NEXT();
 
-                        // don't need the switch index on the stack any more
-                        sp--;
-                    }
-                        break;
+                VM_OP(SWI) {
+                    CHECK_FOR_ARGS(1);
+                    size_t index = stack[sp - 1].deref().as_unsigned();
+                    size_t noptions = arg;
 
-                    case PSH:
-                        CHECK_OVERFLOW();
-                        CHECK_CONSTANT();
-                        stack[sp++].copy(bc->constants[arg]);
-                        break;
-                    case POP:
-                        sp--;
-                        break;
-                    case J:
-                        next_ip = arg;
-                        break;
-                    case JT:
-                        CHECK_FOR_ARGS(1);
-                        if (rhs_deref.as_boolean()) next_ip = arg;
-                        sp--;
-                        break;
-                    case JF:
-                        CHECK_FOR_ARGS(1);
-                        if (!rhs_deref.as_boolean()) next_ip = arg;
-                        sp--;
-                        break;
-                    case IDX: {
-                        CHECK_FOR_ARGS(2);
-                        size_t index = rhs_deref.as_unsigned();
-                        vardata_t &arr = lhs_deref;
-                        bool is_mutable = (arg != 0);
-                        if (is_mutable &&
-                            (arr.type() != vardata_t::VECTOR
-                             || arr.length() <= index))
-                            arr.resize(index + 1);
-
-                        vardata_t *x = arr.index(index);
-
-                        // if the array is a local directly on the stack, not a reference,
-                        // copy the value before the table is destroyed when it is removed
-                        // from the stack.
-                        if (lhs->type() != lk::vardata_t::REFERENCE) {
-                            vardata_t *cpy = new vardata_t;
-                            cpy->copy(*x);
-                            x = cpy;
-                        }
+                    if (index >= noptions)
+                        return error((const char *) lk_tr(
+                                             "switch statement index %d out of bounds: only %d options").c_str(), (int) index,
+                                     (int) (noptions));
 
-                        result.assign(x);
-                        sp--;
-                    }
-                        break;
-                    case KEY: {
-                        CHECK_FOR_ARGS(2);
-                        lk_string key(rhs_deref.as_string());
-                        vardata_t &hash = lhs_deref;
-                        bool is_mutable = (arg != 0);
-                        if (is_mutable && hash.type() != vardata_t::HASH)
-                            hash.empty_hash();
-
-                        vardata_t *x = hash.lookup(key);
-                        if (!x) hash.assign(key, x = new vardata_t);
-
-                        // if the table is a local directly on the stack, not a reference,
-                        // copy the value before the table is destroyed when it is removed
-                        // from the stack.
-                        if (lhs->type() != lk::vardata_t::REFERENCE) {
-                            vardata_t *cpy = new vardata_t;
-                            cpy->copy(*x);
-                            x = cpy;
-                        }
+                    // advance instruction pointer to the correct jump based on the index number
+                    next_ip = ip + 1 + index;
 
-                        result.assign(x);
+                    // don't need the switch index on the stack any more
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(PSH)
+                CHECK_OVERFLOW();
+                CHECK_CONSTANT();
+                stack[sp++].copy(bc->constants[arg]);
+                VM_NEXT();
+
+                VM_OP(POP)
+                sp--;
+                VM_NEXT();
+
+                VM_OP(J)
+                next_ip = arg;
+                if (arg <= ip) {
+                    VM_POLL();
+                    if (!Debug && jitc)
+                        jit_run(arg, ip + 1, next_ip);
+                }
+                VM_NEXT();
+
+                VM_OP(JT)
+                CHECK_FOR_ARGS(1);
+                if (stack[sp - 1].deref().as_boolean()) next_ip = arg;
+                sp--;
+                VM_NEXT();
+
+                VM_OP(JF)
+                CHECK_FOR_ARGS(1);
+                if (!stack[sp - 1].deref().as_boolean()) next_ip = arg;
+                sp--;
+                VM_NEXT();
+
+                VM_OP(IDX) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &arr = stack[sp - 2].deref();
+                    if (arr.is_numarray() && !(arg & 1) && !(arg & 2)) {
+                        // reading a packed number gives the value itself, there being no
+                        // item to refer to.  call arguments (arg bit 2) still bind to the item
+                        size_t index = stack[sp - 1].deref().as_unsigned();
+                        size_t len = arr.length();
+                        if (index >= len)
+                            throw error_t((const char *) lk_tr("array index out of bounds at %d (length: %d)").c_str(),
+                                          (int) index, (int) len);
+                        double d = arr.numbers()[index];
+                        if (vardata_t::is_null_number(d)) stack[sp - 2].nullify();
+                        else stack[sp - 2].assign(d);
                         sp--;
+                        VM_NEXT();
                     }
-                        break;
-
-                    case ADD:
-                        CHECK_FOR_ARGS(2);
-                        if (lhs_deref.type() == vardata_t::STRING || rhs_deref.type() == vardata_t::STRING)
-                            result.assign(lhs_deref.as_string() + rhs_deref.as_string());
-                        else
-                            result.assign(lhs_deref.num() + rhs_deref.num());
-                        sp--;
-                        break;
-                    case SUB:
-                        CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.num() - rhs_deref.num());
-                        sp--;
-                        break;
-                    case MUL:
-                        CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.num() * rhs_deref.num());
-                        sp--;
-                        break;
-                    case DIV:
-                        CHECK_FOR_ARGS(2);
-                        if (rhs_deref.num() == 0.0)
-                            result.assign(std::numeric_limits<double>::quiet_NaN());
-                        else
-                            result.assign(lhs_deref.num() / rhs_deref.num());
-                        sp--;
-                        break;
-                    case EXP:
-                        CHECK_FOR_ARGS(2);
-                        result.assign(::pow(lhs_deref.num(), rhs_deref.num()));
-                        sp--;
-                        break;
-                    case LT:
-                        CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.lessthan(rhs_deref) ? 1.0 : 0.0);
-                        sp--;
-                        break;
-                    case LE:
-                        CHECK_FOR_ARGS(2);
-                        result.assign((lhs_deref.lessthan(rhs_deref)
-                                       || lhs_deref.equals(rhs_deref)) ? 1.0 : 0.0);
-                        sp--;
-                        break;
-                    case GT:
-                        CHECK_FOR_ARGS(2);
-                        result.assign((!lhs_deref.lessthan(rhs_deref)
-                                       && !lhs_deref.equals(rhs_deref)) ? 1.0 : 0.0);
-                        sp--;
-                        break;
-                    case GE:
-                        CHECK_FOR_ARGS(2);
-                        result.assign(!(lhs_deref.lessthan(rhs_deref)) ? 1.0 : 0.0);
-                        sp--;
-                        break;
-                    case EQ:
-                        CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.equals(rhs_deref) ? 1.0 : 0.0);
-                        sp--;
-                        break;
-                    case NE:
-                        CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.equals(rhs_deref) ? 0.0 : 1.0);
-                        sp--;
-                        break;
-                    case OR:
-                        CHECK_FOR_ARGS(2);
-                        result.assign((((int) lhs_deref.num()) || ((int) rhs_deref.num())) ? 1 : 0);
-                        sp--;
-                        break;
-                    case AND:
-                        CHECK_FOR_ARGS(2);
-                        result.assign((((int) lhs_deref.num()) && ((int) rhs_deref.num())) ? 1 : 0);
-                        sp--;
-                        break;
-                    case INC:
-                        CHECK_FOR_ARGS(1);
-                        rhs_deref.assign(rhs_deref.num() + 1.0);
-                        break;
-                    case DEC:
-                        CHECK_FOR_ARGS(1);
-                        rhs_deref.assign(rhs_deref.num() - 1.0);
-                        break;
-                    case NOT:
-                        CHECK_FOR_ARGS(1);
-                        rhs->assign(((int) rhs_deref.num()) ? 0.0 : 1.0);
-                        break;
-                    case NEG:
-                        CHECK_FOR_ARGS(1);
-                        rhs->assign(0.0 - rhs_deref.num());
-                        break;
-                    case MAT:
-                        CHECK_FOR_ARGS(2);
-                        if (lhs_deref.type() == vardata_t::HASH) {
-                            lk::varhash_t *hh = lhs_deref.hash();
-                            lk::varhash_t::iterator it = hh->find(rhs_deref.as_string());
-                            if (it != hh->end())
-                                hh->erase(it);
-                        } else if (lhs_deref.type() == vardata_t::VECTOR) {
-                            std::vector<lk::vardata_t> *vv = lhs_deref.vec();
-                            size_t idx = rhs_deref.as_unsigned();
-                            if (idx < vv->size())
-                                vv->erase(vv->begin() + idx);
-                        } else
-                            return error(lk_tr("-@ requires a hash or vector").c_str());
 
-                        sp--;
-                        break;
-
-                    case WAT:
-                        if (lhs_deref.type() == vardata_t::HASH) {
-                            lk::varhash_t *hh = lhs_deref.hash();
-                            result.assign(hh->find(rhs_deref.as_string()) != hh->end() ? 1.0 : 0.0);
-                        } else if (lhs_deref.type() == vardata_t::VECTOR) {
-                            result.assign(-1.0);
-                            std::vector<lk::vardata_t> *vv = lhs_deref.vec();
-                            for (size_t i = 0; i < vv->size(); i++) {
-                                if ((*vv)[i].equals(rhs_deref)) {
-                                    result.assign((double) i);
-                                    break;
-                                }
-                            }
-                        } else if (lhs_deref.type() == vardata_t::STRING) {
-                            lk_string::size_type pos = lhs_deref.str().find(rhs_deref.as_string());
-                            result.assign(pos != lk_string::npos ? (int) pos : -1.0);
+                    index_item(arg);
+                }
+                VM_NEXT();
+
+                VM_OP(IDXWR)
+                VM_OP(IDXWRP) {
+                    CHECK_FOR_ARGS(3);
+                    // a number assigned to an item of a packed array is stored in place, rather
+                    // than unpacking the array to refer to the item
+                    vardata_t &arr = stack[sp - 2].deref();
+                    if (arr.is_numarray() && (arg & 1) && stack[sp - 3].deref().type() == vardata_t::NUMBER) {
+                        size_t index = stack[sp - 1].deref().as_unsigned();
+                        double d = stack[sp - 3].deref().as_number();
+                        if (index > arr.length()) arr.resize(index + 1);
+                        arr.set_item(index, d);
+                        if (op == IDXWR) {
+                            // the value of the assignment, there being no item to refer to
+                            stack[sp - 3].assign(d);
+                            sp -= 2;
                         } else
-                            return error(lk_tr("?@ requires a hash, vector, or string").c_str());
+                            sp -= 3;
+                        VM_NEXT();
+                    }
 
-                        sp--;
-                        break;
+                    index_item(arg);
+                    write(op == IDXWR);
+                }
+                VM_NEXT();
+
+                VM_OP(IDXINC)
+                VM_OP(IDXDEC) {
+                    CHECK_FOR_ARGS(2);
+                    // as IDXWR, for an item of a packed array that holds a number
+                    vardata_t &arr = stack[sp - 2].deref();
+                    if (arr.is_numarray() && (arg & 1)) {
+                        size_t index = stack[sp - 1].deref().as_unsigned();
+                        if (index < arr.length() && !vardata_t::is_null_number(arr.numbers()[index])) {
+                            double d = arr.numbers()[index] + (op == IDXINC ? 1.0 : -1.0);
+                            arr.set_item(index, d);
+                            stack[sp - 2].assign(d);
+                            sp--;
+                            VM_NEXT();
+                        }
+                    }
 
-                    case GET:
-                        CHECK_OVERFLOW();
-                        CHECK_IDENTIFIER();
-                        if (!special_get(bc->identifiers[arg], stack[sp++]))
-                            return error((const char *) lk_string(
-                                    lk_tr("failed to read external value") + " '" + bc->identifiers[arg] +
-                                    "'").c_str());
-                        break;
-
-                    case SET:
-                        CHECK_FOR_ARGS(1);
-                        CHECK_IDENTIFIER();
-                        if (!special_set(bc->identifiers[arg], rhs_deref))
-                            return error((const char *) lk_string(
-                                    lk_tr("failed to write external value") + " '" + bc->identifiers[arg] +
-                                    "'").c_str());
+                    index_item(arg);
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    rhs.assign(rhs.num() + (op == IDXINC ? 1.0 : -1.0));
+                }
+                VM_NEXT();
+
+                VM_OP(KEY) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &key = stack[sp - 1].deref();
+                    vardata_t &hash = stack[sp - 2].deref();
+                    bool is_mutable = (arg != 0);
+                    vardata_t *x;
+                    if (is_mutable && hash.type() != vardata_t::HASH) {
+                        vardata_t k(key); // the key may be the value replaced by the table
+                        hash.empty_hash();
+                        x = hash.lookup(k, true);
+                    } else
+                        x = hash.lookup(key, true);
+
+                    // if the table is a local directly on the stack, not a reference,
+                    // copy the value before the table is destroyed when it is removed
+                    // from the stack.
+                    if (stack[sp - 2].type() != lk::vardata_t::REFERENCE) {
+                        vardata_t *cpy = new vardata_t;
+                        cpy->copy(*x);
+                        x = cpy;
+                    }
+
+                    stack[sp - 2].assign(x);
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(ADD) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (lhs.type() == vardata_t::STRING || rhs.type() == vardata_t::STRING)
+                        stack[sp - 2].assign(lhs.as_string() + rhs.as_string());
+                    else if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::ADD, lhs, rhs, stack[sp - 2]);
+                    else {
+                        VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                        stack[sp - 2].assign(lhs.num() + rhs.num());
+                    }
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(SUB) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::SUB, lhs, rhs, stack[sp - 2]);
+                    else {
+                        VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                        stack[sp - 2].assign(lhs.num() - rhs.num());
+                    }
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(MUL) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::MUL, lhs, rhs, stack[sp - 2]);
+                    else {
+                        VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                        stack[sp - 2].assign(lhs.num() * rhs.num());
+                    }
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(DIV) {
+                    CHECK_FOR_ARGS(2);
+                    if (vecops::applies(stack[sp - 2].deref(), stack[sp - 1].deref())) {
+                        vecops::binary(vecops::DIV, stack[sp - 2].deref(), stack[sp - 1].deref(), stack[sp - 2]);
                         sp--;
-                        break;
-                    case SZ:
-                        CHECK_FOR_ARGS(1);
-                        if (rhs_deref.type() == vardata_t::VECTOR)
-                            rhs->assign((int) rhs_deref.length());
-                        else if (rhs_deref.type() == vardata_t::STRING)
-                            rhs->assign((int) rhs_deref.str().length());
-                        else if (rhs_deref.type() == vardata_t::HASH) {
-                            int count = 0;
-
-                            varhash_t *h = rhs_deref.hash();
-                            for (varhash_t::iterator it = h->begin();
-                                 it != h->end();
-                                 ++it) {
-                                if ((*it).second->deref().type() != vardata_t::NULLVAL)
-                                    count++;
-                            }
-                            rhs->assign(count);
-                        } else
-                            return error(lk_tr("operand to sizeof must be a array, string, or table type").c_str());
-
-                        break;
-                    case KEYS:
-                        CHECK_FOR_ARGS(1);
-                        if (rhs_deref.type() == vardata_t::HASH) {
-                            varhash_t *h = rhs_deref.hash();
-
-                            lk::vardata_t keys;
-                            keys.empty_vector();
-                            keys.vec()->reserve(h->size());
-                            for (varhash_t::iterator it = h->begin();
-                                 it != h->end();
-                                 ++it) {
-                                if ((*it).second->deref().type() != vardata_t::NULLVAL)
-                                    keys.vec_append((*it).first);
-                            }
-                            rhs->copy(keys);
-                        } else
-                            return error(lk_tr("operand to @ (keysof) must be a table").c_str());
-
-                        break;
-                    case WR: {
-                        CHECK_FOR_ARGS(2);
-                        // copy the value into a temporary first in case
-                        // the reference being assigned will erase the value
-                        //   e.g.    x = [ 1, 2, 3 ];  x = x[1];
-
-                        // note:  this should be optimized by delaying
-                        // deletion of the old value data object (string, vector or hash)
-                        // until after the copy is complete...
-                        lk::vardata_t temp;
-                        temp.copy(lhs_deref);
-                        rhs_deref.copy(temp);
-
-                        // refresh the reference on the stack to the newly assigned value
-                        stack[sp - 2].assign(rhs);
+                        VM_NEXT();
+                    }
+                    VM_QUICKEN(stack[sp - 2].deref().type() == vardata_t::NUMBER
+                               && stack[sp - 1].deref().type() == vardata_t::NUMBER);
+                    double den = stack[sp - 1].deref().num();
+                    if (den == 0.0)
+                        stack[sp - 2].assign(std::numeric_limits<double>::quiet_NaN());
+                    else
+                        stack[sp - 2].assign(stack[sp - 2].deref().num() / den);
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(EXP) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::EXP, lhs, rhs, stack[sp - 2]);
+                    else
+                        stack[sp - 2].assign(::pow(lhs.num(), rhs.num()));
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(LT)
+                VM_OP(LE)
+                VM_OP(GT)
+                VM_OP(GE) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (vecops::applies(lhs, rhs)) {
+                        vecops::binary(op == LT ? vecops::LT : op == LE ? vecops::LE : op == GT ? vecops::GT : vecops::GE,
+                                       lhs, rhs, stack[sp - 2]);
                         sp--;
-                        break;
+                        VM_NEXT();
                     }
 
-                    case TYP:
-                        CHECK_OVERFLOW();
-                        CHECK_IDENTIFIER();
-
-                        if (vardata_t *x = frames.back()->env.lookup(bc->identifiers[arg], true))
-                            stack[sp++].assign(x->deref().typestr());
-                        else
-                            stack[sp++].assign("unknown");
-                        break;
+                    VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                    bool cond;
+                    switch (op) {
+                        case LT: cond = lhs.lessthan(rhs); break;
+                        case LE: cond = lhs.lessthan(rhs) || lhs.equals(rhs); break;
+                        case GT: cond = !lhs.lessthan(rhs) && !lhs.equals(rhs); break;
+                        default: cond = !lhs.lessthan(rhs); break;
+                    }
+                    stack[sp - 2].assign(cond ? 1.0 : 0.0);
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(EQ)
+                VM_OP(NE) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                    bool eq = lhs.equals(rhs);
+                    stack[sp - 2].assign((op == EQ) == eq ? 1.0 : 0.0);
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(OR)
+                CHECK_FOR_ARGS(2);
+                stack[sp - 2].assign(
+                        (((int) stack[sp - 2].deref().num()) || ((int) stack[sp - 1].deref().num())) ? 1 : 0);
+                sp--;
+                VM_NEXT();
+
+                VM_OP(AND)
+                CHECK_FOR_ARGS(2);
+                stack[sp - 2].assign(
+                        (((int) stack[sp - 2].deref().num()) && ((int) stack[sp - 1].deref().num())) ? 1 : 0);
+                sp--;
+                VM_NEXT();
+
+                VM_OP(INC) {
+                    CHECK_FOR_ARGS(1);
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    rhs.assign(rhs.num() + 1.0);
+                }
+                VM_NEXT();
 
-                    case FREF:
+                VM_OP(DEC) {
+                    CHECK_FOR_ARGS(1);
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    rhs.assign(rhs.num() - 1.0);
+                }
+                VM_NEXT();
+
+                VM_OP(NOT)
+                CHECK_FOR_ARGS(1);
+                stack[sp - 1].assign(((int) stack[sp - 1].deref().num()) ? 0.0 : 1.0);
+                VM_NEXT();
+
+                VM_OP(NEG)
+                CHECK_FOR_ARGS(1);
+                if (stack[sp - 1].deref().type() == vardata_t::VECTOR)
+                    vecops::negate(stack[sp - 1].deref(), stack[sp - 1]);
+                else
+                    stack[sp - 1].assign(0.0 - stack[sp - 1].deref().num());
+                VM_NEXT();
+
+                VM_OP(MAT) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (lhs.type() == vardata_t::HASH) {
+                        lk::varhash_t *hh = lhs.hash();
+                        lk::varhash_t::iterator it = hh->find(rhs.as_string());
+                        if (it != hh->end())
+                            hh->erase(it);
+                    } else if (lhs.type() == vardata_t::VECTOR) {
+                        std::vector<lk::vardata_t> *vv = lhs.vec();
+                        size_t idx = rhs.as_unsigned();
+                        if (idx < vv->size())
+                            vv->erase(vv->begin() + idx);
+                    } else
+                        return error(lk_tr("-@ requires a hash or vector").c_str());
+
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(WAT) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    vardata_t &result = stack[sp - 2];
+                    if (lhs.type() == vardata_t::HASH) {
+                        lk::varhash_t *hh = lhs.hash();
+                        result.assign(hh->find(rhs.as_string()) != hh->end() ? 1.0 : 0.0);
+                    } else if (lhs.type() == vardata_t::VECTOR) {
+                        std::vector<lk::vardata_t> *vv = lhs.vec();
+                        double pos = -1.0;
+                        for (size_t i = 0; i < vv->size(); i++) {
+                            if ((*vv)[i].equals(rhs)) {
+                                pos = (double) i;
+                                break;
+                            }
+                        }
+                        result.assign(pos);
+                    } else if (lhs.type() == vardata_t::STRING) {
+                        lk_string::size_type pos = lhs.str().find(rhs.as_string());
+                        result.assign(pos != lk_string::npos ? (int) pos : -1.0);
+                    } else
+                        return error(lk_tr("?@ requires a hash, vector, or string").c_str());
+
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(GET)
+                CHECK_OVERFLOW();
+                CHECK_IDENTIFIER();
+                if (!special_get(bc->identifiers[arg], stack[sp++]))
+                    return error((const char *) lk_string(
+                            lk_tr("failed to read external value") + " '" + bc->identifiers[arg] +
+                            "'").c_str());
+                VM_NEXT();
+
+                VM_OP(SET)
+                CHECK_FOR_ARGS(1);
+                CHECK_IDENTIFIER();
+                if (!special_set(bc->identifiers[arg], stack[sp - 1].deref()))
+                    return error((const char *) lk_string(
+                            lk_tr("failed to write external value") + " '" + bc->identifiers[arg] +
+                            "'").c_str());
+                sp--;
+                VM_NEXT();
+
+                VM_OP(SZ) {
+                    CHECK_FOR_ARGS(1);
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (rhs.type() == vardata_t::VECTOR)
+                        stack[sp - 1].assign((int) rhs.length());
+                    else if (rhs.type() == vardata_t::STRING)
+                        stack[sp - 1].assign((int) rhs.str().length());
+                    else if (rhs.type() == vardata_t::HASH) {
+                        int count = 0;
+
+                        varhash_t *h = rhs.hash();
+                        for (varhash_t::iterator it = h->begin();
+                             it != h->end();
+                             ++it) {
+                            if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                                count++;
+                        }
+                        stack[sp - 1].assign(count);
+                    } else
+                        return error(lk_tr("operand to sizeof must be a array, string, or table type").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(KEYS) {
+                    CHECK_FOR_ARGS(1);
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    if (rhs.type() == vardata_t::HASH) {
+                        varhash_t *h = rhs.hash();
+
+                        lk::vardata_t keys;
+                        keys.empty_vector();
+                        keys.vec()->reserve(h->size());
+                        for (varhash_t::iterator it = h->begin();
+                             it != h->end();
+                             ++it) {
+                            if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                                keys.vec_append((*it).first);
+                        }
+                        stack[sp - 1].copy(keys);
+                    } else
+                        return error(lk_tr("operand to @ (keysof) must be a table").c_str());
+                }
+                VM_NEXT();
+
+                VM_OP(WR)
+                CHECK_FOR_ARGS(2);
+                write(true);
+                VM_NEXT();
+
+                VM_OP(ADDWR) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &var = stack[sp - 1].deref();
+                    vecops::plus_eq(var, stack[sp - 2].deref());
+
+                    // leave the variable as WR does
+                    if (&var != &stack[sp - 1]) stack[sp - 2].assign(&var);
+                    else stack[sp - 2].copy(var);
+                    sp--;
+                }
+                VM_NEXT();
+
+                VM_OP(TYP)
+                CHECK_OVERFLOW();
+                CHECK_IDENTIFIER();
+
+                if (vardata_t *x = frames.back()->env.lookup(bc->atoms[arg], true))
+                    stack[sp++].assign(x->deref().typestr());
+                else
+                    stack[sp++].assign("unknown");
+                VM_NEXT();
+
+                VM_OP(FREF)
+                CHECK_OVERFLOW();
+                stack[sp++].assign_faddr(arg);
+                VM_NEXT();
+
+                VM_OP(RET)
+                if (frames.size() > 1) {
+                    vardata_t *result_tmp = &stack[sp - 1];
+                    frame &F = *frames.back();
+                    int ncleanup = (int) (F.nargs + 1 + arg);
+                    if (F.thiscall) ncleanup++;
+
+                    if (sp <= ncleanup)
+                        return error((const char *) lk_string(
+                                             lk_tr("stack corruption upon function return") + " (sp=%d, nc=%d)").c_str(),
+                                     (int) sp, (int) ncleanup);
+                    sp -= ncleanup;
+                    if (result_tmp->type() == vardata_t::REFERENCE) stack[sp - 1].copy(result_tmp->deref());
+                    else stack[sp - 1].move(*result_tmp); // a temporary of the returning frame
+                    next_ip = F.retaddr;
+
+                    pop_frame();
+                } else
+                    next_ip = code_size;
+                VM_NEXT();
+
+                VM_OP(END)
+                next_ip = code_size;
+                VM_NEXT();
+
+                VM_OP(PICK)
+                CHECK_OVERFLOW();
+                CHECK_FOR_ARGS(arg + 1);
+                stack[sp].copy(stack[sp - 1 - arg]);
+                sp++;
+                VM_NEXT();
+
+                VM_OP(DROP) {
+                    CHECK_FOR_ARGS(arg + 1);
+                    vardata_t &result = stack[sp - 1];
+                    if (result.type() == vardata_t::REFERENCE) {
+                        vardata_t value;
+                        value.copy(result.deref());
+                        stack[sp - 1 - arg].move(value);
+                    } else if (arg > 0)
+                        stack[sp - 1 - arg].move(result);
+                    sp -= arg;
+                }
+                VM_NEXT();
+
+                VM_OP(FORPREP)
+                VM_OP(FORLOOP) {
+                    CHECK_FOR_ARGS(1);
+                    frame &F = *frames.back();
+                    size_t slot = (arg >> 16) & FOR_SLOT_MAX, test = arg >> 22;
+                    vardata_t *x;
+                    if (slot < F.slots.size() && F.slots[slot] != 0)
+                        x = F.slots[slot];
+                    else {
+                        // FORPREP reads the counter as the loop test would, FORLOOP as i++ would
                         CHECK_OVERFLOW();
-                        stack[sp++].assign_faddr(arg);
-                        break;
-
-                    case RET:
-                        if (frames.size() > 1) {
-                            vardata_t *result_tmp = &stack[sp - 1];
-                            frame &F = *frames.back();
-                            int ncleanup = (int) (F.nargs + 1 + arg);
-                            if (F.thiscall) ncleanup++;
-
-                            if (sp <= ncleanup)
-                                return error((const char *) lk_string(
-                                                     lk_tr("stack corruption upon function return") + " (sp=%d, nc=%d)").c_str(),
-                                             (int) sp, (int) ncleanup);
-                            sp -= ncleanup;
-                            stack[sp - 1].copy(result_tmp->deref());
-                            next_ip = F.retaddr;
-
-                            delete frames.back();
-                            frames.pop_back();
-                        } else
-                            next_ip = code_size;
-
-                        break;
-
-                    case END:
-                        next_ip = code_size;
-                        break;
+                        if (!push_local(op == FORPREP ? RLOC : LLOC, arg & FOR_VAR_MASK))
+                            return false;
+                        x = &stack[--sp];
+                    }
 
-                    case NUL:
-                        CHECK_OVERFLOW();
-                        stack[sp].nullify();
-                        sp++;
-                        break;
+                    vardata_t &val = x->deref();
+                    if (op == FORLOOP)
+                        val.assign(val.num() + (test < FOR_GT ? 1.0 : -1.0));
+                    // FORPREP skips the J out of the loop if the loop runs, FORLOOP the J back if not
+                    if (for_test(test, val, stack[sp - 1].deref()) == (op == FORPREP))
+                        next_ip = ip + 2;
+                    sp--;
+                }
+                VM_NEXT();
+
+// quickened instructions: the generic forms of these, once the operands are numbers
+#define VM_QUICK_BINARY(qop, expr) \
+                VM_OP(qop) { \
+                    CHECK_FOR_ARGS(2); \
+                    vardata_t &lhs = stack[sp - 2].deref(); \
+                    vardata_t &rhs = stack[sp - 1].deref(); \
+                    if (lhs.type() != vardata_t::NUMBER || rhs.type() != vardata_t::NUMBER) VM_DEOPT(); \
+                    double a = lhs.num_unchecked(), b = rhs.num_unchecked(); \
+                    stack[sp - 2].assign(expr); \
+                    sp--; \
+                } \
+                VM_NEXT();
+
+// the constant was a number when the instruction was quickened
+#define VM_QUICK_CONST(qop, expr) \
+                VM_OP(qop) { \
+                    CHECK_FOR_ARGS(1); \
+                    vardata_t &lhs = stack[sp - 1].deref(); \
+                    if (lhs.type() != vardata_t::NUMBER) VM_DEOPT(); \
+                    double a = lhs.num_unchecked(), b = bc->constants[arg].num_unchecked(); \
+                    stack[sp - 1].assign(expr); \
+                } \
+                VM_NEXT();
+
+#define VM_QUICK_JF(qop, cond) \
+                VM_OP(qop) { \
+                    CHECK_FOR_ARGS(2); \
+                    vardata_t &lhs = stack[sp - 2].deref(); \
+                    vardata_t &rhs = stack[sp - 1].deref(); \
+                    if (lhs.type() != vardata_t::NUMBER || rhs.type() != vardata_t::NUMBER) VM_DEOPT(); \
+                    double a = lhs.num_unchecked(), b = rhs.num_unchecked(); \
+                    sp -= 2; \
+                    if (!(cond)) next_ip = arg; \
+                } \
+                VM_NEXT();
+
+                // comparisons are as lessthan() and equals() give them, also for NaN
+                VM_QUICK_BINARY(ADDN, a + b)
+                VM_QUICK_BINARY(SUBN, a - b)
+                VM_QUICK_BINARY(MULN, a * b)
+                VM_QUICK_BINARY(DIVN, b == 0.0 ? std::numeric_limits<double>::quiet_NaN() : a / b)
+                VM_QUICK_BINARY(LTN, a < b ? 1.0 : 0.0)
+                VM_QUICK_BINARY(GTN, !(a < b) && a != b ? 1.0 : 0.0)
+                VM_QUICK_BINARY(LEN, a < b || a == b ? 1.0 : 0.0)
+                VM_QUICK_BINARY(GEN, !(a < b) ? 1.0 : 0.0)
+                VM_QUICK_BINARY(NEN, a != b ? 1.0 : 0.0)
+                VM_QUICK_BINARY(EQN, a == b ? 1.0 : 0.0)
+                VM_QUICK_CONST(ADDCN, a + b)
+                VM_QUICK_CONST(SUBCN, a - b)
+                VM_QUICK_CONST(MULCN, a * b)
+                VM_QUICK_JF(LTJFN, a < b)
+                VM_QUICK_JF(GTJFN, !(a < b) && a != b)
+                VM_QUICK_JF(LEJFN, a < b || a == b)
+                VM_QUICK_JF(GEJFN, !(a < b))
+                VM_QUICK_JF(NEJFN, a != b)
+                VM_QUICK_JF(EQJFN, a == b)
+
+                VM_OP(NUL)
+                CHECK_OVERFLOW();
+                stack[sp].nullify();
+                sp++;
+                VM_NEXT();
+
+                VM_OP(DUP)
+                CHECK_OVERFLOW();
+                CHECK_FOR_ARGS(1);
+                stack[sp].copy(stack[sp - 1]);
+                sp++;
+                VM_NEXT();
+
+                VM_OP(VEC) {
+                    CHECK_FOR_ARGS(arg);
+                    if (arg > 0) {
+                        vardata_t &vv = stack[sp - arg];
+
+                        // an array of numbers only is built packed
+                        size_t nnum = 0;
+                        while (nnum < arg && stack[sp - arg + nnum].deref().type() == vardata_t::NUMBER)
+                            nnum++;
+                        if (nnum == arg) {
+                            std::vector<double> nums(arg);
+                            for (size_t i = 0; i < arg; i++)
+                                nums[i] = stack[sp - arg + i].deref().as_number();
+                            vv.assign(nums.data(), arg);
+                            sp -= (arg - 1);
+                            VM_NEXT();
+                        }
 
-                    case DUP:
+                        vardata_t save1;
+                        save1.copy(vv.deref());
+                        vv.empty_vector();
+                        vv.vec()->resize(arg);
+                        vv.index(0)->copy(save1);
+                        for (size_t i = 1; i < arg; i++)
+                            vv.index(i)->copy(stack[sp - arg + i].deref());
+                        sp -= (arg - 1);
+                    } else {
                         CHECK_OVERFLOW();
-                        CHECK_FOR_ARGS(1);
-                        stack[sp].copy(stack[sp - 1]);
+                        stack[sp].empty_vector();
                         sp++;
-                        break;
-
-                    case VEC: {
-                        CHECK_FOR_ARGS(arg);
-                        if (arg > 0) {
-                            vardata_t &vv = stack[sp - arg];
-                            vardata_t save1;
-                            save1.copy(vv.deref());
-                            vv.empty_vector();
-                            vv.vec()->resize(arg);
-                            vv.index(0)->copy(save1);
-                            for (size_t i = 1; i < arg; i++)
-                                vv.index(i)->copy(stack[sp - arg + i].deref());
-                            sp -= (arg - 1);
-                        } else {
-                            CHECK_OVERFLOW();
-                            stack[sp].empty_vector();
-                            sp++;
-                        }
-                        break;
                     }
-                    case HASH: {
-                        size_t N = arg * 2;
-                        CHECK_FOR_ARGS(N);
-                        vardata_t &vv = stack[sp - N];
-                        lk_string key1(vv.deref().as_string());
-                        vv.empty_hash();
-                        if (arg > 0) {
-                            for (size_t i = 0; i < N; i += 2)
-                                vv.hash_item(i == 0 ? key1 :
-                                             stack[sp - N + i].as_string()).copy(
-                                        stack[sp - N + i + 1].deref());
-                        }
-                        sp -= (N - 1);
-                        break;
+                }
+                VM_NEXT();
+
+                VM_OP(HASH) {
+                    size_t N = arg * 2;
+                    CHECK_FOR_ARGS(N);
+                    vardata_t &vv = stack[sp - N];
+                    vardata_t key1(vv.deref()); // the first key is replaced by the table
+                    vv.empty_hash();
+                    if (arg > 0) {
+                        for (size_t i = 0; i < N; i += 2)
+                            vv.hash_item(i == 0 ? key1 : stack[sp - N + i].deref(),
+                                         stack[sp - N + i + 1].deref());
+                    }
+                    sp -= (N - 1);
+                }
+                VM_NEXT();
+
+                VM_OP(ADDC) {
+                    CHECK_FOR_ARGS(1);
+                    CHECK_CONSTANT();
+                    vardata_t &lhs = stack[sp - 1].deref();
+                    const vardata_t &rhs = bc->constants[arg];
+                    if (lhs.type() == vardata_t::STRING || rhs.type() == vardata_t::STRING)
+                        stack[sp - 1].assign(lhs.as_string() + rhs.as_string());
+                    else if (vecops::applies(lhs, rhs))
+                        vecops::binary(vecops::ADD, lhs, rhs, stack[sp - 1]);
+                    else {
+                        VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                        stack[sp - 1].assign(lhs.num() + rhs.num());
+                    }
+                }
+                VM_NEXT();
+
+                VM_OP(SUBC)
+                VM_OP(MULC) {
+                    CHECK_FOR_ARGS(1);
+                    CHECK_CONSTANT();
+                    vardata_t &lhs = stack[sp - 1].deref();
+                    const vardata_t &rhs = bc->constants[arg];
+                    VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                    if (vecops::applies(lhs, rhs))
+                        vecops::binary(op == SUBC ? vecops::SUB : vecops::MUL, lhs, rhs, stack[sp - 1]);
+                    else if (op == SUBC)
+                        stack[sp - 1].assign(lhs.num() - rhs.num());
+                    else
+                        stack[sp - 1].assign(lhs.num() * rhs.num());
+                }
+                VM_NEXT();
+
+                VM_OP(LTJF)
+                VM_OP(GTJF)
+                VM_OP(LEJF)
+                VM_OP(GEJF)
+                VM_OP(NEJF)
+                VM_OP(EQJF) {
+                    CHECK_FOR_ARGS(2);
+                    vardata_t &lhs = stack[sp - 2].deref();
+                    vardata_t &rhs = stack[sp - 1].deref();
+                    bool cond;
+                    if (op != NEJF && op != EQJF && vecops::applies(lhs, rhs))
+                        throw error_t(vecops::mask_test_error());
+
+                    VM_QUICKEN(lhs.type() == vardata_t::NUMBER && rhs.type() == vardata_t::NUMBER);
+                    switch (op) {
+                        case LTJF: cond = lhs.lessthan(rhs); break;
+                        case GTJF: cond = !lhs.lessthan(rhs) && !lhs.equals(rhs); break;
+                        case LEJF: cond = lhs.lessthan(rhs) || lhs.equals(rhs); break;
+                        case GEJF: cond = !lhs.lessthan(rhs); break;
+                        case NEJF: cond = !lhs.equals(rhs); break;
+                        default: cond = lhs.equals(rhs); break;
+                    }
+                    sp -= 2;
+                    if (!cond) next_ip = arg;
+                }
+                VM_NEXT();
+
+                VM_OP(JTK)
+                CHECK_FOR_ARGS(1);
+                if (stack[sp - 1].deref().as_boolean()) next_ip = arg;
+                VM_NEXT();
+
+                VM_OP(JFK)
+                CHECK_FOR_ARGS(1);
+                if (!stack[sp - 1].deref().as_boolean()) next_ip = arg;
+                VM_NEXT();
+
+                VM_OP(INCL)
+                VM_OP(DECL) {
+                    frame &F = *frames.back();
+                    size_t slot = (arg >> 16);
+                    vardata_t *x;
+                    if (slot < F.slots.size() && F.slots[slot] != 0)
+                        x = F.slots[slot];
+                    else {
+                        CHECK_OVERFLOW();
+                        if (!push_local(LLOC, arg))
+                            return false;
+                        x = &stack[--sp];
                     }
 
-                    default:
-                        return error((const char *) lk_string(lk_tr("invalid instruction") + " (0x%02X)").c_str(),
-                                     (unsigned int) op);
-                };
+                    vardata_t &val = x->deref();
+                    val.assign(val.num() + (op == INCL ? 1.0 : -1.0));
+                }
+                VM_NEXT();
 
-                ip = next_ip;
+                VM_OP(WRP)
+                CHECK_FOR_ARGS(2);
+                write(false);
+                VM_NEXT();
 
-                nexecuted++;
-                if (mode == SINGLE && nexecuted > 0) return true;
-            }
+                default:
+#ifdef LK_COMPUTED_GOTO
+                op_invalid:
+#endif
+                    return error((const char *) lk_string(lk_tr("invalid instruction") + " (0x%02X)").c_str(),
+                                 (unsigned int) op);
+            };
+
+            done:;
         }
         catch (std::exception &exc) {
-            srcpos_t spos = (ip < bc->debuginfo.size()) ? bc->debuginfo[ip] : srcpos_t::npos;
+            srcpos_t spos = bc->srcpos(ip);
 
             return error((const char *) lk_string(lk_tr("runtime exception at") + " %s %d: %s").c_str(),
                          spos.line < 0 ? "ip" : (const char *) lk_string(lk_tr("line")).c_str(),
@@ -776,11 +1915,101 @@ namespace lk {
         return true;
     }
 
-    bool vm::error(const char *fmt, ...) {
-        const srcpos_t &spos = (bc && ip < bc->debuginfo.size()) ? bc->debuginfo[ip] : srcpos_t::npos;
+/// pushes a reference to a slotted local that is not cached yet in the current frame: the
+/// name is resolved as for RREF/LREF, and the variable is cached only if it is owned
+/// by the frame's environment
+    void vm::index_item(size_t arg) {
+        size_t index = stack[sp - 1].deref().as_unsigned();
+        vardata_t &arr = stack[sp - 2].deref();
+        bool is_mutable = (arg & 1) != 0;
+        if (is_mutable &&
+            (arr.type() != vardata_t::VECTOR
+             || arr.length() <= index))
+            arr.resize(index + 1);
+
+        vardata_t *x = arr.index(index);
+
+        // if the array is a local directly on the stack, not a reference,
+        // copy the value before the table is destroyed when it is removed
+        // from the stack.
+        if (stack[sp - 2].type() != lk::vardata_t::REFERENCE) {
+            vardata_t *cpy = new vardata_t;
+            cpy->copy(*x);
+            x = cpy;
+        }
+
+        stack[sp - 2].assign(x);
+        sp--;
+    }
+
+    void vm::write(bool keep) {
+        // copy the value into a temporary first in case
+        // the reference being assigned will erase the value
+        //   e.g.    x = [ 1, 2, 3 ];  x = x[1];
+
+        // a value that is not a reference is a temporary, replaced below, so it is
+        // moved rather than copied
+        lk::vardata_t temp;
+        if (stack[sp - 2].type() == vardata_t::REFERENCE) temp.copy(stack[sp - 2].deref());
+        else temp.move(stack[sp - 2]);
+        stack[sp - 1].deref().move(temp);
+
+        if (keep) {
+            // leave the assigned variable as the value of the assignment, which a chained
+            // assignment such as 'a = b = 5' then assigns in turn.  a reference to the stack
+            // slot above it would be overwritten by the next instruction
+            vardata_t &var = stack[sp - 1].deref();
+            if (&var != &stack[sp - 1]) stack[sp - 2].assign(&var);
+            else stack[sp - 2].copy(var);
+            sp--;
+        } else
+            sp -= 2;
+    }
+
+    bool vm::push_local(Opcode op, size_t arg) {
+        frame &F = *frames.back();
+        env_t &globals = frames.front()->env;
+        size_t slot = (arg >> 16);
+
+        arg &= SLOT_ID_MAX;
+        CHECK_IDENTIFIER();
+        const lk_string &name = bc->identifiers[arg];
+        const atom_t &atom = bc->atoms[arg];
+
+        vardata_t *x = 0;
+        if (fcallinfo_t *fci = lookup_func(arg)) {
+            stack[sp++].assign_fcall(fci);
+            return true;
+        } else if ((x = F.env.lookup(atom, false)) != 0) {
+            // local variable, cache it below
+        } else if (op == RLOC) {
+            if (vardata_t *x1 = F.env.lookup(atom, true)) {
+                stack[sp++].assign(x1);
+                return true;
+            }
+            return error((const char *) lk_string(
+                    lk_tr("referencing unassigned variable:") + name + "\n").c_str());
+        } else {
+            vardata_t *x2 = globals.lookup(atom, false);
+            if (x2 && x2->flagval(vardata_t::GLOBALVAL)) {
+                stack[sp++].assign(x2);
+                return true;
+            }
+
+            x = new vardata_t;
+            F.env.assign(atom, x);
+        }
 
+        if (slot >= F.slots.size())
+            F.slots.resize(slot + 1, 0);
+        F.slots[slot] = x;
+        stack[sp++].assign(x);
+        return true;
+    }
+
+    bool vm::error(const char *fmt, ...) {
         char buf[512];
-        sprintf(buf, "[%d] ", spos.stmt);
+        sprintf(buf, "[%d] ", bc ? bc->debuginfo.stmt(ip) : srcpos_t::npos.stmt);
         errStr = buf;
 
         va_list args;
@@ -795,17 +2024,18 @@ namespace lk {
     int vm::setbrk(int line, const lk_string &file) {
         if (!bc) return -1;
 
-        for (size_t i = 0; i < bc->debuginfo.size() && i < brkpt.size(); i++) {
-            if (bc->debuginfo[i].file == file
-                && bc->debuginfo[i].line >= line) {
+        const std::vector<linetable::entry> &runs = bc->debuginfo.entries();
+        for (size_t r = 0; r < runs.size() && runs[r].start < brkpt.size(); r++) {
+            if (bc->debuginfo.file(runs[r].file) == file
+                && runs[r].line >= line) {
                 // snap the breakpoint to the beginning of the statement
-                while (i > 0
-                       && bc->debuginfo[i - 1].file == bc->debuginfo[i].file
-                       && bc->debuginfo[i - 1].stmt == bc->debuginfo[i].stmt)
-                    i--;
+                while (r > 0
+                       && runs[r - 1].file == runs[r].file
+                       && runs[r - 1].stmt == runs[r].stmt)
+                    r--;
 
-                brkpt[i] = true;
-                return bc->debuginfo[i].stmt;
+                brkpt[runs[r].start] = true;
+                return runs[r].stmt;
             }
         }
 
@@ -818,7 +2048,7 @@ namespace lk {
         if (bc) {
             for (size_t i = 0; i < bc->debuginfo.size() && i < brkpt.size(); i++)
                 if (brkpt[i])
-                    list.push_back(bc->debuginfo[i]);
+                    list.push_back(bc->srcpos(i));
         }
 
         return list;